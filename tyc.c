@@ -3,6 +3,8 @@
  * Compilazione: gcc -o tyc tyc.c -lncurses
  */
 
+ #define _GNU_SOURCE
+ 
  #include <stdio.h>
  #include <stdlib.h>
  #include <string.h>
@@ -17,11 +19,126 @@
  #include <locale.h>
  #include <pwd.h>
  #include <grp.h>
+ #include <errno.h>
+ #include <pthread.h>
+ #include <stdatomic.h>
+ #include <stdarg.h>
+ #include <sys/ioctl.h>
+ #include <stdint.h>
+ #include <ctype.h>
+ #include <fnmatch.h>
+ #include <setjmp.h>
+ #include <sys/mman.h>
+ #include <sys/wait.h>
+ #include <poll.h>
+ #include <dlfcn.h>
+ #include <zlib.h>
+ #ifdef __SSE2__
+ #include <emmintrin.h>
+ #endif
+ #ifdef __linux__
+ #include <sys/syscall.h>
+ #include <sys/vfs.h>
+ #include <sys/sendfile.h>
+ #include <sys/inotify.h>
+ #include <sys/uio.h>
+ #if defined(__has_include)
+ #if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+ #include <linux/io_uring.h>
+ #define HAVE_IO_URING 1
+ #endif
+ #endif
+ #else
+ #include <sys/param.h>
+ #include <sys/mount.h>
+ #endif
  
  #define MAX_PATH_LEN 1024
  #define MAX_FILENAME_LEN 256
  #define MAX_COMMAND_LEN 1024
- #define MAX_FILES 1000
+ #define NAME_CHUNK_SIZE (64 * 1024)
+ #define MIN_FILES_CAPACITY 256
+ #define SCAN_BUFFER_SIZE (256 * 1024)
+ #define DEFAULT_STAT_THREADS 8
+ #define DEFAULT_LISTING_CACHE_MB 64 // Memoria per gli elenchi delle directory visitate di recente
+ #define MAX_POOL_THREADS 64
+ #define PARALLEL_STAT_MIN 64 // Sotto questa soglia non conviene distribuire le stat
+ #define PARALLEL_STAT_BATCH 32
+ #define LOADER_FIRST_BATCH 64 // Prima consegna piccola: la prima schermata appare subito
+ #define LOADER_BATCH 4096
+ #define UI_TICK_MS 100 // Intervallo di aggiornamento durante il lavoro in background
+ #define FRAME_MIN_MS 16 // Intervallo minimo tra due ridisegni: gli aggiornamenti vengono accorpati
+ 
+ #define COPY_CHUNK_SIZE (8 * 1024 * 1024) // Blocco per copy_file_range/sendfile
+ #define COPY_BUFFER_SIZE (1024 * 1024) // Buffer per il ciclo read/write
+ #define MAX_COPY_PAIRS 32
+ #define COPY_NOCACHE_MIN (64 * 1024 * 1024) // Oltre questa dimensione la copia non resta in cache
+ #define DEFAULT_JOB_THREADS 2
+ #define MAX_JOB_THREADS 16
+ #define MAX_JOB_ROWS 3 // Righe dell'area di stato delle operazioni
+ #define JOB_LINGER_SEC 3 // Per quanto resta visibile un'operazione terminata
+ #define MAX_TREE_THREADS 16
+ #define LINK_BUCKETS 1024
+ #define MAX_TREE_ERRORS 1000 // Oltre questo numero gli errori vengono solo contati
+ #define SIZE_CACHE_BUCKETS 65536
+ #define SIZE_CACHE_MAX (1 << 20) // Directory ricordate al massimo dalla cache delle dimensioni
+ #define SIZE_REFRESH_MS 500 // Intervallo di aggiornamento dei totali durante un calcolo
+ #define RADIX_MIN_RUN 32 // Sotto questa soglia i nomi con lo stesso prefisso si confrontano e basta
+ #define WATCH_QUIET_MS 50 // Le modifiche si applicano dopo questa pausa negli eventi...
+ #define WATCH_COALESCE_MS 250 // ...o comunque dopo questo tempo dalla prima
+ #define WATCH_MAX_CHANGES 4096 // Oltre questo numero di nomi si rilegge la directory
+ #define WATCH_POLL_SEC 2 // Controllo della data di modifica senza inotify
+ #define MAX_FILTER_LEN 64
+ #define PARALLEL_FILTER_MIN 65536 // Sotto questa soglia il filtro si applica in un solo thread
+ #define PARALLEL_FILTER_BATCH 8192
+ #define VIEW_ROW_MAX 4096 // Nel visualizzatore le righe piu' lunghe proseguono nella successiva
+ #define VIEW_INDEX_STEP 64 // L'indice registra l'inizio di una riga ogni VIEW_INDEX_STEP
+ #define VIEW_BLOCK_SAMPLES 65536
+ #define VIEW_INDEX_BLOCKS 16384
+ #define VIEW_MAP_RESERVE (1LL << 30) // Margine mappato oltre la fine, per i file che crescono
+ #define VIEW_NOCACHE_CHUNK (64 * 1024 * 1024)
+ #define VIEW_BACK_LIMIT (1024 * 1024) // Ricerca all'indietro dell'inizio di una riga senza indice
+ #define VIEW_FOLLOW_MS 500
+ #define GREP_BUFFER_SIZE (1024 * 1024) // Blocco di lettura della ricerca nei file
+ #define GREP_BINARY_CHECK 8192 // Un NUL nei primi byte indica un file binario
+ #define GREP_MAX_HITS 100000
+ #define COMPARE_CHUNK (1024 * 1024) // Blocco letto da ciascun file nel confronto del contenuto
+ #define COMPARE_SEGMENT (64 * 1024 * 1024) // Parte di un file grande confrontata da un solo thread
+ #define GREP_MAX_TEXT 200 // Caratteri della riga conservati per ogni risultato
+ #define URING_ENTRIES 256 // Richieste in volo nell'anello io_uring di ogni thread
+ #define URING_STAT_MIN 64 // Sotto questa soglia le statx si fanno direttamente
+ #define URING_COPY_DEPTH 8 // Blocchi di una copia in volo contemporaneamente
+ #define URING_COPY_BLOCK (256 * 1024) // Dimensione di ogni buffer registrato
+ #define ARCHIVE_SPAN (4 * 1024 * 1024) // Distanza minima tra due punti di ripresa della decompressione
+ #define ARCHIVE_WINDOW 32768 // Finestra di deflate salvata in ogni punto di ripresa
+ #define ARCHIVE_BUFFER (256 * 1024) // Blocchi letti e decompressi dagli archivi
+ #define ARCHIVE_CACHE_MAX 8 // Indici di archivi tenuti in memoria
+ #define ARCHIVE_META_MAX (1024 * 1024) // Dimensione massima di nomi lunghi e intestazioni pax
+ #define NAME_INDEX_MAGIC "TYCNIDX1" // Intestazione dei file degli indici dei nomi
+ #define NAME_INDEX_NONE UINT32_MAX
+ #define FIND_MAX_RESULTS 100000 // Risultati mostrati al massimo da una ricerca nell'indice dei nomi
+ #define PERF_BUCKETS 26 // Istogramma delle latenze: potenze di 2 da 1 us a 32 s
+ #define BENCH_RUNS 5 // Ripetizioni di ogni misura di tyc --batch bench
+ #define BENCH_COPY_MAX 100000 // Oltre questo numero di entry l'albero non viene copiato
+ #define BENCH_FRAMES 20 // Schermate disegnate per ogni ripetizione
+ #define BENCH_SMALL_FILES 2000
+ #define BENCH_SMALL_SIZE (16 * 1024)
+ #define BENCH_LARGE_FILES 2
+ #define BENCH_LARGE_SIZE (128 * 1024 * 1024)
+ #define BENCH_SPARSE_SIZE (1024LL * 1024 * 1024) // File sparso con pochi blocchi scritti
+ 
+ #ifdef __linux__
+ #ifndef FICLONE
+ #define FICLONE _IOW(0x94, 9, int)
+ #endif
+ #endif
+ 
+ #ifndef DT_UNKNOWN
+ #define DT_UNKNOWN 0
+ #define DT_DIR 4
+ #define DT_REG 8
+ #define DT_LNK 10
+ #endif
  
  #ifndef GIT_VERSION
  #define GIT_VERSION "v0.0.0-dev"
@@ -29,48 +146,1290 @@
 
  // Struttura per rappresentare un file
  typedef struct {
-     char name[MAX_FILENAME_LEN];
+     const char *name; // Punta nell'arena dei nomi del pannello
      off_t size;
      mode_t mode;
      time_t mtime;
      int is_dir;
+     int has_meta; // 0 = size/mode/mtime non ancora letti (lettura pigra)
+     unsigned char d_type; // Tipo restituito dalla scansione (DT_*)
+     unsigned char has_dir_size; // Directory: 1 = dir_size calcolata, 2 = calcolata con errori
+     unsigned char compare_mark; // Esito del confronto con l'altro pannello (CMP_*)
+     off_t dir_size; // Dimensione del contenuto della directory, dalla cache delle dimensioni
+     uint32_t id; // Identificativo stabile nella lista, per le permutazioni in cache
+     const char *row; // Riga formattata, nell'arena rows del pannello (NULL se da preparare)
  } FileEntry;
  
+ // Blocco dell'arena dei nomi: i nomi sono copiati in sequenza in data[]
+ typedef struct NameChunk {
+     struct NameChunk *next;
+     size_t used;
+     size_t size;
+     char data[];
+ } NameChunk;
+ 
+ // Arena di stringhe: i blocchi restano allocati e vengono riutilizzati
+ // ad ogni lettura, cosi' i puntatori ai nomi restano stabili
+ typedef struct {
+     NameChunk *head;
+     NameChunk *current;
+ } NameArena;
+ 
+ // Caricamento in background di una directory. Il thread di caricamento
+ // scrive i nomi nell'arena del pannello (di cui ha l'uso esclusivo finche'
+ // e' attivo) e accumula le entry in pending; il thread principale le
+ // trasferisce nel pannello con poll_directory_load()
+ typedef struct {
+     pthread_t thread;
+     pthread_mutex_t lock;
+     NameArena *names;
+     int dir_fd;
+     int unclassified_only; // Metadati solo per le entry che d_type non classifica
+     FileEntry *pending;
+     int num_pending;
+     int pending_cap;
+     int total; // Entry lette finora
+     int done;
+     int error; // errno dell'eventuale errore di lettura
+     atomic_int cancel;
+     int shadow; // Aggiornamento: la lista del pannello viene sostituita solo alla fine
+     NameArena shadow_names; // Nomi della nuova lista durante un aggiornamento
+     struct timespec started; // Per la strumentazione, a zero se spenta
+ } DirLoader;
+ 
+ // Criteri di ordinamento
+ enum {
+     SORT_NAME,
+     SORT_SIZE,
+     SORT_MTIME,
+     SORT_NATURAL,   // Nome, con i numeri confrontati per valore
+     SORT_EXTENSION,
+     SORT_MODES
+ };
+ 
+ // Tipi di filtro della lista
+ enum {
+     FILTER_SUBSTRING,
+     FILTER_GLOB,
+     FILTER_FUZZY,   // Caratteri del filtro nell'ordine, anche non adiacenti
+     FILTER_MODES
+ };
+ 
+ // Esito del confronto di un'entry con quella omonima dell'altro pannello
+ enum {
+     CMP_NONE,       // Uguale, o non confrontata
+     CMP_ONLY,       // Assente nell'altro pannello
+     CMP_NEWER,      // Piu' recente di quella dell'altro pannello
+     CMP_OLDER,
+     CMP_DIFFERENT,  // Stessa data, dimensione o contenuto diversi
+     CMP_CHECKING    // Contenuto in corso di verifica
+ };
+ 
+ // Modalita' della riga di comando
+ enum { INPUT_NORMAL, INPUT_QUICKSEARCH, INPUT_FILTER };
+ 
+ // Ordine crescente gia' calcolato per un criterio, valido finche' la lista
+ // non cambia (version)
+ typedef struct {
+     uint32_t *ids; // Id delle entry in ordine, ".." esclusa
+     int count;
+     int num_dirs; // Le prime num_dirs sono directory
+     unsigned long version;
+ } SortCache;
+ 
+ // Elemento da ordinare: chiave precalcolata e posizione dell'entry
+ typedef struct {
+     uint64_t key;
+     uint32_t index;
+ } SortItem;
+ 
+ // Stato dell'ultimo disegno della lista di un pannello, per ridisegnare
+ // solo le righe che cambiano
+ typedef struct {
+     WINDOW *win; // Area della lista, sottofinestra di stdscr
+     int valid; // 0 = la finestra va ridisegnata per intero
+     int x, y, width, height;
+     int scroll_pos;
+     int selected;
+     int active;
+ } PanelView;
+ 
  // Struttura per rappresentare un pannello
  typedef struct {
      char current_path[MAX_PATH_LEN];
-     FileEntry files[MAX_FILES];
+     FileEntry *files; // Array crescente, riutilizzato tra le letture
      int num_files;
+     int capacity;
+     NameArena names;
+     NameArena rows; // Righe formattate delle entry gia' disegnate
+     int changed; // La lista e' cambiata dall'ultimo disegno
+     PanelView view;
+     int dir_fd; // Directory aperta, per i metadati relativi (fstatat/statx)
+     DirLoader *loader; // Caricamento in corso, NULL se la lista e' completa
+     char *reselect_name; // Entry da riselezionare al termine di un aggiornamento
+     int reselect_index;
      int selected;
      int scroll_pos;
-     int sort_by; // 0 = nome, 1 = dimensione, 2 = data
+     int sort_by; // SORT_*
      int sort_order; // 0 = asc, 1 = desc
+     SortCache sort_cache[SORT_MODES];
+     unsigned long list_version; // Cambia quando entry o metadati cambiano
+     uint32_t next_id;
+     int watch_wd; // Watch inotify sulla directory, -1 se assente
+     int watch_poll; // Controlla periodicamente la data di modifica della directory
+     struct timespec dir_mtime; // Data di modifica della directory alla lettura
+     time_t last_poll;
+     char **changed_names; // Nomi modificati in attesa di essere applicati
+     int num_changed;
+     int rescan_needed; // Troppe modifiche, o directory rimossa: va riletta
+     struct timespec first_change;
+     struct timespec last_change;
+     char filter[MAX_FILTER_LEN + 1]; // Filtro della lista, "" se assente
+     int filter_len;
+     int filter_mode; // FILTER_*
+     int *filter_levels[MAX_FILTER_LEN + 1]; // Entry (indici crescenti, ".." esclusa) che soddisfano
+     int filter_counts[MAX_FILTER_LEN + 1];  // i primi N caratteri del filtro, NULL se non calcolate
+     struct Archive *archive; // Archivio mostrato come directory virtuale, NULL se assente
+     int archive_dir; // Membro della directory mostrata, -1 = radice dell'archivio
+     char archive_wait[MAX_PATH_LEN]; // Archivio da aprire quando il suo indice e' pronto
+     uint64_t *tags; // Entry marcate: un bit per id, valido fino alla prossima lettura
+     uint32_t tag_words;
+     int num_tagged;
+     off_t tagged_bytes; // Dimensione delle entry marcate...
+     unsigned long tagged_version; // ...ricalcolata quando list_version cambia
+     char **retag_names; // Nomi da rimarcare al termine di una rilettura
+     int num_retag;
+     struct NameIndex *found; // Indice dei nomi di cui si mostrano i risultati, NULL se assente
+     char found_query[MAX_FILTER_LEN + 1]; // Ricerca, ripetuta ad ogni rilettura
+     int found_truncated; // Risultati oltre FIND_MAX_RESULTS
+     char found_wait[MAX_PATH_LEN]; // Radice dell'indice in costruzione di cui mostrare i risultati
  } Panel;
  
+ // Scansione a blocchi di una directory (getdents64 su Linux)
+ typedef struct {
+     int fd;
+ #ifdef __linux__
+     char *buf;
+     long len;
+     long pos;
+ #else
+     DIR *dir;
+ #endif
+ } DirScan;
+ 
+ // Funzione eseguita dal pool su un intervallo di indici [from, to)
+ typedef void (*PoolTask)(void *arg, int from, int to);
+ 
+ // Pool di thread persistente per distribuire lavoro indicizzato (parallel for)
+ typedef struct {
+     pthread_t threads[MAX_POOL_THREADS];
+     int num_threads;
+     pthread_mutex_t run_lock; // Serializza i chiamanti di pool_run
+     pthread_mutex_t lock;
+     pthread_cond_t work_cond;
+     pthread_cond_t done_cond;
+     PoolTask task;
+     void *arg;
+     int total;
+     int batch;
+     atomic_int next; // Prossimo indice da assegnare
+     int busy; // Thread ancora al lavoro sul compito corrente
+     unsigned long generation;
+     int shutdown;
+ } WorkerPool;
+ 
+ // Parametri per la lettura parallela dei metadati
+ typedef struct {
+     int dir_fd;
+     FileEntry *files;
+     int unclassified_only;
+     atomic_int *cancel; // Se non NULL, interrompe la lettura quando diventa vero
+ } MetadataJob;
+ 
+ // Metodi di copia, in ordine di preferenza
+ enum {
+     COPY_REFLINK,    // Clonazione dei blocchi (FICLONE), nessun dato copiato
+     COPY_RANGE,      // copy_file_range: copia nel kernel
+     COPY_SENDFILE,   // sendfile: copia nel kernel senza passare da user space
+     COPY_URING,      // io_uring: letture e scritture in volo su buffer registrati
+     COPY_READWRITE,  // Ciclo read/write con buffer grande
+     COPY_METHODS
+ };
+ 
+ // Risultato di una copia
+ typedef struct {
+     int method; // Metodo con cui sono stati copiati i dati
+     off_t bytes; // Byte copiati
+     const char *failed_step; // Operazione fallita, in caso di errore
+     long long files; // Entry elaborate dalle operazioni ricorsive
+     char **errors; // Errori delle operazioni ricorsive (liberati da free_copy_stats)
+     int num_errors;
+ } CopyStats;
+ 
+ // Controllo di una copia da parte di un altro thread: avanzamento, pausa e annullamento
+ typedef struct {
+     atomic_llong bytes_done;
+     atomic_llong bytes_total; // 0 se non noto (operazioni ricorsive)
+     atomic_llong files_done;
+     atomic_int paused;
+     atomic_int cancel;
+ } CopyControl;
+ 
+ // Stato interno di una copia tra due descrittori
+ typedef struct {
+     int src_fd;
+     int dst_fd;
+     dev_t src_dev;
+     dev_t dst_dev;
+     int method; // Metodo corrente, si degrada se non supportato
+     char *buffer; // Buffer del ciclo read/write, allocato al primo uso
+     int nocache; // Rilascia dalla page cache le zone gia' copiate
+     off_t prev_offset; // Ultima zona copiata, da rilasciare alla successiva
+     off_t prev_length;
+     CopyStats *stats;
+     CopyControl *control; // NULL se la copia non e' controllata
+ } CopySession;
+ 
+ #ifdef HAVE_IO_URING
+ // Anello io_uring gestito con le chiamate di sistema dirette, senza liburing.
+ // Ogni thread che lo usa ne ha uno proprio (thread_uring)
+ typedef struct {
+     int fd;
+     unsigned entries;
+     unsigned queued; // Richieste preparate e non ancora inviate al kernel
+     unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+     unsigned *cq_head, *cq_tail, *cq_mask;
+     struct io_uring_sqe *sqes;
+     struct io_uring_cqe *cqes;
+     void *sq_map, *cq_map;
+     size_t sq_map_size, cq_map_size, sqes_size;
+     char *buffers; // URING_COPY_DEPTH buffer registrati, allocati alla prima copia
+     int buffers_failed; // Registrazione non riuscita: le copie non usano l'anello
+ } Uring;
+ 
+ // Un blocco di una copia con io_uring
+ typedef struct {
+     off_t offset;
+     size_t length; // Byte richiesti
+     size_t got; // Byte letti
+     size_t written;
+     int state; // 0 = libero, 1 = in lettura, 2 = in scrittura
+ } UringSlot;
+ #endif
+ 
+ // Primo metodo utilizzabile per una coppia di filesystem sorgente/destinazione
+ typedef struct {
+     dev_t src_dev;
+     dev_t dst_dev;
+     int method;
+ } CopyPair;
+ 
+ // Directory visitata da un'operazione ricorsiva. refs conta la scansione
+ // della directory stessa piu' i figli non ancora conclusi: quando arriva a
+ // zero la directory viene completata (permessi e date della copia, oppure
+ // rimozione) e si rilascia il padre
+ typedef struct TreeNode {
+     struct TreeNode *parent;
+     int src_fd;
+     int dst_fd;
+     atomic_int refs;
+     atomic_int failed; // Qualche entry non e' stata elaborata
+     dev_t dev;
+     ino_t ino;
+     atomic_llong apparent; // Calcolo delle dimensioni: totali del sottoalbero
+     atomic_llong allocated;
+     atomic_llong files;
+     mode_t mode;
+     uid_t uid;
+     gid_t gid;
+     struct timespec times[2];
+     char name[];
+ } TreeNode;
+ 
+ // Coda di directory di un thread: il proprietario lavora dal fondo
+ // (profondita' prima), gli altri rubano dalla cima (sottoalberi grandi)
+ typedef struct {
+     pthread_mutex_t lock;
+     TreeNode **items;
+     int head;
+     int tail;
+     int cap;
+ } TreeDeque;
+ 
+ // File con piu' link fisici gia' copiato, per ricreare il link
+ typedef struct LinkEntry {
+     struct LinkEntry *next;
+     dev_t dev;
+     ino_t ino;
+     char path[]; // Relativo alla radice della destinazione
+ } LinkEntry;
+ 
+ enum { TREE_COPY, TREE_DELETE, TREE_SIZE };
+ 
+ // Stato di un'entry di un'operazione su un gruppo di entry marcate
+ enum { GROUP_QUEUED, GROUP_DONE, GROUP_MOVED, GROUP_FAILED };
+ 
+ // Entry marcata della directory radice di un'operazione di gruppo
+ typedef struct {
+     const char *name;
+     ino_t ino;
+     int inside; // Directory che contiene la destinazione: non si puo' copiare
+     atomic_int state; // GROUP_*
+ } GroupEntry;
+ 
+ // Operazione ricorsiva su un albero di directory
+ typedef struct {
+     int type;
+     const char *src_root; // Per i messaggi d'errore
+     int root_parent_fd; // Directory che contiene la radice da eliminare
+     int dst_root_fd;
+     dev_t root_dev; // Calcolo delle dimensioni: non si esce dal filesystem della radice
+     CopyStats *stats;
+     CopyControl *control;
+     int keep_going;
+     int preserve_owner;
+     atomic_int stop; // Annullamento, o primo errore senza keep_going
+     atomic_int pending; // Directory accodate o in elaborazione
+     atomic_llong bytes;
+     atomic_llong files;
+     int num_workers;
+     TreeDeque deques[MAX_TREE_THREADS];
+     pthread_mutex_t idle_lock;
+     pthread_cond_t idle_cond;
+     pthread_mutex_t links_lock;
+     LinkEntry *links[LINK_BUCKETS];
+     pthread_mutex_t errors_lock;
+     int first_errno;
+     const char *first_step;
+     GroupEntry *group; // Operazione di gruppo: entry della radice ordinate per nome, NULL se assente
+     GroupEntry **group_order; // ...e in ordine di inode, l'ordine in cui si elaborano
+     int group_count;
+     int group_state; // Si elaborano solo le entry in questo stato
+     int rename_first; // Spostamento: si prova prima a rinominare
+     atomic_int group_next;
+     TreeNode *group_root;
+ } TreeOp;
+ 
+ // Indice delle righe di un file visualizzato: l'inizio di una riga ogni
+ // VIEW_INDEX_STEP, in blocchi che non vengono mai spostati. Il thread
+ // dell'indice aggiunge i campioni e li pubblica con num_samples, il thread
+ // principale li legge senza lock
+ typedef struct {
+     uint64_t *blocks[VIEW_INDEX_BLOCKS];
+     atomic_long num_samples;
+     atomic_llong indexed; // Byte gia' esaminati
+     atomic_long total_rows; // Righe del file, -1 finche' l'indice non arriva in fondo
+     atomic_int full; // Indice esaurito (file con troppe righe o memoria finita)
+     atomic_int done; // Il thread dell'indice ha terminato
+     atomic_int cancel;
+ } LineIndex;
+ 
+ // Stato del visualizzatore interno
+ typedef struct {
+     const char *path;
+     int fd;
+     const char *data; // File mappato in memoria
+     size_t size; // Dimensione nota del file
+     size_t map_len; // Lunghezza della mappatura, con il margine per la crescita
+     LineIndex *index;
+     pthread_t index_thread;
+     int index_running;
+     size_t index_end; // Fine della zona affidata al thread dell'indice
+     size_t top; // Inizio della prima riga mostrata (multiplo di 16 in esadecimale)
+     int hscroll;
+     int hex;
+     int follow;
+ } Viewer;
+ 
+ // Riga trovata dalla ricerca nei file
+ typedef struct {
+     char *path; // Relativo alla directory della ricerca
+     long line;
+     off_t offset; // Inizio della riga nel file
+     char *text;
+ } GrepHit;
+ 
+ // Directory da leggere o file da esaminare nella ricerca
+ typedef struct GrepItem {
+     struct GrepItem *next;
+     int is_dir;
+     char path[]; // Relativo alla directory della ricerca
+ } GrepItem;
+ 
+ // Ricerca di un testo nel contenuto dei file di un albero di directory.
+ // I thread prendono directory e file da una lista comune (items)
+ typedef struct {
+     char root[MAX_PATH_LEN];
+     int root_fd;
+     char pattern[MAX_FILTER_LEN + 1];
+     char needle[MAX_FILTER_LEN + 1]; // Testo cercato, in minuscolo se ignore_case
+     size_t pattern_len;
+     int ignore_case;
+     pthread_t threads[MAX_TREE_THREADS];
+     int num_threads;
+     pthread_mutex_t lock; // Protegge items, busy e i risultati
+     pthread_cond_t cond;
+     GrepItem *items;
+     int busy; // Thread al lavoro su un elemento, che possono aggiungerne altri
+     GrepHit *hits;
+     int num_hits;
+     int hits_cap;
+     int truncated; // Raggiunto GREP_MAX_HITS
+     atomic_llong files;
+     atomic_llong binary;
+     atomic_llong bytes;
+     atomic_int cancel;
+     int exited; // Thread usciti dal ciclo di lavoro (protetto da lock)
+     atomic_int finished; // Thread terminati
+     int done; // Thread gia' raccolti con pthread_join
+     struct timespec started;
+     struct timespec finished_at;
+     int selected; // Posizione nell'elenco dei risultati
+     int top;
+ } GrepSearch;
+ 
+ // Coppia di file omonimi con la stessa dimensione, da confrontare per contenuto
+ typedef struct {
+     char *left; // Percorsi completi
+     char *right;
+     uint32_t left_id; // Entry nei pannelli
+     uint32_t right_id;
+     off_t size;
+     int mark; // Esito se il contenuto e' diverso (CMP_NEWER, CMP_OLDER o CMP_DIFFERENT)
+     atomic_int differs;
+     atomic_int failed; // Errore di lettura
+     atomic_int remaining; // Segmenti non ancora confrontati
+ } ComparePair;
+ 
+ // Parte di un file da confrontare
+ typedef struct {
+     int pair;
+     off_t offset;
+ } CompareSegment;
+ 
+ // Verifica in background del contenuto dei file dopo il confronto tra i
+ // pannelli. I file grandi sono divisi in segmenti distribuiti tra i thread;
+ // il primo segmento che trova una differenza ferma gli altri della coppia
+ typedef struct {
+     ComparePair *pairs;
+     int num_pairs;
+     CompareSegment *segments;
+     int num_segments;
+     atomic_int next_segment;
+     atomic_int pairs_done;
+     atomic_llong bytes;
+     atomic_int cancel;
+     atomic_int finished; // Thread terminati
+     pthread_t threads[MAX_TREE_THREADS];
+     int num_threads;
+     char left_path[MAX_PATH_LEN]; // Directory confrontate
+     char right_path[MAX_PATH_LEN];
+     struct timespec started;
+ } CompareCheck;
+ 
+ // Parametri per l'applicazione parallela del filtro
+ typedef struct {
+     Panel *panel;
+     const int *source; // Entry da esaminare, NULL = tutte tranne ".."
+     const char *folded; // Filtro in minuscolo
+     size_t len;
+     const char *literal; // Parte letterale dei glob
+     size_t literal_len;
+     unsigned char *hits; // Esito per ogni entry esaminata
+ } FilterJob;
+ 
+ // Argomento dei thread di un'operazione ricorsiva
+ typedef struct {
+     TreeOp *op;
+     int index;
+ } TreeWorker;
+ 
+ // Formati di archivio riconosciuti dal contenuto
+ enum { ARCHIVE_TAR, ARCHIVE_GZIP, ARCHIVE_ZSTD };
+ 
+ // Membro di un archivio tar nell'indice
+ typedef struct {
+     const char *path; // Percorso normalizzato, nell'arena dell'archivio
+     const char *name; // Ultimo componente di path
+     const char *link; // Destinazione di un link simbolico (o fisico, finche' non risolto)
+     off_t offset; // Inizio dei dati nel flusso tar decompresso
+     off_t size;
+     time_t mtime;
+     mode_t mode; // S_IFREG, S_IFDIR o S_IFLNK con i permessi
+     int parent; // Membro della directory che lo contiene, -1 = radice
+ } ArchiveMember;
+ 
+ // Punto da cui riprendere la decompressione senza ripartire dall'inizio
+ typedef struct {
+     off_t in; // Posizione nel file compresso
+     off_t out; // Posizione corrispondente nel flusso tar
+     int bits; // gzip: bit del byte in - 1 non ancora consumati
+     unsigned char *window; // gzip: ultimi 32 KB decompressi, il dizionario da cui ripartire
+     unsigned window_len;
+ } ArchiveCheckpoint;
+ 
+ // Indice di un archivio, costruito con una sola lettura sequenziale.
+ // Non cambia piu' dopo la costruzione: pannelli e operazioni lo condividono
+ typedef struct Archive {
+     struct Archive *next; // Cache degli indici, in testa il piu' recente
+     int refs; // Cache e utilizzatori (pannelli, operazioni), protetto da archive_lock
+     char path[MAX_PATH_LEN];
+     dev_t dev;
+     ino_t ino;
+     off_t file_size;
+     time_t mtime;
+     int format; // ARCHIVE_*
+     ArchiveMember *members; // Ordinati per percorso
+     int num_members;
+     NameArena names;
+     ArchiveCheckpoint *checkpoints; // In ordine di posizione
+     int num_checkpoints;
+     int checkpoints_cap;
+ } Archive;
+ 
+ // Buffer di ZSTD_decompressStream: zstd.h non serve, la libreria si carica a runtime
+ typedef struct {
+     const void *src;
+     size_t size;
+     size_t pos;
+ } ZstdInBuffer;
+ 
+ typedef struct {
+     void *dst;
+     size_t size;
+     size_t pos;
+ } ZstdOutBuffer;
+ 
+ // Funzioni di libzstd, caricate con dlopen al primo archivio .tar.zst
+ typedef struct {
+     int loaded;
+     void *(*create)(void);
+     size_t (*release)(void *ctx);
+     size_t (*decompress)(void *ctx, ZstdOutBuffer *out, ZstdInBuffer *in);
+     unsigned (*is_error)(size_t code);
+ } ZstdApi;
+ 
+ // Lettura del flusso tar di un archivio, decompresso se serve. base e' la
+ // posizione nel flusso di out_buf[0]: il prossimo byte e' base + out_off
+ typedef struct {
+     Archive *archive;
+     int fd;
+     off_t base;
+     char *out_buf;
+     size_t out_len;
+     size_t out_off;
+     unsigned char *in_buf; // Dati compressi; per i tar non compressi buffer di copia
+     size_t in_len;
+     size_t in_pos; // Byte di in_buf gia' consumati
+     off_t in; // Posizione nel file del byte che segue in_buf
+     int finished; // Fine dei dati compressi
+     int raw; // gzip: ripreso da un punto di ripresa, senza intestazione e trailer
+     z_stream zs;
+     int zs_init;
+     void *zstd; // Contesto di decompressione zstd
+     int frame_done; // zstd: l'ultimo frame e' completo
+     int indexing; // Registra i punti di ripresa nell'archivio
+     off_t last_checkpoint;
+     int no_copy_range; // copy_file_range non supportato verso la destinazione
+ } ArchiveStream;
+ 
+ // Membro da estrarre: la destinazione e' quella della sua radice seguita da
+ // path + skip (il percorso oltre la radice, o oltre la directory che la contiene)
+ typedef struct {
+     ArchiveMember *member;
+     size_t skip;
+ } ExtractItem;
+ 
+ // Valori dei record che precedono un membro (nomi lunghi GNU, intestazioni pax)
+ typedef struct {
+     char *path;
+     char *link;
+     off_t size; // -1 se non indicata
+     int has_mtime;
+     time_t mtime;
+ } ArchiveExtra;
+ 
+ // Indice dei nomi di un albero di directory. Il file si mappa in memoria
+ // cosi' com'e': intestazione, directory (ordinate per percorso), entry
+ // (contigue per directory, ordinate per nome) e infine i nomi
+ typedef struct {
+     char magic[8];
+     uint32_t num_dirs;
+     uint32_t num_entries;
+     uint64_t names_size;
+     int64_t built; // Data dell'ultima costruzione o aggiornamento
+     char root[MAX_PATH_LEN];
+ } NameIndexHeader;
+ 
+ typedef struct {
+     uint32_t path; // Percorso relativo alla radice, in names ("" per la radice)
+     uint32_t first; // Entry della directory: entries[first, first + count)
+     uint32_t count;
+     uint32_t partial; // Lettura incompleta: va riletta al prossimo aggiornamento
+     int64_t mtime_sec; // Data di modifica della directory alla lettura
+     int64_t mtime_nsec;
+ } NameIndexDir;
+ 
+ typedef struct {
+     uint32_t dir; // Directory che la contiene
+     uint32_t name; // In names
+     uint32_t mode;
+     uint32_t subdir; // Directory: la sua posizione in dirs, NAME_INDEX_NONE se non letta
+     int64_t size;
+     int64_t mtime;
+ } NameIndexEntry;
+ 
+ // File di un indice dei nomi mappato in memoria
+ typedef struct NameIndex {
+     char root[MAX_PATH_LEN];
+     void *map;
+     size_t size;
+     const NameIndexHeader *header;
+     const NameIndexDir *dirs;
+     const NameIndexEntry *entries;
+     const char *names;
+ } NameIndex;
+ 
+ // Ricerca nell'indice dei nomi: nome (sottostringa o glob, senza distinzione
+ // di maiuscole), dimensione dei file e data di modifica
+ typedef struct {
+     char pattern[MAX_FILTER_LEN + 1];
+     char folded[MAX_FILTER_LEN + 1];
+     size_t len;
+     int glob;
+     char literal[MAX_FILTER_LEN + 1]; // Tratto letterale piu' lungo del glob
+     size_t literal_len;
+     long long min_size; // -1 se non indicata
+     long long max_size;
+     time_t newer; // 0 se non indicata
+     time_t older;
+ } NameQuery;
+ 
+ // Entry letta durante la costruzione dell'indice dei nomi
+ typedef struct {
+     const char *name; // Nell'arena del thread o nell'indice precedente
+     mode_t mode;
+     off_t size;
+     time_t mtime;
+     uint32_t old; // Directory: posizione nell'indice precedente, NAME_INDEX_NONE se assente
+ } IndexName;
+ 
+ // Directory letta (o ripresa dall'indice precedente), in un solo blocco
+ // con le sue entry ordinate per nome, il percorso e i nomi
+ typedef struct IndexRecord {
+     struct IndexRecord *next;
+     const char *path;
+     struct timespec mtime;
+     int partial;
+     int count;
+     IndexName entries[];
+ } IndexRecord;
+ 
+ // Directory da leggere nella costruzione dell'indice dei nomi
+ typedef struct IndexItem {
+     struct IndexItem *next;
+     uint32_t old; // Posizione nell'indice precedente, NAME_INDEX_NONE se assente
+     char path[]; // Relativo alla radice, "" per la radice
+ } IndexItem;
+ 
+ // Costruzione di un indice dei nomi: i thread prendono le directory da una
+ // lista comune (items) e vi aggiungono le sottodirectory, come nella ricerca nei file
+ typedef struct {
+     int root_fd;
+     dev_t dev; // Le directory di altri filesystem montati sotto la radice non si leggono
+     NameIndex *old; // Indice precedente, NULL se si costruisce da zero
+     CopyControl *control;
+     pthread_t threads[MAX_TREE_THREADS];
+     int num_threads;
+     pthread_mutex_t lock; // Protegge items, busy e le directory lette
+     pthread_cond_t cond;
+     IndexItem *items;
+     int busy;
+     IndexRecord *records;
+     long num_records;
+     long long num_entries;
+     size_t names_size;
+     int error; // errno di un errore che rende l'indice inutilizzabile
+     atomic_long reread; // Directory rilette
+     atomic_long reused; // Directory riprese dall'indice precedente
+ } IndexBuild;
+ 
+ // Ricerca di un FindJob eseguita a blocchi di entry dal pool
+ typedef struct {
+     const NameIndex *index;
+     const NameQuery *query;
+     const unsigned char *in_scope; // Directory sotto quella del pannello
+     unsigned char *hits;
+ } FindJob;
+ 
+ // Tipi e stati delle operazioni in background
+ enum { JOB_COPY, JOB_MOVE, JOB_DELETE, JOB_EXTRACT, JOB_INDEX, JOB_NAMES, JOB_SIZE, JOB_SIZE_ALL };
+ enum { JOB_QUEUED, JOB_RUNNING, JOB_DONE, JOB_FAILED, JOB_CANCELLED };
+ 
+ // Operazione sui file eseguita dai thread delle operazioni
+ typedef struct Job {
+     struct Job *next;
+     int id;
+     int type;
+     int state; // Protetto da jobs_lock
+     char src[MAX_PATH_LEN];
+     char dst[MAX_PATH_LEN];
+     CopyControl control;
+     int method; // Metodo di copia usato
+     int error; // errno in caso di errore
+     const char *failed_step;
+     struct timespec started;
+     struct timespec finished;
+     int reaped; // Il thread principale ha gia' gestito la conclusione
+     char **errors; // Errori delle operazioni ricorsive
+     int num_errors;
+     char **names; // Operazione di gruppo: entry marcate di src verso la directory dst (un solo blocco)
+     int num_names;
+ } Job;
+ 
+ // Opzioni lette dall'ambiente
+ typedef struct {
+     int lazy_stat; // TYC_LAZY_STAT: metadati solo per le righe visibili o per l'ordinamento
+     int stat_threads; // TYC_STAT_THREADS: thread per le stat (0/1 = sempre seriale)
+     int stat_parallel; // TYC_STAT_PARALLEL: 0 = mai, 1 = solo fs di rete, 2 = sempre
+     int job_threads; // TYC_JOB_THREADS: operazioni eseguite in parallelo
+     int tree_threads; // TYC_TREE_THREADS: thread per copia/eliminazione ricorsiva
+     int keep_going; // TYC_KEEP_GOING: le operazioni ricorsive proseguono dopo un errore
+     int watch; // TYC_WATCH: 0 = mai, 1 = inotify (default), 2 = solo controllo periodico
+     int frame_time; // TYC_FRAME_TIME: mostra il tempo di disegno nell'intestazione
+     int external_viewer; // TYC_VIEWER: 1 = F3 usa sempre $PAGER
+     int allocated_size; // TYC_DIR_SIZE: 1 = le directory mostrano lo spazio occupato su disco
+     size_t listing_cache; // TYC_LISTING_CACHE: memoria massima della cache degli elenchi (0 = disattivata)
+     int io_uring; // TYC_IO_URING: 0 = mai, 1 = dove sostituisce thread o read/write (default), 2 = sempre
+     char index_dir[MAX_PATH_LEN]; // TYC_INDEX_DIR: directory dei file degli indici dei nomi
+     int sort_by; // TYC_SORT: ordinamento iniziale dei pannelli (SORT_*)
+ } Config;
+ 
+ // Elenco di una directory lasciata di recente, per tornarci senza attendere
+ // la lettura. Vale finche' data di modifica e di cambio stato della
+ // directory restano quelle registrate
+ typedef struct CachedListing {
+     struct CachedListing *prev; // Ordine LRU: in testa la piu' recente
+     struct CachedListing *next;
+     dev_t dev;
+     ino_t ino;
+     struct timespec mtime;
+     struct timespec ctime;
+     FileEntry *files; // Entry ordinate, ".." esclusa; i nomi puntano in names
+     int num_files;
+     char *names;
+     size_t names_size;
+     int sort_by;
+     int sort_order;
+     int selected;
+     int scroll_pos;
+     size_t memory; // Memoria occupata in tutto
+     char path[];
+ } CachedListing;
+ 
+ // Totali di una directory gia' calcolati, mostrati finche' la sua data di
+ // modifica non cambia. Sono quelli dell'ultimo calcolo: file cresciuti sul
+ // posto o modifiche nelle sottodirectory non cambiano la data
+ typedef struct SizeEntry {
+     struct SizeEntry *next;
+     dev_t dev;
+     ino_t ino;
+     struct timespec mtime;
+     long long apparent; // Somma delle dimensioni (st_size)
+     long long allocated; // Spazio occupato su disco (st_blocks)
+     long long files;
+     int partial; // Qualche entry non e' stata letta
+ } SizeEntry;
+ 
+ // Statistiche di disegno dello schermo
+ typedef struct {
+     double last_ms;
+     double avg_ms; // Media mobile esponenziale
+     double max_ms;
+     int rows; // Righe dei pannelli ridisegnate nel fotogramma corrente
+     int last_rows; // ...e nel precedente
+ } FrameStats;
+ 
+ // Ciclo degli eventi: SIGWINCH e i thread in background lo svegliano
+ // scrivendo un byte nella self-pipe
+ typedef struct {
+     int wake_pipe[2];
+     atomic_int wake_pending; // C'e' gia' un byte nella pipe: non serve scriverne altri
+     struct sigaction old_winch; // Gestore di ncurses, che fa restituire KEY_RESIZE a getch
+     int dirty; // Lo schermo va ridisegnato
+     struct timespec last_frame;
+ } EventLoop;
+ 
+ // Operazioni misurate dalla strumentazione (TYC_PERF, TYC_TRACE, 'P')
+ enum {
+     PERF_READ_DIR,
+     PERF_SORT,
+     PERF_DRAW,
+     PERF_COPY,
+     PERF_DELETE,
+     PERF_FIND,
+     PERF_OPS
+ };
+ 
+ // Chiamate di sistema contate nei percorsi misurati
+ enum {
+     PERF_SYS_GETDENTS,
+     PERF_SYS_STAT,
+     PERF_SYS_OPEN,
+     PERF_SYS_READ,
+     PERF_SYS_WRITE,
+     PERF_SYS_COPY,  // copy_file_range, sendfile e FICLONE
+     PERF_SYS_UNLINK,
+     PERF_SYS_URING, // io_uring_enter: invio e attesa di un gruppo di richieste
+     PERF_SYSCALLS
+ };
+ 
+ // Statistiche di un'operazione, aggiornate da piu' thread
+ typedef struct {
+     atomic_ulong count;
+     atomic_ulong total_us;
+     atomic_ulong max_us;
+     atomic_ulong entries;
+     atomic_ullong bytes;
+     atomic_ulong buckets[PERF_BUCKETS]; // Il bucket i conta le durate sotto 2^i us
+ } PerfCounter;
+ 
+ typedef struct {
+     atomic_int enabled; // Spento: ogni punto di misura costa un solo confronto
+     int overlay; // Riquadro delle statistiche visibile
+     WINDOW *win;
+     FILE *trace; // Traccia in formato Chrome trace-event (TYC_TRACE)
+     const char *trace_path;
+     long trace_events;
+     pthread_mutex_t trace_lock;
+     struct timespec origin; // Istante zero della traccia
+     PerfCounter ops[PERF_OPS];
+     atomic_ulong syscalls[PERF_SYSCALLS];
+ } Perf;
+ 
  // Variabili globali
+ Config config;
+ WorkerPool *stat_pool;
+ pthread_mutex_t stat_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+ CopyPair copy_pairs[MAX_COPY_PAIRS];
+ int num_copy_pairs;
+ pthread_mutex_t copy_pairs_lock = PTHREAD_MUTEX_INITIALIZER;
+ const char *copy_method_names[COPY_METHODS] = { "reflink", "copy_file_range", "sendfile", "io_uring", "read/write" };
+ char status_message[MAX_COMMAND_LEN];
+ int status_error; // Il messaggio e' un errore: va mostrato in rosso
+ Job *jobs; // Coda delle operazioni, incluse quelle terminate da poco
+ pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+ pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+ pthread_t job_threads[MAX_JOB_THREADS];
+ int num_job_threads;
+ int jobs_shutdown;
+ int next_job_id = 1;
+ int selected_job; // Id dell'operazione selezionata nell'area di stato
+ char **error_report; // Errori dell'ultima operazione ricorsiva, visibili con 'e'
+ int error_report_count;
+ char error_report_title[MAX_COMMAND_LEN];
  Panel left_panel, right_panel;
  Panel *active_panel;
+ Panel *sort_panel; // Pannello di cui file_compare usa il criterio di ordinamento
+ int inotify_fd = -1;
+ FrameStats frame_stats;
+ EventLoop events = { .wake_pipe = { -1, -1 } };
+ Perf perf = { .trace_lock = PTHREAD_MUTEX_INITIALIZER };
+ int input_mode; // INPUT_*
+ char search_text[MAX_FILTER_LEN + 1]; // Testo della ricerca rapida
+ int search_len;
+ GrepSearch *grep_search; // Ultima ricerca nei file, riaperta con 'G'
+ int archive_view_job; // Estrazione di un membro da visualizzare (id dell'operazione, 0 = nessuna)
+ int archive_view_ready; // Estrazione conclusa: il visualizzatore si apre dal ciclo degli eventi
+ char archive_view_path[MAX_PATH_LEN]; // Copia temporanea del membro
+ CompareCheck *compare_check; // Verifica del contenuto in corso, NULL se assente
+ _Thread_local sigjmp_buf *view_fault_jmp; // Ripristino dopo un SIGBUS nel visualizzatore
+ SizeEntry **size_cache; // Tabella hash per (dev, inode), allocata al primo calcolo
+ int size_cache_count;
+ pthread_mutex_t size_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+ atomic_ulong size_cache_version; // Cambia ad ogni totale registrato
+ unsigned long size_applied_version; // Totali gia' mostrati nei pannelli
+ struct timespec size_applied_time;
+ CachedListing *listing_cache_head; // Cache LRU degli elenchi delle directory
+ CachedListing *listing_cache_tail;
+ int listing_cache_count;
+ size_t listing_cache_memory;
+ long listing_cache_hits;
+ long listing_cache_misses;
+ Archive *archive_cache; // Indici degli archivi aperti di recente
+ pthread_mutex_t archive_lock = PTHREAD_MUTEX_INITIALIZER;
+ ZstdApi zstd_api;
+ pthread_once_t zstd_once = PTHREAD_ONCE_INIT;
+ int batch_mode; // Esecuzione senza interfaccia (--batch)
  int term_rows, term_cols;
  
  // Prototipi di funzione
+ void load_config();
  void init_panels();
+ void free_panels();
  void read_directory(Panel *panel);
+ void load_directory(Panel *panel);
+ int poll_directory_load(Panel *panel);
+ void finish_directory_load(Panel *panel);
+ void cancel_directory_load(Panel *panel);
+ void release_directory_load(Panel *panel);
+ void finish_listing(Panel *panel);
+ void start_directory_load(Panel *panel, int shadow);
+ void cache_listing(Panel *panel);
+ int restore_listing(Panel *panel);
+ void uncache_listing(CachedListing *entry);
+ void free_listing_cache();
+ void loader_flush(DirLoader *ld, FileEntry *batch, int count);
+ void *loader_thread(void *data);
+ int dirscan_init(DirScan *scan, int fd);
+ int dirscan_next(DirScan *scan, const char **name, size_t *len, unsigned char *type);
+ int dirscan_detach(DirScan *scan);
+ int fetch_entry_metadata(int dir_fd, FileEntry *file);
+ int fetch_metadata_batch(int dir_fd, FileEntry *files, int count, int compact,
+                          int unclassified_only, atomic_int *cancel);
+ int load_metadata(Panel *panel, int from, int to, int compact, int unclassified_only);
+ WorkerPool *pool_create(int num_threads);
+ void pool_run(WorkerPool *pool, PoolTask task, void *arg, int total, int batch);
+ void pool_destroy(WorkerPool *pool);
+ WorkerPool *get_stat_pool();
+ int is_network_fs(int fd);
+ void arena_reset(NameArena *arena);
+ const char *arena_strdup(NameArena *arena, const char *str, size_t len);
+ void arena_free(NameArena *arena);
+ FileEntry *panel_new_entry(Panel *panel, const char *name, size_t len);
  void draw_interface();
  void draw_panel(Panel *panel, int x, int y, int width, int height);
- void handle_input();
+ void draw_row(Panel *panel, int pos, int line);
+ const char *format_row(Panel *panel, FileEntry *file, char *buf, size_t size);
+ void invalidate_screen();
+ void handle_input(int ch);
  void execute_command(const char *command);
- void copy_file(const char *src, const char *dst);
- void move_file(const char *src, const char *dst);
- void delete_file(const char *path);
+ int copy_file(const char *src, const char *dst, CopyStats *stats, CopyControl *control);
+ int copy_fd_data(int src_fd, int dst_fd, const struct stat *st, CopyStats *stats, CopyControl *control);
+ int copy_check_control(CopyControl *control);
+ int get_copy_method(dev_t src_dev, dev_t dst_dev);
+ void set_copy_method(dev_t src_dev, dev_t dst_dev, int method);
+ int write_all(int fd, const char *buf, size_t len);
+ int pwrite_all(int fd, const char *buf, size_t len, off_t offset);
+ ssize_t copy_chunk(CopySession *session, off_t offset, size_t length);
+ int copy_range(CopySession *session, off_t offset, off_t length);
+ void copy_release_cache(CopySession *session, off_t offset, off_t length);
+ int copy_method_unsupported(int err);
+ int move_file(const char *src, const char *dst, CopyStats *stats, CopyControl *control);
+ int delete_file(const char *path, CopyStats *stats, CopyControl *control);
+ void free_copy_stats(CopyStats *stats);
+ int copy_tree(const char *src, const char *dst, CopyStats *stats, CopyControl *control);
+ int delete_tree(const char *path, CopyStats *stats, CopyControl *control);
+ int group_operation(int type, const char *src_dir, const char *dst_dir, char **names, int count,
+                     CopyStats *stats, CopyControl *control);
+ int size_tree(const char *path, CopyStats *stats, CopyControl *control);
+ void size_cache_store(TreeNode *node, int partial);
+ int size_cache_lookup(const struct stat *st, SizeEntry *out);
+ void size_cache_free();
+ int tree_link_seen(TreeOp *op, const struct stat *st);
+ int apply_dir_sizes(Panel *panel, int force);
+ void update_dir_sizes(int force);
+ void format_size(off_t size, char *buf);
+ void show_dir_size(const char *path);
+ int run_tree_op(TreeOp *op, TreeNode *root);
+ TreeNode *tree_node_new(TreeNode *parent, const char *name, size_t len);
+ void tree_push(TreeOp *op, int index, TreeNode *node);
+ TreeNode *tree_take(TreeOp *op, int index);
+ void tree_release(TreeOp *op, TreeNode *node);
+ void tree_process(TreeOp *op, int index, TreeNode *node);
+ void tree_copy_entry(TreeOp *op, TreeNode *node, const char *name, const struct stat *st);
+ void tree_error(TreeOp *op, TreeNode *node, const char *name, const char *step, int err);
+ size_t tree_node_path(TreeNode *node, char *buf, size_t size);
+ void tree_entry(TreeOp *op, int index, TreeNode *node, const char *name, size_t len, const struct stat *st);
+ int tree_group_next(TreeOp *op, int index);
+ void tree_group_failed(TreeOp *op, TreeNode *node, const char *name);
+ int compare_group_names(const void *a, const void *b);
+ int compare_group_inodes(const void *a, const void *b);
+ void *tree_worker(void *data);
+ void set_times_from_stat(struct timespec times[2], const struct stat *st);
+ struct timespec stat_mtime(const struct stat *st);
+ struct timespec stat_ctime(const struct stat *st);
+ void show_error_list();
+ int confirm(const char *format, ...);
+ Job *enqueue_job(int type, const char *src, const char *dst);
+ Job *enqueue_group(int type, const char *src_dir, const char *dst_dir, char **names, int count);
+ Job *new_job(int type, const char *src, const char *dst);
+ Job *submit_job(Job *job);
+ void *job_worker(void *data);
+ void run_job(Job *job);
+ int poll_jobs();
+ void draw_jobs(int y, int rows);
+ int count_jobs();
+ Job *find_selected_job();
+ void stop_jobs();
+ void refresh_directory(Panel *panel);
+ void watch_directory(Panel *panel);
+ void unwatch_directory(Panel *panel);
+ void read_watch_events();
+ void queue_change(Panel *panel, const char *name);
+ void queue_rescan(Panel *panel);
+ int apply_changes(Panel *panel);
+ int check_directory_mtime(Panel *panel);
+ int poll_watches();
+ int input_timeout();
+ void init_event_loop();
+ void winch_handler(int sig);
+ void ui_wake();
+ void wait_events(int timeout_ms);
+ void run_event_loop();
+ int poll_background();
+ int modal_getch(int draw_panels, int tick_ms);
+ int compare_names(const void *a, const void *b);
+ int compare_ints(const void *a, const void *b);
+ int file_compare(const void *a, const void *b);
+ int background_busy();
+ int path_in_directory(const char *path, const char *dir);
+ int job_touches(Job *job, const char *dir);
+ double elapsed_seconds(const struct timespec *from, const struct timespec *to);
+ void zstd_load();
+ int zstd_available();
+ int archive_format(int fd);
+ const char *archive_error_step(int err);
+ int archive_stream_init(ArchiveStream *s, Archive *archive, int fd);
+ int archive_stream_open(ArchiveStream *s, const ArchiveCheckpoint *cp);
+ void archive_stream_close(ArchiveStream *s);
+ off_t archive_stream_progress(ArchiveStream *s);
+ ssize_t archive_input(ArchiveStream *s);
+ ssize_t archive_ensure_input(ArchiveStream *s, size_t len);
+ int archive_add_checkpoint(ArchiveStream *s, int bits);
+ int archive_next_gzip_member(ArchiveStream *s);
+ int archive_fill_gzip(ArchiveStream *s);
+ int archive_fill_zstd(ArchiveStream *s);
+ int archive_fill(ArchiveStream *s);
+ ssize_t archive_read(ArchiveStream *s, char *buf, size_t len);
+ int archive_skip(ArchiveStream *s, off_t len);
+ int archive_seek(ArchiveStream *s, off_t offset);
+ ssize_t archive_copy_chunk(ArchiveStream *s, int fd, size_t len);
+ long long tar_number(const char *field, size_t len);
+ int tar_checksum_ok(const char *header);
+ long normalize_member_path(const char *src, char *dst);
+ void archive_parse_pax(ArchiveExtra *extra, char *data, size_t size);
+ ArchiveMember *archive_new_member(Archive *archive);
+ int archive_add_member(Archive *archive, const char *path, const char *link, char type,
+                        off_t offset, off_t size, time_t mtime, mode_t mode);
+ int archive_parse(ArchiveStream *s, CopyControl *control, const char **failed_step);
+ int member_compare(const void *a, const void *b);
+ int member_offset_compare(const void *a, const void *b);
+ int archive_find(Archive *archive, const char *path, size_t len);
+ int archive_child(Archive *archive, int dir, const char *name);
+ void archive_subtree(Archive *archive, int index, int *from, int *to);
+ int archive_add_parents(Archive *archive);
+ int archive_finish_index(Archive *archive);
+ Archive *archive_build(const char *path, CopyControl *control, const char **failed_step);
+ void archive_free(Archive *archive);
+ void archive_release(Archive *archive);
+ Archive *archive_lookup(const char *path);
+ void archive_insert(Archive *archive);
+ void free_archive_cache();
+ Archive *archive_for_path(const char *path, const char **inner, CopyControl *control, const char **failed_step);
+ int archive_extract_file(ArchiveStream *s, ArchiveMember *member, const char *path,
+                          CopyStats *stats, CopyControl *control);
+ int archive_extract(Archive *archive, const int *roots, int num_roots, const char *dst, int keep_names,
+                     CopyStats *stats, CopyControl *control);
+ int extract_path(const char *src, const char *dst, CopyStats *stats, CopyControl *control);
+ int extract_group(const char *src_dir, const char *dst_dir, char **names, int count,
+                   CopyStats *stats, CopyControl *control);
+ int index_archive(const char *path, CopyStats *stats, CopyControl *control);
+ int is_archive_name(const char *name);
+ void open_archive(Panel *panel, const char *name);
+ void enter_archive(Panel *panel, Archive *archive);
+ void close_archive(Panel *panel);
+ void archive_indexed(const char *path, int ok);
+ void list_archive_directory(Panel *panel);
+ void archive_change_directory(Panel *panel, const char *name);
+ void archive_dir_sizes(Panel *panel, int only_selected);
+ void view_archive_member(Panel *panel, FileEntry *file);
+ void show_archive_view();
+ void remove_archive_view();
+ int archive_readonly(Panel *panel);
+ int copy_job_type(Panel *panel);
+ void name_index_file(const char *root, char *buf, size_t size);
+ int name_index_root(const char *path, char *root, size_t size);
+ NameIndex *name_index_open(const char *root);
+ void name_index_close(NameIndex *index);
+ uint32_t name_index_child(const NameIndex *index, uint32_t dir, const char *name);
+ int compare_index_names(const void *a, const void *b);
+ int compare_index_records(const void *a, const void *b);
+ IndexItem *index_item_new(IndexItem *next, const char *path, const char *name, uint32_t old);
+ void index_fail(IndexBuild *build, int err);
+ int index_reserve(IndexName **scratch, int *cap, int count);
+ void index_directory(IndexBuild *build, IndexItem *item, NameArena *arena, IndexName **scratch, int *scratch_cap);
+ void *index_worker(void *data);
+ int make_index_dir();
+ int name_index_write(IndexBuild *build, const char *root);
+ int build_name_index(const char *root, CopyStats *stats, CopyControl *control);
+ int parse_name_query(const char *text, NameQuery *query);
+ int name_query_match(const NameQuery *query, const char *name, const NameIndexEntry *entry);
+ void find_task(void *arg, int from, int to);
+ void list_found(Panel *panel);
+ void start_name_index(const char *root);
+ void find_files(Panel *panel, const char *text);
+ void show_found(Panel *panel, NameIndex *index);
+ void close_found(Panel *panel);
+ int path_within(const char *path, const char *dir);
+ void names_indexed(const char *root, int ok);
+ void open_found_entry(Panel *panel, FileEntry *file);
+ void select_loaded_entry(Panel *panel, const char *name);
+ int found_readonly(Panel *panel);
+ #ifdef HAVE_IO_URING
+ Uring *uring_create(unsigned entries);
+ void uring_free(void *data);
+ int uring_available();
+ void uring_probe();
+ Uring *thread_uring();
+ void thread_uring_key();
+ struct io_uring_sqe *uring_get_sqe(Uring *ring);
+ int uring_submit(Uring *ring, unsigned wait);
+ struct io_uring_cqe *uring_peek(Uring *ring);
+ void uring_seen(Uring *ring);
+ int uring_fetch_metadata(MetadataJob *job, int count);
+ ssize_t uring_copy_chunk(CopySession *session, off_t offset, size_t length);
+ #endif
+ void perf_init();
+ void perf_close();
+ void perf_record(int op, const struct timespec *start, long entries, long long bytes, const char *detail);
+ void perf_format_us(unsigned long us, char *buf, size_t size);
+ unsigned long perf_percentile(PerfCounter *counter, int percent);
+ void draw_perf_overlay(int y, int rows);
+ void sort_entries(Panel *panel);
+ int copy_path(const char *src, const char *dst, CopyStats *stats, CopyControl *control);
+ int delete_path(const char *path, CopyStats *stats, CopyControl *control);
  void view_file(const char *path);
+ int run_external(const char *command, const char *path);
+ int run_viewer(const char *path, size_t offset);
+ void view_fault_handler(int sig);
+ size_t view_next_row(const char *data, size_t start, size_t end);
+ size_t view_skip_rows(const char *data, size_t start, size_t end, long *count);
+ size_t index_sample(LineIndex *index, long k);
+ int index_add_sample(LineIndex *index, long k, size_t offset);
+ void index_rows(Viewer *viewer);
+ void *index_thread(void *data);
+ void start_indexer(Viewer *viewer);
+ void stop_indexer(Viewer *viewer);
+ void reset_index(LineIndex *index);
+ int viewer_map(Viewer *viewer);
+ int viewer_check_size(Viewer *viewer);
+ size_t view_row_start(Viewer *viewer, size_t offset, long *row);
+ size_t view_goto_row(Viewer *viewer, long row);
+ size_t view_last_page(Viewer *viewer, int height);
+ void view_scroll(Viewer *viewer, long delta, int height);
+ void draw_view_text(Viewer *viewer, int line, size_t start, size_t end);
+ void draw_view_hex(Viewer *viewer, int line, size_t start);
+ void draw_viewer(Viewer *viewer);
+ long prompt_number(const char *label);
+ int prompt_text(const char *label, char *buf, size_t size, int draw_panels);
+ size_t count_newlines(const char *p, size_t len);
+ const char *find_pattern(const char *p, size_t size, const char *needle, size_t len, int fold);
+ GrepItem *grep_item_new(GrepItem *next, int is_dir, const char *dir, const char *name);
+ void grep_directory(GrepSearch *search, const char *path);
+ void grep_add_hit(GrepHit **hits, int *count, int *cap, const char *path, long line,
+                   off_t offset, const char *start, const char *end);
+ void grep_region(GrepSearch *search, const char *path, const char *buf, size_t len, off_t base,
+                  long *line, GrepHit **hits, int *count, int *cap);
+ void grep_file(GrepSearch *search, const char *path, char *buf);
+ void *grep_worker(void *data);
+ GrepSearch *start_grep(const char *root, const char *pattern);
+ int grep_finished(GrepSearch *search);
+ void free_grep(GrepSearch *search);
+ void show_grep_results(GrepSearch *search);
+ void compare_panels(int verify);
+ int compare_entries(FileEntry *left, FileEntry *right, int verify);
+ FileEntry **entries_by_name(Panel *panel);
+ int compare_entry_names(const void *a, const void *b);
+ void show_compare_summary();
+ void start_compare_check(ComparePair *pairs, int num_pairs);
+ void *compare_worker(void *data);
+ int compare_segment(CompareCheck *check, ComparePair *pair, off_t offset, char *buf_a, char *buf_b);
+ ssize_t pread_full(int fd, char *buf, size_t len, off_t offset);
+ int poll_compare();
+ void free_compare_check(CompareCheck *check, int apply);
+ void sync_panels();
  void edit_file(const char *path);
  void open_shell();
- int compare_files(const void *a, const void *b, Panel *panel);
  void sort_files(Panel *panel);
+ int sort_needs_metadata(int sort_by);
+ uint64_t folded_prefix(const char *str);
+ uint64_t natural_key(const char *str);
+ const char *file_extension(const char *name);
+ int natural_compare(const char *a, const char *b);
+ int entry_compare(int sort_by, const FileEntry *fa, const FileEntry *fb);
+ int sort_item_compare(const void *a, const void *b);
+ void radix_sort(SortItem *items, SortItem *tmp, size_t count);
+ void sort_group(Panel *panel, SortItem *items, SortItem *tmp, size_t count);
+ void sort_range(const FileEntry *files, int sort_by, SortItem *items, SortItem *tmp, size_t count, int depth);
+ void reverse_entries(FileEntry *files, int from, int to);
+ void resort_panel(Panel *panel);
+ int contains_folded(const char *name, const char *needle, size_t len);
+ int fuzzy_match(const char *name, const char *pattern, size_t len);
+ int filter_match(Panel *panel, const char *name, const char *folded, size_t len, const char *literal, size_t literal_len);
+ size_t glob_literal(const char *folded, size_t len, char *literal);
+ void filter_task(void *arg, int from, int to);
+ void update_filter(Panel *panel);
+ void clear_filter_levels(Panel *panel, int keep);
+ void set_filter(Panel *panel, const char *text, int len);
+ int visible_count(Panel *panel);
+ int visible_entry(Panel *panel, int pos);
+ int visible_pos(Panel *panel, int index);
+ void move_selection(Panel *panel, int delta);
+ int is_tagged(Panel *panel, FileEntry *file);
+ void set_tag(Panel *panel, FileEntry *file, int tagged);
+ void clear_tags(Panel *panel);
+ void count_tags(Panel *panel);
+ int tagged_count(Panel *panel);
+ void save_tags(Panel *panel);
+ void restore_tags(Panel *panel);
+ void free_retag_names(Panel *panel);
+ void tag_matching(Panel *panel, const char *pattern, int tagged);
+ void invert_tags(Panel *panel);
+ char **tagged_names(Panel *panel, int *count);
+ void enqueue_tagged(Panel *panel, int type, const char *dst_dir);
+ int quick_search(Panel *panel, const char *text, int len, int from);
+ int handle_search_key(int ch);
  void change_directory(Panel *panel, const char *path);
- char *get_file_permissions(mode_t mode);
+ void reset_panel_view(Panel *panel);
+ void get_file_permissions(mode_t mode, char *perms);
  void display_error(const char *message);
+ void show_message(const char *format, ...);
  void cleanup();
+ int run_batch(int argc, char **argv);
+ void json_string(const char *value);
+ int batch_list(const char *path);
+ void batch_entry(const FileEntry *file);
+ int batch_find(const char *path, const char *text);
+ int batch_operation(const char *op, const char *src, const char *dst);
+ int run_bench(const char *root, int argc, char **argv);
+ int compare_doubles(const void *a, const void *b);
+ void bench_remove(const char *path);
+ void bench_report(const char *test, const char *tree, long entries, double *samples, int count, long long bytes);
+ int bench_make_tree(const char *root, const char *name, long entries, int deep, int data);
+ int bench_make_files(const char *root);
+ void bench_listing(const char *root, const char *tree, int runs);
+ void bench_render(const char *tree, int runs);
+ void bench_copy(const char *root, const char *tree, int runs);
+ 
+ // Inizio di un'operazione misurata; con la strumentazione spenta start resta a zero
+ static inline void perf_start(struct timespec *start) {
+     start->tv_sec = start->tv_nsec = 0;
+     if (atomic_load_explicit(&perf.enabled, memory_order_relaxed))
+         clock_gettime(CLOCK_MONOTONIC, start);
+ }
+ 
+ // Fine di un'operazione misurata con perf_start
+ static inline void perf_end(int op, const struct timespec *start, long entries, long long bytes, const char *detail) {
+     if (start->tv_sec || start->tv_nsec)
+         perf_record(op, start, entries, bytes, detail);
+ }
+ 
+ // Conta una chiamata di sistema
+ static inline void perf_count(int call) {
+     if (atomic_load_explicit(&perf.enabled, memory_order_relaxed))
+         atomic_fetch_add_explicit(&perf.syscalls[call], 1, memory_order_relaxed);
+ }
  
  // Funzione per inizializzare l'interfaccia ncurses
  void init_ncurses() {
@@ -80,6 +1439,7 @@
      cbreak();
      noecho();
      keypad(stdscr, TRUE);
+     set_escdelay(25);
      curs_set(0);
      
      // Definizione delle coppie di colori
@@ -89,550 +1449,9961 @@
      init_pair(4, COLOR_GREEN, COLOR_BLUE);    // File eseguibili
      init_pair(5, COLOR_WHITE, COLOR_RED);     // Messaggi di errore
      init_pair(6, COLOR_BLACK, COLOR_WHITE);   // File selezionato
+     init_pair(7, COLOR_CYAN, COLOR_BLUE);     // Entry marcate
      
      // Ottieni dimensioni del terminale
      getmaxyx(stdscr, term_rows, term_cols);
      
-     // Imposta gestore del segnale per il resize del terminale
-     signal(SIGWINCH, (void (*)(int))cleanup);
+     // Il resize del terminale sveglia il ciclo degli eventi
+     init_event_loop();
  }
  
  // Funzione main
- int main() {
+ int main(int argc, char **argv) {
+     load_config();
+     perf_init();
+     // Con --batch le operazioni vengono eseguite senza interfaccia
+     if (argc > 1 && strcmp(argv[1], "--batch") == 0)
+         return run_batch(argc - 2, argv + 2);
      init_ncurses();
      init_panels();
      
      // Leggi directory iniziale
-     read_directory(&left_panel);
-     read_directory(&right_panel);
+     load_directory(&left_panel);
+     load_directory(&right_panel);
      
-     // Loop principale
-     while (1) {
-         draw_interface();
-         handle_input();
-     }
+     run_event_loop();
      
      cleanup();
      return 0;
  }
  
- // Inizializza i pannelli
- void init_panels() {
-     getcwd(left_panel.current_path, MAX_PATH_LEN);
-     strcpy(right_panel.current_path, left_panel.current_path);
+ // Prepara la self-pipe e il gestore di SIGWINCH, che si aggiunge a quello
+ // installato da ncurses
+ void init_event_loop() {
+     struct sigaction action;
+     int i;
      
-     left_panel.selected = 0;
-     left_panel.scroll_pos = 0;
-     left_panel.num_files = 0;
-     left_panel.sort_by = 0;
-     left_panel.sort_order = 0;
+     if (pipe(events.wake_pipe) == 0) {
+         for (i = 0; i < 2; i++) {
+             fcntl(events.wake_pipe[i], F_SETFL, O_NONBLOCK);
+             fcntl(events.wake_pipe[i], F_SETFD, FD_CLOEXEC);
+         }
+     } else {
+         events.wake_pipe[0] = events.wake_pipe[1] = -1;
+     }
      
-     right_panel.selected = 0;
-     right_panel.scroll_pos = 0;
-     right_panel.num_files = 0;
-     right_panel.sort_by = 0;
-     right_panel.sort_order = 0;
+     memset(&action, 0, sizeof(action));
+     action.sa_handler = winch_handler;
+     sigemptyset(&action.sa_mask);
+     action.sa_flags = SA_RESTART;
+     sigaction(SIGWINCH, &action, &events.old_winch);
+ }
+ 
+ // Gestore di SIGWINCH: ncurses annota il nuovo formato (il prossimo getch
+ // restituisce KEY_RESIZE) e il ciclo degli eventi si sveglia
+ void winch_handler(int sig) {
+     int saved_errno = errno;
      
-     active_panel = &left_panel;
+     if (events.old_winch.sa_flags & SA_SIGINFO) {
+         if (events.old_winch.sa_sigaction)
+             events.old_winch.sa_sigaction(sig, NULL, NULL);
+     } else if (events.old_winch.sa_handler != SIG_DFL && events.old_winch.sa_handler != SIG_IGN) {
+         events.old_winch.sa_handler(sig);
+     }
+     ui_wake();
+     errno = saved_errno;
  }
  
- // Legge il contenuto di una directory
- void read_directory(Panel *panel) {
-     DIR *dir;
-     struct dirent *entry;
-     struct stat st;
-     char full_path[MAX_PATH_LEN];
+ // Sveglia il ciclo degli eventi. Si puo' chiamare da qualsiasi thread e
+ // da un gestore di segnale; senza interfaccia non fa nulla
+ void ui_wake() {
+     ssize_t ret;
      
-     panel->num_files = 0;
+     if (events.wake_pipe[1] < 0 || atomic_exchange(&events.wake_pending, 1))
+         return;
+     ret = write(events.wake_pipe[1], "", 1);
+     (void)ret;
+ }
+ 
+ // Attende un tasto, una notifica o un evento inotify per al massimo
+ // timeout_ms (senza limite se negativo) e svuota la self-pipe
+ void wait_events(int timeout_ms) {
+     struct pollfd fds[3];
+     char buf[64];
+     int nfds = 0;
      
-     // Aggiungi solo l'entry per la directory padre ".."
-     strcpy(panel->files[panel->num_files].name, "..");
-     panel->files[panel->num_files].is_dir = 1;
-     panel->num_files++;
+     fds[nfds].fd = STDIN_FILENO;
+     fds[nfds++].events = POLLIN;
+     if (events.wake_pipe[0] >= 0) {
+         fds[nfds].fd = events.wake_pipe[0];
+         fds[nfds++].events = POLLIN;
+     }
+     if (inotify_fd >= 0) {
+         fds[nfds].fd = inotify_fd;
+         fds[nfds++].events = POLLIN;
+     }
      
-     if ((dir = opendir(panel->current_path)) == NULL) {
-         display_error("Impossibile aprire la directory");
-         return;
+     // Un segnale interrompe poll, ma ha gia' scritto nella pipe
+     if (poll(fds, nfds, timeout_ms) > 0 && events.wake_pipe[0] >= 0 && fds[1].revents) {
+         // Le notifiche successive scrivono un nuovo byte, raccolto al prossimo giro
+         atomic_store(&events.wake_pending, 0);
+         while (read(events.wake_pipe[0], buf, sizeof(buf)) > 0)
+             ;
      }
+ }
+ 
+ // Ciclo principale: raccoglie lo stato del lavoro in background, ridisegna
+ // se qualcosa e' cambiato (al massimo un fotogramma ogni FRAME_MIN_MS) e
+ // attende in poll() il prossimo evento. Senza lavoro in corso l'attesa non
+ // ha scadenza, cosi' il programma fermo non usa la CPU
+ void run_event_loop() {
+     struct timespec now;
+     int ch, wait_ms, since;
      
-     while ((entry = readdir(dir)) != NULL && panel->num_files < MAX_FILES) {
-         // Salta le entries "." e ".." perché abbiamo già aggiunto ".."
-         // e non vogliamo visualizzare "."
-         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-             continue;
-         
-         snprintf(full_path, MAX_PATH_LEN, "%s/%s", panel->current_path, entry->d_name);
+     events.dirty = 1;
+     while (1) {
+         if (poll_background()) events.dirty = 1;
+         if (archive_view_ready) {
+             show_archive_view();
+             events.dirty = 1;
+         }
          
-         if (stat(full_path, &st) == -1)
-             continue;
+         wait_ms = input_timeout();
+         if (events.dirty) {
+             clock_gettime(CLOCK_MONOTONIC, &now);
+             since = elapsed_seconds(&events.last_frame, &now) * 1000;
+             if (since >= FRAME_MIN_MS) {
+                 draw_interface();
+                 events.dirty = 0;
+                 events.last_frame = now;
+             } else if (wait_ms < 0 || wait_ms > FRAME_MIN_MS - since) {
+                 wait_ms = FRAME_MIN_MS - since;
+             }
+         }
          
-         strncpy(panel->files[panel->num_files].name, entry->d_name, MAX_FILENAME_LEN - 1);
-         panel->files[panel->num_files].name[MAX_FILENAME_LEN - 1] = '\0';
-         panel->files[panel->num_files].size = st.st_size;
-         panel->files[panel->num_files].mode = st.st_mode;
-         panel->files[panel->num_files].mtime = st.st_mtime;
-         panel->files[panel->num_files].is_dir = S_ISDIR(st.st_mode);
+         wait_events(wait_ms);
          
-         panel->num_files++;
+         // Tutti i tasti gia' arrivati prima del prossimo disegno: con la
+         // ripetizione dei tasti si salta direttamente all'ultima posizione.
+         // timeout va reimpostato ogni volta perche' le finestre modali lo cambiano
+         while (1) {
+             timeout(0);
+             if ((ch = getch()) == ERR)
+                 break;
+             handle_input(ch);
+             events.dirty = 1;
+         }
      }
+ }
+ 
+ // Raccoglie lo stato del lavoro in background: operazioni, confronto,
+ // letture e modifiche delle directory. Vero se la vista va ridisegnata
+ int poll_background() {
+     int changed = 0;
      
-     closedir(dir);
-     
-     // Ordina i file
-     sort_files(panel);
+     changed |= poll_jobs();
+     changed |= poll_compare();
+     changed |= poll_directory_load(&left_panel);
+     changed |= poll_directory_load(&right_panel);
+     changed |= poll_watches();
+     // Avanzamento, velocita' e tempi stimati cambiano anche senza eventi
+     changed |= background_busy();
+     return changed;
  }
  
- // Confronta due file per l'ordinamento
- int file_compare(const void *a, const void *b) {
-     FileEntry *fa = (FileEntry *)a;
-     FileEntry *fb = (FileEntry *)b;
-     
-     // Mantieni sempre ".." in cima
-     if (strcmp(fa->name, "..") == 0) return -1;
-     if (strcmp(fb->name, "..") == 0) return 1;
-     
-     // Confronta in base al criterio di ordinamento attuale
-     if (active_panel->sort_by == 0) { // Nome
-         if (fa->is_dir && !fb->is_dir) return -1;
-         if (!fa->is_dir && fb->is_dir) return 1;
-         return active_panel->sort_order ? 
-                -strcasecmp(fa->name, fb->name) : 
-                strcasecmp(fa->name, fb->name);
-     } else if (active_panel->sort_by == 1) { // Dimensione
-         if (fa->is_dir && !fb->is_dir) return -1;
-         if (!fa->is_dir && fb->is_dir) return 1;
-         return active_panel->sort_order ? 
-                (fb->size - fa->size) : 
-                (fa->size - fb->size);
-     } else { // Data
-         if (fa->is_dir && !fb->is_dir) return -1;
-         if (!fa->is_dir && fb->is_dir) return 1;
-         return active_panel->sort_order ? 
-                (fb->mtime - fa->mtime) : 
-                (fa->mtime - fb->mtime);
-     }
- }
- 
- // Ordina i file
- void sort_files(Panel *panel) {
-     // Non ordiniamo il primo elemento ("..")
-     qsort(panel->files + 1, panel->num_files - 1, sizeof(FileEntry), file_compare);
+ // Attesa di un tasto in una finestra modale: intanto il lavoro in
+ // background prosegue come nel ciclo degli eventi. Restituisce il tasto, o
+ // ERR quando la finestra va ridisegnata (con draw_panels l'interfaccia
+ // sotto e' gia' stata ridisegnata, se qualcosa e' cambiato). Con tick_ms
+ // (-1 = nessuno) l'attesa non supera l'aggiornamento proprio della finestra
+ int modal_getch(int draw_panels, int tick_ms) {
+     int wait_ms = input_timeout(), ch;
+     
+     if (tick_ms >= 0 && (wait_ms < 0 || wait_ms > tick_ms))
+         wait_ms = tick_ms;
+     wait_events(wait_ms);
+     timeout(0);
+     ch = getch();
+     if (ch == KEY_RESIZE) {
+         getmaxyx(stdscr, term_rows, term_cols);
+         invalidate_screen();
+     } else if (ch != ERR) {
+         return ch;
+     } else if (!poll_background()) {
+         return ERR;
+     }
+     if (draw_panels) draw_interface();
+     return ERR;
  }
  
- // Disegna l'interfaccia utente
- void draw_interface() {
-     clear();
+ // Legge le opzioni dalle variabili d'ambiente
+ void load_config() {
+     char *value = getenv("TYC_LAZY_STAT");
      
-     int panel_width = term_cols / 2;
-     int panel_height = term_rows - 4; // Lascia spazio per l'intestazione e la barra di comando
+     config.lazy_stat = value && *value && strcmp(value, "0") != 0;
      
-     // Disegna intestazione
-     attron(COLOR_PAIR(2));
-     mvhline(0, 0, ' ', term_cols);
-     mvprintw(0, 1, "Tiny Commander %s - Eugenio Bonifacio", GIT_VERSION);
-     attroff(COLOR_PAIR(2));
+     value = getenv("TYC_STAT_THREADS");
+     config.stat_threads = value ? atoi(value) : DEFAULT_STAT_THREADS;
+     if (config.stat_threads < 0) config.stat_threads = 0;
+     if (config.stat_threads > MAX_POOL_THREADS) config.stat_threads = MAX_POOL_THREADS;
      
-     // Disegna pannelli
-     draw_panel(&left_panel, 0, 1, panel_width, panel_height);
-     draw_panel(&right_panel, panel_width, 1, panel_width, panel_height);
+     value = getenv("TYC_STAT_PARALLEL");
+     if (value && strcmp(value, "never") == 0)
+         config.stat_parallel = 0;
+     else if (value && strcmp(value, "always") == 0)
+         config.stat_parallel = 2;
+     else
+         config.stat_parallel = 1;
      
-     // Disegna barra di comando
-     attron(COLOR_PAIR(2));
-     mvhline(term_rows - 3, 0, ' ', term_cols);
-     mvprintw(term_rows - 3, 1, "F1-Aiuto F2-Menu F3-Vedi F4-Edit F5-Copia F6-Sposta F7-Mkdir F8-Elimina F9-Shell F10-Esci");
-     attroff(COLOR_PAIR(2));
+     value = getenv("TYC_JOB_THREADS");
+     config.job_threads = value ? atoi(value) : DEFAULT_JOB_THREADS;
+     if (config.job_threads < 1) config.job_threads = 1;
+     if (config.job_threads > MAX_JOB_THREADS) config.job_threads = MAX_JOB_THREADS;
      
-     // Disegna linea di stato
-     mvhline(term_rows - 2, 0, ' ', term_cols);
-     mvprintw(term_rows - 2, 1, "Current: %s", active_panel->current_path);
+     // I thread ricorsivi passano molto tempo in I/O: qualcuno in piu' dei core
+     value = getenv("TYC_TREE_THREADS");
+     config.tree_threads = value ? atoi(value) : 2 * (int)sysconf(_SC_NPROCESSORS_ONLN);
+     if (config.tree_threads < 1) config.tree_threads = 1;
+     if (config.tree_threads > MAX_TREE_THREADS) config.tree_threads = MAX_TREE_THREADS;
      
-     // Disegna linea di comando
-     mvhline(term_rows - 1, 0, ' ', term_cols);
-     mvprintw(term_rows - 1, 0, "> ");
+     value = getenv("TYC_KEEP_GOING");
+     config.keep_going = value && *value && strcmp(value, "0") != 0;
      
-     refresh();
- }
- 
- // Disegna un pannello
- void draw_panel(Panel *panel, int x, int y, int width, int height) {
-     int i;
-     int max_display = height;
-     char size_str[20];
-     char date_str[20];
-     char perm_str[11];
-     struct tm *tm_info;
+     value = getenv("TYC_WATCH");
+     if (value && (strcmp(value, "off") == 0 || strcmp(value, "0") == 0))
+         config.watch = 0;
+     else if (value && strcmp(value, "poll") == 0)
+         config.watch = 2;
+     else
+         config.watch = 1;
      
-     // Se il pannello è attivo, usa un colore diverso
-     if (panel == active_panel) {
-         attron(A_BOLD);
-     }
+     value = getenv("TYC_FRAME_TIME");
+     config.frame_time = value && *value && strcmp(value, "0") != 0;
      
-     // Disegna intestazione del pannello
-     attron(COLOR_PAIR(1));
-     mvhline(y, x, ' ', width);
-     mvprintw(y, x + 2, "%s", panel->current_path);
-     attroff(COLOR_PAIR(1));
+     value = getenv("TYC_VIEWER");
+     config.external_viewer = value && (strcmp(value, "pager") == 0 || strcmp(value, "external") == 0);
+     
+     value = getenv("TYC_DIR_SIZE");
+     config.allocated_size = value && strcmp(value, "allocated") == 0;
+     
+     value = getenv("TYC_LISTING_CACHE");
+     config.listing_cache = (size_t)(value ? atoi(value) : DEFAULT_LISTING_CACHE_MB) * 1024 * 1024;
+     if (value && atoi(value) < 0) config.listing_cache = 0;
      
-     // Regola scroll_pos se necessario
-     if (panel->selected < panel->scroll_pos) {
-         panel->scroll_pos = panel->selected;
-     } else if (panel->selected >= panel->scroll_pos + max_display) {
-         panel->scroll_pos = panel->selected - max_display + 1;
+     value = getenv("TYC_SORT");
+     {
+         static const char *sort_keys[] = { "name", "size", "date", "natural", "ext" };
+         int i;
+     
+         config.sort_by = SORT_NAME;
+         for (i = 0; value && i < SORT_MODES; i++)
+             if (strcmp(value, sort_keys[i]) == 0)
+                 config.sort_by = i;
      }
      
-     // Disegna file
-     for (i = 0; i < max_display && i + panel->scroll_pos < panel->num_files; i++) {
-         FileEntry *file = &panel->files[i + panel->scroll_pos];
-         
-         // Prepara stringa dimensione
-         if (file->is_dir) {
-             strcpy(size_str, "<DIR>");
-         } else {
-             if (file->size < 1024) {
-                 sprintf(size_str, "%5ldB", file->size);
-             } else if (file->size < 1024 * 1024) {
-                 sprintf(size_str, "%5ldK", file->size / 1024);
-             } else {
-                 sprintf(size_str, "%5ldM", file->size / (1024 * 1024));
-             }
-         }
-         
-         // Prepara stringa data
-         tm_info = localtime(&file->mtime);
-         strftime(date_str, 20, "%Y-%m-%d %H:%M", tm_info);
-         
-         // Prepara stringa permessi
-         char *perm = get_file_permissions(file->mode);
-         strcpy(perm_str, perm);
-         free(perm);
+     value = getenv("TYC_IO_URING");
+     if (value && (strcmp(value, "off") == 0 || strcmp(value, "0") == 0))
+         config.io_uring = 0;
+     else if (value && strcmp(value, "always") == 0)
+         config.io_uring = 2;
+     else
+         config.io_uring = 1;
+     
+     // Gli indici dei nomi stanno nella cache dell'utente, come per le altre applicazioni
+     value = getenv("TYC_INDEX_DIR");
+     if (value && *value)
+         snprintf(config.index_dir, sizeof(config.index_dir), "%s", value);
+     else if ((value = getenv("XDG_CACHE_HOME")) && *value)
+         snprintf(config.index_dir, sizeof(config.index_dir), "%s/tyc", value);
+     else
+         snprintf(config.index_dir, sizeof(config.index_dir), "%s/.cache/tyc",
+                  getenv("HOME") ? getenv("HOME") : "/tmp");
+ }
+ 
+ // Inizializza i pannelli
+ void init_panels() {
+     getcwd(left_panel.current_path, MAX_PATH_LEN);
+     strcpy(right_panel.current_path, left_panel.current_path);
+     
+     left_panel.selected = 0;
+     left_panel.scroll_pos = 0;
+     left_panel.num_files = 0;
+     left_panel.capacity = 0;
+     left_panel.files = NULL;
+     left_panel.names.head = left_panel.names.current = NULL;
+     left_panel.rows.head = left_panel.rows.current = NULL;
+     left_panel.changed = 1;
+     memset(&left_panel.view, 0, sizeof(PanelView));
+     left_panel.dir_fd = -1;
+     left_panel.loader = NULL;
+     left_panel.reselect_name = NULL;
+     left_panel.sort_by = config.sort_by;
+     left_panel.sort_order = 0;
+     memset(left_panel.sort_cache, 0, sizeof(left_panel.sort_cache));
+     left_panel.list_version = 0;
+     left_panel.next_id = 0;
+     left_panel.watch_wd = -1;
+     left_panel.changed_names = NULL;
+     left_panel.num_changed = 0;
+     left_panel.filter[0] = '\0';
+     left_panel.filter_len = 0;
+     left_panel.filter_mode = FILTER_SUBSTRING;
+     memset(left_panel.filter_levels, 0, sizeof(left_panel.filter_levels));
+     left_panel.archive = NULL;
+     left_panel.archive_dir = -1;
+     left_panel.archive_wait[0] = '\0';
+     left_panel.tags = NULL;
+     left_panel.tag_words = 0;
+     left_panel.num_tagged = 0;
+     left_panel.retag_names = NULL;
+     left_panel.num_retag = 0;
+     left_panel.found = NULL;
+     left_panel.found_query[0] = '\0';
+     left_panel.found_wait[0] = '\0';
+     
+     right_panel.selected = 0;
+     right_panel.scroll_pos = 0;
+     right_panel.num_files = 0;
+     right_panel.capacity = 0;
+     right_panel.files = NULL;
+     right_panel.names.head = right_panel.names.current = NULL;
+     right_panel.rows.head = right_panel.rows.current = NULL;
+     right_panel.changed = 1;
+     memset(&right_panel.view, 0, sizeof(PanelView));
+     right_panel.dir_fd = -1;
+     right_panel.loader = NULL;
+     right_panel.reselect_name = NULL;
+     right_panel.sort_by = config.sort_by;
+     right_panel.sort_order = 0;
+     memset(right_panel.sort_cache, 0, sizeof(right_panel.sort_cache));
+     right_panel.list_version = 0;
+     right_panel.next_id = 0;
+     right_panel.watch_wd = -1;
+     right_panel.changed_names = NULL;
+     right_panel.num_changed = 0;
+     right_panel.filter[0] = '\0';
+     right_panel.filter_len = 0;
+     right_panel.filter_mode = FILTER_SUBSTRING;
+     memset(right_panel.filter_levels, 0, sizeof(right_panel.filter_levels));
+     right_panel.archive = NULL;
+     right_panel.archive_dir = -1;
+     right_panel.archive_wait[0] = '\0';
+     right_panel.tags = NULL;
+     right_panel.tag_words = 0;
+     right_panel.num_tagged = 0;
+     right_panel.retag_names = NULL;
+     right_panel.num_retag = 0;
+     right_panel.found = NULL;
+     right_panel.found_query[0] = '\0';
+     right_panel.found_wait[0] = '\0';
+     
+     active_panel = &left_panel;
+ }
+ 
+ // Libera la memoria dei pannelli
+ void free_panels() {
+     stop_jobs();
+     cancel_directory_load(&left_panel);
+     cancel_directory_load(&right_panel);
+     free(left_panel.reselect_name);
+     free(right_panel.reselect_name);
+     free_retag_names(&left_panel);
+     free_retag_names(&right_panel);
+     free(left_panel.tags);
+     free(right_panel.tags);
+     if (stat_pool) {
+         pool_destroy(stat_pool);
+         stat_pool = NULL;
+     }
+     free_grep(grep_search);
+     grep_search = NULL;
+     free_compare_check(compare_check, 0);
+     compare_check = NULL;
+     size_cache_free();
+     free_listing_cache();
+     close_archive(&left_panel);
+     close_archive(&right_panel);
+     free_archive_cache();
+     close_found(&left_panel);
+     close_found(&right_panel);
+     unwatch_directory(&left_panel);
+     unwatch_directory(&right_panel);
+     if (inotify_fd >= 0) close(inotify_fd);
+     if (left_panel.dir_fd >= 0) close(left_panel.dir_fd);
+     if (right_panel.dir_fd >= 0) close(right_panel.dir_fd);
+     clear_filter_levels(&left_panel, 0);
+     clear_filter_levels(&right_panel, 0);
+     for (int i = 0; i < SORT_MODES; i++) {
+         free(left_panel.sort_cache[i].ids);
+         free(right_panel.sort_cache[i].ids);
+     }
+     free(left_panel.files);
+     arena_free(&left_panel.names);
+     arena_free(&left_panel.rows);
+     if (left_panel.view.win) delwin(left_panel.view.win);
+     free(right_panel.files);
+     arena_free(&right_panel.names);
+     arena_free(&right_panel.rows);
+     if (right_panel.view.win) delwin(right_panel.view.win);
+ }
+ 
+ // Rende di nuovo disponibili tutti i blocchi dell'arena senza liberarli
+ void arena_reset(NameArena *arena) {
+     NameChunk *chunk;
+     
+     for (chunk = arena->head; chunk; chunk = chunk->next)
+         chunk->used = 0;
+     arena->current = arena->head;
+ }
+ 
+ // Copia una stringa nell'arena; restituisce NULL se la memoria e' esaurita
+ const char *arena_strdup(NameArena *arena, const char *str, size_t len) {
+     NameChunk *chunk = arena->current;
+     char *dst;
+     
+     // Passa al blocco successivo (gia' allocato o nuovo) se non c'e' spazio
+     while (!chunk || chunk->size - chunk->used < len + 1) {
+         if (chunk && chunk->next) {
+             chunk = chunk->next;
+             chunk->used = 0;
+             continue;
+         }
+         
+         size_t size = len + 1 > NAME_CHUNK_SIZE ? len + 1 : NAME_CHUNK_SIZE;
+         NameChunk *new_chunk = malloc(sizeof(NameChunk) + size);
+         if (!new_chunk) return NULL;
+         new_chunk->next = NULL;
+         new_chunk->used = 0;
+         new_chunk->size = size;
          
-         // Colore in base al tipo di file
-         if (i + panel->scroll_pos == panel->selected) {
-             attron(COLOR_PAIR(6)); // File selezionato
-         } else if (file->is_dir) {
-             attron(COLOR_PAIR(3)); // Directory
-         } else if (file->mode & S_IXUSR) {
-             attron(COLOR_PAIR(4)); // File eseguibile
+         if (chunk) {
+             // Inserisce il nuovo blocco dopo quello corrente
+             new_chunk->next = chunk->next;
+             chunk->next = new_chunk;
          } else {
-             attron(COLOR_PAIR(1)); // File normale
+             new_chunk->next = arena->head;
+             arena->head = new_chunk;
+         }
+         chunk = new_chunk;
+     }
+     arena->current = chunk;
+     
+     dst = chunk->data + chunk->used;
+     memcpy(dst, str, len);
+     dst[len] = '\0';
+     chunk->used += len + 1;
+     return dst;
+ }
+ 
+ // Libera tutti i blocchi dell'arena
+ void arena_free(NameArena *arena) {
+     NameChunk *chunk = arena->head;
+     
+     while (chunk) {
+         NameChunk *next = chunk->next;
+         free(chunk);
+         chunk = next;
+     }
+     arena->head = arena->current = NULL;
+ }
+ 
+ // Aggiunge una nuova entry al pannello, facendo crescere l'array se serve
+ FileEntry *panel_new_entry(Panel *panel, const char *name, size_t len) {
+     FileEntry *entry;
+     
+     if (panel->num_files == panel->capacity) {
+         int new_capacity = panel->capacity ? panel->capacity * 2 : MIN_FILES_CAPACITY;
+         FileEntry *files = realloc(panel->files, new_capacity * sizeof(FileEntry));
+         if (!files) return NULL;
+         panel->files = files;
+         panel->capacity = new_capacity;
+     }
+     
+     entry = &panel->files[panel->num_files];
+     memset(entry, 0, sizeof(FileEntry));
+     entry->name = arena_strdup(&panel->names, name, len);
+     if (!entry->name) return NULL;
+     
+     panel->num_files++;
+     return entry;
+ }
+ 
+ // Prepara la scansione a blocchi di una directory gia' aperta. Il descrittore
+ // resta di proprieta' del chiamante e viene restituito da dirscan_detach()
+ int dirscan_init(DirScan *scan, int fd) {
+     scan->fd = fd;
+     
+ #ifdef __linux__
+     scan->buf = malloc(SCAN_BUFFER_SIZE);
+     scan->len = scan->pos = 0;
+     if (!scan->buf) return -1;
+ #else
+     // fdopendir prende possesso del descrittore: ne usiamo una copia
+     int dup_fd = dup(fd);
+     scan->dir = dup_fd >= 0 ? fdopendir(dup_fd) : NULL;
+     if (!scan->dir) {
+         if (dup_fd >= 0) close(dup_fd);
+         return -1;
+     }
+ #endif
+     return 0;
+ }
+ 
+ // Restituisce la prossima entry: 1 se trovata, 0 a fine directory, -1 in caso di errore.
+ // Il nome resta valido fino alla chiamata successiva.
+ int dirscan_next(DirScan *scan, const char **name, size_t *len, unsigned char *type) {
+ #ifdef __linux__
+     // Formato dei record restituiti da getdents64
+     struct linux_dirent64 {
+         unsigned long long d_ino;
+         long long d_off;
+         unsigned short d_reclen;
+         unsigned char d_type;
+         char d_name[];
+     } *dent;
+     
+     if (scan->pos >= scan->len) {
+         perf_count(PERF_SYS_GETDENTS);
+         scan->len = syscall(SYS_getdents64, scan->fd, scan->buf, SCAN_BUFFER_SIZE);
+         scan->pos = 0;
+         if (scan->len <= 0) return scan->len < 0 ? -1 : 0;
+     }
+     
+     dent = (struct linux_dirent64 *)(scan->buf + scan->pos);
+     scan->pos += dent->d_reclen;
+     *name = dent->d_name;
+     *len = strlen(dent->d_name);
+     *type = dent->d_type;
+     return 1;
+ #else
+     struct dirent *entry;
+     
+     errno = 0;
+     if ((entry = readdir(scan->dir)) == NULL) return errno ? -1 : 0;
+     *name = entry->d_name;
+     *len = strlen(entry->d_name);
+     *type = entry->d_type;
+     return 1;
+ #endif
+ }
+ 
+ // Chiude la scansione restituendo il descrittore della directory, che resta aperto
+ int dirscan_detach(DirScan *scan) {
+ #ifdef __linux__
+     free(scan->buf);
+ #else
+     closedir(scan->dir);
+ #endif
+     return scan->fd;
+ }
+ 
+ // Legge i metadati di un'entry relativi alla directory aperta, chiedendo
+ // al kernel solo i campi usati da FileEntry
+ int fetch_entry_metadata(int dir_fd, FileEntry *file) {
+ #if defined(__linux__) && defined(STATX_TYPE)
+     static int statx_unavailable = 0;
+     struct statx stx;
+     
+     perf_count(PERF_SYS_STAT);
+     if (!statx_unavailable) {
+         if (statx(dir_fd, file->name, 0,
+                   STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME, &stx) == 0) {
+             file->size = stx.stx_size;
+             file->mode = stx.stx_mode;
+             file->mtime = stx.stx_mtime.tv_sec;
+             file->is_dir = S_ISDIR(stx.stx_mode);
+             file->has_meta = 1;
+             return 0;
          }
+         if (errno != ENOSYS) return -1;
+         statx_unavailable = 1;
+     }
+ #endif
+     struct stat st;
+     
+ #if !defined(__linux__) || !defined(STATX_TYPE)
+     perf_count(PERF_SYS_STAT);
+ #endif
+     if (fstatat(dir_fd, file->name, &st, 0) == -1)
+         return -1;
+     file->size = st.st_size;
+     file->mode = st.st_mode;
+     file->mtime = st.st_mtime;
+     file->is_dir = S_ISDIR(st.st_mode);
+     file->has_meta = 1;
+     return 0;
+ }
+ 
+ // Corpo dei thread del pool: attende un compito e ne elabora blocchi di indici
+ void *pool_worker(void *data) {
+     WorkerPool *pool = data;
+     unsigned long seen = 0;
+     
+     pthread_mutex_lock(&pool->lock);
+     while (1) {
+         while (!pool->shutdown && pool->generation == seen)
+             pthread_cond_wait(&pool->work_cond, &pool->lock);
+         if (pool->shutdown) break;
+         seen = pool->generation;
+         pthread_mutex_unlock(&pool->lock);
          
-         mvhline(y + i + 1, x, ' ', width);
-         mvprintw(y + i + 1, x + 1, "%-20s %10s %s %s", 
-                  file->name, size_str, date_str, perm_str);
+         while (1) {
+             int from = atomic_fetch_add(&pool->next, pool->batch);
+             if (from >= pool->total) break;
+             int to = from + pool->batch < pool->total ? from + pool->batch : pool->total;
+             pool->task(pool->arg, from, to);
+         }
          
-         if (i + panel->scroll_pos == panel->selected) {
-             attroff(COLOR_PAIR(6));
-         } else if (file->is_dir) {
-             attroff(COLOR_PAIR(3));
-         } else if (file->mode & S_IXUSR) {
-             attroff(COLOR_PAIR(4));
-         } else {
-             attroff(COLOR_PAIR(1));
+         pthread_mutex_lock(&pool->lock);
+         if (--pool->busy == 0)
+             pthread_cond_signal(&pool->done_cond);
+     }
+     pthread_mutex_unlock(&pool->lock);
+     return NULL;
+ }
+ 
+ // Crea un pool con il numero di thread indicato
+ WorkerPool *pool_create(int num_threads) {
+     WorkerPool *pool = calloc(1, sizeof(WorkerPool));
+     int i;
+     
+     if (!pool) return NULL;
+     pthread_mutex_init(&pool->run_lock, NULL);
+     pthread_mutex_init(&pool->lock, NULL);
+     pthread_cond_init(&pool->work_cond, NULL);
+     pthread_cond_init(&pool->done_cond, NULL);
+     
+     for (i = 0; i < num_threads && i < MAX_POOL_THREADS; i++) {
+         if (pthread_create(&pool->threads[i], NULL, pool_worker, pool) != 0)
+             break;
+         pool->num_threads++;
+     }
+     
+     if (pool->num_threads == 0) {
+         pool_destroy(pool);
+         return NULL;
+     }
+     return pool;
+ }
+ 
+ // Esegue task su [0, total) a blocchi di batch indici; anche il chiamante
+ // partecipa e la funzione ritorna solo quando tutti gli indici sono elaborati
+ void pool_run(WorkerPool *pool, PoolTask task, void *arg, int total, int batch) {
+     pthread_mutex_lock(&pool->run_lock);
+     
+     pthread_mutex_lock(&pool->lock);
+     pool->task = task;
+     pool->arg = arg;
+     pool->total = total;
+     pool->batch = batch > 0 ? batch : 1;
+     atomic_store(&pool->next, 0);
+     pool->busy = pool->num_threads;
+     pool->generation++;
+     pthread_cond_broadcast(&pool->work_cond);
+     pthread_mutex_unlock(&pool->lock);
+     
+     while (1) {
+         int from = atomic_fetch_add(&pool->next, pool->batch);
+         if (from >= total) break;
+         task(arg, from, from + pool->batch < total ? from + pool->batch : total);
+     }
+     
+     pthread_mutex_lock(&pool->lock);
+     while (pool->busy > 0)
+         pthread_cond_wait(&pool->done_cond, &pool->lock);
+     pthread_mutex_unlock(&pool->lock);
+     
+     pthread_mutex_unlock(&pool->run_lock);
+ }
+ 
+ // Termina i thread e libera il pool
+ void pool_destroy(WorkerPool *pool) {
+     int i;
+     
+     pthread_mutex_lock(&pool->lock);
+     pool->shutdown = 1;
+     pthread_cond_broadcast(&pool->work_cond);
+     pthread_mutex_unlock(&pool->lock);
+     
+     for (i = 0; i < pool->num_threads; i++)
+         pthread_join(pool->threads[i], NULL);
+     
+     pthread_mutex_destroy(&pool->run_lock);
+     pthread_mutex_destroy(&pool->lock);
+     pthread_cond_destroy(&pool->work_cond);
+     pthread_cond_destroy(&pool->done_cond);
+     free(pool);
+ }
+ 
+ // Restituisce il pool condiviso, creandolo al primo uso. Puo' essere
+ // richiesto sia dal thread principale che dai caricamenti
+ WorkerPool *get_stat_pool() {
+     WorkerPool *pool;
+     
+     pthread_mutex_lock(&stat_pool_lock);
+     if (!stat_pool)
+         stat_pool = pool_create(config.stat_threads - 1); // Il chiamante e' il thread mancante
+     pool = stat_pool;
+     pthread_mutex_unlock(&stat_pool_lock);
+     return pool;
+ }
+ 
+ // Riconosce i filesystem di rete, dove ogni stat costa un round trip
+ int is_network_fs(int fd) {
+     struct statfs sfs;
+     
+     if (fstatfs(fd, &sfs) != 0)
+         return 0;
+ #ifdef __linux__
+     switch ((unsigned long)sfs.f_type & 0xFFFFFFFFUL) {
+         case 0x6969:     // NFS
+         case 0x517B:     // SMB
+         case 0xFF534D42: // CIFS
+         case 0xFE534D42: // SMB2
+         case 0x65735546: // FUSE (sshfs, ...)
+         case 0x00C36400: // CephFS
+         case 0x01021997: // 9P
+         case 0x5346414F: // AFS
+         case 0x0BD00BD0: // Lustre
+         case 0x01161970: // GFS2
+             return 1;
+     }
+     return 0;
+ #else
+     return !(sfs.f_flags & MNT_LOCAL);
+ #endif
+ }
+ 
+ // Legge i metadati di un blocco di entry (eseguito dai thread del pool).
+ // Le entry non leggibili vengono marcate con has_meta = -1
+ void metadata_task(void *arg, int from, int to) {
+     MetadataJob *job = arg;
+     int i;
+     
+     for (i = from; i < to; i++) {
+         FileEntry *file = &job->files[i];
+         if (job->cancel && atomic_load(job->cancel))
+             return;
+         if (file->has_meta ||
+             (job->unclassified_only && (file->d_type == DT_DIR || file->d_type == DT_REG)))
+             continue;
+         if (fetch_entry_metadata(job->dir_fd, file) != 0)
+             file->has_meta = -1;
+     }
+ }
+ 
+ // Legge i metadati mancanti di count entry, in parallelo sui filesystem di rete.
+ // Se compact e' vero le entry non leggibili vengono tolte dall'array, altrimenti
+ // restano senza metadati; con unclassified_only si saltano file e directory gia'
+ // classificati da d_type. Restituisce il numero di entry rimaste
+ int fetch_metadata_batch(int dir_fd, FileEntry *files, int count, int compact,
+                          int unclassified_only, atomic_int *cancel) {
+     MetadataJob job = { dir_fd, files, unclassified_only, cancel };
+     WorkerPool *pool = NULL;
+     int i, out = 0;
+     
+     if (count <= 0 || dir_fd < 0)
+         return count;
+     
+     int parallel = config.stat_threads > 1 && count >= PARALLEL_STAT_MIN &&
+                    (config.stat_parallel == 2 ||
+                     (config.stat_parallel == 1 && is_network_fs(dir_fd)));
+     
+     // Con io_uring le statx di un blocco partono insieme e il kernel le
+     // esegue in parallelo, al posto dei thread; "always" lo usa anche in locale
+ #ifdef HAVE_IO_URING
+     if ((parallel || (config.io_uring == 2 && count >= URING_STAT_MIN)) &&
+         uring_fetch_metadata(&job, count) == 0)
+         parallel = -1;
+ #endif
+     if (parallel > 0)
+         pool = get_stat_pool();
+     
+     if (pool)
+         pool_run(pool, metadata_task, &job, count, PARALLEL_STAT_BATCH);
+     else if (parallel >= 0)
+         metadata_task(&job, 0, count);
+     
+     for (i = 0; i < count; i++) {
+         if (files[i].has_meta < 0) {
+             if (compact) continue;
+             files[i].has_meta = 1; // Non riprovare ad ogni ridisegno
+         }
+         if (out != i) files[out] = files[i];
+         out++;
+     }
+     return out;
+ }
+ 
+ // Legge i metadati mancanti delle entry [from, to) del pannello (vedi
+ // fetch_metadata_batch); restituisce il nuovo "to"
+ int load_metadata(Panel *panel, int from, int to, int compact, int unclassified_only) {
+     int out;
+     
+     if (to > panel->num_files) to = panel->num_files;
+     if (from >= to) return to;
+     
+     out = from + fetch_metadata_batch(panel->dir_fd, panel->files + from, to - from,
+                                       compact, unclassified_only, NULL);
+     if (out != to) {
+         memmove(&panel->files[out], &panel->files[to],
+                 (panel->num_files - to) * sizeof(FileEntry));
+         panel->num_files -= to - out;
+     }
+     return out;
+ }
+ 
+ // Legge i metadati di un blocco di entry e lo consegna al pannello
+ void loader_flush(DirLoader *ld, FileEntry *batch, int count) {
+     count = fetch_metadata_batch(ld->dir_fd, batch, count, 1, ld->unclassified_only, &ld->cancel);
+     if (count == 0 || atomic_load(&ld->cancel))
+         return;
+     
+     pthread_mutex_lock(&ld->lock);
+     if (ld->num_pending + count > ld->pending_cap) {
+         int new_cap = ld->pending_cap ? ld->pending_cap : LOADER_BATCH;
+         while (new_cap < ld->num_pending + count) new_cap *= 2;
+         FileEntry *pending = realloc(ld->pending, new_cap * sizeof(FileEntry));
+         if (!pending) {
+             ld->error = ENOMEM;
+             pthread_mutex_unlock(&ld->lock);
+             return;
+         }
+         ld->pending = pending;
+         ld->pending_cap = new_cap;
+     }
+     memcpy(ld->pending + ld->num_pending, batch, count * sizeof(FileEntry));
+     ld->num_pending += count;
+     ld->total += count;
+     pthread_mutex_unlock(&ld->lock);
+     ui_wake();
+ }
+ 
+ // Thread di caricamento: legge i nomi a blocchi, ne recupera i metadati e
+ // consegna ogni blocco appena pronto
+ void *loader_thread(void *data) {
+     DirLoader *ld = data;
+     DirScan scan;
+     FileEntry *batch;
+     const char *name;
+     size_t len;
+     unsigned char type;
+     int count = 0, limit = LOADER_FIRST_BATCH, result = 0, error = 0;
+     
+     batch = malloc(LOADER_BATCH * sizeof(FileEntry));
+     if (!batch || dirscan_init(&scan, ld->dir_fd) != 0) {
+         free(batch);
+         pthread_mutex_lock(&ld->lock);
+         ld->error = ENOMEM;
+         ld->done = 1;
+         pthread_mutex_unlock(&ld->lock);
+         ui_wake();
+         return NULL;
+     }
+     
+     while (!atomic_load(&ld->cancel) && (result = dirscan_next(&scan, &name, &len, &type)) > 0) {
+         // Salta le entries "." e ".." perché abbiamo già aggiunto ".."
+         // e non vogliamo visualizzare "."
+         if (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.')))
+             continue;
+         
+         FileEntry *file = &batch[count];
+         memset(file, 0, sizeof(FileEntry));
+         file->name = arena_strdup(ld->names, name, len);
+         if (!file->name) {
+             error = ENOMEM;
+             break;
+         }
+         file->d_type = type;
+         file->is_dir = (type == DT_DIR);
+         
+         if (++count == limit) {
+             loader_flush(ld, batch, count);
+             count = 0;
+             limit = LOADER_BATCH;
+         }
+     }
+     if (result < 0)
+         error = errno;
+     
+     loader_flush(ld, batch, count);
+     dirscan_detach(&scan);
+     free(batch);
+     
+     pthread_mutex_lock(&ld->lock);
+     if (error && !ld->error) ld->error = error;
+     ld->done = 1;
+     pthread_mutex_unlock(&ld->lock);
+     ui_wake();
+     return NULL;
+ }
+ 
+ // Avvia il caricamento in background della directory corrente del pannello.
+ // La lista viene svuotata subito e riempita man mano da poll_directory_load()
+ void load_directory(Panel *panel) {
+     FileEntry *file;
+     
+     cancel_directory_load(panel);
+     
+     // Riutilizza l'array e l'arena della lettura precedente
+     panel->num_files = 0;
+     panel->next_id = 0;
+     clear_tags(panel);
+     panel->list_version++;
+     panel->changed = 1;
+     clear_filter_levels(panel, 0);
+     arena_reset(&panel->names);
+     arena_reset(&panel->rows);
+     if (panel->dir_fd >= 0) {
+         close(panel->dir_fd);
+         panel->dir_fd = -1;
+     }
+     
+     // Aggiungi solo l'entry per la directory padre ".."
+     file = panel_new_entry(panel, "..", 2);
+     if (!file) {
+         display_error("Memoria insufficiente");
+         return;
+     }
+     file->is_dir = 1;
+     file->has_meta = 1;
+     file->id = panel->next_id++;
+     
+     // Dentro un archivio l'elenco viene dall'indice gia' in memoria
+     if (panel->archive) {
+         list_archive_directory(panel);
+         return;
+     }
+     // I risultati di una ricerca vengono dall'indice dei nomi
+     if (panel->found) {
+         list_found(panel);
+         return;
+     }
+     
+     panel->dir_fd = open(panel->current_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+     if (panel->dir_fd < 0) {
+         unwatch_directory(panel);
+         free_retag_names(panel);
+         display_error("Impossibile aprire la directory");
+         return;
+     }
+     
+     // Il watch parte prima della lettura: le modifiche durante il
+     // caricamento vengono applicate alla fine
+     watch_directory(panel);
+     start_directory_load(panel, 0);
+ }
+ 
+ // Avvia il thread che legge la directory gia' aperta del pannello. Con
+ // shadow le entry restano nel caricamento fino alla fine e sostituiscono
+ // in un colpo solo la lista mostrata
+ void start_directory_load(Panel *panel, int shadow) {
+     DirLoader *ld = calloc(1, sizeof(DirLoader));
+     
+     if (!ld) {
+         display_error("Memoria insufficiente");
+         return;
+     }
+     pthread_mutex_init(&ld->lock, NULL);
+     ld->shadow = shadow;
+     ld->names = shadow ? &ld->shadow_names : &panel->names;
+     ld->dir_fd = panel->dir_fd;
+     // In modalita' pigra i metadati servono subito solo se si ordina per dimensione o data
+     ld->unclassified_only = config.lazy_stat && !sort_needs_metadata(panel->sort_by);
+     atomic_init(&ld->cancel, 0);
+     perf_start(&ld->started);
+     panel->loader = ld;
+     
+     if (pthread_create(&ld->thread, NULL, loader_thread, ld) != 0) {
+         // Senza thread il caricamento avviene in modo sincrono
+         loader_thread(ld);
+         ld->thread = pthread_self();
+     }
+ }
+ 
+ // Libera il caricamento del pannello dopo che il thread e' terminato
+ void release_directory_load(Panel *panel) {
+     DirLoader *ld = panel->loader;
+     
+     if (!pthread_equal(ld->thread, pthread_self()))
+         pthread_join(ld->thread, NULL);
+     pthread_mutex_destroy(&ld->lock);
+     free(ld->pending);
+     arena_free(&ld->shadow_names);
+     free(ld);
+     panel->loader = NULL;
+ }
+ 
+ // Trasferisce nel pannello le entry gia' lette; se il caricamento e' finito
+ // ordina la lista mantenendo la selezione. Restituisce 1 se la lista e' cambiata
+ int poll_directory_load(Panel *panel) {
+     DirLoader *ld = panel->loader;
+     int done, error, changed = 0;
+     
+     if (!ld) return 0;
+     
+     pthread_mutex_lock(&ld->lock);
+     if (ld->shadow) {
+         NameArena names;
+         FileEntry *parent;
+         
+         // L'aggiornamento sostituisce la lista solo quando e' completo
+         if (!ld->done || atomic_load(&ld->cancel)) {
+             done = ld->done;
+             pthread_mutex_unlock(&ld->lock);
+             if (done) release_directory_load(panel);
+             return 0;
+         }
+         free(panel->reselect_name);
+         panel->reselect_name = NULL;
+         if (panel->selected > 0 && panel->selected < panel->num_files) {
+             panel->reselect_name = strdup(panel->files[panel->selected].name);
+             panel->reselect_index = panel->selected;
+         }
+         save_tags(panel);
+         // I nomi della lista precedente vengono liberati con il caricamento
+         names = panel->names;
+         panel->names = ld->shadow_names;
+         ld->shadow_names = names;
+         arena_reset(&panel->rows);
+         panel->num_files = 0;
+         panel->next_id = 0;
+         if ((parent = panel_new_entry(panel, "..", 2)) != NULL) {
+             parent->is_dir = 1;
+             parent->has_meta = 1;
+             parent->id = panel->next_id++;
+         }
+         panel->list_version++;
+         changed = panel->changed = 1;
+         clear_filter_levels(panel, 0);
+     }
+     if (ld->num_pending > 0) {
+         if (panel->num_files + ld->num_pending > panel->capacity) {
+             int new_capacity = panel->capacity ? panel->capacity : MIN_FILES_CAPACITY;
+             while (new_capacity < panel->num_files + ld->num_pending) new_capacity *= 2;
+             FileEntry *files = realloc(panel->files, new_capacity * sizeof(FileEntry));
+             if (!files) {
+                 atomic_store(&ld->cancel, 1);
+                 ld->error = ENOMEM;
+                 ld->num_pending = 0;
+             } else {
+                 panel->files = files;
+                 panel->capacity = new_capacity;
+             }
+         }
+         // Le nuove entry vanno in coda: indici, selezione e scroll non cambiano
+         if (ld->num_pending > 0) {
+             memcpy(panel->files + panel->num_files, ld->pending, ld->num_pending * sizeof(FileEntry));
+             for (int i = 0; i < ld->num_pending; i++)
+                 panel->files[panel->num_files + i].id = panel->next_id++;
+             panel->num_files += ld->num_pending;
+             panel->list_version++;
+             ld->num_pending = 0;
+             changed = panel->changed = 1;
+             clear_filter_levels(panel, 0);
+         }
+     }
+     done = ld->done;
+     error = ld->error;
+     pthread_mutex_unlock(&ld->lock);
+     
+     if (done) {
+         struct timespec started = ld->started;
+         
+         release_directory_load(panel);
+         finish_listing(panel);
+         perf_end(PERF_READ_DIR, &started, panel->num_files - 1, 0, panel->current_path);
+         if (error == ENOMEM)
+             display_error("Memoria insufficiente: elenco incompleto");
+         else if (error)
+             display_error("Errore durante la lettura della directory");
+         changed = 1;
+     }
+     return changed;
+ }
+ 
+ // Ordina la lista completa mantenendo selezionata la stessa entry
+ // alla stessa altezza sullo schermo
+ void finish_listing(Panel *panel) {
+     const char *selected_name = NULL;
+     char *reselect_name = panel->reselect_name;
+     int row = 0, i;
+     
+     // Dopo un aggiornamento si cerca per nome l'entry selezionata prima,
+     // a meno che nel frattempo l'utente non abbia spostato la selezione
+     panel->reselect_name = NULL;
+     if (reselect_name && panel->selected != panel->reselect_index) {
+         free(reselect_name);
+         reselect_name = NULL;
+     }
+     
+     if (panel->selected > 0 && panel->selected < panel->num_files) {
+         selected_name = panel->files[panel->selected].name;
+         row = visible_pos(panel, panel->selected) - panel->scroll_pos;
+     }
+     
+     apply_dir_sizes(panel, 0);
+     sort_files(panel);
+     update_filter(panel);
+     restore_tags(panel);
+     
+     if (!selected_name && !reselect_name)
+         return;
+     for (i = 0; i < panel->num_files; i++) {
+         if (reselect_name ? strcmp(panel->files[i].name, reselect_name) == 0
+                           : panel->files[i].name == selected_name) {
+             int pos = visible_pos(panel, i);
+             panel->selected = i;
+             // Senza una selezione precedente lo scorrimento lo decide draw_panel
+             if (selected_name)
+                 panel->scroll_pos = pos - row > 0 ? pos - row : 0;
+             break;
+         }
+     }
+     free(reselect_name);
+ }
+ 
+ // Rilegge in background la directory corrente mantenendo la selezione
+ void refresh_directory(Panel *panel) {
+     cancel_directory_load(panel);
+     free(panel->reselect_name);
+     panel->reselect_name = NULL;
+     if (panel->selected > 0 && panel->selected < panel->num_files) {
+         panel->reselect_name = strdup(panel->files[panel->selected].name);
+         panel->reselect_index = panel->selected;
+     }
+     // Le marcature sopravvivono alla rilettura
+     save_tags(panel);
+     load_directory(panel);
+ }
+ 
+ // Attende la fine del caricamento in corso e lo completa
+ void finish_directory_load(Panel *panel) {
+     while (panel->loader) {
+         pthread_join(panel->loader->thread, NULL);
+         panel->loader->thread = pthread_self();
+         poll_directory_load(panel);
+     }
+ }
+ 
+ // Interrompe il caricamento in corso, tenendo le entry gia' lette
+ void cancel_directory_load(Panel *panel) {
+     if (!panel->loader) return;
+     
+     atomic_store(&panel->loader->cancel, 1);
+     finish_directory_load(panel);
+ }
+ 
+ // Legge il contenuto di una directory, attendendo la fine del caricamento
+ void read_directory(Panel *panel) {
+     load_directory(panel);
+     finish_directory_load(panel);
+ }
+ 
+ // Vero se due istanti coincidono
+ static inline int same_timespec(struct timespec a, struct timespec b) {
+     return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+ }
+ 
+ // Conserva nella cache l'elenco del pannello prima di cambiare directory.
+ // Solo un elenco completo e aggiornato (seguito con inotify, o con la data di
+ // modifica invariata dalla lettura) puo' essere riusato
+ void cache_listing(Panel *panel) {
+     CachedListing *entry;
+     struct stat st;
+     size_t names_size = 0, path_len = strlen(panel->current_path), memory;
+     int i, count = panel->num_files - 1;
+     char *dst;
+     
+     if (config.listing_cache == 0 || panel->dir_fd < 0 || count < 0)
+         return;
+     read_watch_events();
+     if (panel->loader || panel->num_changed > 0 || panel->rescan_needed ||
+         (panel->watch_wd < 0 && !panel->watch_poll) || fstat(panel->dir_fd, &st) != 0)
+         return;
+     if (panel->watch_poll && !same_timespec(stat_mtime(&st), panel->dir_mtime))
+         return;
+     
+     for (entry = listing_cache_head; entry; entry = entry->next) {
+         if (strcmp(entry->path, panel->current_path) == 0) {
+             uncache_listing(entry);
+             break;
+         }
+     }
+     for (i = 1; i <= count; i++)
+         names_size += strlen(panel->files[i].name) + 1;
+     memory = sizeof(CachedListing) + path_len + 1 + count * sizeof(FileEntry) + names_size;
+     if (memory > config.listing_cache)
+         return;
+     
+     entry = malloc(sizeof(CachedListing) + path_len + 1);
+     if (!entry) return;
+     entry->files = malloc(count ? count * sizeof(FileEntry) : 1);
+     entry->names = malloc(names_size ? names_size : 1);
+     if (!entry->files || !entry->names) {
+         free(entry->files);
+         free(entry->names);
+         free(entry);
+         return;
+     }
+     memcpy(entry->path, panel->current_path, path_len + 1);
+     entry->dev = st.st_dev;
+     entry->ino = st.st_ino;
+     entry->mtime = stat_mtime(&st);
+     entry->ctime = stat_ctime(&st);
+     entry->num_files = count;
+     entry->names_size = names_size;
+     entry->sort_by = panel->sort_by;
+     entry->sort_order = panel->sort_order;
+     entry->selected = panel->selected;
+     entry->scroll_pos = panel->scroll_pos;
+     entry->memory = memory;
+     dst = entry->names;
+     for (i = 0; i < count; i++) {
+         FileEntry *file = &entry->files[i];
+         size_t len = strlen(panel->files[i + 1].name) + 1;
+         
+         *file = panel->files[i + 1];
+         memcpy(dst, file->name, len);
+         file->name = dst;
+         file->row = NULL;
+         file->compare_mark = CMP_NONE;
+         dst += len;
+     }
+     
+     entry->prev = NULL;
+     entry->next = listing_cache_head;
+     if (listing_cache_head) listing_cache_head->prev = entry;
+     listing_cache_head = entry;
+     if (!listing_cache_tail) listing_cache_tail = entry;
+     listing_cache_count++;
+     listing_cache_memory += memory;
+     
+     // Oltre il limite si scartano gli elenchi usati meno di recente
+     while (listing_cache_memory > config.listing_cache && listing_cache_tail != entry)
+         uncache_listing(listing_cache_tail);
+ }
+ 
+ // Toglie un elenco dalla cache e lo libera
+ void uncache_listing(CachedListing *entry) {
+     if (entry->prev) entry->prev->next = entry->next;
+     else listing_cache_head = entry->next;
+     if (entry->next) entry->next->prev = entry->prev;
+     else listing_cache_tail = entry->prev;
+     listing_cache_count--;
+     listing_cache_memory -= entry->memory;
+     free(entry->files);
+     free(entry->names);
+     free(entry);
+ }
+ 
+ // Libera tutta la cache degli elenchi
+ void free_listing_cache() {
+     while (listing_cache_head)
+         uncache_listing(listing_cache_head);
+ }
+ 
+ // Mostra subito l'elenco in cache della directory del pannello, se la
+ // directory non e' cambiata, e lo aggiorna in background. Restituisce 0 se
+ // la directory va letta normalmente
+ int restore_listing(Panel *panel) {
+     CachedListing *entry;
+     FileEntry *file;
+     struct stat st;
+     const char *names;
+     int i;
+     
+     if (config.listing_cache == 0)
+         return 0;
+     for (entry = listing_cache_head; entry; entry = entry->next) {
+         if (strcmp(entry->path, panel->current_path) == 0) break;
+     }
+     if (entry && (stat(panel->current_path, &st) != 0 || st.st_dev != entry->dev || st.st_ino != entry->ino ||
+                   !same_timespec(stat_mtime(&st), entry->mtime) || !same_timespec(stat_ctime(&st), entry->ctime))) {
+         uncache_listing(entry);
+         entry = NULL;
+     }
+     if (!entry) {
+         listing_cache_misses++;
+         return 0;
+     }
+     
+     cancel_directory_load(panel);
+     if (panel->dir_fd >= 0) close(panel->dir_fd);
+     panel->dir_fd = open(panel->current_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+     if (panel->dir_fd < 0) {
+         uncache_listing(entry);
+         listing_cache_misses++;
+         return 0;
+     }
+     if (panel->capacity < entry->num_files + 1) {
+         int new_capacity = panel->capacity ? panel->capacity : MIN_FILES_CAPACITY;
+         while (new_capacity < entry->num_files + 1) new_capacity *= 2;
+         FileEntry *files = realloc(panel->files, new_capacity * sizeof(FileEntry));
+         if (!files) {
+             close(panel->dir_fd);
+             panel->dir_fd = -1;
+             return 0;
+         }
+         panel->files = files;
+         panel->capacity = new_capacity;
+     }
+     
+     panel->num_files = 0;
+     panel->next_id = 0;
+     clear_tags(panel);
+     panel->list_version++;
+     panel->changed = 1;
+     clear_filter_levels(panel, 0);
+     arena_reset(&panel->names);
+     arena_reset(&panel->rows);
+     file = panel_new_entry(panel, "..", 2);
+     // Tutti i nomi in un solo blocco dell'arena
+     names = entry->names_size ? arena_strdup(&panel->names, entry->names, entry->names_size - 1) : NULL;
+     if (!file || (entry->names_size && !names)) {
+         uncache_listing(entry);
+         load_directory(panel);
+         return 1;
+     }
+     file->is_dir = 1;
+     file->has_meta = 1;
+     file->id = panel->next_id++;
+     for (i = 0; i < entry->num_files; i++) {
+         file = &panel->files[panel->num_files++];
+         *file = entry->files[i];
+         file->name = names + (entry->files[i].name - entry->names);
+         file->id = panel->next_id++;
+     }
+     if (entry->sort_by == panel->sort_by && entry->sort_order == panel->sort_order) {
+         panel->selected = entry->selected < panel->num_files ? entry->selected : 0;
+         panel->scroll_pos = entry->scroll_pos;
+     } else {
+         sort_files(panel);
+     }
+     uncache_listing(entry);
+     listing_cache_hits++;
+     
+     // Le entry appena mostrate vengono rilette in background
+     watch_directory(panel);
+     start_directory_load(panel, 1);
+     return 1;
+ }
+ 
+ // Segue le modifiche alla directory del pannello: con inotify se possibile,
+ // altrimenti (o sui filesystem di rete, dove inotify non vede le modifiche
+ // fatte da altri client) controllando periodicamente la data di modifica
+ void watch_directory(Panel *panel) {
+     struct stat st;
+     
+     unwatch_directory(panel);
+     if (config.watch == 0) return;
+     
+ #ifdef __linux__
+     if (config.watch == 1 && inotify_fd < 0)
+         inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+     if (config.watch == 1 && inotify_fd >= 0)
+         panel->watch_wd = inotify_add_watch(inotify_fd, panel->current_path,
+                                             IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                             IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+                                             IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_EXCL_UNLINK);
+ #endif
+     panel->watch_poll = panel->watch_wd < 0 || is_network_fs(panel->dir_fd);
+     panel->last_poll = time(NULL);
+     if (fstat(panel->dir_fd, &st) == 0)
+         panel->dir_mtime = stat_mtime(&st);
+ }
+ 
+ // Smette di seguire la directory e scarta le modifiche in sospeso
+ void unwatch_directory(Panel *panel) {
+     Panel *other = panel == &left_panel ? &right_panel : &left_panel;
+     
+ #ifdef __linux__
+     // Due pannelli sulla stessa directory condividono il watch
+     if (panel->watch_wd >= 0 && other->watch_wd != panel->watch_wd)
+         inotify_rm_watch(inotify_fd, panel->watch_wd);
+ #endif
+     panel->watch_wd = -1;
+     panel->watch_poll = 0;
+     panel->rescan_needed = 0;
+     while (panel->num_changed > 0)
+         free(panel->changed_names[--panel->num_changed]);
+     free(panel->changed_names);
+     panel->changed_names = NULL;
+ }
+ 
+ int compare_names(const void *a, const void *b) {
+     return strcmp(*(char * const *)a, *(char * const *)b);
+ }
+ 
+ int compare_ints(const void *a, const void *b) {
+     int x = *(const int *)a, y = *(const int *)b;
+     return (x > y) - (x < y);
+ }
+ 
+ // Segna che la lista del pannello va riletta completamente
+ void queue_rescan(Panel *panel) {
+     while (panel->num_changed > 0)
+         free(panel->changed_names[--panel->num_changed]);
+     if (!panel->rescan_needed) {
+         clock_gettime(CLOCK_MONOTONIC, &panel->last_change);
+         panel->first_change = panel->last_change;
+     }
+     panel->rescan_needed = 1;
+ }
+ 
+ // Aggiunge un nome alle modifiche in sospeso del pannello
+ void queue_change(Panel *panel, const char *name) {
+     if (panel->rescan_needed) return;
+     
+     if (panel->num_changed == 0)
+         clock_gettime(CLOCK_MONOTONIC, &panel->first_change);
+     clock_gettime(CLOCK_MONOTONIC, &panel->last_change);
+     
+     // Le scritture producono raffiche di eventi sullo stesso nome
+     if (panel->num_changed > 0 && strcmp(panel->changed_names[panel->num_changed - 1], name) == 0)
+         return;
+     
+     if (panel->num_changed == WATCH_MAX_CHANGES) {
+         int i, unique = 0;
+         
+         // Prima di arrendersi elimina i duplicati
+         qsort(panel->changed_names, panel->num_changed, sizeof(char *), compare_names);
+         for (i = 0; i < panel->num_changed; i++) {
+             if (unique > 0 && strcmp(panel->changed_names[unique - 1], panel->changed_names[i]) == 0)
+                 free(panel->changed_names[i]);
+             else
+                 panel->changed_names[unique++] = panel->changed_names[i];
+         }
+         panel->num_changed = unique;
+         if (unique == WATCH_MAX_CHANGES) {
+             queue_rescan(panel);
+             return;
+         }
+     }
+     
+     if (!panel->changed_names)
+         panel->changed_names = malloc(WATCH_MAX_CHANGES * sizeof(char *));
+     if (!panel->changed_names ||
+         (panel->changed_names[panel->num_changed] = strdup(name)) == NULL) {
+         queue_rescan(panel);
+         return;
+     }
+     panel->num_changed++;
+ }
+ 
+ // Legge gli eventi inotify disponibili e li smista ai pannelli
+ void read_watch_events() {
+ #ifdef __linux__
+     char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+     Panel *panels[2] = { &left_panel, &right_panel };
+     ssize_t len;
+     
+     if (inotify_fd < 0) return;
+     
+     while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+         char *ptr = buf;
+         
+         while (ptr < buf + len) {
+             struct inotify_event *event = (struct inotify_event *)ptr;
+             int i;
+             
+             ptr += sizeof(struct inotify_event) + event->len;
+             for (i = 0; i < 2; i++) {
+                 Panel *panel = panels[i];
+                 
+                 if (panel->watch_wd < 0)
+                     continue;
+                 // Eventi persi, o directory rimossa: l'elenco non e' piu' affidabile
+                 if (event->mask & IN_Q_OVERFLOW)
+                     queue_rescan(panel);
+                 else if (event->wd != panel->watch_wd)
+                     continue;
+                 else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+                     queue_rescan(panel);
+                 else if (event->len > 0)
+                     queue_change(panel, event->name);
+             }
+         }
+     }
+ #endif
+ }
+ 
+ // Applica le modifiche in sospeso alla lista ordinata: le entry sparite
+ // vengono tolte, quelle cambiate o nuove inserite al loro posto con una
+ // fusione, senza riordinare tutto. Restituisce 1 se la lista e' cambiata
+ int apply_changes(Panel *panel) {
+     const char *selected_name = NULL;
+     int row = 0;
+     char **names = panel->changed_names;
+     int num_names = panel->num_changed;
+     FileEntry *adds;
+     int *hits;
+     int i, j, k, num_adds = 0;
+     
+     if (panel->selected > 0 && panel->selected < panel->num_files) {
+         selected_name = panel->files[panel->selected].name;
+         row = visible_pos(panel, panel->selected) - panel->scroll_pos;
+     }
+     
+     qsort(names, num_names, sizeof(char *), compare_names);
+     for (i = j = 0; i < num_names; i++) {
+         if (j > 0 && strcmp(names[j - 1], names[i]) == 0)
+             free(names[i]);
+         else
+             names[j++] = names[i];
+     }
+     num_names = panel->num_changed = j;
+     
+     adds = malloc(num_names * sizeof(FileEntry));
+     hits = malloc(num_names * sizeof(int));
+     if (!adds || !hits) {
+         free(adds);
+         free(hits);
+         queue_rescan(panel);
+         return 0;
+     }
+     for (i = 0; i < num_names; i++)
+         hits[i] = -1;
+     
+     // Una sola passata sulla lista, cercando ogni nome tra quelli modificati
+     for (i = 1; i < panel->num_files; i++) {
+         const char *key = panel->files[i].name;
+         char **found = bsearch(&key, names, num_names, sizeof(char *), compare_names);
+         if (found) hits[found - names] = i;
+     }
+     
+     // Metadati aggiornati delle entry che esistono ancora
+     for (i = 0; i < num_names; i++) {
+         FileEntry entry;
+         struct stat st;
+         
+         if (fstatat(panel->dir_fd, names[i], &st, AT_SYMLINK_NOFOLLOW) != 0)
+             continue; // Rimossa
+         
+         memset(&entry, 0, sizeof(entry));
+         entry.name = hits[i] >= 0 ? panel->files[hits[i]].name
+                                   : arena_strdup(&panel->names, names[i], strlen(names[i]));
+         entry.id = hits[i] >= 0 ? panel->files[hits[i]].id : panel->next_id++;
+         if (!entry.name) continue;
+         if (fetch_entry_metadata(panel->dir_fd, &entry) != 0) {
+             // Link simbolico non valido: si mostra il link stesso
+             entry.size = st.st_size;
+             entry.mode = st.st_mode;
+             entry.mtime = st.st_mtime;
+             entry.has_meta = 1;
+         }
+         entry.d_type = entry.is_dir ? DT_DIR : S_ISREG(entry.mode) ? DT_REG : DT_UNKNOWN;
+         if (S_ISDIR(st.st_mode)) {
+             SizeEntry cached;
+             if (size_cache_lookup(&st, &cached)) {
+                 entry.has_dir_size = 1 + cached.partial;
+                 entry.dir_size = config.allocated_size ? cached.allocated : cached.apparent;
+             }
+         }
+         adds[num_adds++] = entry;
+     }
+     
+     // Toglie tutte le entry modificate; quelle ancora esistenti vengono
+     // reinserite perche' la chiave di ordinamento puo' essere cambiata
+     qsort(hits, num_names, sizeof(int), compare_ints);
+     for (j = 0; j < num_names && hits[j] < 0; j++)
+         ;
+     for (i = k = 1; i < panel->num_files; i++) {
+         if (j < num_names && hits[j] == i) {
+             j++;
+             continue;
+         }
+         panel->files[k++] = panel->files[i];
+     }
+     panel->num_files = k;
+     free(hits);
+     
+     // Fusione dal fondo delle entry aggiunte, ordinate, con la lista
+     if (num_adds > 0 && panel->num_files + num_adds > panel->capacity) {
+         int new_capacity = panel->capacity ? panel->capacity : MIN_FILES_CAPACITY;
+         while (new_capacity < panel->num_files + num_adds) new_capacity *= 2;
+         FileEntry *files = realloc(panel->files, new_capacity * sizeof(FileEntry));
+         if (!files) {
+             free(adds);
+             queue_rescan(panel);
+             return 1;
+         }
+         panel->files = files;
+         panel->capacity = new_capacity;
+     }
+     sort_panel = panel;
+     qsort(adds, num_adds, sizeof(FileEntry), file_compare);
+     i = panel->num_files - 1;
+     k = panel->num_files + num_adds - 1;
+     for (j = num_adds - 1; j >= 0; k--) {
+         if (i >= 1 && file_compare(&panel->files[i], &adds[j]) > 0)
+             panel->files[k] = panel->files[i--];
+         else
+             panel->files[k] = adds[j--];
+     }
+     panel->num_files += num_adds;
+     free(adds);
+     
+     while (panel->num_changed > 0)
+         free(panel->changed_names[--panel->num_changed]);
+     
+     // La selezione segue l'entry; se e' stata rimossa resta alla stessa altezza
+     clear_filter_levels(panel, 0);
+     if (selected_name) {
+         for (i = 0; i < panel->num_files; i++) {
+             if (panel->files[i].name == selected_name) {
+                 panel->selected = i;
+                 break;
+             }
+         }
+     }
+     if (panel->selected >= panel->num_files)
+         panel->selected = panel->num_files - 1;
+     update_filter(panel);
+     if (selected_name) {
+         int pos = visible_pos(panel, panel->selected);
+         panel->scroll_pos = pos - row > 0 ? pos - row : 0;
+     }
+     panel->changed = 1;
+     panel->list_version++;
+     return 1;
+ }
+ 
+ // Controllo periodico: per le directory senza inotify, se la data di
+ // modifica e' cambiata la directory viene riletta. Restituisce 1 se riletta
+ int check_directory_mtime(Panel *panel) {
+     struct stat st;
+     time_t now = time(NULL);
+     
+     if ((panel->watch_wd < 0 && !panel->watch_poll) || panel->loader || now - panel->last_poll < WATCH_POLL_SEC)
+         return 0;
+     panel->last_poll = now;
+     
+     // Finche' dir_fd e' aperto la rimozione della directory non genera
+     // IN_DELETE_SELF: si riconosce dal numero di link sceso a zero
+     if (fstat(panel->dir_fd, &st) == 0 && st.st_nlink == 0) {
+         queue_rescan(panel);
+         return 0;
+     }
+     if (!panel->watch_poll)
+         return 0;
+     
+     if (stat(panel->current_path, &st) != 0) {
+         queue_rescan(panel);
+         return 0;
+     }
+     if (same_timespec(stat_mtime(&st), panel->dir_mtime))
+         return 0;
+     refresh_directory(panel);
+     return 1;
+ }
+ 
+ // Raccoglie gli eventi e, passato l'intervallo di accorpamento, li applica
+ // ai pannelli. Restituisce 1 se qualche lista e' cambiata
+ int poll_watches() {
+     Panel *panels[2] = { &left_panel, &right_panel };
+     struct timespec now;
+     int changed = 0, i;
+     
+     read_watch_events();
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     
+     for (i = 0; i < 2; i++) {
+         Panel *panel = panels[i];
+         
+         changed |= check_directory_mtime(panel);
+         
+         // Le modifiche arrivate durante un caricamento si applicano alla fine
+         if ((!panel->rescan_needed && panel->num_changed == 0) || panel->loader)
+             continue;
+         if (elapsed_seconds(&panel->last_change, &now) * 1000 < WATCH_QUIET_MS &&
+             elapsed_seconds(&panel->first_change, &now) * 1000 < WATCH_COALESCE_MS)
+             continue;
+         
+         if (panel->rescan_needed) {
+             // Se la directory e' stata rimossa si risale alla prima esistente
+             while (access(panel->current_path, X_OK) != 0 && strcmp(panel->current_path, "/") != 0) {
+                 char *slash = strrchr(panel->current_path, '/');
+                 if (slash == panel->current_path) slash[1] = '\0';
+                 else *slash = '\0';
+                 panel->selected = panel->scroll_pos = 0;
+             }
+             refresh_directory(panel);
+             changed = 1;
+         } else {
+             changed |= apply_changes(panel);
+         }
+     }
+     return changed;
+ }
+ 
+ // Attesa massima del ciclo degli eventi: breve con lavoro in background o
+ // modifiche in sospeso, infinita se gli eventi attesi arrivano tutti dai
+ // descrittori in poll (tasti, inotify, notifiche dei thread)
+ int input_timeout() {
+     Panel *panels[2] = { &left_panel, &right_panel };
+     int i, timeout_ms = -1;
+     
+     if (background_busy())
+         return UI_TICK_MS;
+     for (i = 0; i < 2; i++) {
+         if (panels[i]->num_changed > 0 || panels[i]->rescan_needed)
+             return WATCH_QUIET_MS;
+         if (panels[i]->watch_poll)
+             timeout_ms = WATCH_POLL_SEC * 1000;
+     }
+     return timeout_ms;
+ }
+ 
+ // Prime 8 lettere minuscole di una stringa come intero big-endian: confrontare
+ // le chiavi equivale a confrontare con strcasecmp i primi 8 caratteri
+ uint64_t folded_prefix(const char *str) {
+     uint64_t key = 0;
+     int i;
+     
+     for (i = 0; i < 8; i++) {
+         key <<= 8;
+         if (*str) key |= (unsigned char)tolower((unsigned char)*str++);
+     }
+     return key;
+ }
+ 
+ // Chiave per l'ordinamento naturale: come folded_prefix fino alla prima
+ // sequenza di cifre, poi un byte per la lunghezza del numero (da '0' a '9',
+ // nell'intervallo delle cifre: il confronto con gli altri caratteri resta
+ // quello di natural_compare) e, fino a 8 cifre, le sue cifre significative
+ uint64_t natural_key(const char *str) {
+     uint64_t key = 0;
+     int used = 0;
+     
+     while (used < 8 && *str && !isdigit((unsigned char)*str)) {
+         key = key << 8 | (unsigned char)tolower((unsigned char)*str++);
+         used++;
+     }
+     if (used < 8 && isdigit((unsigned char)*str)) {
+         const char *digits;
+         size_t len;
+         
+         while (*str == '0') str++;
+         for (digits = str; isdigit((unsigned char)*str); str++)
+             ;
+         len = str - digits;
+         key = key << 8 | (unsigned char)('0' + (len < 9 ? len : 9));
+         used++;
+         // Da 9 cifre in su la lunghezza non e' piu' distinta: le cifre
+         // ordinerebbero 1000000000 prima di 123456789, quindi le chiavi
+         // restano uguali e decide natural_compare
+         while (len < 9 && used < 8 && digits < str) {
+             key = key << 8 | (unsigned char)*digits++;
+             used++;
+         }
+     }
+     return key << (8 * (8 - used));
+ }
+ 
+ // Estensione di un nome ("" se assente; i file nascosti non ne hanno una)
+ const char *file_extension(const char *name) {
+     const char *dot = strrchr(name, '.');
+     return dot && dot != name ? dot + 1 : "";
+ }
+ 
+ // Confronto "naturale": le sequenze di cifre valgono come numeri, cosi'
+ // file2 viene prima di file10. Senza distinzione tra maiuscole e minuscole
+ int natural_compare(const char *a, const char *b) {
+     while (*a && *b) {
+         if (isdigit((unsigned char)*a) && isdigit((unsigned char)*b)) {
+             const char *start_a, *start_b;
+             size_t len_a, len_b;
+             int diff;
+             
+             while (*a == '0') a++;
+             while (*b == '0') b++;
+             for (start_a = a; isdigit((unsigned char)*a); a++)
+                 ;
+             for (start_b = b; isdigit((unsigned char)*b); b++)
+                 ;
+             len_a = a - start_a;
+             len_b = b - start_b;
+             // Il numero con piu' cifre significative e' il maggiore
+             if (len_a != len_b) return len_a < len_b ? -1 : 1;
+             if ((diff = memcmp(start_a, start_b, len_a)) != 0) return diff;
+             continue;
+         }
+         
+         int ca = tolower((unsigned char)*a), cb = tolower((unsigned char)*b);
+         if (ca != cb) return ca - cb;
+         a++;
+         b++;
+     }
+     return (unsigned char)*a - (unsigned char)*b;
+ }
+ 
+ // Dimensione usata per ordinare: per le directory il totale, se calcolato
+ static inline off_t entry_size(const FileEntry *file) {
+     return file->has_dir_size ? file->dir_size : file->size;
+ }
+ 
+ // Confronta due entry secondo il criterio crescente sort_by, directory in
+ // testa. A parita' di chiave decide il nome
+ int entry_compare(int sort_by, const FileEntry *fa, const FileEntry *fb) {
+     int result = 0;
+     
+     if (fa->is_dir != fb->is_dir)
+         return fa->is_dir ? -1 : 1;
+     
+     switch (sort_by) {
+         case SORT_SIZE:
+             result = (entry_size(fa) > entry_size(fb)) - (entry_size(fa) < entry_size(fb));
+             break;
+         case SORT_MTIME:
+             result = (fa->mtime > fb->mtime) - (fa->mtime < fb->mtime);
+             break;
+         case SORT_NATURAL:
+             result = natural_compare(fa->name, fb->name);
+             break;
+         case SORT_EXTENSION:
+             if (!fa->is_dir)
+                 result = strcasecmp(file_extension(fa->name), file_extension(fb->name));
+             break;
+     }
+     if (result == 0) result = strcasecmp(fa->name, fb->name);
+     if (result == 0) result = strcmp(fa->name, fb->name);
+     return result;
+ }
+ 
+ // Confronta due file per l'ordinamento secondo il criterio di sort_panel
+ int file_compare(const void *a, const void *b) {
+     int result = entry_compare(sort_panel->sort_by, a, b);
+     
+     // L'ordine decrescente inverte solo all'interno di directory e file
+     if (sort_panel->sort_order && ((const FileEntry *)a)->is_dir == ((const FileEntry *)b)->is_dir)
+         result = -result;
+     return result;
+ }
+ 
+ // Confronto tra elementi con la stessa chiave, secondo sort_panel
+ int sort_item_compare(const void *a, const void *b) {
+     const FileEntry *files = sort_panel->files;
+     return entry_compare(sort_panel->sort_by, &files[((const SortItem *)a)->index],
+                          &files[((const SortItem *)b)->index]);
+ }
+ 
+ // Radix sort LSD stabile sulle chiavi a 64 bit, un byte per passata.
+ // Le passate in cui tutte le chiavi hanno lo stesso byte vengono saltate
+ void radix_sort(SortItem *items, SortItem *tmp, size_t count) {
+     size_t counts[256];
+     int shift;
+     size_t i;
+     
+     for (shift = 0; shift < 64; shift += 8) {
+         size_t sum = 0;
+         
+         memset(counts, 0, sizeof(counts));
+         for (i = 0; i < count; i++)
+             counts[(items[i].key >> shift) & 0xff]++;
+         if (count == 0 || counts[(items[0].key >> shift) & 0xff] == count)
+             continue;
+         
+         for (i = 0; i < 256; i++) {
+             size_t c = counts[i];
+             counts[i] = sum;
+             sum += c;
+         }
+         for (i = 0; i < count; i++)
+             tmp[counts[(items[i].key >> shift) & 0xff]++] = items[i];
+         memcpy(items, tmp, count * sizeof(SortItem));
+     }
+ }
+ 
+ // Ordina in modo crescente un gruppo di entry (solo directory o solo file):
+ // radix sort sulle chiavi precalcolate (dimensione, data o prefisso del
+ // nome), poi confronto completo solo tra le entry con la stessa chiave
+ void sort_group(Panel *panel, SortItem *items, SortItem *tmp, size_t count) {
+     int sort_by = panel->sort_by;
+     
+     if (sort_by == SORT_EXTENSION && count > 0 && panel->files[items[0].index].is_dir)
+         sort_by = SORT_NAME; // Le directory non hanno estensione
+     sort_range(panel->files, sort_by, items, tmp, count, 0);
+ }
+ 
+ // Ordina items con il radix sort sulla chiave di livello depth. Per i nomi
+ // i gruppi grandi con lo stesso prefisso passano agli 8 caratteri successivi
+ void sort_range(const FileEntry *files, int sort_by, SortItem *items, SortItem *tmp, size_t count, int depth) {
+     size_t i, run;
+     
+     for (i = 0; i < count; i++) {
+         const FileEntry *file = &files[items[i].index];
+         switch (sort_by) {
+             case SORT_SIZE: items[i].key = (uint64_t)entry_size(file); break;
+             // Il bit di segno invertito rende ordinabili come unsigned le date negative
+             case SORT_MTIME: items[i].key = (uint64_t)(int64_t)file->mtime ^ (1ULL << 63); break;
+             case SORT_EXTENSION: items[i].key = folded_prefix(file_extension(file->name)); break;
+             case SORT_NATURAL: items[i].key = natural_key(file->name); break;
+             default:
+                 items[i].key = strnlen(file->name, 8 * depth) < (size_t)(8 * depth) ? 0
+                              : folded_prefix(file->name + 8 * depth);
+                 break;
+         }
+     }
+     radix_sort(items, tmp, count);
+     
+     // A parita' di chiave decide il confronto completo
+     for (i = 0; i < count; i = run) {
+         for (run = i + 1; run < count && items[run].key == items[i].key; run++)
+             ;
+         if (run - i < 2)
+             continue;
+         if (sort_by == SORT_NAME && run - i > RADIX_MIN_RUN && items[i].key != 0 && depth < 8) {
+             sort_range(files, sort_by, items + i, tmp, run - i, depth + 1);
+         } else if (sort_by == SORT_EXTENSION && run - i > RADIX_MIN_RUN) {
+             // Con estensioni corte la chiave le contiene per intero: il gruppo
+             // si ordina per nome
+             size_t j;
+             for (j = i; j < run && strlen(file_extension(files[items[j].index].name)) < 8; j++)
+                 ;
+             if (j == run)
+                 sort_range(files, SORT_NAME, items + i, tmp, run - i, 0);
+             else
+                 qsort(items + i, run - i, sizeof(SortItem), sort_item_compare);
+         } else
+             qsort(items + i, run - i, sizeof(SortItem), sort_item_compare);
+     }
+ }
+ 
+ // Inverte l'ordine delle entry in [from, to)
+ void reverse_entries(FileEntry *files, int from, int to) {
+     for (to--; from < to; from++, to--) {
+         FileEntry tmp = files[from];
+         files[from] = files[to];
+         files[to] = tmp;
+     }
+ }
+ 
+ // Ordina i file, misurando il tempo se la strumentazione e' attiva
+ void sort_files(Panel *panel) {
+     struct timespec start;
+     
+     perf_start(&start);
+     sort_entries(panel);
+     perf_end(PERF_SORT, &start, panel->num_files - 1, 0, NULL);
+ }
+ 
+ // L'ordine crescente di ogni criterio resta in cache (come sequenza di id
+ // delle entry) finche' la lista non cambia: tornare a un criterio gia' usato,
+ // o invertire l'ordine, costa una sola passata
+ void sort_entries(Panel *panel) {
+     SortCache *cache = &panel->sort_cache[panel->sort_by];
+     int count = panel->num_files - 1;
+     FileEntry *sorted;
+     int i, num_dirs = 0;
+     
+     panel->changed = 1;
+     clear_filter_levels(panel, 0);
+     if (count < 1) return;
+     
+     // Per ordinare per dimensione o data servono i metadati di tutte le entry
+     if (sort_needs_metadata(panel->sort_by))
+         load_metadata(panel, 1, panel->num_files, 0, 0);
+     
+     sorted = malloc(count * sizeof(FileEntry));
+     if (!sorted) {
+         // Senza memoria per la permutazione si ordina sul posto
+         sort_panel = panel;
+         qsort(panel->files + 1, count, sizeof(FileEntry), file_compare);
+         return;
+     }
+     
+     if (cache->ids && cache->version == panel->list_version && cache->count == count) {
+         // Riapplica la permutazione gia' calcolata
+         uint32_t *pos = malloc(panel->next_id * sizeof(uint32_t));
+         if (pos) {
+             for (i = 1; i <= count; i++)
+                 pos[panel->files[i].id] = i;
+             for (i = 0; i < count; i++)
+                 sorted[i] = panel->files[pos[cache->ids[i]]];
+             free(pos);
+             num_dirs = cache->num_dirs;
+         } else {
+             cache->version = panel->list_version - 1;
+         }
+     }
+     
+     if (cache->version != panel->list_version || cache->count != count || !cache->ids) {
+         SortItem *items = malloc(2 * count * sizeof(SortItem));
+         uint32_t *ids = realloc(cache->ids, count * sizeof(uint32_t));
+         int num_files = 0;
+         
+         if (ids) cache->ids = ids;
+         if (!items || !ids) {
+             free(items);
+             free(sorted);
+             sort_panel = panel;
+             qsort(panel->files + 1, count, sizeof(FileEntry), file_compare);
+             return;
+         }
+         
+         // Directory in testa, file in coda
+         for (i = 1; i <= count; i++) {
+             if (panel->files[i].is_dir) num_dirs++;
+         }
+         for (i = 1; i <= count; i++) {
+             if (panel->files[i].is_dir) items[num_files++].index = i;
+         }
+         for (i = 1; i <= count; i++) {
+             if (!panel->files[i].is_dir) items[num_files++].index = i;
+         }
+         
+         sort_panel = panel;
+         sort_group(panel, items, items + count, num_dirs);
+         sort_group(panel, items + num_dirs, items + count, count - num_dirs);
+         
+         for (i = 0; i < count; i++) {
+             sorted[i] = panel->files[items[i].index];
+             ids[i] = sorted[i].id;
+         }
+         cache->count = count;
+         cache->num_dirs = num_dirs;
+         cache->version = panel->list_version;
+         free(items);
+     }
+     
+     memcpy(panel->files + 1, sorted, count * sizeof(FileEntry));
+     free(sorted);
+     
+     // L'ordine decrescente inverte solo all'interno di directory e file
+     if (panel->sort_order) {
+         reverse_entries(panel->files, 1, 1 + num_dirs);
+         reverse_entries(panel->files, 1 + num_dirs, panel->num_files);
+     }
+ }
+ 
+ // Riordina il pannello dopo un cambio di criterio, mantenendo selezionata
+ // la stessa entry alla stessa altezza
+ void resort_panel(Panel *panel) {
+     int row = visible_pos(panel, panel->selected) - panel->scroll_pos;
+     uint32_t id;
+     int i, pos;
+     
+     if (panel->selected <= 0 || panel->selected >= panel->num_files) {
+         sort_files(panel);
+         return;
+     }
+     id = panel->files[panel->selected].id;
+     sort_files(panel);
+     update_filter(panel);
+     for (i = 1; i < panel->num_files; i++) {
+         if (panel->files[i].id == id) {
+             panel->selected = i;
+             pos = visible_pos(panel, i);
+             panel->scroll_pos = pos - row > 0 ? pos - row : 0;
+             // ...senza scorrere oltre la fine: una lista che entra nel pannello resta intera
+             if (panel->scroll_pos > visible_count(panel) - panel->view.height)
+                 panel->scroll_pos = visible_count(panel) > panel->view.height ? visible_count(panel) - panel->view.height : 0;
+             break;
+         }
+     }
+ }
+ 
+ // Vero se il criterio richiede i metadati completi di tutte le entry
+ int sort_needs_metadata(int sort_by) {
+     return sort_by == SORT_SIZE || sort_by == SORT_MTIME;
+ }
+ 
+ // Minuscola ASCII, come nei confronti senza distinzione di maiuscole
+ static inline unsigned char fold_char(unsigned char c) {
+     return (unsigned char)(c - 'A') < 26 ? c | 0x20 : c;
+ }
+ 
+ #ifdef __SSE2__
+ // Vero se i 16 byte da p stanno nella stessa pagina (leggerli e' sicuro
+ // anche oltre la fine della stringa)
+ #define SAME_PAGE_16(p) (((uintptr_t)(p) & 4095) <= 4096 - 16)
+ 
+ // Converte in minuscolo le lettere ASCII di un blocco di 16 byte
+ static inline __m128i fold_block(__m128i block) {
+     __m128i offset = _mm_sub_epi8(block, _mm_set1_epi8('A'));
+     __m128i upper = _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(25)), offset);
+     return _mm_or_si128(block, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+ }
+ #endif
+ 
+ // Vero se name contiene needle (gia' in minuscolo, len >= 1) senza distinzione
+ // di maiuscole. Con SSE2 si confrontano 16 posizioni alla volta il primo e
+ // l'ultimo carattere dell'ago, e solo i candidati vengono verificati per intero.
+ // La lettura oltre il terminatore (nella stessa pagina) e' voluta: va esclusa
+ // dai controlli di AddressSanitizer
+ #ifdef __SSE2__
+ __attribute__((no_sanitize_address))
+ #endif
+ int contains_folded(const char *name, const char *needle, size_t len) {
+     size_t i = 0, j;
+     
+ #ifdef __SSE2__
+     const __m128i first = _mm_set1_epi8(needle[0]);
+     const __m128i last = _mm_set1_epi8(needle[len - 1]);
+     
+     while (SAME_PAGE_16(name + i) && SAME_PAGE_16(name + i + len - 1)) {
+         __m128i block = _mm_loadu_si128((const __m128i *)(name + i));
+         __m128i block_last = _mm_loadu_si128((const __m128i *)(name + i + len - 1));
+         unsigned zero = _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_setzero_si128()));
+         unsigned candidates = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(fold_block(block), first),
+                                                               _mm_cmpeq_epi8(fold_block(block_last), last)));
+         
+         // Oltre la fine della stringa le posizioni non contano
+         if (zero) {
+             unsigned end = __builtin_ctz(zero);
+             candidates &= end >= len ? (1u << (end - len + 1)) - 1 : 0;
+         }
+         while (candidates) {
+             size_t pos = i + __builtin_ctz(candidates);
+             for (j = 1; j + 1 < len && fold_char(name[pos + j]) == (unsigned char)needle[j]; j++)
+                 ;
+             if (j + 1 >= len) return 1;
+             candidates &= candidates - 1;
+         }
+         if (zero) return 0;
+         i += 16;
+     }
+ #endif
+     // Confronto semplice per la parte finale vicina al bordo di pagina
+     for (; name[i]; i++) {
+         for (j = 0; j < len && name[i + j] && fold_char(name[i + j]) == (unsigned char)needle[j]; j++)
+             ;
+         if (j == len) return 1;
+     }
+     return 0;
+ }
+ 
+ // Vero se i caratteri di pattern (in minuscolo) compaiono in ordine in name
+ int fuzzy_match(const char *name, const char *pattern, size_t len) {
+     size_t j = 0;
+     
+     for (; *name && j < len; name++) {
+         if (fold_char(*name) == (unsigned char)pattern[j]) j++;
+     }
+     return j == len;
+ }
+ 
+ // Vero se name soddisfa i primi len caratteri del filtro del pannello
+ int filter_match(Panel *panel, const char *name, const char *folded, size_t len, const char *literal, size_t literal_len) {
+     switch (panel->filter_mode) {
+         case FILTER_GLOB:
+             // La parte letterale piu' lunga scarta in fretta la maggior parte dei nomi
+             if (literal_len > 0 && !contains_folded(name, literal, literal_len))
+                 return 0;
+             return fnmatch(panel->filter, name, FNM_CASEFOLD) == 0;
+         case FILTER_FUZZY:
+             return fuzzy_match(name, folded, len);
+         default:
+             return contains_folded(name, folded, len);
+     }
+ }
+ 
+ // Tratto letterale piu' lungo di un glob (gia' in minuscolo), per scartare
+ // con contains_folded i nomi che non possono corrispondere prima di fnmatch
+ size_t glob_literal(const char *folded, size_t len, char *literal) {
+     size_t run = 0, literal_len = 0, i;
+     
+     for (i = 0; i <= len; i++) {
+         // I caratteri non ASCII restano fuori: FNM_CASEFOLD li confronta secondo il locale
+         if (i < len && (unsigned char)folded[i] < 0x80 && !strchr("*?[]\\", folded[i])) {
+             run++;
+         } else {
+             if (run > literal_len) {
+                 literal_len = run;
+                 memcpy(literal, folded + i - run, run);
+             }
+             run = 0;
+             // Dentro una classe [...] il contenuto non e' letterale
+             if (i < len && folded[i] == '[') {
+                 while (i < len && folded[i] != ']') i++;
+             }
+         }
+     }
+     literal[literal_len] = '\0';
+     return literal_len;
+ }
+ 
+ // Applica il filtro alle entry [from, to) di un FilterJob
+ void filter_task(void *arg, int from, int to) {
+     FilterJob *job = arg;
+     int i;
+     
+     for (i = from; i < to; i++) {
+         const FileEntry *file = &job->panel->files[job->source ? job->source[i] : i + 1];
+         job->hits[i] = filter_match(job->panel, file->name, job->folded, job->len, job->literal, job->literal_len);
+     }
+ }
+ 
+ // Calcola, se manca, il risultato del filtro corrente. Aggiungendo un
+ // carattere i risultati possono solo diminuire (tranne che per i glob):
+ // si filtra il risultato del prefisso piu' lungo gia' calcolato invece
+ // di tutta la lista
+ void update_filter(Panel *panel) {
+     char folded[MAX_FILTER_LEN + 1];
+     char literal[MAX_FILTER_LEN + 1] = "";
+     size_t literal_len = 0;
+     int len = panel->filter_len;
+     int *source = NULL, source_count = 0, *result, count = 0;
+     int i, level;
+     WorkerPool *pool;
+     
+     if (len <= 0 || len > MAX_FILTER_LEN || panel->filter_levels[len]) return;
+     
+     for (i = 0; i < len; i++)
+         folded[i] = fold_char(panel->filter[i]);
+     folded[len] = '\0';
+     
+     if (panel->filter_mode == FILTER_GLOB) {
+         literal_len = glob_literal(folded, len, literal);
+     } else {
+         for (level = len - 1; level > 0 && !panel->filter_levels[level]; level--)
+             ;
+         if (level > 0) {
+             source = panel->filter_levels[level];
+             source_count = panel->filter_counts[level];
+         }
+     }
+     
+     // ".." resta sempre visibile ed e' esclusa dai risultati
+     if (!source) source_count = panel->num_files > 0 ? panel->num_files - 1 : 0;
+     FilterJob job = { panel, source, folded, len, literal, literal_len, malloc(source_count + 1) };
+     result = malloc(source_count * sizeof(int) + 1);
+     if (!result || !job.hits) {
+         free(result);
+         free(job.hits);
+         return;
+     }
+     
+     if (source_count >= PARALLEL_FILTER_MIN && config.stat_threads > 1 && (pool = get_stat_pool()))
+         pool_run(pool, filter_task, &job, source_count, PARALLEL_FILTER_BATCH);
+     else
+         filter_task(&job, 0, source_count);
+     
+     for (i = 0; i < source_count; i++) {
+         if (job.hits[i])
+             result[count++] = source ? source[i] : i + 1;
+     }
+     free(job.hits);
+     panel->filter_levels[len] = result;
+     panel->filter_counts[len] = count;
+ }
+ 
+ // Libera i risultati del filtro per i prefissi piu' lunghi di keep caratteri.
+ // Con keep = 0 si scartano tutti, quando la lista cambia: verranno
+ // ricalcolati al prossimo disegno
+ void clear_filter_levels(Panel *panel, int keep) {
+     int i;
+     
+     for (i = keep + 1; i <= MAX_FILTER_LEN; i++) {
+         free(panel->filter_levels[i]);
+         panel->filter_levels[i] = NULL;
+     }
+ }
+ 
+ // Imposta il testo del filtro del pannello ("" per toglierlo)
+ void set_filter(Panel *panel, const char *text, int len) {
+     int common = 0;
+     
+     if (len > MAX_FILTER_LEN) len = MAX_FILTER_LEN;
+     // I risultati dei prefissi comuni restano validi
+     while (common < len && common < panel->filter_len && panel->filter[common] == text[common])
+         common++;
+     clear_filter_levels(panel, panel->filter_mode == FILTER_GLOB ? 0 : common);
+     memmove(panel->filter, text, len);
+     panel->filter[len] = '\0';
+     panel->filter_len = len;
+     panel->changed = 1;
+     update_filter(panel);
+     
+     // Se la selezione e' stata nascosta si passa alla prima entry visibile
+     if (panel->selected > 0 && visible_entry(panel, visible_pos(panel, panel->selected)) != panel->selected) {
+         panel->selected = visible_entry(panel, visible_count(panel) > 1 ? 1 : 0);
+         panel->scroll_pos = 0;
+     }
+ }
+ 
+ // Numero di righe della lista, ".." compresa
+ int visible_count(Panel *panel) {
+     if (panel->filter_len == 0 || !panel->filter_levels[panel->filter_len])
+         return panel->num_files;
+     return panel->filter_counts[panel->filter_len] + 1;
+ }
+ 
+ // Entry mostrata alla riga pos della lista
+ int visible_entry(Panel *panel, int pos) {
+     if (panel->filter_len == 0 || !panel->filter_levels[panel->filter_len] || pos == 0)
+         return pos;
+     return panel->filter_levels[panel->filter_len][pos - 1];
+ }
+ 
+ // Riga della lista che mostra l'entry index o, se e' nascosta dal filtro,
+ // la prima riga successiva
+ int visible_pos(Panel *panel, int index) {
+     int *result = panel->filter_levels[panel->filter_len];
+     int low = 0, high;
+     
+     if (panel->filter_len == 0 || !result || index == 0)
+         return index;
+     high = panel->filter_counts[panel->filter_len];
+     while (low < high) {
+         int mid = (low + high) / 2;
+         if (result[mid] < index) low = mid + 1;
+         else high = mid;
+     }
+     return low + 1;
+ }
+ 
+ // Sposta la selezione di delta righe della lista
+ void move_selection(Panel *panel, int delta) {
+     int count = visible_count(panel);
+     int pos = visible_pos(panel, panel->selected) + delta;
+     
+     if (pos >= count) pos = count - 1;
+     if (pos < 0) pos = 0;
+     panel->selected = visible_entry(panel, pos);
+ }
+ 
+ // Vero se l'entry e' marcata
+ int is_tagged(Panel *panel, FileEntry *file) {
+     return file->id / 64 < panel->tag_words && (panel->tags[file->id / 64] >> (file->id % 64) & 1);
+ }
+ 
+ // Dimensione di un'entry nel totale delle marcate
+ static inline off_t tag_size(FileEntry *file) {
+     return file->is_dir ? (file->has_dir_size ? file->dir_size : 0) : file->size;
+ }
+ 
+ // Marca o smarca un'entry ("..", sempre la prima, non si marca). Il bitset
+ // cresce con gli id assegnati dalla lettura
+ void set_tag(Panel *panel, FileEntry *file, int tagged) {
+     uint32_t word = file->id / 64;
+     
+     tagged = tagged != 0;
+     if (file == panel->files || is_tagged(panel, file) == tagged)
+         return;
+     if (word >= panel->tag_words) {
+         uint32_t words = panel->next_id / 64 + 1;
+         uint64_t *tags = realloc(panel->tags, words * sizeof(uint64_t));
+         
+         if (!tags) {
+             display_error("Memoria insufficiente");
+             return;
+         }
+         memset(tags + panel->tag_words, 0, (words - panel->tag_words) * sizeof(uint64_t));
+         panel->tags = tags;
+         panel->tag_words = words;
+     }
+     panel->tags[word] ^= (uint64_t)1 << (file->id % 64);
+     panel->num_tagged += tagged ? 1 : -1;
+     panel->tagged_bytes += tagged ? tag_size(file) : -tag_size(file);
+ }
+ 
+ // Toglie tutte le marcature (la lista sta per ricevere nuovi id)
+ void clear_tags(Panel *panel) {
+     if (panel->tags)
+         memset(panel->tags, 0, panel->tag_words * sizeof(uint64_t));
+     panel->num_tagged = 0;
+     panel->tagged_bytes = 0;
+ }
+ 
+ // Ricalcola numero e dimensione delle entry marcate. I bit delle entry
+ // sparite restano ma non si contano: nella stessa lettura gli id non si riusano
+ void count_tags(Panel *panel) {
+     int i;
+     
+     panel->num_tagged = 0;
+     panel->tagged_bytes = 0;
+     panel->tagged_version = panel->list_version;
+     if (!panel->tags) return;
+     for (i = 1; i < panel->num_files; i++) {
+         if (is_tagged(panel, &panel->files[i])) {
+             panel->num_tagged++;
+             panel->tagged_bytes += tag_size(&panel->files[i]);
+         }
+     }
+ }
+ 
+ // Numero di entry marcate, ricontate se la lista e' cambiata
+ int tagged_count(Panel *panel) {
+     if (panel->num_tagged > 0 && panel->tagged_version != panel->list_version)
+         count_tags(panel);
+     return panel->num_tagged;
+ }
+ 
+ // Prima di rileggere la directory ne ricorda le entry marcate, per
+ // rimarcarle per nome quando la lettura e' finita
+ void save_tags(Panel *panel) {
+     free_retag_names(panel);
+     if (tagged_count(panel) > 0)
+         panel->retag_names = tagged_names(panel, &panel->num_retag);
+     clear_tags(panel);
+ }
+ 
+ // Rimarca dopo una rilettura le entry marcate che esistono ancora
+ void restore_tags(Panel *panel) {
+     int i;
+     
+     if (!panel->retag_names) return;
+     qsort(panel->retag_names, panel->num_retag, sizeof(char *), compare_names);
+     for (i = 1; i < panel->num_files; i++) {
+         const char *key = panel->files[i].name;
+         if (bsearch(&key, panel->retag_names, panel->num_retag, sizeof(char *), compare_names))
+             set_tag(panel, &panel->files[i], 1);
+     }
+     free_retag_names(panel);
+     panel->changed = 1;
+ }
+ 
+ void free_retag_names(Panel *panel) {
+     free(panel->retag_names);
+     panel->retag_names = NULL;
+     panel->num_retag = 0;
+ }
+ 
+ // Marca (o smarca) le entry visibili il cui nome corrisponde al pattern glob
+ void tag_matching(Panel *panel, const char *pattern, int tagged) {
+     int count = visible_count(panel), pos;
+     
+     for (pos = 1; pos < count; pos++) {
+         FileEntry *file = &panel->files[visible_entry(panel, pos)];
+         if (fnmatch(pattern, file->name, FNM_CASEFOLD) == 0)
+             set_tag(panel, file, tagged);
+     }
+     panel->changed = 1;
+ }
+ 
+ // Inverte la marcatura delle entry visibili
+ void invert_tags(Panel *panel) {
+     int count = visible_count(panel), pos;
+     
+     for (pos = 1; pos < count; pos++) {
+         FileEntry *file = &panel->files[visible_entry(panel, pos)];
+         set_tag(panel, file, !is_tagged(panel, file));
+     }
+     panel->changed = 1;
+ }
+ 
+ // Nomi delle entry marcate nell'ordine della lista, in un solo blocco da
+ // liberare con free(). NULL se non ce ne sono o se manca la memoria
+ char **tagged_names(Panel *panel, int *count) {
+     size_t size = 0;
+     char **names, *next;
+     int i, n = 0;
+     
+     for (i = 1; i < panel->num_files; i++) {
+         if (is_tagged(panel, &panel->files[i])) {
+             size += sizeof(char *) + strlen(panel->files[i].name) + 1;
+             n++;
+         }
+     }
+     *count = n;
+     if (n == 0 || (names = malloc(size)) == NULL)
+         return NULL;
+     next = (char *)(names + n);
+     for (i = 1, n = 0; i < panel->num_files; i++) {
+         if (is_tagged(panel, &panel->files[i])) {
+             names[n++] = next;
+             next = stpcpy(next, panel->files[i].name) + 1;
+         }
+     }
+     return names;
+ }
+ 
+ // Accoda come una sola operazione le entry marcate del pannello (copia o
+ // spostamento in dst_dir, eliminazione, estrazione da un archivio) e toglie
+ // la marcatura
+ void enqueue_tagged(Panel *panel, int type, const char *dst_dir) {
+     char **names;
+     int count;
+     
+     names = tagged_names(panel, &count);
+     if (!names) {
+         if (count > 0) display_error("Memoria insufficiente");
+         return;
+     }
+     enqueue_group(type, panel->current_path, dst_dir, names, count);
+     clear_tags(panel);
+     panel->changed = 1;
+ }
+ 
+ // Cerca dalla riga from in poi (ricominciando dall'inizio) la prima entry
+ // il cui nome inizia con text; in mancanza, la prima che lo contiene.
+ // Restituisce la riga trovata o -1
+ int quick_search(Panel *panel, const char *text, int len, int from) {
+     char folded[MAX_FILTER_LEN + 1];
+     int count = visible_count(panel);
+     int pass, i;
+     
+     for (i = 0; i < len; i++)
+         folded[i] = fold_char(text[i]);
+     folded[len] = '\0';
+     
+     for (pass = 0; pass < 2; pass++) {
+         for (i = 0; i < count; i++) {
+             int pos = (from + i) % count;
+             const char *name = panel->files[visible_entry(panel, pos)].name;
+             
+             if (pass == 0 ? strncasecmp(name, text, len) == 0 : contains_folded(name, folded, len))
+                 return pos;
+         }
+     }
+     return -1;
+ }
+ 
+ // Gestisce un tasto durante la ricerca rapida o la modifica del filtro.
+ // Restituisce 0 se il tasto chiude la modalita' e va gestito normalmente
+ int handle_search_key(int ch) {
+     Panel *panel = active_panel;
+     int editing_filter = input_mode == INPUT_FILTER;
+     int len = editing_filter ? panel->filter_len : search_len;
+     
+     if (ch == ERR) return 1;
+     
+     if (ch == 27) { // Esc: chiude; per il filtro lo toglie anche
+         if (editing_filter) set_filter(panel, "", 0);
+         input_mode = INPUT_NORMAL;
+         return 1;
+     }
+     if (ch == '\n') {
+         input_mode = INPUT_NORMAL;
+         return editing_filter; // Nella ricerca Enter apre anche l'entry trovata
+     }
+     if (ch == KEY_BACKSPACE || ch == 127 || ch == 8) {
+         if (len == 0) return 1;
+         if (editing_filter) {
+             set_filter(panel, panel->filter, len - 1);
+         } else {
+             search_len--;
+             search_text[search_len] = '\0';
+         }
+         return 1;
+     }
+     if (ch == '\t' && editing_filter) { // Cambia tipo di filtro
+         panel->filter_mode = (panel->filter_mode + 1) % FILTER_MODES;
+         clear_filter_levels(panel, 0);
+         set_filter(panel, panel->filter, panel->filter_len);
+         return 1;
+     }
+     if (!editing_filter && (ch == '/' || ch == KEY_DOWN) && search_len > 0) { // Prossima corrispondenza
+         int pos = quick_search(panel, search_text, search_len, visible_pos(panel, panel->selected) + 1);
+         if (pos >= 0) panel->selected = visible_entry(panel, pos);
+         return 1;
+     }
+     if (ch < 32 || ch > 255 || len >= MAX_FILTER_LEN) {
+         // Qualsiasi altro tasto chiude la ricerca e viene gestito normalmente
+         input_mode = INPUT_NORMAL;
+         return 0;
+     }
+     
+     if (editing_filter) {
+         char buf[MAX_FILTER_LEN + 1];
+         memcpy(buf, panel->filter, len);
+         buf[len] = (char)ch;
+         set_filter(panel, buf, len + 1);
+     } else {
+         // Il carattere si aggiunge solo se esiste un'entry che corrisponde
+         search_text[search_len] = (char)ch;
+         int pos = quick_search(panel, search_text, search_len + 1, visible_pos(panel, panel->selected));
+         if (pos >= 0) {
+             panel->selected = visible_entry(panel, pos);
+             search_text[++search_len] = '\0';
+         } else {
+             search_text[search_len] = '\0';
+             beep();
+         }
+     }
+     return 1;
+ }
+ 
+ // Disegna l'interfaccia utente
+ void draw_interface() {
+     struct timespec start, end, perf_time;
+     
+     perf_start(&perf_time);
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     frame_stats.rows = 0;
+     
+     int job_rows = count_jobs();
+     if (job_rows > MAX_JOB_ROWS) job_rows = MAX_JOB_ROWS;
+     
+     int panel_width = term_cols / 2;
+     // Lascia spazio per le due intestazioni, le operazioni, la barra di comando e le due linee in fondo
+     int panel_height = term_rows - 5 - job_rows;
+     
+     // Disegna intestazione
+     attron(COLOR_PAIR(2));
+     mvhline(0, 0, ' ', term_cols);
+     mvprintw(0, 1, "Tiny Commander %s - Eugenio Bonifacio", GIT_VERSION);
+     if (config.frame_time) {
+         char stats[80];
+         int len = snprintf(stats, sizeof(stats), "%.2f ms (media %.2f, max %.2f) %d righe",
+                            frame_stats.last_ms, frame_stats.avg_ms, frame_stats.max_ms, frame_stats.last_rows);
+         mvprintw(0, term_cols - len - 1 > 0 ? term_cols - len - 1 : 0, "%s", stats);
+     }
+     attroff(COLOR_PAIR(2));
+     
+     // Disegna pannelli
+     draw_panel(&left_panel, 0, 1, panel_width, panel_height);
+     draw_panel(&right_panel, panel_width, 1, panel_width, panel_height);
+     
+     // Disegna l'area delle operazioni in corso
+     if (job_rows > 0)
+         draw_jobs(term_rows - 3 - job_rows, job_rows);
+     
+     // Disegna barra di comando
+     attron(COLOR_PAIR(2));
+     mvhline(term_rows - 3, 0, ' ', term_cols);
+     mvprintw(term_rows - 3, 1, "F1-Aiuto F2-Menu F3-Vedi F4-Edit F5-Copia F6-Sposta F7-Mkdir F8-Elimina F9-Shell F10-Esci");
+     attroff(COLOR_PAIR(2));
+     
+     // Disegna linea di stato
+     mvhline(term_rows - 2, 0, ' ', term_cols);
+     mvprintw(term_rows - 2, 1, "Current: %s", active_panel->current_path);
+     
+     // Disegna linea di comando, o l'ultimo messaggio
+     mvhline(term_rows - 1, 0, ' ', term_cols);
+     if (input_mode == INPUT_QUICKSEARCH) {
+         mvprintw(term_rows - 1, 0, "Cerca: %s", search_text);
+     } else if (input_mode == INPUT_FILTER) {
+         static const char *filter_names[] = { "sottostringa", "glob", "fuzzy" };
+         mvprintw(term_rows - 1, 0, "Filtro [%s, Tab cambia]: %s",
+                  filter_names[active_panel->filter_mode], active_panel->filter);
+     } else if (status_message[0] && status_error) {
+         attron(COLOR_PAIR(5));
+         mvhline(term_rows - 1, 0, ' ', term_cols);
+         mvprintw(term_rows - 1, 0, "%s", status_message);
+         attroff(COLOR_PAIR(5));
+     } else if (status_message[0]) {
+         mvprintw(term_rows - 1, 0, "%s", status_message);
+     } else {
+         mvprintw(term_rows - 1, 0, "> ");
+     }
+     
+     // Niente clear(): ncurses invia al terminale solo le celle cambiate
+     wnoutrefresh(stdscr);
+     if (left_panel.view.win) wnoutrefresh(left_panel.view.win);
+     if (right_panel.view.win) wnoutrefresh(right_panel.view.win);
+     if (perf.overlay)
+         draw_perf_overlay(1, panel_height);
+     doupdate();
+     
+     clock_gettime(CLOCK_MONOTONIC, &end);
+     frame_stats.last_ms = elapsed_seconds(&start, &end) * 1000;
+     frame_stats.avg_ms = frame_stats.avg_ms ? frame_stats.avg_ms * 0.9 + frame_stats.last_ms * 0.1
+                                             : frame_stats.last_ms;
+     if (frame_stats.last_ms > frame_stats.max_ms)
+         frame_stats.max_ms = frame_stats.last_ms;
+     frame_stats.last_rows = frame_stats.rows;
+     perf_end(PERF_DRAW, &perf_time, frame_stats.rows, 0, NULL);
+ }
+ 
+ // Forza il ridisegno completo dello schermo al prossimo draw_interface(),
+ // dopo che qualcun altro (shell, editor, elenchi a schermo intero) lo ha usato
+ void invalidate_screen() {
+     clearok(curscr, TRUE);
+     left_panel.view.valid = 0;
+     right_panel.view.valid = 0;
+ }
+ 
+ // Restituisce la riga di un'entry. Le righe con i metadati letti restano
+ // in cache finche' la lista non viene riletta o l'entry aggiornata
+ const char *format_row(Panel *panel, FileEntry *file, char *buf, size_t size) {
+     char size_str[20];
+     char date_str[20];
+     char perm_str[11];
+     struct tm tm_info;
+     int len;
+     
+     if (file->row) return file->row;
+     
+     // Prepara stringa dimensione; le directory mostrano il totale se calcolato
+     if (file->is_dir && file->has_dir_size) {
+         size_str[0] = file->has_dir_size == 2 ? '~' : ' ';
+         format_size(file->dir_size, size_str + 1);
+     } else if (file->is_dir) {
+         strcpy(size_str, "<DIR>");
+     } else {
+         format_size(file->size, size_str);
+     }
+     
+     // Prepara stringa data
+     localtime_r(&file->mtime, &tm_info);
+     strftime(date_str, 20, "%Y-%m-%d %H:%M", &tm_info);
+     
+     // Prepara stringa permessi
+     get_file_permissions(file->mode, perm_str);
+     
+     len = snprintf(buf, size, "%-20s %10s %s %s", file->name, size_str, date_str, perm_str);
+     if (len >= (int)size) len = size - 1;
+     
+     if (file->has_meta)
+         file->row = arena_strdup(&panel->rows, buf, len);
+     return file->row ? file->row : buf;
+ }
+ 
+ // Dimensione in forma breve (al massimo 6 caratteri)
+ void format_size(off_t size, char *buf) {
+     if (size < 1024) {
+         sprintf(buf, "%5ldB", (long)size);
+     } else if (size < 1024 * 1024) {
+         sprintf(buf, "%5ldK", (long)(size / 1024));
+     } else if (size < 100000LL * 1024 * 1024) {
+         sprintf(buf, "%5ldM", (long)(size / (1024 * 1024)));
+     } else {
+         sprintf(buf, "%5ldG", (long)(size / (1024 * 1024 * 1024)));
+     }
+ }
+ 
+ // Disegna alla riga line della finestra la riga pos della lista (vuota oltre la fine)
+ void draw_row(Panel *panel, int pos, int line) {
+     WINDOW *win = panel->view.win;
+     int width = panel->view.width;
+     char buf[MAX_PATH_LEN + 64];
+     attr_t attr = panel == active_panel ? A_BOLD : 0;
+     int index, tagged;
+     
+     frame_stats.rows++;
+     if (pos >= visible_count(panel)) {
+         wattron(win, COLOR_PAIR(1) | attr);
+         mvwhline(win, line, 0, ' ', width);
+         wattroff(win, COLOR_PAIR(1) | attr);
+         return;
+     }
+     
+     index = visible_entry(panel, pos);
+     FileEntry *file = &panel->files[index];
+     
+     // Colore in base al tipo di file
+     tagged = is_tagged(panel, file);
+     if (index == panel->selected) {
+         attr |= COLOR_PAIR(6); // File selezionato
+     } else if (tagged) {
+         attr |= COLOR_PAIR(7); // Entry marcata
+     } else if (file->is_dir) {
+         attr |= COLOR_PAIR(3); // Directory
+     } else if (file->mode & S_IXUSR) {
+         attr |= COLOR_PAIR(4); // File eseguibile
+     } else {
+         attr |= COLOR_PAIR(1); // File normale
+     }
+     
+     wattron(win, attr);
+     mvwhline(win, line, 0, ' ', width);
+     // Esito del confronto tra i pannelli nella prima colonna, o la marcatura
+     if (file->compare_mark)
+         mvwaddch(win, line, 0, " +><*?"[file->compare_mark]);
+     else if (tagged)
+         mvwaddch(win, line, 0, '*');
+     // La riga si ferma al bordo: l'altro pannello potrebbe non essere ridisegnato
+     mvwaddnstr(win, line, 1, format_row(panel, file, buf, sizeof(buf)), width - 1);
+     wattroff(win, attr);
+ }
+ 
+ // Disegna un pannello. La lista viene ridisegnata per intero solo se e'
+ // cambiata; altrimenti si ridisegnano le righe della vecchia e della nuova
+ // selezione, e lo scorrimento sposta le righe gia' disegnate
+ void draw_panel(Panel *panel, int x, int y, int width, int height) {
+     PanelView *view = &panel->view;
+     int active = panel == active_panel;
+     int full, i, count, sel_pos, missing = 0;
+     
+     update_filter(panel);
+     count = visible_count(panel);
+     
+     // Se il pannello è attivo, usa un colore diverso
+     if (active) {
+         attron(A_BOLD);
+     }
+     
+     // Disegna intestazione del pannello
+     attron(COLOR_PAIR(1));
+     mvhline(y, x, ' ', width);
+     mvprintw(y, x + 2, "%s", panel->current_path);
+     if (panel->loader)
+         printw("  [caricamento: %d voci]", panel->num_files - 1);
+     if (panel->archive)
+         printw("  [archivio, sola lettura]");
+     if (panel->found)
+         printw("  [trova: %s, %d risultati%s]", panel->found_query, panel->num_files - 1,
+                panel->found_truncated ? ", elenco troncato" : "");
+     if (panel->sort_by != SORT_NAME || panel->sort_order) {
+         static const char *sort_names[] = { "nome", "dimensione", "data", "naturale", "estensione" };
+         printw("  [%s%s]", sort_names[panel->sort_by], panel->sort_order ? ", decrescente" : "");
+     }
+     if (panel->filter_len > 0) {
+         static const char *filter_names[] = { "filtro", "filtro glob", "filtro fuzzy" };
+         printw("  [%s: %s, %d voci]", filter_names[panel->filter_mode], panel->filter, count - 1);
+     }
+     if (tagged_count(panel) > 0) {
+         char size_str[20];
+         const char *size = size_str;
+         
+         format_size(panel->tagged_bytes, size_str);
+         while (*size == ' ') size++;
+         printw("  [%d marcati, %s]", panel->num_tagged, size);
+     }
+     attroff(COLOR_PAIR(1));
+     
+     if (active) {
+         attroff(A_BOLD);
+     }
+     
+     // Durante un aggiornamento la lista puo' essere piu' corta della selezione;
+     // con il filtro la selezione passa alla prima riga visibile che la segue
+     if (panel->selected >= panel->num_files)
+         panel->selected = panel->num_files > 0 ? panel->num_files - 1 : 0;
+     sel_pos = visible_pos(panel, panel->selected);
+     if (sel_pos >= count) sel_pos = count > 0 ? count - 1 : 0;
+     panel->selected = visible_entry(panel, sel_pos);
+     
+     // Regola scroll_pos (una riga della lista, non un indice) se necessario
+     if (panel->scroll_pos > count - 1) panel->scroll_pos = count > 0 ? count - 1 : 0;
+     if (sel_pos < panel->scroll_pos) {
+         panel->scroll_pos = sel_pos;
+     } else if (sel_pos >= panel->scroll_pos + height) {
+         panel->scroll_pos = sel_pos - height + 1;
+     }
+     
+     // In modalita' pigra i metadati si leggono solo per le righe visibili
+     for (i = panel->scroll_pos; i < panel->scroll_pos + height && i < count; i++)
+         missing += !panel->files[visible_entry(panel, i)].has_meta;
+     if (missing > 0) {
+         if (panel->filter_len == 0) {
+             load_metadata(panel, panel->scroll_pos, panel->scroll_pos + height, 0, 0);
+         } else {
+             // Le righe filtrate non sono contigue nella lista
+             for (i = panel->scroll_pos; i < panel->scroll_pos + height && i < count; i++) {
+                 int index = visible_entry(panel, i);
+                 if (!panel->files[index].has_meta)
+                     load_metadata(panel, index, index + 1, 0, 0);
+             }
+         }
+         for (i = panel->scroll_pos; i < panel->scroll_pos + height && i < count; i++)
+             missing -= !panel->files[visible_entry(panel, i)].has_meta;
+         if (missing > 0) {
+             panel->changed = 1;
+             panel->list_version++;
+         }
+     }
+     
+     // La finestra della lista segue le dimensioni del pannello
+     if (!view->win || view->x != x || view->y != y || view->width != width || view->height != height) {
+         if (view->win) delwin(view->win);
+         view->win = height > 0 && width > 0 ? derwin(stdscr, height, width, y + 1, x) : NULL;
+         view->x = x;
+         view->y = y;
+         view->width = width;
+         view->height = height;
+         view->valid = 0;
+         if (!view->win) return;
+     }
+     
+     full = !view->valid || panel->changed || view->active != active;
+     
+     if (!full && panel->scroll_pos != view->scroll_pos) {
+         int delta = panel->scroll_pos - view->scroll_pos;
+         
+         if (abs(delta) >= height) {
+             full = 1;
+         } else {
+             // Sposta le righe gia' disegnate e disegna solo quelle che entrano
+             scrollok(view->win, TRUE);
+             wscrl(view->win, delta);
+             scrollok(view->win, FALSE);
+             if (delta > 0) {
+                 for (i = height - delta; i < height; i++)
+                     draw_row(panel, panel->scroll_pos + i, i);
+             } else {
+                 for (i = 0; i < -delta; i++)
+                     draw_row(panel, panel->scroll_pos + i, i);
+             }
+         }
+     }
+     
+     if (full) {
+         for (i = 0; i < height; i++)
+             draw_row(panel, panel->scroll_pos + i, i);
+     } else if (view->selected != panel->selected) {
+         // Vecchia e nuova selezione, se visibili
+         int old_pos = visible_pos(panel, view->selected);
+         if (old_pos >= panel->scroll_pos && old_pos < panel->scroll_pos + height)
+             draw_row(panel, old_pos, old_pos - panel->scroll_pos);
+         draw_row(panel, sel_pos, sel_pos - panel->scroll_pos);
+     }
+     
+     view->valid = 1;
+     view->scroll_pos = panel->scroll_pos;
+     view->selected = panel->selected;
+     view->active = active;
+     panel->changed = 0;
+ }
+ 
+ // Scrive in perms (almeno 11 caratteri) la stringa dei permessi in formato Unix
+ void get_file_permissions(mode_t mode, char *perms) {
+     perms[0] = (S_ISDIR(mode)) ? 'd' : '-';
+     perms[1] = (mode & S_IRUSR) ? 'r' : '-';
+     perms[2] = (mode & S_IWUSR) ? 'w' : '-';
+     perms[3] = (mode & S_IXUSR) ? 'x' : '-';
+     perms[4] = (mode & S_IRGRP) ? 'r' : '-';
+     perms[5] = (mode & S_IWGRP) ? 'w' : '-';
+     perms[6] = (mode & S_IXGRP) ? 'x' : '-';
+     perms[7] = (mode & S_IROTH) ? 'r' : '-';
+     perms[8] = (mode & S_IWOTH) ? 'w' : '-';
+     perms[9] = (mode & S_IXOTH) ? 'x' : '-';
+     perms[10] = '\0';
+ }
+ 
+ // Cambia directory
+ void change_directory(Panel *panel, const char *path) {
+     char new_path[MAX_PATH_LEN];
+     
+     // Dentro un archivio i percorsi relativi si risolvono nell'indice
+     if (panel->archive && path[0] != '/') {
+         archive_change_directory(panel, path);
+         return;
+     }
+     
+     // Gestione percorsi relativi e assoluti
+     if (path[0] == '/') {
+         strncpy(new_path, path, MAX_PATH_LEN - 1);
+     } else {
+         snprintf(new_path, MAX_PATH_LEN, "%s/%s", panel->current_path, path);
+     }
+     
+     // Normalizza il percorso
+     char *real_path = realpath(new_path, NULL);
+     if (real_path) {
+         // L'elenco lasciato resta in cache per tornarci subito
+         if (strcmp(real_path, panel->current_path) != 0)
+             cache_listing(panel);
+         close_archive(panel);
+         close_found(panel);
+         strcpy(panel->current_path, real_path);
+         free(real_path);
+         reset_panel_view(panel);
+         if (!restore_listing(panel))
+             load_directory(panel);
+     } else {
+         display_error("Directory non accessibile");
+     }
+ }
+ 
+ // Torna all'inizio della lista e toglie il filtro, che vale per la
+ // directory in cui e' stato scritto
+ void reset_panel_view(Panel *panel) {
+     panel->selected = 0;
+     panel->scroll_pos = 0;
+     panel->filter_len = 0;
+     panel->filter[0] = '\0';
+     clear_filter_levels(panel, 0);
+     if (panel == active_panel) input_mode = INPUT_NORMAL;
+ }
+ 
+ // Gestisce l'input utente
+ void handle_input(int ch) {
+     FileEntry *selected_file;
+     Panel *inactive_panel;
+     char full_path[MAX_PATH_LEN];
+     char target_path[MAX_PATH_LEN];
+     
+     // ncurses ha gia' adattato stdscr al nuovo formato del terminale
+     if (ch == KEY_RESIZE) {
+         getmaxyx(stdscr, term_rows, term_cols);
+         invalidate_screen();
+         return;
+     }
+     
+     // Il messaggio precedente resta visibile fino al prossimo tasto
+     status_message[0] = '\0';
+     
+     // Durante la ricerca rapida e la modifica del filtro i tasti vanno al testo
+     update_filter(active_panel);
+     if (input_mode != INPUT_NORMAL && handle_search_key(ch))
+         return;
+     
+     switch(ch) {
+         case KEY_UP:
+             move_selection(active_panel, -1);
+             break;
+             
+         case KEY_DOWN:
+             move_selection(active_panel, 1);
+             break;
+             
+         case KEY_PPAGE:
+             move_selection(active_panel, -(active_panel->view.height > 1 ? active_panel->view.height - 1 : 1));
+             break;
+             
+         case KEY_NPAGE:
+             move_selection(active_panel, active_panel->view.height > 1 ? active_panel->view.height - 1 : 1);
+             break;
+             
+         case KEY_HOME:
+             active_panel->selected = 0;
+             break;
+             
+         case KEY_END:
+             move_selection(active_panel, visible_count(active_panel));
+             break;
+             
+         case 27: // Esc: interrompe il caricamento, tenendo le entry gia' lette, o la verifica
+                  // del contenuto, o toglie il filtro, o torna dai risultati della ricerca
+             if (active_panel->loader)
+                 cancel_directory_load(active_panel);
+             else if (compare_check)
+                 atomic_store(&compare_check->cancel, 1);
+             else if (active_panel->filter_len > 0)
+                 set_filter(active_panel, "", 0);
+             else if (active_panel->found)
+                 change_directory(active_panel, active_panel->current_path);
+             break;
+             
+         case '/': // Ricerca rapida: seleziona la prima entry che inizia con il testo digitato
+             input_mode = INPUT_QUICKSEARCH;
+             search_len = 0;
+             search_text[0] = '\0';
+             break;
+             
+         case 'f': // Filtro: mostra solo le entry che corrispondono al testo digitato
+             input_mode = INPUT_FILTER;
+             break;
+             
+         case KEY_IC: // Insert: marca o smarca l'entry e passa alla successiva
+         case ' ': {
+             int selected = active_panel->selected;
+             
+             selected_file = &active_panel->files[selected];
+             set_tag(active_panel, selected_file, !is_tagged(active_panel, selected_file));
+             move_selection(active_panel, 1);
+             // All'ultima riga la selezione resta ferma: la riga va ridisegnata
+             if (active_panel->selected == selected)
+                 active_panel->changed = 1;
+             break;
+         }
+             
+         case '+': // Marca le entry che corrispondono a un pattern
+         case '-': { // ...o le smarca
+             char pattern[MAX_FILTER_LEN + 1];
+             
+             if (prompt_text(ch == '+' ? "Marca (glob)" : "Smarca (glob)", pattern, sizeof(pattern), 1) > 0)
+                 tag_matching(active_panel, pattern, ch == '+');
+             break;
+         }
+             
+         case '*': // Inverte la marcatura
+             invert_tags(active_panel);
+             break;
+             
+         case 'g': { // Cerca un testo nei file sotto la directory corrente
+             char pattern[MAX_FILTER_LEN + 1];
+             
+             if (active_panel->archive) {
+                 show_message("Ricerca non disponibile negli archivi");
+                 break;
+             }
+             if (prompt_text("Cerca nei file", pattern, sizeof(pattern), 1) <= 0)
+                 break;
+             free_grep(grep_search);
+             grep_search = start_grep(active_panel->current_path, pattern);
+             if (grep_search)
+                 show_grep_results(grep_search);
+             else
+                 display_error("Directory non accessibile");
+             break;
+         }
+             
+         case 'F': { // Cerca per nome nell'indice dei nomi sotto la directory corrente
+             char text[MAX_FILTER_LEN + 1];
+             
+             if (active_panel->archive) {
+                 show_message("Ricerca non disponibile negli archivi");
+                 break;
+             }
+             if (prompt_text("Trova (nome >100k <1g -7d)", text, sizeof(text), 1) > 0)
+                 find_files(active_panel, text);
+             break;
+         }
+             
+         case 'I': { // Ricostruisce da zero l'indice dei nomi della directory corrente
+             char file[MAX_PATH_LEN * 2];
+             
+             if (active_panel->archive || active_panel->found)
+                 break;
+             name_index_file(active_panel->current_path, file, sizeof(file));
+             unlink(file);
+             start_name_index(active_panel->current_path);
+             show_message("Indice dei nomi di %s in costruzione", active_panel->current_path);
+             break;
+         }
+             
+         case 'G': // Riapre i risultati dell'ultima ricerca nei file
+             if (grep_search)
+                 show_grep_results(grep_search);
+             else
+                 show_message("Nessuna ricerca da mostrare");
+             break;
+             
+         case KEY_LEFT:
+         case '\t':
+             // Cambia pannello attivo
+             active_panel = (active_panel == &left_panel) ? &right_panel : &left_panel;
+             break;
+             
+         case '\n': // Enter
+             selected_file = &active_panel->files[active_panel->selected];
+             if (active_panel->found) {
+                 open_found_entry(active_panel, selected_file);
+             } else if (selected_file->is_dir) {
+                 change_directory(active_panel, selected_file->name);
+             } else if (!active_panel->archive && is_archive_name(selected_file->name)) {
+                 // Gli archivi tar si aprono come directory in sola lettura
+                 open_archive(active_panel, selected_file->name);
+             }
+             break;
+             
+         case KEY_F(3): // View; su una directory ne calcola la dimensione
+             selected_file = &active_panel->files[active_panel->selected];
+             snprintf(full_path, MAX_PATH_LEN, "%s/%s", 
+                      active_panel->current_path, selected_file->name);
+             if (active_panel->archive) {
+                 // Nell'archivio le dimensioni vengono dall'indice, i file si estraggono per vederli
+                 if (!selected_file->is_dir)
+                     view_archive_member(active_panel, selected_file);
+                 else if (strcmp(selected_file->name, "..") != 0)
+                     archive_dir_sizes(active_panel, 1);
+             } else if (!selected_file->is_dir)
+                 view_file(full_path);
+             else if (strcmp(selected_file->name, "..") != 0)
+                 enqueue_job(JOB_SIZE, full_path, NULL);
+             break;
+             
+         case 'S': // Calcola la dimensione di tutte le directory del pannello
+             if (active_panel->archive) {
+                 archive_dir_sizes(active_panel, 0);
+                 if (active_panel->sort_by == SORT_SIZE)
+                     resort_panel(active_panel);
+                 break;
+             }
+             enqueue_job(JOB_SIZE_ALL, active_panel->current_path, NULL);
+             break;
+             
+         case 'C': // Confronta i pannelli per nome, dimensione e data
+             compare_panels(0);
+             break;
+             
+         case 'V': // Confronta i pannelli verificando anche il contenuto dei file
+             if (left_panel.archive || right_panel.archive) {
+                 show_message("Verifica del contenuto non disponibile negli archivi");
+                 break;
+             }
+             compare_panels(1);
+             break;
+             
+         case 'y': // Copia nel pannello inattivo le differenze trovate dal confronto
+             sync_panels();
+             break;
+             
+         case 'i': // Statistiche della cache degli elenchi delle directory
+             show_message("Cache elenchi: %d directory, %.1f MB di %zu MB, %ld riusi, %ld letture",
+                          listing_cache_count, listing_cache_memory / (1024.0 * 1024),
+                          config.listing_cache / (1024 * 1024), listing_cache_hits, listing_cache_misses);
+             break;
+             
+         case 'P': // Riquadro delle statistiche di prestazione; la raccolta parte alla prima apertura
+             atomic_store(&perf.enabled, 1);
+             perf.overlay = !perf.overlay;
+             if (!perf.overlay) {
+                 delwin(perf.win);
+                 perf.win = NULL;
+                 invalidate_screen();
+             }
+             break;
+             
+         case 'a': // Dimensione delle directory: apparente o occupata su disco
+             config.allocated_size = !config.allocated_size;
+             update_dir_sizes(1);
+             show_message(config.allocated_size ? "Directory: spazio occupato su disco"
+                                                : "Directory: dimensione apparente");
+             break;
+             
+         case KEY_F(4): // Edit
+             selected_file = &active_panel->files[active_panel->selected];
+             if (archive_readonly(active_panel))
+                 break;
+             if (!selected_file->is_dir) {
+                 snprintf(full_path, MAX_PATH_LEN, "%s/%s", 
+                          active_panel->current_path, selected_file->name);
+                 edit_file(full_path);
+             }
+             break;
+             
+         case KEY_F(5): // Copy
+             selected_file = &active_panel->files[active_panel->selected];
+             inactive_panel = (active_panel == &left_panel) ? &right_panel : &left_panel;
+             
+             snprintf(full_path, MAX_PATH_LEN, "%s/%s", 
+                      active_panel->current_path, selected_file->name);
+             snprintf(target_path, MAX_PATH_LEN, "%s/%s", 
+                      inactive_panel->current_path, selected_file->name);
+             
+             if (archive_readonly(inactive_panel) || found_readonly(active_panel) || found_readonly(inactive_panel))
+                 break;
+             // Le entry marcate si copiano con un'unica operazione
+             if (tagged_count(active_panel) > 0) {
+                 enqueue_tagged(active_panel, copy_job_type(active_panel), inactive_panel->current_path);
+                 break;
+             }
+             // Non copiare ".."
+             if (strcmp(selected_file->name, "..") == 0)
+                 break;
+             // Da un archivio si estrae solo il membro selezionato
+             enqueue_job(copy_job_type(active_panel), full_path, target_path);
+             break;
+             
+         case KEY_F(6): // Move
+             selected_file = &active_panel->files[active_panel->selected];
+             inactive_panel = (active_panel == &left_panel) ? &right_panel : &left_panel;
+             
+             snprintf(full_path, MAX_PATH_LEN, "%s/%s", 
+                      active_panel->current_path, selected_file->name);
+             snprintf(target_path, MAX_PATH_LEN, "%s/%s", 
+                      inactive_panel->current_path, selected_file->name);
+             
+             if (archive_readonly(active_panel) || archive_readonly(inactive_panel) ||
+                 found_readonly(active_panel) || found_readonly(inactive_panel))
+                 break;
+             if (tagged_count(active_panel) > 0) {
+                 enqueue_tagged(active_panel, JOB_MOVE, inactive_panel->current_path);
+                 break;
+             }
+             if (strcmp(selected_file->name, "..") == 0)
+                 break;
+             enqueue_job(JOB_MOVE, full_path, target_path);
+             break;
+             
+         case KEY_F(8): // Delete
+             selected_file = &active_panel->files[active_panel->selected];
+             
+             if (archive_readonly(active_panel) || found_readonly(active_panel))
+                 break;
+             if (tagged_count(active_panel) > 0) {
+                 if (confirm("Eliminare %d elementi marcati (le directory con tutto il contenuto)?",
+                             active_panel->num_tagged))
+                     enqueue_tagged(active_panel, JOB_DELETE, NULL);
+                 break;
+             }
+             // Non eliminiamo ".."
+             if (strcmp(selected_file->name, "..") == 0)
+                 break;
+                 
+             snprintf(full_path, MAX_PATH_LEN, "%s/%s", 
+                      active_panel->current_path, selected_file->name);
+             
+             // Una directory viene eliminata con tutto il contenuto
+             if ((selected_file->is_dir || selected_file->d_type == DT_DIR) &&
+                 !confirm("Eliminare la directory %s e tutto il suo contenuto?", selected_file->name))
+                 break;
+             enqueue_job(JOB_DELETE, full_path, NULL);
+             break;
+             
+         case KEY_F(9): // Shell
+             open_shell();
+             break;
+             
+         case KEY_F(7): // Mkdir
+             // TODO: implementare creazione directory
+             break;
+             
+         case KEY_F(1): // Help
+             // TODO: mostra aiuto
+             break;
+             
+         case KEY_F(2): // Menu
+             // TODO: mostra menu
+             break;
+             
+         case 's': // Cambia ordinamento (nome, dimensione, data, naturale, estensione)
+             active_panel->sort_by = (active_panel->sort_by + 1) % SORT_MODES;
+             resort_panel(active_panel);
+             break;
+             
+         case 'j': // Seleziona l'operazione successiva nell'area di stato
+             pthread_mutex_lock(&jobs_lock);
+             {
+                 Job *job = find_selected_job();
+                 job = job && job->next ? job->next : jobs;
+                 selected_job = job ? job->id : 0;
+             }
+             pthread_mutex_unlock(&jobs_lock);
+             break;
+             
+         case 'p': // Sospende o riprende l'operazione selezionata
+             pthread_mutex_lock(&jobs_lock);
+             {
+                 Job *job = find_selected_job();
+                 if (job && job->state < JOB_DONE)
+                     atomic_store(&job->control.paused, !atomic_load(&job->control.paused));
+             }
+             pthread_mutex_unlock(&jobs_lock);
+             break;
+             
+         case 'c': // Annulla l'operazione selezionata
+             pthread_mutex_lock(&jobs_lock);
+             {
+                 Job *job = find_selected_job();
+                 if (job && job->state < JOB_DONE)
+                     atomic_store(&job->control.cancel, 1);
+                 // Un'operazione ancora in coda si chiude subito
+                 if (job && job->state == JOB_QUEUED) {
+                     job->state = JOB_CANCELLED;
+                     clock_gettime(CLOCK_MONOTONIC, &job->finished);
+                 }
+             }
+             pthread_mutex_unlock(&jobs_lock);
+             break;
+             
+         case 'k': // Proseguire o fermarsi al primo errore nelle operazioni ricorsive
+             config.keep_going = !config.keep_going;
+             show_message(config.keep_going ? "Le operazioni ricorsive proseguono dopo un errore"
+                                            : "Le operazioni ricorsive si fermano al primo errore");
+             break;
+             
+         case 'e': // Elenco degli errori dell'ultima operazione ricorsiva
+             if (error_report_count > 0)
+                 show_error_list();
+             else
+                 show_message("Nessun errore da mostrare");
+             break;
+             
+         case 'r': // Inverte ordine
+             active_panel->sort_order = !active_panel->sort_order;
+             resort_panel(active_panel);
+             break;
+         
+         case 'q':
+         case 'Q':  
+         case KEY_F(10):  // F10
+             cleanup();
+             free_panels();
+             perf_close();
+             exit(0);
+             break;
+     }
+ }
+ 
+ // Visualizza un file con il visualizzatore interno o, se configurato (o se
+ // il file non si puo' mappare in memoria), con il visualizzatore esterno
+ void view_file(const char *path) {
+     char *viewer;
+     
+     if (!config.external_viewer && run_viewer(path, 0))
+         return;
+     
+     // Ottieni il visualizzatore dalla variabile d'ambiente o usa 'less' di default
+     viewer = getenv("PAGER");
+     if (!viewer) viewer = "less";
+     run_external(viewer, path);
+ }
+ 
+ // Modifica un file usando l'editor configurato
+ void edit_file(const char *path) {
+     // Ottieni l'editor dalla variabile d'ambiente o usa 'vi' di default
+     char *editor = getenv("EDITOR");
+     if (!editor) editor = "vi";
+     
+     run_external(editor, path);
+ }
+ 
+ // Esegue command (che puo' contenere opzioni, es. "less -R") sul file path.
+ // Il percorso arriva alla shell come argomento separato ("$1"): apici,
+ // spazi e altri caratteri speciali nel nome non vengono interpretati
+ int run_external(const char *command, const char *path) {
+     char script[MAX_COMMAND_LEN];
+     struct sigaction ignore, old_int, old_quit;
+     int status = -1;
+     pid_t pid;
+     
+     snprintf(script, sizeof(script), "%s \"$1\"", command);
+     
+     // Salva lo stato del terminale e ripristina modalità canonica
+     def_prog_mode();
+     endwin();
+     
+     // Come system(): Ctrl-C e Ctrl-\ vanno solo al programma eseguito
+     memset(&ignore, 0, sizeof(ignore));
+     ignore.sa_handler = SIG_IGN;
+     sigemptyset(&ignore.sa_mask);
+     sigaction(SIGINT, &ignore, &old_int);
+     sigaction(SIGQUIT, &ignore, &old_quit);
+     
+     pid = fork();
+     if (pid == 0) {
+         sigaction(SIGINT, &old_int, NULL);
+         sigaction(SIGQUIT, &old_quit, NULL);
+         execl("/bin/sh", "sh", "-c", script, "sh", path, (char *)NULL);
+         _exit(127);
+     }
+     if (pid > 0) {
+         while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+             ;
+     }
+     
+     sigaction(SIGINT, &old_int, NULL);
+     sigaction(SIGQUIT, &old_quit, NULL);
+     
+     // Ripristina lo stato del terminale
+     reset_prog_mode();
+     invalidate_screen();
+     return status;
+ }
+ 
+ // Gestore di SIGBUS durante la visualizzazione: un file accorciato da un
+ // altro processo fa fallire l'accesso alle pagine oltre la nuova fine
+ void view_fault_handler(int sig) {
+     if (view_fault_jmp)
+         siglongjmp(*view_fault_jmp, 1);
+     signal(sig, SIG_DFL);
+     raise(sig);
+ }
+ 
+ // Inizio della riga che segue quella che inizia a start. Una riga finisce
+ // dopo '\n' o dopo VIEW_ROW_MAX byte, cosi' nessuna scansione di riga e'
+ // illimitata (file binari, righe enormi)
+ size_t view_next_row(const char *data, size_t start, size_t end) {
+     size_t len = end - start > VIEW_ROW_MAX ? VIEW_ROW_MAX + 1 : end - start;
+     const char *nl = memchr(data + start, '\n', len);
+     
+     if (nl) return nl - data + 1;
+     return end - start > VIEW_ROW_MAX ? start + VIEW_ROW_MAX : end;
+ }
+ 
+ // Avanza di *count righe da start (che deve essere l'inizio di una riga).
+ // Restituisce l'inizio della riga raggiunta e lascia in *count le righe
+ // mancanti se si arriva a end. Con SSE2 i '\n' si contano 16 byte alla
+ // volta; si procede riga per riga solo vicino alla destinazione o quando
+ // una riga potrebbe superare VIEW_ROW_MAX
+ size_t view_skip_rows(const char *data, size_t start, size_t end, long *count) {
+     while (*count > 0 && start < end) {
+ #ifdef __SSE2__
+         const __m128i newline = _mm_set1_epi8('\n');
+         size_t p = start;
+         
+         while (p + 16 <= end) {
+             unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + p)), newline));
+             int found = __builtin_popcount(mask);
+             
+             if (found >= *count) break;
+             // Un'interruzione forzata prima del primo '\n' del blocco va gestita riga per riga
+             if (p + 16 - start > VIEW_ROW_MAX && (!mask || p + __builtin_ctz(mask) - start > VIEW_ROW_MAX))
+                 break;
+             if (mask) {
+                 *count -= found;
+                 start = p + 32 - __builtin_clz(mask); // Dopo l'ultimo '\n' del blocco
+             }
+             p += 16;
+         }
+         if (*count == 0) break;
+ #endif
+         start = view_next_row(data, start, end);
+         (*count)--;
+     }
+     return start;
+ }
+ 
+ // Inizio della riga numero k * VIEW_INDEX_STEP
+ size_t index_sample(LineIndex *index, long k) {
+     return index->blocks[k / VIEW_BLOCK_SAMPLES][k % VIEW_BLOCK_SAMPLES];
+ }
+ 
+ // Aggiunge all'indice il campione k. Restituisce 0 se l'indice e' pieno
+ int index_add_sample(LineIndex *index, long k, size_t offset) {
+     long block = k / VIEW_BLOCK_SAMPLES;
+     
+     if (block >= VIEW_INDEX_BLOCKS) {
+         atomic_store(&index->full, 1);
+         return 0;
+     }
+     if (!index->blocks[block]) {
+         index->blocks[block] = malloc(VIEW_BLOCK_SAMPLES * sizeof(uint64_t));
+         if (!index->blocks[block]) {
+             atomic_store(&index->full, 1);
+             return 0;
+         }
+     }
+     index->blocks[block][k % VIEW_BLOCK_SAMPLES] = offset;
+     atomic_store(&index->num_samples, k + 1); // Pubblica il campione al thread principale
+     return 1;
+ }
+ 
+ // Indicizza le righe da dove si era fermato il thread precedente fino a index_end
+ void index_rows(Viewer *viewer) {
+     LineIndex *index = viewer->index;
+     long k = atomic_load(&index->num_samples);
+     // Si riparte dall'ultimo campione: le righe successive possono essere
+     // cambiate se il file e' cresciuto a meta' di una riga
+     size_t start = k > 0 ? index_sample(index, k - 1) : 0;
+     long rows = k > 0 ? (k - 1) * VIEW_INDEX_STEP : 0;
+     size_t end = viewer->index_end;
+     size_t released = start - start % VIEW_NOCACHE_CHUNK;
+     int nocache = end >= COPY_NOCACHE_MIN;
+     
+     if (k > 0) k--;
+     while (start < end && !atomic_load(&index->cancel)) {
+         long wanted, left;
+         
+         if (rows % VIEW_INDEX_STEP == 0) {
+             if (!index_add_sample(index, k, start)) break;
+             k++;
+         }
+         wanted = left = VIEW_INDEX_STEP - rows % VIEW_INDEX_STEP;
+         start = view_skip_rows(viewer->data, start, end, &left);
+         rows += wanted - left;
+         atomic_store(&index->indexed, start);
+         
+         // Come per le copie, i file enormi non restano in cache dopo la scansione
+         if (nocache && start - released >= VIEW_NOCACHE_CHUNK) {
+             madvise((void *)(viewer->data + released), VIEW_NOCACHE_CHUNK, MADV_DONTNEED);
+ #ifdef POSIX_FADV_DONTNEED
+             posix_fadvise(viewer->fd, released, VIEW_NOCACHE_CHUNK, POSIX_FADV_DONTNEED);
+ #endif
+             released += VIEW_NOCACHE_CHUNK;
+         }
+     }
+     if (start >= end)
+         atomic_store(&index->total_rows, rows);
+ }
+ 
+ // Thread di indicizzazione
+ void *index_thread(void *data) {
+     Viewer *viewer = data;
+     sigjmp_buf jmp;
+     
+     if (sigsetjmp(jmp, 1) == 0) {
+         view_fault_jmp = &jmp;
+         index_rows(viewer);
+     }
+     view_fault_jmp = NULL;
+     atomic_store(&viewer->index->done, 1);
+     return NULL;
+ }
+ 
+ // Avvia l'indicizzazione della parte del file non ancora esaminata, se
+ // il thread precedente ha finito
+ void start_indexer(Viewer *viewer) {
+     LineIndex *index = viewer->index;
+     
+     if (viewer->index_running) {
+         if (!atomic_load(&index->done)) return;
+         pthread_join(viewer->index_thread, NULL);
+         viewer->index_running = 0;
+     }
+     if (viewer->size == 0 || atomic_load(&index->full) ||
+         ((size_t)atomic_load(&index->indexed) >= viewer->size && atomic_load(&index->total_rows) >= 0))
+         return;
+     
+     viewer->index_end = viewer->size;
+     atomic_store(&index->done, 0);
+     atomic_store(&index->cancel, 0);
+     atomic_store(&index->total_rows, -1);
+     if (pthread_create(&viewer->index_thread, NULL, index_thread, viewer) == 0)
+         viewer->index_running = 1;
+ }
+ 
+ // Ferma l'indicizzazione in corso
+ void stop_indexer(Viewer *viewer) {
+     if (!viewer->index_running) return;
+     atomic_store(&viewer->index->cancel, 1);
+     pthread_join(viewer->index_thread, NULL);
+     viewer->index_running = 0;
+ }
+ 
+ // Svuota l'indice (file accorciato o sostituito)
+ void reset_index(LineIndex *index) {
+     int i;
+     
+     for (i = 0; i < VIEW_INDEX_BLOCKS && index->blocks[i]; i++) {
+         free(index->blocks[i]);
+         index->blocks[i] = NULL;
+     }
+     atomic_store(&index->num_samples, 0);
+     atomic_store(&index->indexed, 0);
+     atomic_store(&index->full, 0);
+     atomic_store(&index->total_rows, -1);
+ }
+ 
+ // Mappa il file in memoria per la dimensione corrente, piu' un margine in
+ // cui il file puo' crescere senza rifare la mappatura (solo a 64 bit).
+ // L'indicizzazione deve essere ferma
+ int viewer_map(Viewer *viewer) {
+     struct stat st;
+     size_t len;
+     void *data;
+     
+     if (fstat(viewer->fd, &st) != 0 || !S_ISREG(st.st_mode))
+         return 0;
+     len = st.st_size + (sizeof(void *) >= 8 ? VIEW_MAP_RESERVE : 0);
+     len += -len % sysconf(_SC_PAGESIZE);
+     if (len == 0) len = sysconf(_SC_PAGESIZE);
+     data = mmap(NULL, len, PROT_READ, MAP_SHARED, viewer->fd, 0);
+     if (data == MAP_FAILED)
+         return 0;
+     if (viewer->data)
+         munmap((void *)viewer->data, viewer->map_len);
+     viewer->data = data;
+     viewer->map_len = len;
+     viewer->size = st.st_size;
+     return 1;
+ }
+ 
+ // Controlla se il file e' cresciuto o e' stato accorciato. Restituisce 1
+ // se la dimensione e' cambiata
+ int viewer_check_size(Viewer *viewer) {
+     struct stat st;
+     
+     if (fstat(viewer->fd, &st) != 0 || (size_t)st.st_size == viewer->size)
+         return 0;
+     
+     if ((size_t)st.st_size < viewer->size || (size_t)st.st_size > viewer->map_len) {
+         // Accorciato (si ricomincia da capo) o oltre il margine mappato
+         stop_indexer(viewer);
+         if ((size_t)st.st_size < viewer->size) {
+             reset_index(viewer->index);
+             viewer->top = 0;
+         }
+         if (!viewer_map(viewer)) {
+             viewer->size = 0;
+             return 1;
+         }
+     }
+     viewer->size = st.st_size;
+     if (viewer->top > viewer->size) viewer->top = 0;
+     start_indexer(viewer);
+     return 1;
+ }
+ 
+ // Inizio della riga che contiene offset. Se l'indice copre quella zona si
+ // parte dal campione precedente e *row riceve il numero di riga; altrimenti
+ // si cerca all'indietro il '\n' precedente (al massimo VIEW_BACK_LIMIT byte)
+ // e *row vale -1
+ size_t view_row_start(Viewer *viewer, size_t offset, long *row) {
+     LineIndex *index = viewer->index;
+     long count = atomic_load(&index->num_samples);
+     size_t start, next;
+     long n = 0;
+     
+     if (row) *row = -1;
+     if (viewer->size == 0) return 0;
+     if (offset >= viewer->size) offset = viewer->size - 1;
+     
+     if (count > 0 && (size_t)atomic_load(&index->indexed) > offset) {
+         long low = 0, high = count - 1;
+         
+         // Ultimo campione che non supera offset
+         while (low < high) {
+             long mid = (low + high + 1) / 2;
+             if (index_sample(index, mid) <= offset) low = mid;
+             else high = mid - 1;
+         }
+         start = index_sample(index, low);
+         n = low * VIEW_INDEX_STEP;
+         while ((next = view_next_row(viewer->data, start, viewer->size)) <= offset) {
+             start = next;
+             n++;
+         }
+         if (row) *row = n;
+         return start;
+     }
+     
+     start = offset;
+     while (start > 0 && offset - start < VIEW_BACK_LIMIT && viewer->data[start - 1] != '\n')
+         start--;
+     while ((next = view_next_row(viewer->data, start, viewer->size)) <= offset)
+         start = next;
+     return start;
+ }
+ 
+ // Inizio della riga numero row, se l'indice l'ha gia' raggiunta; altrimenti
+ // dell'ultima riga indicizzata
+ size_t view_goto_row(Viewer *viewer, long row) {
+     LineIndex *index = viewer->index;
+     long count = atomic_load(&index->num_samples);
+     long k = row / VIEW_INDEX_STEP, left;
+     size_t start;
+     
+     if (count == 0) return 0;
+     if (k >= count) {
+         k = count - 1;
+         row = k * VIEW_INDEX_STEP;
+     }
+     start = index_sample(index, k);
+     left = row - k * VIEW_INDEX_STEP;
+     start = view_skip_rows(viewer->data, start, viewer->size, &left);
+     // Oltre la fine si resta sull'ultima riga
+     if (start >= viewer->size && viewer->size > 0)
+         start = view_row_start(viewer, viewer->size - 1, NULL);
+     return start;
+ }
+ 
+ // Prima riga da mostrare perche' le ultime height righe riempiano lo schermo
+ size_t view_last_page(Viewer *viewer, int height) {
+     size_t top;
+     int i;
+     
+     if (viewer->size == 0) return 0;
+     if (viewer->hex) {
+         size_t last = (viewer->size - 1) & ~(size_t)15;
+         return last > (size_t)(height - 1) * 16 ? last - (size_t)(height - 1) * 16 : 0;
+     }
+     top = view_row_start(viewer, viewer->size - 1, NULL);
+     for (i = 1; i < height && top > 0; i++)
+         top = view_row_start(viewer, top - 1, NULL);
+     return top;
+ }
+ 
+ // Sposta la prima riga mostrata di delta righe
+ void view_scroll(Viewer *viewer, long delta, int height) {
+     if (viewer->hex) {
+         size_t last = view_last_page(viewer, height);
+         long long top = (long long)viewer->top + delta * 16;
+         viewer->top = top < 0 ? 0 : (size_t)top > last ? last : (size_t)top;
+         return;
+     }
+     if (delta > 0) {
+         long rest = height;
+         
+         viewer->top = view_skip_rows(viewer->data, viewer->top, viewer->size, &delta);
+         // Non si scorre oltre l'ultima pagina piena
+         view_skip_rows(viewer->data, viewer->top, viewer->size, &rest);
+         if (rest > 0) viewer->top = view_last_page(viewer, height);
+     } else {
+         for (; delta < 0 && viewer->top > 0; delta++)
+             viewer->top = view_row_start(viewer, viewer->top - 1, NULL);
+     }
+ }
+ 
+ // Disegna la riga di testo che va da start a end con lo scorrimento orizzontale
+ void draw_view_text(Viewer *viewer, int line, size_t start, size_t end) {
+     char buf[MAX_PATH_LEN];
+     int col = 0, out = 0;
+     size_t i;
+     
+     if (end > start && viewer->data[end - 1] == '\n') end--;
+     for (i = start; i < end && out < term_cols && out < (int)sizeof(buf) - 8; i++) {
+         unsigned char c = viewer->data[i];
+         int spaces = c == '\t' ? 8 - col % 8 : 1;
+         
+         while (spaces-- > 0) {
+             if (col >= viewer->hscroll && out < term_cols)
+                 buf[out++] = c == '\t' ? ' ' : (c < 32 || c == 127) ? '.' : c;
+             col++;
+         }
+     }
+     mvaddnstr(line, 0, buf, out);
+ }
+ 
+ // Disegna la riga esadecimale dei 16 byte da start
+ void draw_view_hex(Viewer *viewer, int line, size_t start) {
+     char buf[128];
+     size_t end = start + 16 < viewer->size ? start + 16 : viewer->size;
+     int len = snprintf(buf, sizeof(buf), "%010llx ", (unsigned long long)start);
+     size_t i;
+     
+     for (i = start; i < start + 16; i++) {
+         if (i < end)
+             len += snprintf(buf + len, sizeof(buf) - len, "%s%02x", i % 8 == 0 ? "  " : " ",
+                             (unsigned char)viewer->data[i]);
+         else
+             len += snprintf(buf + len, sizeof(buf) - len, "%s  ", i % 8 == 0 ? "  " : " ");
+     }
+     len += snprintf(buf + len, sizeof(buf) - len, "  ");
+     for (i = start; i < end; i++) {
+         unsigned char c = viewer->data[i];
+         buf[len++] = c < 32 || c >= 127 ? '.' : c;
+     }
+     mvaddnstr(line, 0, buf, len < term_cols ? len : term_cols);
+ }
+ 
+ // Disegna il visualizzatore
+ void draw_viewer(Viewer *viewer) {
+     LineIndex *index = viewer->index;
+     int height = term_rows - 2;
+     size_t pos = viewer->top;
+     long row = -1, total = atomic_load(&index->total_rows);
+     char info[MAX_COMMAND_LEN];
+     int i, len;
+     
+     erase();
+     
+     for (i = 0; i < height && pos < viewer->size; i++) {
+         if (viewer->hex) {
+             draw_view_hex(viewer, i + 1, pos);
+             pos += 16;
+         } else {
+             size_t next = view_next_row(viewer->data, pos, viewer->size);
+             draw_view_text(viewer, i + 1, pos, next);
+             pos = next;
+         }
+     }
+     
+     // Intestazione: posizione nel file e stato dell'indice
+     if (!viewer->hex && viewer->size > 0)
+         view_row_start(viewer, viewer->top, &row);
+     len = 0;
+     if (viewer->hex)
+         len += snprintf(info + len, sizeof(info) - len, "offset %llu", (unsigned long long)viewer->top);
+     else if (row >= 0)
+         len += snprintf(info + len, sizeof(info) - len, "riga %ld", row + 1);
+     else
+         len += snprintf(info + len, sizeof(info) - len, "riga ?");
+     if (!viewer->hex && total >= 0)
+         len += snprintf(info + len, sizeof(info) - len, "/%ld", total);
+     len += snprintf(info + len, sizeof(info) - len, "  %d%%",
+                     viewer->size ? (int)(viewer->top * 100 / viewer->size) : 100);
+     if (total < 0 && viewer->size > 0)
+         len += snprintf(info + len, sizeof(info) - len, "  [indice %d%%]",
+                         (int)(atomic_load(&index->indexed) * 100 / viewer->size));
+     if (viewer->hex) len += snprintf(info + len, sizeof(info) - len, "  [hex]");
+     if (viewer->follow) snprintf(info + len, sizeof(info) - len, "  [segui]");
+     
+     attron(COLOR_PAIR(2));
+     mvhline(0, 0, ' ', term_cols);
+     mvprintw(0, 1, "%.*s", term_cols - 2, viewer->path);
+     len = strlen(info);
+     mvprintw(0, term_cols - len - 1 > 0 ? term_cols - len - 1 : 0, "%s", info);
+     mvhline(term_rows - 1, 0, ' ', term_cols);
+     if (status_message[0])
+         mvprintw(term_rows - 1, 1, "%s", status_message);
+     else
+         mvprintw(term_rows - 1, 1, "Frecce/PgSu/PgGiu/Home/Fine: scorri  g: riga  %%: percentuale  h: hex  f: segui  p: pager  q: esci");
+     attroff(COLOR_PAIR(2));
+     refresh();
+ }
+ 
+ // Chiede un testo nella linea di comando. Restituisce la lunghezza del
+ // testo, o -1 se l'utente annulla con Esc. Con draw_panels i pannelli sotto
+ // restano aggiornati; senza (dal visualizzatore) si ridisegna solo la riga
+ int prompt_text(const char *label, char *buf, size_t size, int draw_panels) {
+     int len = 0, ch;
+     
+     curs_set(1);
+     while (1) {
+         mvhline(term_rows - 1, 0, ' ', term_cols);
+         mvprintw(term_rows - 1, 0, "%s: %.*s", label, len, buf);
+         refresh();
+         if ((ch = modal_getch(draw_panels, -1)) == ERR)
+             continue;
+         if (ch >= 32 && ch < 256 && ch != 127 && len < (int)size - 1) {
+             buf[len++] = ch;
+         } else if ((ch == KEY_BACKSPACE || ch == 127 || ch == 8) && len > 0) {
+             len--;
+         } else if (ch == '\n') {
+             break;
+         } else if (ch == 27) {
+             len = -1;
+             break;
+         }
+     }
+     curs_set(0);
+     buf[len > 0 ? len : 0] = '\0';
+     return len;
+ }
+ 
+ // Chiede un numero nella linea di comando; -1 se annullato o non valido
+ long prompt_number(const char *label) {
+     char buf[20], *end;
+     long value;
+     
+     if (prompt_text(label, buf, sizeof(buf), 0) <= 0)
+         return -1;
+     value = strtol(buf, &end, 10);
+     return *end || value < 0 ? -1 : value;
+ }
+ 
+ // Visualizzatore interno: il file e' mappato in memoria e la prima pagina
+ // appare subito, mentre un thread costruisce l'indice delle righe per i
+ // salti a una riga qualsiasi. La prima riga mostrata e' quella che contiene
+ // offset. Restituisce 0 se il file non si puo' mappare
+ int run_viewer(const char *path, size_t offset) {
+     // In memoria dinamica: lo stato deve restare valido dopo un siglongjmp
+     Viewer *viewer = calloc(1, sizeof(Viewer));
+     struct sigaction action, old_bus;
+     sigjmp_buf jmp;
+     volatile int running = 1;
+     
+     if (!viewer) return 0;
+     viewer->path = path;
+     viewer->fd = open(path, O_RDONLY | O_CLOEXEC);
+     if (viewer->fd < 0) {
+         free(viewer);
+         display_error(strerror(errno));
+         return 1;
+     }
+     viewer->index = calloc(1, sizeof(LineIndex));
+     if (!viewer->index || !viewer_map(viewer)) {
+         free(viewer->index);
+         close(viewer->fd);
+         free(viewer);
+         return 0;
+     }
+     atomic_store(&viewer->index->total_rows, -1);
+     
+     memset(&action, 0, sizeof(action));
+     action.sa_handler = view_fault_handler;
+     sigemptyset(&action.sa_mask);
+     sigaction(SIGBUS, &action, &old_bus);
+     
+     if (offset > 0)
+         viewer->top = view_row_start(viewer, offset, NULL);
+     start_indexer(viewer);
+     status_message[0] = '\0';
+     
+     while (running) {
+         // Un accesso oltre la fine di un file accorciato riporta qui
+         if (sigsetjmp(jmp, 1) != 0) {
+             view_fault_jmp = NULL;
+             viewer_check_size(viewer);
+             continue;
+         }
+         view_fault_jmp = &jmp;
+         
+         int height = term_rows - 2;
+         int at_end = viewer->follow && viewer->top >= view_last_page(viewer, height);
+         
+         // Con il file che cresce si resta in fondo
+         if (viewer_check_size(viewer) && at_end)
+             viewer->top = view_last_page(viewer, height);
+         start_indexer(viewer);
+         
+         draw_viewer(viewer);
+         
+         // Senza indicizzazione ne' modalita' segui l'attesa e' quella del
+         // lavoro in background, che intanto prosegue
+         int ch = modal_getch(0, viewer->follow ? VIEW_FOLLOW_MS : viewer->index_running ? UI_TICK_MS : -1);
+         if (ch != ERR) status_message[0] = '\0';
+         
+         switch (ch) {
+             case KEY_UP: view_scroll(viewer, -1, height); break;
+             case KEY_DOWN: view_scroll(viewer, 1, height); break;
+             case KEY_PPAGE: view_scroll(viewer, -(height - 1), height); break;
+             case KEY_NPAGE: case ' ': view_scroll(viewer, height - 1, height); break;
+             case KEY_HOME: viewer->top = 0; break;
+             case KEY_END: viewer->top = view_last_page(viewer, height); break;
+             case KEY_LEFT: viewer->hscroll = viewer->hscroll > 8 ? viewer->hscroll - 8 : 0; break;
+             case KEY_RIGHT: viewer->hscroll += 8; break;
+             
+             case 'g': { // Vai a riga
+                 long row = prompt_number("Riga");
+                 if (row > 0 && !viewer->hex) {
+                     viewer->top = view_goto_row(viewer, row - 1);
+                     if (atomic_load(&viewer->index->total_rows) < 0 &&
+                         (row - 1) / VIEW_INDEX_STEP >= atomic_load(&viewer->index->num_samples))
+                         show_message("Indice ancora incompleto: mostrata l'ultima riga indicizzata");
+                 }
+                 break;
+             }
+             
+             case '%': { // Vai a una percentuale del file
+                 long percent = prompt_number("Percentuale");
+                 if (percent >= 0 && viewer->size > 0) {
+                     size_t offset = percent >= 100 ? viewer->size - 1 : viewer->size / 100 * percent;
+                     viewer->top = viewer->hex ? offset & ~(size_t)15 : view_row_start(viewer, offset, NULL);
+                 }
+                 break;
+             }
+             
+             case 'h': // Esadecimale
+                 viewer->hex = !viewer->hex;
+                 viewer->top = viewer->hex ? viewer->top & ~(size_t)15 : view_row_start(viewer, viewer->top, NULL);
+                 break;
+                 
+             case 'f': // Segue la crescita del file, come tail -f
+                 viewer->follow = !viewer->follow;
+                 if (viewer->follow) viewer->top = view_last_page(viewer, height);
+                 break;
+                 
+             case 'p': { // Visualizzatore esterno
+                 char *pager = getenv("PAGER");
+                 view_fault_jmp = NULL;
+                 run_external(pager ? pager : "less", path);
+                 break;
+             }
+             
+             case 'q':
+             case 'Q':
+             case 27:
+             case KEY_F(3):
+             case KEY_F(10):
+                 running = 0;
+                 break;
+         }
+     }
+     view_fault_jmp = NULL;
+     
+     stop_indexer(viewer);
+     sigaction(SIGBUS, &old_bus, NULL);
+     reset_index(viewer->index);
+     free(viewer->index);
+     munmap((void *)viewer->data, viewer->map_len);
+     close(viewer->fd);
+     free(viewer);
+     invalidate_screen();
+     return 1;
+ }
+ 
+ // Numero di '\n' nei len byte da p, contati 16 byte alla volta con SSE2
+ size_t count_newlines(const char *p, size_t len) {
+     size_t count = 0, i = 0;
+     
+ #ifdef __SSE2__
+     const __m128i newline = _mm_set1_epi8('\n');
+     for (; i + 16 <= len; i += 16)
+         count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), newline)));
+ #endif
+     for (; i < len; i++)
+         count += p[i] == '\n';
+     return count;
+ }
+ 
+ // Prima occorrenza di needle (lungo len >= 1) nei size byte da p, o NULL.
+ // Con fold il confronto ignora le maiuscole ASCII e needle e' gia' in
+ // minuscolo. Come contains_folded, con SSE2 si filtrano 16 posizioni alla
+ // volta con il primo e l'ultimo carattere
+ const char *find_pattern(const char *p, size_t size, const char *needle, size_t len, int fold) {
+     size_t i = 0, j;
+     
+     if (len == 0 || size < len) return NULL;
+ #ifdef __SSE2__
+     const __m128i first = _mm_set1_epi8(needle[0]);
+     const __m128i last = _mm_set1_epi8(needle[len - 1]);
+     
+     for (; i + len - 1 + 16 <= size; i += 16) {
+         __m128i block = _mm_loadu_si128((const __m128i *)(p + i));
+         __m128i block_last = _mm_loadu_si128((const __m128i *)(p + i + len - 1));
+         if (fold) {
+             block = fold_block(block);
+             block_last = fold_block(block_last);
+         }
+         unsigned candidates = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block, first),
+                                                               _mm_cmpeq_epi8(block_last, last)));
+         while (candidates) {
+             const char *at = p + i + __builtin_ctz(candidates);
+             if (fold) {
+                 for (j = 1; j + 1 < len && fold_char(at[j]) == (unsigned char)needle[j]; j++)
+                     ;
+                 if (j + 1 >= len) return at;
+             } else if (memcmp(at + 1, needle + 1, len - 1) == 0) {
+                 return at;
+             }
+             candidates &= candidates - 1;
+         }
+     }
+ #endif
+     for (; i + len <= size; i++) {
+         for (j = 0; j < len && (fold ? fold_char(p[i + j]) : (unsigned char)p[i + j]) == (unsigned char)needle[j]; j++)
+             ;
+         if (j == len) return p + i;
+     }
+     return NULL;
+ }
+ 
+ // Aggiunge un elemento da elaborare alla lista items
+ GrepItem *grep_item_new(GrepItem *next, int is_dir, const char *dir, const char *name) {
+     size_t dir_len = strcmp(dir, ".") == 0 ? 0 : strlen(dir);
+     size_t name_len = strlen(name);
+     GrepItem *item = malloc(sizeof(GrepItem) + dir_len + name_len + 2);
+     
+     if (!item) return next;
+     item->next = next;
+     item->is_dir = is_dir;
+     if (dir_len > 0) {
+         memcpy(item->path, dir, dir_len);
+         item->path[dir_len] = '/';
+         memcpy(item->path + dir_len + 1, name, name_len + 1);
+     } else {
+         memcpy(item->path, name, name_len + 1);
+     }
+     return item;
+ }
+ 
+ // Legge una directory e accoda in un solo passaggio sottodirectory e file.
+ // I link simbolici non vengono seguiti
+ void grep_directory(GrepSearch *search, const char *path) {
+     GrepItem *items = NULL, *last = NULL;
+     const char *name;
+     size_t len;
+     unsigned char type;
+     DirScan scan;
+     int fd;
+     
+     fd = openat(search->root_fd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+     if (fd < 0) return;
+     if (dirscan_init(&scan, fd) != 0) {
+         close(fd);
+         return;
+     }
+     while (!atomic_load(&search->cancel) && dirscan_next(&scan, &name, &len, &type) > 0) {
+         if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+         if (type == DT_UNKNOWN) {
+             struct stat st;
+             if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+             type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+         }
+         if (type != DT_DIR && type != DT_REG) continue;
+         items = grep_item_new(items, type == DT_DIR, path, name);
+         if (!last) last = items;
+     }
+     close(dirscan_detach(&scan));
+     
+     if (items) {
+         pthread_mutex_lock(&search->lock);
+         last->next = search->items;
+         search->items = items;
+         pthread_cond_broadcast(&search->cond);
+         pthread_mutex_unlock(&search->lock);
+     }
+ }
+ 
+ // Registra la riga [start, end) alla posizione offset del file come risultato
+ void grep_add_hit(GrepHit **hits, int *count, int *cap, const char *path, long line,
+                   off_t offset, const char *start, const char *end) {
+     size_t len = end - start < GREP_MAX_TEXT ? (size_t)(end - start) : GREP_MAX_TEXT;
+     GrepHit *hit;
+     size_t i;
+     
+     if (*count == *cap) {
+         int new_cap = *cap ? *cap * 2 : 16;
+         GrepHit *grown = realloc(*hits, new_cap * sizeof(GrepHit));
+         if (!grown) return;
+         *hits = grown;
+         *cap = new_cap;
+     }
+     hit = &(*hits)[*count];
+     hit->path = strdup(path);
+     hit->text = malloc(len + 1);
+     if (!hit->path || !hit->text) {
+         free(hit->path);
+         free(hit->text);
+         return;
+     }
+     for (i = 0; i < len; i++)
+         hit->text[i] = (unsigned char)start[i] < 32 ? ' ' : start[i];
+     hit->text[len] = '\0';
+     hit->line = line;
+     hit->offset = offset;
+     (*count)++;
+ }
+ 
+ // Cerca il testo nelle righe complete di buf[0, len), che inizia alla
+ // posizione base del file con la riga *line
+ void grep_region(GrepSearch *search, const char *path, const char *buf, size_t len, off_t base,
+                  long *line, GrepHit **hits, int *count, int *cap) {
+     const char *p = buf, *end = buf + len, *counted = buf, *match;
+     
+     while (p < end && (match = find_pattern(p, end - p, search->needle, search->pattern_len, search->ignore_case))) {
+         const char *line_start = match, *line_end;
+         
+         while (line_start > buf && line_start[-1] != '\n') line_start--;
+         line_end = memchr(match, '\n', end - match);
+         if (!line_end) line_end = end;
+         
+         *line += count_newlines(counted, line_start - counted);
+         counted = line_start;
+         grep_add_hit(hits, count, cap, path, *line, base + (line_start - buf), line_start, line_end);
+         // Un solo risultato per riga
+         p = line_end + 1;
+     }
+     *line += count_newlines(counted, end - counted);
+ }
+ 
+ // Cerca il testo in un file, leggendolo a blocchi grandi. I risultati del
+ // file vengono pubblicati insieme, cosi' restano raggruppati
+ void grep_file(GrepSearch *search, const char *path, char *buf) {
+     GrepHit *hits = NULL;
+     int count = 0, cap = 0;
+     size_t keep = 0;
+     off_t base = 0;
+     long line = 1;
+     ssize_t n;
+     int fd, first = 1;
+     
+     fd = openat(search->root_fd, path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+     if (fd < 0) return;
+ #ifdef POSIX_FADV_SEQUENTIAL
+     posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+ #endif
+     
+     while (!atomic_load(&search->cancel) && (n = read(fd, buf + keep, GREP_BUFFER_SIZE - keep)) > 0) {
+         size_t len = keep + n, done;
+         const char *last_newline;
+         
+         atomic_fetch_add(&search->bytes, n);
+         // Come grep, un NUL all'inizio del file indica un file binario
+         if (first && memchr(buf, '\0', len < GREP_BINARY_CHECK ? len : GREP_BINARY_CHECK)) {
+             atomic_fetch_add(&search->binary, 1);
+             break;
+         }
+         first = 0;
+         
+         // Si elaborano solo le righe complete; il resto passa al blocco successivo
+         for (last_newline = buf + len; last_newline > buf && last_newline[-1] != '\n'; last_newline--)
+             ;
+         done = last_newline > buf ? (size_t)(last_newline - buf) : len;
+         grep_region(search, path, buf, done, base, &line, &hits, &count, &cap);
+         base += done;
+         keep = len - done;
+         memmove(buf, buf + done, keep);
+     }
+     if (keep > 0 && !atomic_load(&search->cancel) && !(first && memchr(buf, '\0', keep)))
+         grep_region(search, path, buf, keep, base, &line, &hits, &count, &cap);
+     close(fd);
+     atomic_fetch_add(&search->files, 1);
+     
+     if (count > 0) {
+         pthread_mutex_lock(&search->lock);
+         if (search->num_hits + count > search->hits_cap) {
+             int new_cap = search->hits_cap ? search->hits_cap : 256;
+             while (new_cap < search->num_hits + count) new_cap *= 2;
+             GrepHit *grown = realloc(search->hits, new_cap * sizeof(GrepHit));
+             if (grown) {
+                 search->hits = grown;
+                 search->hits_cap = new_cap;
+             }
+         }
+         if (search->num_hits + count <= search->hits_cap && search->num_hits < GREP_MAX_HITS) {
+             memcpy(search->hits + search->num_hits, hits, count * sizeof(GrepHit));
+             search->num_hits += count;
+             count = 0;
+         } else {
+             search->truncated = 1;
+         }
+         pthread_mutex_unlock(&search->lock);
+     }
+     while (count > 0) {
+         free(hits[--count].path);
+         free(hits[count].text);
+     }
+     free(hits);
+ }
+ 
+ // Thread della ricerca: prende directory e file dalla lista condivisa
+ // finche' la lista e' vuota e nessun altro thread puo' aggiungerne
+ void *grep_worker(void *data) {
+     GrepSearch *search = data;
+     char *buf = malloc(GREP_BUFFER_SIZE);
+     
+     while (buf) {
+         GrepItem *item;
+         
+         pthread_mutex_lock(&search->lock);
+         while (!search->items && search->busy > 0 && !atomic_load(&search->cancel))
+             pthread_cond_wait(&search->cond, &search->lock);
+         if (!search->items || atomic_load(&search->cancel)) {
+             pthread_cond_broadcast(&search->cond);
+             pthread_mutex_unlock(&search->lock);
+             break;
+         }
+         item = search->items;
+         search->items = item->next;
+         search->busy++;
+         pthread_mutex_unlock(&search->lock);
+         
+         if (item->is_dir)
+             grep_directory(search, item->path);
+         else
+             grep_file(search, item->path, buf);
+         free(item);
+         
+         pthread_mutex_lock(&search->lock);
+         search->busy--;
+         if (search->busy == 0 && !search->items)
+             pthread_cond_broadcast(&search->cond);
+         pthread_mutex_unlock(&search->lock);
+     }
+     free(buf);
+     // L'ultimo thread registra la fine, per le statistiche
+     pthread_mutex_lock(&search->lock);
+     if (++search->exited == (search->num_threads ? search->num_threads : 1))
+         clock_gettime(CLOCK_MONOTONIC, &search->finished_at);
+     pthread_mutex_unlock(&search->lock);
+     atomic_fetch_add(&search->finished, 1);
+     return NULL;
+ }
+ 
+ // Avvia la ricerca di pattern nei file sotto root. Se il testo non contiene
+ // maiuscole la ricerca ignora le maiuscole
+ GrepSearch *start_grep(const char *root, const char *pattern) {
+     GrepSearch *search = calloc(1, sizeof(GrepSearch));
+     size_t i;
+     
+     if (!search) return NULL;
+     snprintf(search->root, sizeof(search->root), "%s", root);
+     snprintf(search->pattern, sizeof(search->pattern), "%s", pattern);
+     search->pattern_len = strlen(search->pattern);
+     search->ignore_case = 1;
+     for (i = 0; i < search->pattern_len; i++) {
+         if (isupper((unsigned char)search->pattern[i])) search->ignore_case = 0;
+     }
+     for (i = 0; i < search->pattern_len; i++)
+         search->needle[i] = search->ignore_case ? fold_char(search->pattern[i]) : search->pattern[i];
+     
+     search->root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+     if (search->root_fd < 0) {
+         free(search);
+         return NULL;
+     }
+     pthread_mutex_init(&search->lock, NULL);
+     pthread_cond_init(&search->cond, NULL);
+     search->items = grep_item_new(NULL, 1, ".", ".");
+     clock_gettime(CLOCK_MONOTONIC, &search->started);
+     
+     // I thread partono quando sono stati creati tutti: num_threads e' protetto da lock
+     pthread_mutex_lock(&search->lock);
+     for (i = 0; i < (size_t)config.tree_threads; i++) {
+         if (pthread_create(&search->threads[search->num_threads], NULL, grep_worker, search) != 0)
+             break;
+         search->num_threads++;
+     }
+     pthread_mutex_unlock(&search->lock);
+     if (search->num_threads == 0) {
+         // Senza thread la ricerca avviene nel thread principale
+         grep_worker(search);
+     }
+     return search;
+ }
+ 
+ // Vero quando tutti i thread della ricerca hanno terminato
+ int grep_finished(GrepSearch *search) {
+     if (search->done) return 1;
+     if (atomic_load(&search->finished) < (search->num_threads ? search->num_threads : 1))
+         return 0;
+     for (int i = 0; i < search->num_threads; i++)
+         pthread_join(search->threads[i], NULL);
+     search->done = 1;
+     return 1;
+ }
+ 
+ // Interrompe la ricerca e libera risultati e lista di lavoro
+ void free_grep(GrepSearch *search) {
+     GrepItem *item;
+     
+     if (!search) return;
+     atomic_store(&search->cancel, 1);
+     pthread_mutex_lock(&search->lock);
+     pthread_cond_broadcast(&search->cond);
+     pthread_mutex_unlock(&search->lock);
+     for (int i = 0; i < search->num_threads && !search->done; i++)
+         pthread_join(search->threads[i], NULL);
+     
+     while ((item = search->items)) {
+         search->items = item->next;
+         free(item);
+     }
+     for (int i = 0; i < search->num_hits; i++) {
+         free(search->hits[i].path);
+         free(search->hits[i].text);
+     }
+     free(search->hits);
+     close(search->root_fd);
+     pthread_mutex_destroy(&search->lock);
+     pthread_cond_destroy(&search->cond);
+     free(search);
+ }
+ 
+ // Mostra a tutto schermo i risultati della ricerca, aggiornati mentre la
+ // ricerca prosegue. Enter porta il pannello attivo sul file, F3 lo apre
+ // alla riga trovata
+ void show_grep_results(GrepSearch *search) {
+     char path[MAX_PATH_LEN * 2];
+     char line[MAX_COMMAND_LEN];
+     int selected = search->selected, top = search->top;
+     
+     while (1) {
+         int rows = term_rows - 2;
+         int running = !grep_finished(search);
+         struct timespec now;
+         double elapsed;
+         int i, ch, count;
+         
+         // Un membro d'archivio estratto nel frattempo per F3 si apre anche da qui
+         if (archive_view_ready) show_archive_view();
+         clock_gettime(CLOCK_MONOTONIC, &now);
+         elapsed = elapsed_seconds(&search->started, running ? &now : &search->finished_at);
+         if (elapsed <= 0) elapsed = 1e-6;
+         
+         pthread_mutex_lock(&search->lock);
+         count = search->num_hits;
+         if (selected >= count) selected = count > 0 ? count - 1 : 0;
+         if (selected < top) top = selected;
+         if (selected >= top + rows) top = selected - rows + 1;
+         
+         erase();
+         attron(COLOR_PAIR(2));
+         mvhline(0, 0, ' ', term_cols);
+         // Riga di titolo, comunque tagliata alla larghezza dello schermo:
+         // modello e directory limitati perche' entrino entrambi in line
+         snprintf(line, sizeof(line), "\"%.*s\" in %.*s: %d risultati%s, %lld file (%lld binari), %.0f file/s, %.1f MB/s%s",
+                  (int)sizeof(line) / 4, search->pattern, (int)sizeof(line) / 2, search->root, count, search->truncated ? "+" : "",
+                  (long long)atomic_load(&search->files), (long long)atomic_load(&search->binary),
+                  atomic_load(&search->files) / elapsed, atomic_load(&search->bytes) / elapsed / (1024 * 1024),
+                  running ? "  [in corso]" : atomic_load(&search->cancel) ? "  [annullata]" : "");
+         mvprintw(0, 1, "%.*s", term_cols - 2, line);
+         attroff(COLOR_PAIR(2));
+         for (i = 0; i < rows && top + i < count; i++) {
+             GrepHit *hit = &search->hits[top + i];
+             if (top + i == selected) attron(COLOR_PAIR(6));
+             snprintf(line, sizeof(line), "%s:%ld: %s", hit->path, hit->line, hit->text);
+             mvhline(i + 1, 0, ' ', term_cols);
+             mvprintw(i + 1, 1, "%.*s", term_cols - 2, line);
+             if (top + i == selected) attroff(COLOR_PAIR(6));
+         }
+         pthread_mutex_unlock(&search->lock);
+         
+         attron(COLOR_PAIR(2));
+         mvhline(term_rows - 1, 0, ' ', term_cols);
+         mvprintw(term_rows - 1, 1, "Frecce/PgSu/PgGiu: scorri  Enter: vai al file  F3: apri alla riga  Esc: %s",
+                  running ? "interrompi" : "chiudi");
+         attroff(COLOR_PAIR(2));
+         refresh();
+         
+         ch = modal_getch(0, running ? UI_TICK_MS : -1);
+         if (ch == KEY_UP && selected > 0) selected--;
+         else if (ch == KEY_DOWN && selected + 1 < count) selected++;
+         else if (ch == KEY_PPAGE) selected = selected > rows ? selected - rows : 0;
+         else if (ch == KEY_NPAGE) selected = selected + rows < count ? selected + rows : (count > 0 ? count - 1 : 0);
+         else if (ch == KEY_HOME) selected = 0;
+         else if (ch == KEY_END) selected = count > 0 ? count - 1 : 0;
+         else if (ch == 27 && running) atomic_store(&search->cancel, 1);
+         else if (ch == 27 || ch == 'q' || ch == 'Q' || ch == KEY_F(10)) break;
+         else if ((ch == '\n' || ch == KEY_F(3)) && count > 0) {
+             size_t offset;
+             char *slash;
+             
+             pthread_mutex_lock(&search->lock);
+             snprintf(path, sizeof(path), "%s/%s", search->root, search->hits[selected].path);
+             offset = search->hits[selected].offset;
+             pthread_mutex_unlock(&search->lock);
+             
+             if (ch == KEY_F(3)) {
+                 run_viewer(path, offset);
+                 continue;
+             }
+             // Il pannello attivo passa alla directory del file e lo seleziona
+             slash = strrchr(path, '/');
+             *slash = '\0';
+             change_directory(active_panel, path);
+             select_loaded_entry(active_panel, slash + 1);
+             break;
+         }
+     }
+     search->selected = selected;
+     search->top = top;
+     if (!grep_finished(search))
+         atomic_store(&search->cancel, 1);
+     invalidate_screen();
+ }
+ 
+ // Esito dell'entry omonima nell'altro pannello
+ static inline int opposite_mark(int mark) {
+     return mark == CMP_NEWER ? CMP_OLDER : mark == CMP_OLDER ? CMP_NEWER : mark;
+ }
+ 
+ // Entry del pannello (".." esclusa) ordinate per nome, per il confronto
+ FileEntry **entries_by_name(Panel *panel) {
+     FileEntry **entries = malloc((panel->num_files > 1 ? panel->num_files - 1 : 1) * sizeof(FileEntry *));
+     int i;
+     
+     if (!entries) return NULL;
+     for (i = 1; i < panel->num_files; i++)
+         entries[i - 1] = &panel->files[i];
+     qsort(entries, panel->num_files - 1, sizeof(FileEntry *), compare_entry_names);
+     return entries;
+ }
+ 
+ // Confronto per nome di due puntatori a entry
+ int compare_entry_names(const void *a, const void *b) {
+     return strcmp((*(FileEntry * const *)a)->name, (*(FileEntry * const *)b)->name);
+ }
+ 
+ // Confronta due entry omonime con dimensione e data. Se il contenuto va
+ // verificato le marca CMP_CHECKING e restituisce l'esito per left nel caso
+ // risulti diverso, altrimenti 0
+ int compare_entries(FileEntry *left, FileEntry *right, int verify) {
+     int mark = left->mtime > right->mtime ? CMP_NEWER : left->mtime < right->mtime ? CMP_OLDER : CMP_DIFFERENT;
+     
+     left->compare_mark = right->compare_mark = CMP_NONE;
+     if (left->is_dir || right->is_dir) {
+         // Il contenuto delle directory non viene confrontato
+         if (left->is_dir != right->is_dir)
+             left->compare_mark = right->compare_mark = CMP_DIFFERENT;
+         return 0;
+     }
+     if (left->size != right->size) {
+         left->compare_mark = mark;
+         right->compare_mark = opposite_mark(mark);
+         return 0;
+     }
+     if (verify && left->size > 0 && S_ISREG(left->mode) && S_ISREG(right->mode)) {
+         left->compare_mark = right->compare_mark = CMP_CHECKING;
+         return mark;
+     }
+     // Senza verifica, stessa dimensione e data bastano per considerarli uguali
+     if (!verify && mark != CMP_DIFFERENT) {
+         left->compare_mark = mark;
+         right->compare_mark = opposite_mark(mark);
+     }
+     return 0;
+ }
+ 
+ // Riepilogo dei segni del confronto nella riga di stato
+ void show_compare_summary() {
+     int only_left = 0, only_right = 0, differ = 0, i;
+     
+     for (i = 1; i < left_panel.num_files; i++) {
+         int mark = left_panel.files[i].compare_mark;
+         if (mark == CMP_ONLY) only_left++;
+         else if (mark != CMP_NONE) differ++;
+     }
+     for (i = 1; i < right_panel.num_files; i++) {
+         if (right_panel.files[i].compare_mark == CMP_ONLY) only_right++;
+     }
+     if (only_left + only_right + differ == 0)
+         show_message("Confronto: le directory sono uguali");
+     else
+         show_message("Confronto: %d solo a sinistra, %d solo a destra, %d diverse ('y' copia le differenze)",
+                      only_left, only_right, differ);
+ }
+ 
+ // Confronta le entry dei due pannelli per nome, dimensione e data e le
+ // marca (CMP_*). Con verify i file con la stessa dimensione vengono poi
+ // confrontati per contenuto in background
+ void compare_panels(int verify) {
+     Panel *left = &left_panel, *right = &right_panel;
+     FileEntry **left_names, **right_names;
+     ComparePair *pairs = NULL;
+     int num_left, num_right, num_pairs = 0, cap = 0, i = 0, j = 0;
+     
+     if (left->loader || right->loader) {
+         show_message("Attendere la fine della lettura delle directory");
+         return;
+     }
+     if (strcmp(left->current_path, right->current_path) == 0) {
+         show_message("I due pannelli mostrano la stessa directory");
+         return;
+     }
+     free_compare_check(compare_check, 0);
+     compare_check = NULL;
+     
+     // Il confronto usa dimensioni e date di tutte le entry
+     load_metadata(left, 1, left->num_files, 0, 0);
+     load_metadata(right, 1, right->num_files, 0, 0);
+     num_left = left->num_files - 1;
+     num_right = right->num_files - 1;
+     left_names = entries_by_name(left);
+     right_names = entries_by_name(right);
+     if (!left_names || !right_names) {
+         free(left_names);
+         free(right_names);
+         display_error("Memoria insufficiente");
+         return;
+     }
+     
+     // Fusione delle due liste ordinate per nome
+     while (i < num_left || j < num_right) {
+         int cmp = i == num_left ? 1 : j == num_right ? -1 : strcmp(left_names[i]->name, right_names[j]->name);
+         int mark;
+         
+         if (cmp < 0) {
+             left_names[i++]->compare_mark = CMP_ONLY;
+             continue;
+         }
+         if (cmp > 0) {
+             right_names[j++]->compare_mark = CMP_ONLY;
+             continue;
+         }
+         if ((mark = compare_entries(left_names[i], right_names[j], verify)) != 0) {
+             if (num_pairs == cap) {
+                 int new_cap = cap ? cap * 2 : 64;
+                 ComparePair *grown = realloc(pairs, new_cap * sizeof(ComparePair));
+                 if (!grown) {
+                     left_names[i]->compare_mark = right_names[j]->compare_mark = CMP_NONE;
+                     i++, j++;
+                     continue;
+                 }
+                 pairs = grown;
+                 cap = new_cap;
+             }
+             ComparePair *pair = &pairs[num_pairs++];
+             memset(pair, 0, sizeof(ComparePair));
+             if (asprintf(&pair->left, "%s/%s", left->current_path, left_names[i]->name) < 0)
+                 pair->left = NULL;
+             if (asprintf(&pair->right, "%s/%s", right->current_path, right_names[j]->name) < 0)
+                 pair->right = NULL;
+             pair->left_id = left_names[i]->id;
+             pair->right_id = right_names[j]->id;
+             pair->size = left_names[i]->size;
+             pair->mark = mark;
+         }
+         i++;
+         j++;
+     }
+     free(left_names);
+     free(right_names);
+     left->changed = right->changed = 1;
+     
+     if (num_pairs > 0)
+         start_compare_check(pairs, num_pairs);
+     else
+         show_compare_summary();
+ }
+ 
+ // Avvia i thread che verificano il contenuto delle coppie (di cui prende
+ // possesso)
+ void start_compare_check(ComparePair *pairs, int num_pairs) {
+     CompareCheck *check = calloc(1, sizeof(CompareCheck));
+     int i, num_segments = 0;
+     
+     if (!check) {
+         for (i = 0; i < num_pairs; i++) {
+             free(pairs[i].left);
+             free(pairs[i].right);
+         }
+         free(pairs);
+         display_error("Memoria insufficiente");
+         return;
+     }
+     check->pairs = pairs;
+     check->num_pairs = num_pairs;
+     for (i = 0; i < num_pairs; i++)
+         num_segments += (pairs[i].size + COMPARE_SEGMENT - 1) / COMPARE_SEGMENT;
+     check->segments = malloc(num_segments * sizeof(CompareSegment));
+     if (!check->segments) {
+         // Le coppie restano non verificate
+         free_compare_check(check, 0);
+         display_error("Memoria insufficiente");
+         return;
+     }
+     for (i = 0; i < num_pairs; i++) {
+         off_t offset;
+         for (offset = 0; offset < pairs[i].size; offset += COMPARE_SEGMENT) {
+             check->segments[check->num_segments].pair = i;
+             check->segments[check->num_segments++].offset = offset;
+             atomic_fetch_add(&pairs[i].remaining, 1);
+         }
+     }
+     snprintf(check->left_path, sizeof(check->left_path), "%s", left_panel.current_path);
+     snprintf(check->right_path, sizeof(check->right_path), "%s", right_panel.current_path);
+     clock_gettime(CLOCK_MONOTONIC, &check->started);
+     compare_check = check;
+     
+     for (i = 0; i < config.tree_threads && i < check->num_segments; i++) {
+         if (pthread_create(&check->threads[check->num_threads], NULL, compare_worker, check) != 0)
+             break;
+         check->num_threads++;
+     }
+     if (check->num_threads == 0) {
+         // Senza thread la verifica avviene nel thread principale
+         compare_worker(check);
+     }
+ }
+ 
+ // Thread della verifica: prende i segmenti in ordine, cosi' i file vengono
+ // letti in sequenza e quelli grandi da piu' thread insieme
+ void *compare_worker(void *data) {
+     CompareCheck *check = data;
+     char *buf_a = malloc(COMPARE_CHUNK);
+     char *buf_b = malloc(COMPARE_CHUNK);
+     int i;
+     
+     while (!atomic_load(&check->cancel) &&
+            (i = atomic_fetch_add(&check->next_segment, 1)) < check->num_segments) {
+         ComparePair *pair = &check->pairs[check->segments[i].pair];
+         
+         if (!buf_a || !buf_b || !pair->left || !pair->right) {
+             atomic_store(&pair->failed, 1);
+         } else if (!atomic_load(&pair->differs) && !atomic_load(&pair->failed)) {
+             int result = compare_segment(check, pair, check->segments[i].offset, buf_a, buf_b);
+             if (result > 0)
+                 atomic_store(&pair->differs, 1);
+             else if (result < 0)
+                 atomic_store(&pair->failed, 1);
+         }
+         if (atomic_fetch_sub(&pair->remaining, 1) == 1)
+             atomic_fetch_add(&check->pairs_done, 1);
+     }
+     free(buf_a);
+     free(buf_b);
+     atomic_fetch_add(&check->finished, 1);
+     ui_wake();
+     return NULL;
+ }
+ 
+ // Legge len byte da offset, salvo fine del file; restituisce i byte letti o -1
+ ssize_t pread_full(int fd, char *buf, size_t len, off_t offset) {
+     size_t done = 0;
+     
+     while (done < len) {
+         ssize_t n = pread(fd, buf + done, len - done, offset + done);
+         if (n < 0 && errno == EINTR) continue;
+         if (n < 0) return -1;
+         if (n == 0) break;
+         done += n;
+     }
+     return done;
+ }
+ 
+ // Confronta a blocchi un segmento dei due file, fermandosi alla prima
+ // differenza (anche se trovata da un altro thread). Mentre si confronta un
+ // blocco il kernel legge gia' il successivo. Restituisce 1 se diversi, 0 se
+ // uguali, -1 in caso di errore
+ int compare_segment(CompareCheck *check, ComparePair *pair, off_t offset, char *buf_a, char *buf_b) {
+     off_t end = pair->size - offset > COMPARE_SEGMENT ? offset + COMPARE_SEGMENT : pair->size;
+     int fd_a = open(pair->left, O_RDONLY | O_CLOEXEC);
+     int fd_b = open(pair->right, O_RDONLY | O_CLOEXEC);
+     int result = fd_a < 0 || fd_b < 0 ? -1 : 0;
+     off_t pos;
+     
+     for (pos = offset; result == 0 && pos < end; pos += COMPARE_CHUNK) {
+         size_t len = end - pos < COMPARE_CHUNK ? (size_t)(end - pos) : COMPARE_CHUNK;
+         ssize_t got_a, got_b;
+         
+         if (atomic_load(&pair->differs) || atomic_load(&check->cancel))
+             break;
+ #ifdef POSIX_FADV_WILLNEED
+         if (pos + (off_t)len < end) {
+             posix_fadvise(fd_a, pos + len, COMPARE_CHUNK, POSIX_FADV_WILLNEED);
+             posix_fadvise(fd_b, pos + len, COMPARE_CHUNK, POSIX_FADV_WILLNEED);
+         }
+ #endif
+         got_a = pread_full(fd_a, buf_a, len, pos);
+         got_b = pread_full(fd_b, buf_b, len, pos);
+         if (got_a < 0 || got_b < 0)
+             result = -1;
+         else if (got_a != got_b || memcmp(buf_a, buf_b, got_a) != 0)
+             result = 1;
+         else if ((size_t)got_a < len)
+             break; // Entrambi accorciati nello stesso modo
+         if (got_a > 0)
+             atomic_fetch_add(&check->bytes, got_a);
+     }
+ #ifdef POSIX_FADV_DONTNEED
+     // Come nella copia, i file grandi non restano in cache dopo il confronto
+     if (pair->size >= COPY_NOCACHE_MIN) {
+         if (fd_a >= 0) posix_fadvise(fd_a, offset, end - offset, POSIX_FADV_DONTNEED);
+         if (fd_b >= 0) posix_fadvise(fd_b, offset, end - offset, POSIX_FADV_DONTNEED);
+     }
+ #endif
+     if (fd_a >= 0) close(fd_a);
+     if (fd_b >= 0) close(fd_b);
+     return result;
+ }
+ 
+ // Segue la verifica del contenuto: avanzamento nella riga di stato e, al
+ // termine, esiti nei pannelli. Restituisce 1 se qualcosa e' cambiato
+ int poll_compare() {
+     CompareCheck *check = compare_check;
+     
+     if (!check) return 0;
+     if (atomic_load(&check->finished) < (check->num_threads ? check->num_threads : 1)) {
+         snprintf(status_message, sizeof(status_message), "Verifica del contenuto: %d/%d file, %.1f MB (Esc interrompe)",
+                  atomic_load(&check->pairs_done), check->num_pairs, atomic_load(&check->bytes) / (1024.0 * 1024));
+         return 1;
+     }
+     compare_check = NULL;
+     free_compare_check(check, !atomic_load(&check->cancel));
+     return 1;
+ }
+ 
+ // Termina la verifica e ne libera le risorse. Con apply gli esiti vanno
+ // sulle entry dei pannelli che mostrano ancora le stesse directory,
+ // altrimenti le entry in verifica tornano senza segno
+ void free_compare_check(CompareCheck *check, int apply) {
+     Panel *panels[2] = { &left_panel, &right_panel };
+     int i, p, errors = 0;
+     
+     if (!check) return;
+     atomic_store(&check->cancel, !apply);
+     for (i = 0; i < check->num_threads; i++)
+         pthread_join(check->threads[i], NULL);
+     
+     for (p = 0; p < 2; p++) {
+         Panel *panel = panels[p];
+         int *pos = NULL;
+         
+         if (apply && strcmp(panel->current_path, p ? check->right_path : check->left_path) == 0 &&
+             (pos = malloc(panel->next_id * sizeof(int))) != NULL) {
+             // Le entry si ritrovano per id (e nome: la lista potrebbe essere stata riletta)
+             for (i = 0; i < (int)panel->next_id; i++) pos[i] = -1;
+             for (i = 1; i < panel->num_files; i++) pos[panel->files[i].id] = i;
+             for (i = 0; i < check->num_pairs; i++) {
+                 ComparePair *pair = &check->pairs[i];
+                 uint32_t id = p ? pair->right_id : pair->left_id;
+                 const char *path = p ? pair->right : pair->left;
+                 FileEntry *file;
+                 
+                 if (id >= panel->next_id || pos[id] < 0 || !path) continue;
+                 file = &panel->files[pos[id]];
+                 if (strcmp(file->name, strrchr(path, '/') + 1) != 0) continue;
+                 if (atomic_load(&pair->failed)) {
+                     file->compare_mark = CMP_DIFFERENT;
+                     errors += p == 0;
+                 } else if (atomic_load(&pair->differs)) {
+                     file->compare_mark = p ? opposite_mark(pair->mark) : pair->mark;
+                 } else {
+                     file->compare_mark = CMP_NONE;
+                 }
+             }
+         }
+         free(pos);
+         for (i = 1; i < panel->num_files; i++) {
+             if (panel->files[i].compare_mark == CMP_CHECKING)
+                 panel->files[i].compare_mark = CMP_NONE;
+         }
+         panel->changed = 1;
+     }
+     
+     for (i = 0; i < check->num_pairs; i++) {
+         free(check->pairs[i].left);
+         free(check->pairs[i].right);
+     }
+     free(check->pairs);
+     free(check->segments);
+     free(check);
+     
+     if (apply) {
+         show_compare_summary();
+         if (errors > 0)
+             show_message("Confronto: %d file non leggibili, marcati come diversi", errors);
+     }
+ }
+ 
+ // Sincronizzazione in una direzione: copia nel pannello inattivo le entry
+ // del pannello attivo assenti, piu' recenti o diverse secondo l'ultimo
+ // confronto. Quelle piu' recenti nel pannello inattivo restano invariate
+ void sync_panels() {
+     Panel *target = active_panel == &left_panel ? &right_panel : &left_panel;
+     char src[MAX_PATH_LEN], dst[MAX_PATH_LEN];
+     int i, count = 0, queued = 0, too_long = 0;
+     
+     if (compare_check) {
+         show_message("Attendere la fine della verifica del contenuto");
+         return;
+     }
+     for (i = 1; i < active_panel->num_files; i++) {
+         int mark = active_panel->files[i].compare_mark;
+         if (mark == CMP_ONLY || mark == CMP_NEWER || mark == CMP_DIFFERENT) count++;
+     }
+     if (count == 0) {
+         show_message("Nessuna differenza da copiare ('C' confronta i pannelli)");
+         return;
+     }
+     if (archive_readonly(target) || found_readonly(target) || found_readonly(active_panel) ||
+         !confirm("Copiare %d entry in %s?", count, target->current_path))
+         return;
+     
+     for (i = 1; i < active_panel->num_files; i++) {
+         FileEntry *file = &active_panel->files[i];
+         struct stat st;
+         
+         if (file->compare_mark != CMP_ONLY && file->compare_mark != CMP_NEWER &&
+             file->compare_mark != CMP_DIFFERENT)
+             continue;
+         // Un percorso troncato indicherebbe un'altra entry
+         if (snprintf(src, sizeof(src), "%s/%s", active_panel->current_path, file->name) >= (int)sizeof(src) ||
+             snprintf(dst, sizeof(dst), "%s/%s", target->current_path, file->name) >= (int)sizeof(dst)) {
+             too_long++;
+             continue;
+         }
+         // Un file non sostituisce una directory omonima, ne' viceversa
+         if (file->compare_mark != CMP_ONLY && lstat(dst, &st) == 0 && !S_ISDIR(st.st_mode) != !file->is_dir)
+             continue;
+         if (enqueue_job(copy_job_type(active_panel), src, dst)) {
+             file->compare_mark = CMP_NONE;
+             queued++;
+         }
+     }
+     active_panel->changed = 1;
+     if (too_long > 0)
+         show_message("Sincronizzazione: %d copie accodate, %d entry saltate (percorso troppo lungo)", queued, too_long);
+     else
+         show_message("Sincronizzazione: %d copie accodate", queued);
+ }
+ 
+ // Restituisce il primo metodo di copia da provare tra due filesystem
+ int get_copy_method(dev_t src_dev, dev_t dst_dev) {
+     int i, method = COPY_REFLINK;
+     
+     pthread_mutex_lock(&copy_pairs_lock);
+     for (i = 0; i < num_copy_pairs; i++) {
+         if (copy_pairs[i].src_dev == src_dev && copy_pairs[i].dst_dev == dst_dev) {
+             method = copy_pairs[i].method;
+             break;
+         }
+     }
+     pthread_mutex_unlock(&copy_pairs_lock);
+     return method;
+ }
+ 
+ // Ricorda che tra due filesystem i metodi precedenti a method non funzionano
+ void set_copy_method(dev_t src_dev, dev_t dst_dev, int method) {
+     int i;
+     
+     pthread_mutex_lock(&copy_pairs_lock);
+     for (i = 0; i < num_copy_pairs; i++) {
+         if (copy_pairs[i].src_dev == src_dev && copy_pairs[i].dst_dev == dst_dev)
+             break;
+     }
+     if (i == num_copy_pairs) {
+         // Tabella piena: si sovrascrive la voce piu' vecchia
+         if (num_copy_pairs < MAX_COPY_PAIRS)
+             num_copy_pairs++;
+         else
+             i = 0;
+         copy_pairs[i].src_dev = src_dev;
+         copy_pairs[i].dst_dev = dst_dev;
+     }
+     copy_pairs[i].method = method;
+     pthread_mutex_unlock(&copy_pairs_lock);
+ }
+ 
+ // Scrive tutto il buffer gestendo scritture parziali e interruzioni
+ int write_all(int fd, const char *buf, size_t len) {
+     while (len > 0) {
+         ssize_t written;
+         
+         perf_count(PERF_SYS_WRITE);
+         written = write(fd, buf, len);
+         if (written < 0) {
+             if (errno == EINTR) continue;
+             return -1;
+         }
+         buf += written;
+         len -= written;
+     }
+     return 0;
+ }
+ 
+ // Vero se l'errore indica che il metodo non e' supportato per questi file
+ int copy_method_unsupported(int err) {
+     return err == EXDEV || err == EOPNOTSUPP || err == ENOTSUP || err == EINVAL ||
+            err == ENOSYS || err == ENOTTY || err == EBADF || err == EPERM;
+ }
+ 
+ // Scrive tutto il buffer a partire da offset
+ int pwrite_all(int fd, const char *buf, size_t len, off_t offset) {
+     while (len > 0) {
+         ssize_t written;
+         
+         perf_count(PERF_SYS_WRITE);
+         written = pwrite(fd, buf, len, offset);
+         if (written < 0) {
+             if (errno == EINTR) continue;
+             return -1;
+         }
+         buf += written;
+         len -= written;
+         offset += written;
+     }
+     return 0;
+ }
+ 
+ #ifdef HAVE_IO_URING
+ // Crea un anello con almeno entries richieste; NULL con errno se io_uring
+ // non e' disponibile (kernel vecchio, io_uring_disabled, seccomp)
+ Uring *uring_create(unsigned entries) {
+     struct io_uring_params params;
+     Uring *ring = calloc(1, sizeof(Uring));
+     int saved_errno;
+     
+     if (!ring) return NULL;
+     memset(&params, 0, sizeof(params));
+     ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+     if (ring->fd < 0) {
+         saved_errno = errno;
+         free(ring);
+         errno = saved_errno;
+         return NULL;
+     }
+     ring->entries = params.sq_entries;
+     ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+     ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+     // Con IORING_FEAT_SINGLE_MMAP le due code stanno nella stessa mappatura
+     if (params.features & IORING_FEAT_SINGLE_MMAP) {
+         if (ring->cq_map_size > ring->sq_map_size) ring->sq_map_size = ring->cq_map_size;
+         ring->cq_map_size = ring->sq_map_size;
+     }
+     ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+     if (ring->sq_map == MAP_FAILED) {
+         ring->sq_map = NULL;
+         goto fail;
+     }
+     if (params.features & IORING_FEAT_SINGLE_MMAP) {
+         ring->cq_map = ring->sq_map;
+     } else {
+         ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+         if (ring->cq_map == MAP_FAILED) {
+             ring->cq_map = NULL;
+             goto fail;
+         }
+     }
+     ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+     ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_SQES);
+     if (ring->sqes == MAP_FAILED) {
+         ring->sqes = NULL;
+         goto fail;
+     }
+     
+     ring->sq_head = (unsigned *)((char *)ring->sq_map + params.sq_off.head);
+     ring->sq_tail = (unsigned *)((char *)ring->sq_map + params.sq_off.tail);
+     ring->sq_mask = (unsigned *)((char *)ring->sq_map + params.sq_off.ring_mask);
+     ring->sq_array = (unsigned *)((char *)ring->sq_map + params.sq_off.array);
+     ring->cq_head = (unsigned *)((char *)ring->cq_map + params.cq_off.head);
+     ring->cq_tail = (unsigned *)((char *)ring->cq_map + params.cq_off.tail);
+     ring->cq_mask = (unsigned *)((char *)ring->cq_map + params.cq_off.ring_mask);
+     ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_map + params.cq_off.cqes);
+     return ring;
+     
+ fail:
+     saved_errno = errno;
+     uring_free(ring);
+     errno = saved_errno;
+     return NULL;
+ }
+ 
+ // Chiude un anello (anche come distruttore del dato del thread)
+ void uring_free(void *data) {
+     Uring *ring = data;
+     
+     if (!ring) return;
+     if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+     if (ring->cq_map && ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_map_size);
+     if (ring->sq_map) munmap(ring->sq_map, ring->sq_map_size);
+     close(ring->fd);
+     free(ring->buffers);
+     free(ring);
+ }
+ 
+ int uring_state; // 1 = io_uring utilizzabile, -1 = no; deciso una volta da uring_probe
+ pthread_once_t uring_probe_once = PTHREAD_ONCE_INIT;
+ pthread_key_t uring_key;
+ pthread_once_t uring_key_once = PTHREAD_ONCE_INIT;
+ 
+ // Verifica che l'anello si possa creare e che il kernel conosca le
+ // operazioni usate (statx, letture e scritture su buffer registrati)
+ void uring_probe() {
+     static const int ops[] = { IORING_OP_STATX, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED };
+     size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+     struct io_uring_probe *probe = calloc(1, size);
+     Uring *ring = uring_create(4);
+     int i;
+     
+     uring_state = -1;
+     if (ring && probe && syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+         uring_state = 1;
+         for (i = 0; i < (int)(sizeof(ops) / sizeof(ops[0])); i++) {
+             if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+                 uring_state = -1;
+         }
+     }
+     free(probe);
+     uring_free(ring);
+ }
+ 
+ // Vero se io_uring e' abilitato dalla configurazione e funziona su questo kernel
+ int uring_available() {
+     if (!config.io_uring) return 0;
+     pthread_once(&uring_probe_once, uring_probe);
+     return uring_state > 0;
+ }
+ 
+ void thread_uring_key() {
+     pthread_key_create(&uring_key, uring_free);
+ }
+ 
+ // Anello del thread corrente, creato al primo uso e chiuso all'uscita del thread
+ Uring *thread_uring() {
+     Uring *ring;
+     
+     if (!uring_available()) {
+         errno = ENOSYS;
+         return NULL;
+     }
+     pthread_once(&uring_key_once, thread_uring_key);
+     ring = pthread_getspecific(uring_key);
+     if (!ring && (ring = uring_create(URING_ENTRIES)) != NULL)
+         pthread_setspecific(uring_key, ring);
+     return ring;
+ }
+ 
+ // Prossima richiesta libera nella coda di invio, azzerata; NULL se piena
+ struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+     unsigned tail = *ring->sq_tail;
+     unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+     struct io_uring_sqe *sqe;
+     
+     if (tail - head >= ring->entries) return NULL;
+     sqe = &ring->sqes[tail & *ring->sq_mask];
+     memset(sqe, 0, sizeof(*sqe));
+     ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+     __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+     ring->queued++;
+     return sqe;
+ }
+ 
+ // Invia le richieste preparate e attende almeno wait completamenti
+ int uring_submit(Uring *ring, unsigned wait) {
+     int result;
+     
+     do {
+         perf_count(PERF_SYS_URING);
+         result = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+     } while (result < 0 && errno == EINTR);
+     if (result > 0) ring->queued -= result;
+     return result < 0 ? -1 : 0;
+ }
+ 
+ // Primo completamento disponibile, o NULL; va rilasciato con uring_seen
+ struct io_uring_cqe *uring_peek(Uring *ring) {
+     unsigned head = *ring->cq_head;
+     
+     if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+     return &ring->cqes[head & *ring->cq_mask];
+ }
+ 
+ void uring_seen(Uring *ring) {
+     __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+ }
+ 
+ // Legge i metadati delle entry del lavoro con statx inviate a gruppi
+ // nell'anello: il kernel le esegue in parallelo nei suoi thread, senza un
+ // thread per richiesta. Restituisce -1 se io_uring non e' utilizzabile
+ int uring_fetch_metadata(MetadataJob *job, int count) {
+     Uring *ring = thread_uring();
+     struct statx *results;
+     int *free_slots;
+     int next = 0, in_flight = 0, i;
+     
+     if (!ring) return -1;
+     // Ogni richiesta in volo ha il proprio struct statx, preso da una pila di posti liberi
+     results = malloc(ring->entries * (sizeof(struct statx) + sizeof(int)));
+     if (!results) return -1;
+     free_slots = (int *)(results + ring->entries);
+     for (i = 0; i < (int)ring->entries; i++)
+         free_slots[i] = i;
+     
+     while (next < count || in_flight > 0) {
+         struct io_uring_cqe *cqe;
+         struct io_uring_sqe *sqe;
+         
+         // Riempie la coda; le entry completate liberano il proprio posto
+         while (next < count && !(job->cancel && atomic_load(job->cancel))) {
+             FileEntry *file = &job->files[next];
+             
+             if (file->has_meta ||
+                 (job->unclassified_only && (file->d_type == DT_DIR || file->d_type == DT_REG))) {
+                 next++;
+                 continue;
+             }
+             if (in_flight >= (int)ring->entries || !(sqe = uring_get_sqe(ring)))
+                 break;
+             sqe->opcode = IORING_OP_STATX;
+             sqe->fd = job->dir_fd;
+             sqe->addr = (uintptr_t)file->name;
+             sqe->len = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME;
+             i = free_slots[ring->entries - 1 - in_flight];
+             sqe->off = (uintptr_t)&results[i];
+             sqe->user_data = (uint64_t)next << 32 | (unsigned)i;
+             next++;
+             in_flight++;
+         }
+         if (in_flight == 0) break;
+         // Attendere meta' delle richieste riduce le chiamate senza svuotare la coda
+         if (uring_submit(ring, in_flight > 1 ? in_flight / 2 : 1) != 0) {
+             // Anello inutilizzabile: le richieste non inviate vengono scartate
+             // e le entry ancora senza metadati lette direttamente. I risultati
+             // restano allocati, il kernel potrebbe ancora scriverci
+             uring_free(ring);
+             pthread_setspecific(uring_key, NULL);
+             for (i = 0; i < count; i++) {
+                 if (!job->files[i].has_meta && fetch_entry_metadata(job->dir_fd, &job->files[i]) != 0)
+                     job->files[i].has_meta = -1;
+             }
+             return 0;
+         }
+         while ((cqe = uring_peek(ring)) != NULL) {
+             FileEntry *file = &job->files[cqe->user_data >> 32];
+             int slot = (int)(cqe->user_data & 0xffffffff);
+             struct statx *stx = &results[slot];
+             
+             if (cqe->res == 0) {
+                 file->size = stx->stx_size;
+                 file->mode = stx->stx_mode;
+                 file->mtime = stx->stx_mtime.tv_sec;
+                 file->is_dir = S_ISDIR(stx->stx_mode);
+                 file->has_meta = 1;
+             } else if (cqe->res == -EAGAIN || cqe->res == -EINVAL || cqe->res == -ECANCELED) {
+                 // Richiesta rifiutata dall'anello: si riprova senza
+                 if (fetch_entry_metadata(job->dir_fd, file) != 0)
+                     file->has_meta = -1;
+             } else {
+                 file->has_meta = -1;
+             }
+             uring_seen(ring);
+             in_flight--;
+             free_slots[ring->entries - 1 - in_flight] = slot;
+         }
+     }
+     free(results);
+     return 0;
+ }
+ 
+ // Copia al piu' length byte da offset tenendo in volo fino a
+ // URING_COPY_DEPTH blocchi: ogni lettura completata diventa una scrittura
+ // dello stesso buffer registrato, e ogni scrittura completata libera il
+ // buffer per la lettura successiva. Restituisce i byte copiati (0 a fine
+ // file) o -1 con errno; ENOSYS se l'anello non e' disponibile
+ ssize_t uring_copy_chunk(CopySession *session, off_t offset, size_t length) {
+     Uring *ring = thread_uring();
+     UringSlot slots[URING_COPY_DEPTH];
+     off_t next = offset, end = offset + length, eof = -1;
+     int in_flight = 0, error = 0, i;
+     
+     if (!ring) return -1;
+     if (!ring->buffers && !ring->buffers_failed) {
+         struct iovec iov[URING_COPY_DEPTH];
+         
+         if (posix_memalign((void **)&ring->buffers, 4096, URING_COPY_DEPTH * URING_COPY_BLOCK) != 0)
+             ring->buffers = NULL;
+         for (i = 0; ring->buffers && i < URING_COPY_DEPTH; i++) {
+             iov[i].iov_base = ring->buffers + i * URING_COPY_BLOCK;
+             iov[i].iov_len = URING_COPY_BLOCK;
+         }
+         // Il limite RLIMIT_MEMLOCK puo' impedire di bloccare i buffer in memoria
+         if (!ring->buffers ||
+             syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, URING_COPY_DEPTH) != 0) {
+             free(ring->buffers);
+             ring->buffers = NULL;
+             ring->buffers_failed = 1;
+         }
+     }
+     if (!ring->buffers) {
+         errno = ENOSYS;
+         return -1;
+     }
+     memset(slots, 0, sizeof(slots));
+     
+     while (!error) {
+         struct io_uring_cqe *cqe;
+         struct io_uring_sqe *sqe;
+         
+         for (i = 0; i < URING_COPY_DEPTH && next < end && eof < 0; i++) {
+             if (slots[i].state != 0 || !(sqe = uring_get_sqe(ring))) continue;
+             slots[i].offset = next;
+             slots[i].length = end - next < URING_COPY_BLOCK ? (size_t)(end - next) : URING_COPY_BLOCK;
+             slots[i].got = slots[i].written = 0;
+             slots[i].state = 1;
+             sqe->opcode = IORING_OP_READ_FIXED;
+             sqe->fd = session->src_fd;
+             sqe->addr = (uintptr_t)(ring->buffers + i * URING_COPY_BLOCK);
+             sqe->len = slots[i].length;
+             sqe->off = next;
+             sqe->buf_index = i;
+             sqe->user_data = i;
+             next += slots[i].length;
+             in_flight++;
+         }
+         if (in_flight == 0) break;
+         if (uring_submit(ring, 1) != 0) {
+             error = errno;
+             break;
+         }
+         
+         while ((cqe = uring_peek(ring)) != NULL) {
+             UringSlot *slot = &slots[cqe->user_data];
+             char *buf = ring->buffers + cqe->user_data * URING_COPY_BLOCK;
+             int res = cqe->res;
+             
+             uring_seen(ring);
+             in_flight--;
+             if (res < 0) {
+                 if (!error) error = -res;
+                 slot->state = 0;
+                 continue;
+             }
+             if (slot->state == 1) {
+                 slot->got += res;
+                 // Fine del file: i blocchi successivi non vanno richiesti
+                 if (res == 0 && (eof < 0 || slot->offset + (off_t)slot->got < eof))
+                     eof = slot->offset + slot->got;
+                 if (res > 0 && slot->got < slot->length) {
+                     // Lettura parziale: si chiede il resto nello stesso buffer
+                     sqe = uring_get_sqe(ring);
+                     sqe->opcode = IORING_OP_READ_FIXED;
+                     sqe->fd = session->src_fd;
+                     sqe->addr = (uintptr_t)(buf + slot->got);
+                     sqe->len = slot->length - slot->got;
+                     sqe->off = slot->offset + slot->got;
+                     sqe->buf_index = slot - slots;
+                     sqe->user_data = slot - slots;
+                     in_flight++;
+                     continue;
+                 }
+                 if (slot->got == 0) {
+                     slot->state = 0;
+                     continue;
+                 }
+                 slot->state = 2;
+             } else {
+                 if (res == 0) {
+                     if (!error) error = EIO;
+                     slot->state = 0;
+                     continue;
+                 }
+                 slot->written += res;
+                 if (slot->written == slot->got) {
+                     slot->state = 0;
+                     continue;
+                 }
+             }
+             // Scrittura (o resto di una scrittura parziale) del buffer
+             sqe = uring_get_sqe(ring);
+             sqe->opcode = IORING_OP_WRITE_FIXED;
+             sqe->fd = session->dst_fd;
+             sqe->addr = (uintptr_t)(buf + slot->written);
+             sqe->len = slot->got - slot->written;
+             sqe->off = slot->offset + slot->written;
+             sqe->buf_index = slot - slots;
+             sqe->user_data = slot - slots;
+             in_flight++;
+         }
+     }
+     
+     // Dopo un errore si attendono le richieste ancora in volo sui buffer
+     while (in_flight > 0 && uring_submit(ring, 1) == 0) {
+         while (uring_peek(ring)) {
+             uring_seen(ring);
+             in_flight--;
+         }
+     }
+     if (in_flight > 0) {
+         // L'anello non risponde piu': non si puo' riutilizzare
+         uring_free(ring);
+         pthread_setspecific(uring_key, NULL);
+     }
+     if (error) {
+         errno = error;
+         return -1;
+     }
+     return (eof >= 0 ? eof : end) - offset;
+ }
+ #endif
+ 
+ // Copia al piu' length byte a partire da offset con il metodo corrente,
+ // passando al successivo se non e' supportato. Restituisce i byte copiati,
+ // 0 a fine file o -1 con errno
+ ssize_t copy_chunk(CopySession *session, off_t offset, size_t length) {
+     ssize_t n;
+     
+     while (1) {
+         switch (session->method) {
+ #if defined(__linux__) && defined(SYS_copy_file_range)
+             case COPY_RANGE: {
+                 loff_t in = offset, out = offset;
+                 perf_count(PERF_SYS_COPY);
+                 n = syscall(SYS_copy_file_range, session->src_fd, &in, session->dst_fd, &out, length, 0);
+                 if (n >= 0) return n;
+                 break;
+             }
+ #endif
+ #ifdef __linux__
+             case COPY_SENDFILE: {
+                 off_t in = offset;
+                 // sendfile scrive alla posizione corrente della destinazione
+                 if (lseek(session->dst_fd, offset, SEEK_SET) < 0) return -1;
+                 perf_count(PERF_SYS_COPY);
+                 n = sendfile(session->dst_fd, session->src_fd, &in, length);
+                 if (n >= 0) return n;
+                 break;
+             }
+ #endif
+ #ifdef HAVE_IO_URING
+             case COPY_URING:
+                 n = uring_copy_chunk(session, offset, length);
+                 if (n >= 0) return n;
+                 break;
+ #endif
+             case COPY_READWRITE:
+                 if (!session->buffer && !(session->buffer = malloc(COPY_BUFFER_SIZE)))
+                     return -1;
+                 if (length > COPY_BUFFER_SIZE) length = COPY_BUFFER_SIZE;
+                 do {
+                     perf_count(PERF_SYS_READ);
+                     n = pread(session->src_fd, session->buffer, length, offset);
+                 } while (n < 0 && errno == EINTR);
+                 if (n > 0 && pwrite_all(session->dst_fd, session->buffer, n, offset) != 0)
+                     return -1;
+                 return n;
+                 
+             default:
+                 // Metodo non disponibile su questa piattaforma
+                 session->method++;
+                 continue;
+         }
+         
+         // Gli offset sono espliciti, quindi si puo' cambiare metodo anche a meta' copia
+         if (errno == EINTR) continue;
+         if (!copy_method_unsupported(errno)) return -1;
+         session->method++;
+         set_copy_method(session->src_dev, session->dst_dev, session->method);
+     }
+ }
+ 
+ // Rilascia dalla page cache la zona copiata in precedenza e avvia la scrittura
+ // di quella appena copiata, cosi' una copia grande non svuota la cache degli
+ // altri processi
+ void copy_release_cache(CopySession *session, off_t offset, off_t length) {
+ #ifdef __linux__
+     if (length > 0)
+         sync_file_range(session->dst_fd, offset, length, SYNC_FILE_RANGE_WRITE);
+     if (session->prev_length > 0)
+         sync_file_range(session->dst_fd, session->prev_offset, session->prev_length,
+                         SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+ #endif
+ #ifdef POSIX_FADV_DONTNEED
+     if (session->prev_length > 0) {
+         posix_fadvise(session->src_fd, session->prev_offset, session->prev_length, POSIX_FADV_DONTNEED);
+         posix_fadvise(session->dst_fd, session->prev_offset, session->prev_length, POSIX_FADV_DONTNEED);
+     }
+ #endif
+     session->prev_offset = offset;
+     session->prev_length = length;
+ }
+ 
+ // Copia la zona [offset, offset + length); con length < 0 copia fino alla
+ // fine del file sorgente. Restituisce 0 o -1 con errno
+ int copy_range(CopySession *session, off_t offset, off_t length) {
+     while (length != 0) {
+         size_t chunk = length < 0 || length > COPY_CHUNK_SIZE ? COPY_CHUNK_SIZE : (size_t)length;
+         ssize_t n = copy_chunk(session, offset, chunk);
+         
+         if (n < 0) return -1;
+         if (n == 0) break;
+         
+         if (session->nocache)
+             copy_release_cache(session, offset, n);
+         offset += n;
+         if (length > 0) length -= n;
+         session->stats->bytes += n;
+         
+         if (session->control) {
+             atomic_fetch_add(&session->control->bytes_done, n);
+             if (copy_check_control(session->control) != 0)
+                 return -1;
+         }
+     }
+     return 0;
+ }
+ 
+ // Attende finche' la copia e' in pausa; restituisce -1 con errno ECANCELED
+ // se e' stata annullata
+ int copy_check_control(CopyControl *control) {
+     if (!control) return 0;
+     
+     while (atomic_load(&control->paused) && !atomic_load(&control->cancel))
+         usleep(50000);
+     
+     if (atomic_load(&control->cancel)) {
+         errno = ECANCELED;
+         return -1;
+     }
+     return 0;
+ }
+ 
+ // Copia i dati tra due descrittori provando, dal piu' veloce, reflink,
+ // copy_file_range, sendfile e read/write. I file sparsi sono copiati solo
+ // nelle zone con dati (SEEK_DATA/SEEK_HOLE), quelli densi vengono
+ // preallocati. Restituisce 0 o -1 con errno
+ int copy_fd_data(int src_fd, int dst_fd, const struct stat *st, CopyStats *stats, CopyControl *control) {
+     CopySession session;
+     struct stat dst_st;
+     int result = -1, saved_errno;
+     
+     if (fstat(dst_fd, &dst_st) != 0)
+         return -1;
+     
+     memset(&session, 0, sizeof(session));
+     session.src_fd = src_fd;
+     session.dst_fd = dst_fd;
+     session.src_dev = st->st_dev;
+     session.dst_dev = dst_st.st_dev;
+     session.stats = stats;
+     session.control = control;
+     
+     // I metodi nel kernel valgono solo per file regolari
+     session.method = S_ISREG(st->st_mode) ? get_copy_method(st->st_dev, dst_st.st_dev) : COPY_READWRITE;
+     
+ #ifdef __linux__
+     if (session.method == COPY_REFLINK) {
+         perf_count(PERF_SYS_COPY);
+         if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+             stats->method = COPY_REFLINK;
+             stats->bytes = st->st_size;
+             if (control) atomic_fetch_add(&control->bytes_done, st->st_size);
+             return 0;
+         }
+         if (!copy_method_unsupported(errno)) return -1;
+         set_copy_method(st->st_dev, dst_st.st_dev, COPY_RANGE);
+     }
+ #endif
+     if (session.method == COPY_REFLINK)
+         session.method = COPY_RANGE;
+ #ifdef HAVE_IO_URING
+     // Con "always" io_uring sostituisce anche i metodi nel kernel. Per un file
+     // che sta in un solo buffer non c'e' niente da sovrapporre
+     if (S_ISREG(st->st_mode) && config.io_uring == 2 && session.method < COPY_URING &&
+         st->st_size > URING_COPY_BLOCK)
+         session.method = COPY_URING;
+     if (session.method == COPY_URING && (st->st_size <= URING_COPY_BLOCK || !uring_available()))
+         session.method = COPY_READWRITE;
+ #endif
+     
+ #ifdef POSIX_FADV_SEQUENTIAL
+     posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+ #endif
+     session.nocache = S_ISREG(st->st_mode) && st->st_size >= COPY_NOCACHE_MIN;
+     
+ #ifdef SEEK_DATA
+     // Meno blocchi allocati che dati: il file ha dei buchi
+     if (S_ISREG(st->st_mode) && (off_t)st->st_blocks * 512 < st->st_size) {
+         off_t data = 0, hole;
+         int copied = 0;
+         
+         while ((data = lseek(src_fd, data, SEEK_DATA)) >= 0) {
+             if ((hole = lseek(src_fd, data, SEEK_HOLE)) < 0 ||
+                 copy_range(&session, data, hole - data) != 0)
+                 goto done;
+             data = hole;
+             copied = 1;
+         }
+         // ENXIO: dopo l'ultima zona ci sono solo buchi, e la dimensione
+         // finale ricrea il buco in coda senza scrivere zeri
+         if (errno == ENXIO) {
+             if (ftruncate(dst_fd, st->st_size) == 0)
+                 result = 0;
+             goto done;
+         }
+         if (copied) goto done;
+         // SEEK_DATA non supportato: si copia come file denso
+     }
+ #endif
+     
+ #ifdef __linux__
+     // File denso: prealloca lo spazio in un colpo solo (senza cambiare la dimensione)
+     if (S_ISREG(st->st_mode) && st->st_size > 0 &&
+         fallocate(dst_fd, FALLOC_FL_KEEP_SIZE, 0, st->st_size) != 0 && errno == ENOSPC)
+         goto done;
+ #endif
+     
+     result = copy_range(&session, 0, -1);
+     
+ done:
+     saved_errno = errno;
+     if (session.nocache)
+         copy_release_cache(&session, 0, 0);
+     stats->method = session.method;
+     free(session.buffer);
+     errno = saved_errno;
+     return result;
+ }
+ 
+ // Copia un file o, ricorsivamente, una directory. In caso di errore
+ // restituisce -1 con errno e l'operazione fallita in stats->failed_step
+ int copy_file(const char *src, const char *dst, CopyStats *stats, CopyControl *control) {
+     struct timespec start;
+     int result, saved_errno;
+     
+     perf_start(&start);
+     result = copy_path(src, dst, stats, control);
+     saved_errno = errno;
+     perf_end(PERF_COPY, &start, stats->files ? stats->files : result == 0, stats->bytes, src);
+     errno = saved_errno;
+     return result;
+ }
+ 
+ // Copia un file preservando permessi e date; in caso di errore rimuove la copia parziale
+ int copy_path(const char *src, const char *dst, CopyStats *stats, CopyControl *control) {
+     struct stat st, dst_st;
+     int src_fd, dst_fd, saved_errno;
+     
+     memset(stats, 0, sizeof(CopyStats));
+     if (copy_check_control(control) != 0) {
+         stats->failed_step = "Operazione annullata";
+         return -1;
+     }
+     
+     stats->failed_step = "Impossibile aprire il file sorgente";
+     perf_count(PERF_SYS_OPEN);
+     src_fd = open(src, O_RDONLY | O_CLOEXEC);
+     if (src_fd < 0)
+         return -1;
+     if (fstat(src_fd, &st) != 0) {
+         saved_errno = errno;
+         close(src_fd);
+         errno = saved_errno;
+         return -1;
+     }
+     if (S_ISDIR(st.st_mode)) {
+         close(src_fd);
+         return copy_tree(src, dst, stats, control);
+     }
+     
+     // Copiare un file su se stesso lo troncherebbe
+     if (stat(dst, &dst_st) == 0 && dst_st.st_dev == st.st_dev && dst_st.st_ino == st.st_ino) {
+         stats->failed_step = "Sorgente e destinazione coincidono";
+         close(src_fd);
+         errno = EINVAL;
+         return -1;
+     }
+     if (control)
+         atomic_store(&control->bytes_total, st.st_size);
+     
+     stats->failed_step = "Impossibile creare il file destinazione";
+     perf_count(PERF_SYS_OPEN);
+     dst_fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, (st.st_mode & 0777) | S_IWUSR);
+     if (dst_fd < 0) {
+         saved_errno = errno;
+         close(src_fd);
+         errno = saved_errno;
+         return -1;
+     }
+     
+     stats->failed_step = "Errore durante la copia";
+     if (copy_fd_data(src_fd, dst_fd, &st, stats, control) != 0)
+         goto fail;
+     
+     // Copia anche i permessi e le date
+     stats->failed_step = "Impossibile impostare permessi e date";
+     if (fchmod(dst_fd, st.st_mode & 07777) != 0)
+         goto fail;
+     {
+         struct timespec times[2];
+         set_times_from_stat(times, &st);
+         if (futimens(dst_fd, times) != 0)
+             goto fail;
+     }
+     
+     close(src_fd);
+     // Su NFS gli errori di scrittura possono emergere solo alla chiusura
+     stats->failed_step = "Errore durante la scrittura";
+     if (close(dst_fd) != 0) {
+         saved_errno = errno;
+         unlink(dst);
+         errno = saved_errno;
+         return -1;
+     }
+     stats->failed_step = NULL;
+     return 0;
+     
+ fail:
+     saved_errno = errno;
+     close(src_fd);
+     close(dst_fd);
+     unlink(dst);
+     errno = saved_errno;
+     return -1;
+ }
+ 
+ // Sposta un file: rinomina se possibile, altrimenti copia ed elimina
+ // la sorgente (solo se la copia e' riuscita)
+ int move_file(const char *src, const char *dst, CopyStats *stats, CopyControl *control) {
+     struct stat src_st, dst_st;
+     
+     memset(stats, 0, sizeof(CopyStats));
+     
+     // rename sovrascriverebbe la destinazione anche se e' lo stesso file
+     if (lstat(src, &src_st) == 0 && lstat(dst, &dst_st) == 0 &&
+         src_st.st_dev == dst_st.st_dev && src_st.st_ino == dst_st.st_ino) {
+         stats->failed_step = "Sorgente e destinazione coincidono";
+         errno = EINVAL;
+         return -1;
+     }
+     
+     // Prova a rinominare (funziona solo se src e dst sono sullo stesso filesystem)
+     if (rename(src, dst) == 0)
+         return 0;
+     if (errno != EXDEV) {
+         stats->failed_step = "Impossibile spostare il file";
+         return -1;
+     }
+     
+     if (copy_file(src, dst, stats, control) != 0)
+         return -1;
+     
+     // Gli errori raccolti dalla copia servono ancora: la rimozione usa statistiche proprie
+     CopyStats delete_stats;
+     int result = delete_file(src, &delete_stats, control);
+     if (result != 0) {
+         int saved_errno = errno;
+         stats->failed_step = delete_stats.failed_step;
+         free_copy_stats(&delete_stats);
+         errno = saved_errno;
+     }
+     return result;
+ }
+ 
+ // Elimina un file o, ricorsivamente, una directory; in caso di errore
+ // restituisce -1 con errno e l'operazione fallita in stats->failed_step
+ int delete_file(const char *path, CopyStats *stats, CopyControl *control) {
+     struct timespec start;
+     int result, saved_errno;
+     
+     perf_start(&start);
+     result = delete_path(path, stats, control);
+     saved_errno = errno;
+     perf_end(PERF_DELETE, &start, stats->files, 0, path);
+     errno = saved_errno;
+     return result;
+ }
+ 
+ // Eliminazione vera e propria, senza misura
+ int delete_path(const char *path, CopyStats *stats, CopyControl *control) {
+     struct stat st;
+     
+     memset(stats, 0, sizeof(CopyStats));
+     
+     // lstat: un link simbolico a una directory si elimina come un file
+     if (lstat(path, &st) != 0) {
+         stats->failed_step = "File non trovato";
+         return -1;
+     }
+     
+     if (S_ISDIR(st.st_mode))
+         return delete_tree(path, stats, control);
+     
+     perf_count(PERF_SYS_UNLINK);
+     if (unlink(path) != 0) {
+         stats->failed_step = "Impossibile eliminare il file";
+         return -1;
+     }
+     stats->files = 1;
+     if (control) atomic_fetch_add(&control->files_done, 1);
+     return 0;
+ }
+ 
+ // Libera gli errori raccolti in una CopyStats
+ void free_copy_stats(CopyStats *stats) {
+     int i;
+     
+     for (i = 0; i < stats->num_errors; i++)
+         free(stats->errors[i]);
+     free(stats->errors);
+     stats->errors = NULL;
+     stats->num_errors = 0;
+ }
+ 
+ // Data di modifica di un file con i nanosecondi
+ struct timespec stat_mtime(const struct stat *st) {
+ #ifdef __APPLE__
+     return st->st_mtimespec;
+ #else
+     return st->st_mtim;
+ #endif
+ }
+ 
+ // Data dell'ultimo cambiamento dell'inode con i nanosecondi
+ struct timespec stat_ctime(const struct stat *st) {
+ #ifdef __APPLE__
+     return st->st_ctimespec;
+ #else
+     return st->st_ctim;
+ #endif
+ }
+ 
+ // Date di accesso e modifica di un file, nel formato di futimens/utimensat
+ void set_times_from_stat(struct timespec times[2], const struct stat *st) {
+ #ifdef __APPLE__
+     times[0] = st->st_atimespec;
+     times[1] = st->st_mtimespec;
+ #else
+     times[0] = st->st_atim;
+     times[1] = st->st_mtim;
+ #endif
+ }
+ 
+ // Crea il nodo di una directory figlia di parent (che ne resta referenziato)
+ TreeNode *tree_node_new(TreeNode *parent, const char *name, size_t len) {
+     TreeNode *node = malloc(sizeof(TreeNode) + len + 1);
+     
+     if (!node) return NULL;
+     node->parent = parent;
+     node->src_fd = node->dst_fd = -1;
+     atomic_init(&node->refs, 1);
+     atomic_init(&node->failed, 0);
+     atomic_init(&node->apparent, 0);
+     atomic_init(&node->allocated, 0);
+     atomic_init(&node->files, 0);
+     node->dev = 0;
+     node->ino = 0;
+     memcpy(node->name, name, len);
+     node->name[len] = '\0';
+     if (parent)
+         atomic_fetch_add(&parent->refs, 1);
+     return node;
+ }
+ 
+ // Percorso di un nodo relativo alla radice dell'operazione (vuoto per la radice)
+ size_t tree_node_path(TreeNode *node, char *buf, size_t size) {
+     size_t len = 0;
+     
+     if (node && node->parent) {
+         len = tree_node_path(node->parent, buf, size);
+         len += snprintf(buf + len, len < size ? size - len : 0, "%s%s", len ? "/" : "", node->name);
+     } else if (size > 0) {
+         buf[0] = '\0';
+     }
+     return len < size ? len : size - 1;
+ }
+ 
+ // Registra un errore su un'entry della directory node (name vuoto: la directory stessa)
+ void tree_error(TreeOp *op, TreeNode *node, const char *name, const char *step, int err) {
+     char rel[MAX_PATH_LEN];
+     char message[MAX_PATH_LEN + 256];
+     CopyStats *stats = op->stats;
+     
+     // L'annullamento non e' un errore dell'entry
+     if (err == ECANCELED) {
+         atomic_store(&op->stop, 1);
+         return;
+     }
+     
+     if (node) {
+         atomic_store(&node->failed, 1);
+         tree_node_path(node, rel, sizeof(rel));
+         if (op->group)
+             tree_group_failed(op, node, name);
+     } else {
+         rel[0] = '\0';
+     }
+     snprintf(message, sizeof(message), "%s%s%s%s%s: %s: %s", op->src_root,
+              rel[0] ? "/" : "", rel, name[0] ? "/" : "", name, step, strerror(err));
+     
+     pthread_mutex_lock(&op->errors_lock);
+     if (!op->first_errno) {
+         op->first_errno = err;
+         op->first_step = step;
+     }
+     if (stats->num_errors < MAX_TREE_ERRORS) {
+         char **errors = realloc(stats->errors, (stats->num_errors + 1) * sizeof(char *));
+         if (errors) {
+             stats->errors = errors;
+             if ((errors[stats->num_errors] = strdup(message)) != NULL)
+                 stats->num_errors++;
+         }
+     }
+     pthread_mutex_unlock(&op->errors_lock);
+     
+     if (!op->keep_going)
+         atomic_store(&op->stop, 1);
+ }
+ 
+ // Accoda una directory nella coda del thread index
+ void tree_push(TreeOp *op, int index, TreeNode *node) {
+     TreeDeque *deque = &op->deques[index];
+     
+     atomic_fetch_add(&op->pending, 1);
+     pthread_mutex_lock(&deque->lock);
+     if (deque->tail == deque->cap) {
+         if (deque->head > 0) {
+             memmove(deque->items, deque->items + deque->head, (deque->tail - deque->head) * sizeof(TreeNode *));
+             deque->tail -= deque->head;
+             deque->head = 0;
+         } else {
+             int cap = deque->cap ? deque->cap * 2 : 64;
+             TreeNode **items = realloc(deque->items, cap * sizeof(TreeNode *));
+             if (!items) {
+                 // Senza memoria la directory viene elaborata subito dal chiamante
+                 pthread_mutex_unlock(&deque->lock);
+                 tree_process(op, index, node);
+                 tree_release(op, node);
+                 atomic_fetch_sub(&op->pending, 1);
+                 return;
+             }
+             deque->items = items;
+             deque->cap = cap;
+         }
+     }
+     deque->items[deque->tail++] = node;
+     pthread_mutex_unlock(&deque->lock);
+     
+     pthread_cond_signal(&op->idle_cond);
+ }
+ 
+ // Prende una directory dal fondo della propria coda o, se vuota, la ruba
+ // dalla cima di quella di un altro thread
+ TreeNode *tree_take(TreeOp *op, int index) {
+     TreeNode *node = NULL;
+     int i;
+     
+     for (i = 0; i < op->num_workers && !node; i++) {
+         TreeDeque *deque = &op->deques[(index + i) % op->num_workers];
+         
+         pthread_mutex_lock(&deque->lock);
+         if (deque->tail > deque->head)
+             node = i == 0 ? deque->items[--deque->tail] : deque->items[deque->head++];
+         if (deque->head == deque->tail)
+             deque->head = deque->tail = 0;
+         pthread_mutex_unlock(&deque->lock);
+     }
+     return node;
+ }
+ 
+ // Rilascia un riferimento al nodo; l'ultimo completa la directory e
+ // risale verso la radice
+ void tree_release(TreeOp *op, TreeNode *node) {
+     while (node && atomic_fetch_sub(&node->refs, 1) == 1) {
+         TreeNode *parent = node->parent;
+         
+         // La radice di un'operazione di gruppo e' la directory del pannello:
+         // resta com'e', e i descrittori sono di chi ha avviato l'operazione
+         if (!parent && op->group) {
+             free(node);
+             break;
+         }
+         if (op->type == TREE_COPY && node->dst_fd >= 0) {
+             // Permessi definitivi solo ora: la directory poteva essere in sola lettura
+             if (op->preserve_owner && fchown(node->dst_fd, node->uid, node->gid) != 0)
+                 tree_error(op, parent, node->name, "Impossibile impostare il proprietario", errno);
+             if (fchmod(node->dst_fd, node->mode & 07777) != 0 || futimens(node->dst_fd, node->times) != 0)
+                 tree_error(op, parent, node->name, "Impossibile impostare permessi e date", errno);
+         }
+         if (node->src_fd >= 0) close(node->src_fd);
+         if (node->dst_fd >= 0) close(node->dst_fd);
+         
+         if (op->type == TREE_DELETE) {
+             int dir_fd = parent ? parent->src_fd : op->root_parent_fd;
+             
+             if (atomic_load(&node->failed) || atomic_load(&op->stop)) {
+                 // Una directory non svuotata non si puo' rimuovere
+                 if (parent) atomic_store(&parent->failed, 1);
+             } else if (unlinkat(dir_fd, node->name, AT_REMOVEDIR) != 0) {
+                 tree_error(op, parent, parent ? node->name : "", "Impossibile eliminare la directory", errno);
+             } else {
+                 atomic_fetch_add(&op->files, 1);
+                 if (op->control) atomic_fetch_add(&op->control->files_done, 1);
+             }
+         } else if (op->type == TREE_SIZE) {
+             // Il totale della directory e' completo: resta in cache e si somma al padre
+             if (!atomic_load(&op->stop))
+                 size_cache_store(node, atomic_load(&node->failed));
+             if (parent) {
+                 atomic_fetch_add(&parent->apparent, atomic_load(&node->apparent));
+                 atomic_fetch_add(&parent->allocated, atomic_load(&node->allocated));
+                 atomic_fetch_add(&parent->files, atomic_load(&node->files));
+                 if (atomic_load(&node->failed)) atomic_store(&parent->failed, 1);
+             }
+         } else if (atomic_load(&node->failed) && parent) {
+             atomic_store(&parent->failed, 1);
+         }
+         
+         free(node);
+         node = parent;
+     }
+ }
+ 
+ // Copia un'entry non directory della directory node
+ void tree_copy_entry(TreeOp *op, TreeNode *node, const char *name, const struct stat *st) {
+     struct timespec times[2];
+     char rel[MAX_PATH_LEN];
+     
+     set_times_from_stat(times, st);
+     
+     if (S_ISREG(st->st_mode)) {
+         LinkEntry *link = NULL;
+         CopyStats file_stats;
+         int in_fd, out_fd;
+         
+         // I file con piu' link fisici si copiano una volta sola, poi si ricollegano
+         if (st->st_nlink > 1) {
+             size_t len = tree_node_path(node, rel, sizeof(rel));
+             unsigned bucket = (unsigned)((st->st_ino ^ st->st_dev) % LINK_BUCKETS);
+             
+             snprintf(rel + len, sizeof(rel) - len, "%s%s", len ? "/" : "", name);
+             pthread_mutex_lock(&op->links_lock);
+             for (link = op->links[bucket]; link; link = link->next) {
+                 if (link->ino == st->st_ino && link->dev == st->st_dev) break;
+             }
+             if (link) {
+                 snprintf(rel, sizeof(rel), "%s", link->path);
+             } else if ((link = malloc(sizeof(LinkEntry) + strlen(rel) + 1)) != NULL) {
+                 link->dev = st->st_dev;
+                 link->ino = st->st_ino;
+                 strcpy(link->path, rel);
+                 link->next = op->links[bucket];
+                 op->links[bucket] = link;
+                 link = NULL; // Prima occorrenza: va copiata
+             }
+             pthread_mutex_unlock(&op->links_lock);
+             
+             if (link) {
+                 if (linkat(op->dst_root_fd, rel, node->dst_fd, name, 0) != 0 &&
+                     (errno != EEXIST || unlinkat(node->dst_fd, name, 0) != 0 ||
+                      linkat(op->dst_root_fd, rel, node->dst_fd, name, 0) != 0))
+                     tree_error(op, node, name, "Impossibile creare il link fisico", errno);
+                 return;
+             }
+         }
+         
+         perf_count(PERF_SYS_OPEN);
+         in_fd = openat(node->src_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+         if (in_fd < 0) {
+             tree_error(op, node, name, "Impossibile aprire il file sorgente", errno);
+             return;
+         }
+         perf_count(PERF_SYS_OPEN);
+         out_fd = openat(node->dst_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                         (st->st_mode & 0777) | S_IWUSR);
+         if (out_fd < 0) {
+             tree_error(op, node, name, "Impossibile creare il file destinazione", errno);
+             close(in_fd);
+             return;
+         }
+         
+         memset(&file_stats, 0, sizeof(file_stats));
+         const char *step = NULL;
+         if (copy_fd_data(in_fd, out_fd, st, &file_stats, op->control) != 0)
+             step = "Errore durante la copia";
+         else if (op->preserve_owner && fchown(out_fd, st->st_uid, st->st_gid) != 0)
+             step = "Impossibile impostare il proprietario";
+         else if (fchmod(out_fd, st->st_mode & 07777) != 0 || futimens(out_fd, times) != 0)
+             step = "Impossibile impostare permessi e date";
+         int err = errno;
+         
+         close(in_fd);
+         if (close(out_fd) != 0 && !step) {
+             step = "Errore durante la scrittura";
+             err = errno;
+         }
+         atomic_fetch_add(&op->bytes, file_stats.bytes);
+         if (step) {
+             unlinkat(node->dst_fd, name, 0);
+             tree_error(op, node, name, step, err);
+         }
+     } else if (S_ISLNK(st->st_mode)) {
+         char target[MAX_PATH_LEN];
+         ssize_t len = readlinkat(node->src_fd, name, target, sizeof(target) - 1);
+         
+         if (len < 0) {
+             tree_error(op, node, name, "Impossibile leggere il link simbolico", errno);
+             return;
+         }
+         target[len] = '\0';
+         if (symlinkat(target, node->dst_fd, name) != 0 &&
+             (errno != EEXIST || unlinkat(node->dst_fd, name, 0) != 0 ||
+              symlinkat(target, node->dst_fd, name) != 0)) {
+             tree_error(op, node, name, "Impossibile creare il link simbolico", errno);
+             return;
+         }
+         if (op->preserve_owner)
+             fchownat(node->dst_fd, name, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW);
+         utimensat(node->dst_fd, name, times, AT_SYMLINK_NOFOLLOW);
+     } else {
+         // FIFO, dispositivi e socket vengono ricreati
+         if (mknodat(node->dst_fd, name, st->st_mode, st->st_rdev) != 0 &&
+             (errno != EEXIST || unlinkat(node->dst_fd, name, 0) != 0 ||
+              mknodat(node->dst_fd, name, st->st_mode, st->st_rdev) != 0)) {
+             tree_error(op, node, name, "Impossibile creare il file speciale", errno);
+             return;
+         }
+         if (op->preserve_owner)
+             fchownat(node->dst_fd, name, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW);
+         fchmodat(node->dst_fd, name, st->st_mode & 07777, 0);
+         utimensat(node->dst_fd, name, times, AT_SYMLINK_NOFOLLOW);
+     }
+ }
+ 
+ // Elabora una directory: ne apre i descrittori relativi al padre, copia o
+ // elimina le entry e accoda le sottodirectory
+ void tree_process(TreeOp *op, int index, TreeNode *node) {
+     DirScan scan;
+     const char *name;
+     size_t len;
+     unsigned char type;
+     struct stat st;
+     long long apparent = 0, allocated = 0, files = 0;
+     int result;
+     
+     if (atomic_load(&op->stop) || copy_check_control(op->control) != 0) {
+         atomic_store(&op->stop, 1);
+         return;
+     }
+     
+     if (node->src_fd < 0) {
+         perf_count(PERF_SYS_OPEN);
+         node->src_fd = openat(node->parent->src_fd, node->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+         if (node->src_fd < 0) {
+             tree_error(op, node->parent, node->name, "Impossibile aprire la directory", errno);
+             return;
+         }
+     }
+     if (op->type == TREE_COPY && node->dst_fd < 0) {
+         perf_count(PERF_SYS_OPEN);
+         node->dst_fd = openat(node->parent->dst_fd, node->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+         if (node->dst_fd < 0) {
+             tree_error(op, node->parent, node->name, "Impossibile aprire la directory destinazione", errno);
+             return;
+         }
+     }
+     
+     if (dirscan_init(&scan, node->src_fd) != 0) {
+         tree_error(op, node, "", "Memoria insufficiente", ENOMEM);
+         return;
+     }
+     
+     while ((result = dirscan_next(&scan, &name, &len, &type)) > 0) {
+         if (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.')))
+             continue;
+         if (atomic_load(&op->stop))
+             break;
+         
+         // Per eliminare basta d_type; la stat serve solo se il tipo e' ignoto
+         if (op->type == TREE_DELETE && type != DT_UNKNOWN && type != DT_DIR) {
+             perf_count(PERF_SYS_UNLINK);
+             if (unlinkat(node->src_fd, name, 0) != 0)
+                 tree_error(op, node, name, "Impossibile eliminare il file", errno);
+             else {
+                 atomic_fetch_add(&op->files, 1);
+                 if (op->control) atomic_fetch_add(&op->control->files_done, 1);
+             }
+             continue;
+         }
+         
+         perf_count(PERF_SYS_STAT);
+         if (fstatat(node->src_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+             tree_error(op, node, name, "Impossibile leggere i metadati", errno);
+             continue;
+         }
+         
+         if (op->type == TREE_SIZE && !S_ISDIR(st.st_mode)) {
+             // I file con piu' link fisici si contano una volta sola
+             if (st.st_nlink > 1 && tree_link_seen(op, &st))
+                 continue;
+             apparent += st.st_size;
+             allocated += (long long)st.st_blocks * 512;
+             files++;
+             continue;
+         }
+         
+         // Come du -x, i filesystem montati all'interno non si contano
+         if (S_ISDIR(st.st_mode) && op->type == TREE_SIZE && st.st_dev != op->root_dev)
+             continue;
+         tree_entry(op, index, node, name, len, &st);
+     }
+     if (result < 0)
+         tree_error(op, node, "", "Errore durante la lettura della directory", errno);
+     dirscan_detach(&scan);
+     
+     if (op->type == TREE_SIZE) {
+         atomic_fetch_add(&node->apparent, apparent);
+         atomic_fetch_add(&node->allocated, allocated);
+         atomic_fetch_add(&node->files, files);
+         atomic_fetch_add(&op->bytes, apparent);
+         atomic_fetch_add(&op->files, files);
+         if (op->control) {
+             atomic_fetch_add(&op->control->bytes_done, apparent);
+             atomic_fetch_add(&op->control->files_done, files);
+         }
+     }
+ }
+ 
+ // Elabora un'entry della directory node: una sottodirectory viene creata
+ // (nella copia) e accodata, gli altri file copiati o eliminati
+ void tree_entry(TreeOp *op, int index, TreeNode *node, const char *name, size_t len, const struct stat *st) {
+     if (S_ISDIR(st->st_mode)) {
+         TreeNode *child;
+         
+         if (op->type == TREE_COPY && mkdirat(node->dst_fd, name, 0700) != 0) {
+             struct stat dst_st;
+             // Una directory gia' esistente viene unita
+             if (errno != EEXIST || fstatat(node->dst_fd, name, &dst_st, 0) != 0 || !S_ISDIR(dst_st.st_mode)) {
+                 tree_error(op, node, name, "Impossibile creare la directory", errno == EEXIST ? ENOTDIR : errno);
+                 return;
+             }
+         }
+         
+         child = tree_node_new(node, name, len);
+         if (!child) {
+             tree_error(op, node, name, "Memoria insufficiente", ENOMEM);
+             return;
+         }
+         child->mode = st->st_mode;
+         child->uid = st->st_uid;
+         child->gid = st->st_gid;
+         child->dev = st->st_dev;
+         child->ino = st->st_ino;
+         set_times_from_stat(child->times, st);
+         if (op->type == TREE_SIZE) {
+             // La directory stessa fa parte del totale
+             atomic_store(&child->apparent, st->st_size);
+             atomic_store(&child->allocated, (long long)st->st_blocks * 512);
+         }
+         tree_push(op, index, child);
+         return;
+     }
+     
+     if (op->type == TREE_COPY) {
+         tree_copy_entry(op, node, name, st);
+     } else {
+         perf_count(PERF_SYS_UNLINK);
+         if (unlinkat(node->src_fd, name, 0) != 0) {
+             tree_error(op, node, name, "Impossibile eliminare il file", errno);
+             return;
+         }
+     }
+     atomic_fetch_add(&op->files, 1);
+     if (op->control) atomic_fetch_add(&op->control->files_done, 1);
+ }
+ 
+ // Elabora la prossima entry di un'operazione di gruppo; 0 se non ne restano.
+ // Ogni thread ne prende una alla volta, cosi' piu' file sono in corso insieme
+ int tree_group_next(TreeOp *op, int index) {
+     TreeNode *root = op->group_root;
+     GroupEntry *entry;
+     struct stat st;
+     int i, expected = GROUP_QUEUED;
+     
+     // L'entry in corso conta come lavoro in sospeso: gli altri thread non
+     // terminano finche' puo' ancora accodare una directory
+     atomic_fetch_add(&op->pending, 1);
+     if (atomic_load(&op->stop) || copy_check_control(op->control) != 0) {
+         atomic_store(&op->stop, 1);
+         atomic_fetch_sub(&op->pending, 1);
+         return 0;
+     }
+     do {
+         i = atomic_fetch_add(&op->group_next, 1);
+     } while (i < op->group_count && atomic_load(&op->group_order[i]->state) != op->group_state);
+     if (i >= op->group_count) {
+         atomic_fetch_sub(&op->pending, 1);
+         return 0;
+     }
+     entry = op->group_order[i];
+     
+     if (entry->inside) {
+         tree_error(op, root, entry->name, "Impossibile copiare una directory dentro se stessa", EINVAL);
+     } else if (op->rename_first && renameat(root->src_fd, entry->name, root->dst_fd, entry->name) == 0) {
+         atomic_store(&entry->state, GROUP_MOVED);
+         atomic_fetch_add(&op->files, 1);
+         if (op->control) atomic_fetch_add(&op->control->files_done, 1);
+     } else if (op->rename_first && errno != EXDEV) {
+         tree_error(op, root, entry->name, "Impossibile spostare il file", errno);
+     } else {
+         perf_count(PERF_SYS_STAT);
+         if (fstatat(root->src_fd, entry->name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+             tree_error(op, root, entry->name, "Impossibile leggere i metadati", errno);
+         } else {
+             tree_entry(op, index, root, entry->name, strlen(entry->name), &st);
+             // Un errore nel sottoalbero di una directory puo' ancora segnarla come fallita
+             atomic_compare_exchange_strong(&entry->state, &expected, GROUP_DONE);
+         }
+     }
+     atomic_fetch_sub(&op->pending, 1);
+     return 1;
+ }
+ 
+ // Segna come fallita l'entry di un'operazione di gruppo che contiene
+ // l'entry name della directory node
+ void tree_group_failed(TreeOp *op, TreeNode *node, const char *name) {
+     GroupEntry key, *entry;
+     
+     while (node->parent && node->parent->parent)
+         node = node->parent;
+     key.name = node->parent ? node->name : name;
+     entry = bsearch(&key, op->group, op->group_count, sizeof(GroupEntry), compare_group_names);
+     if (entry)
+         atomic_store(&entry->state, GROUP_FAILED);
+ }
+ 
+ int compare_group_names(const void *a, const void *b) {
+     return strcmp(((const GroupEntry *)a)->name, ((const GroupEntry *)b)->name);
+ }
+ 
+ int compare_group_inodes(const void *a, const void *b) {
+     ino_t x = (*(GroupEntry * const *)a)->ino, y = (*(GroupEntry * const *)b)->ino;
+     return x < y ? -1 : x > y;
+ }
+ 
+ // Thread di un'operazione ricorsiva: elabora directory finche' ce ne sono
+ void *tree_worker(void *data) {
+     TreeWorker *worker = data;
+     TreeOp *op = worker->op;
+     
+     while (1) {
+         TreeNode *node = tree_take(op, worker->index);
+         
+         if (node) {
+             tree_process(op, worker->index, node);
+             tree_release(op, node);
+             atomic_fetch_sub(&op->pending, 1);
+             continue;
+         }
+         // Le directory gia' accodate hanno la precedenza sulle entry del gruppo
+         if (op->group && tree_group_next(op, worker->index))
+             continue;
+         if (atomic_load(&op->pending) == 0)
+             break;
+         
+         // Altri thread stanno ancora scandendo: attende nuove directory
+         struct timespec deadline;
+         clock_gettime(CLOCK_REALTIME, &deadline);
+         deadline.tv_nsec += 5 * 1000 * 1000;
+         if (deadline.tv_nsec >= 1000000000L) {
+             deadline.tv_sec++;
+             deadline.tv_nsec -= 1000000000L;
+         }
+         pthread_mutex_lock(&op->idle_lock);
+         if (atomic_load(&op->pending) > 0)
+             pthread_cond_timedwait(&op->idle_cond, &op->idle_lock, &deadline);
+         pthread_mutex_unlock(&op->idle_lock);
+     }
+     return NULL;
+ }
+ 
+ // Esegue l'operazione ricorsiva a partire dalla radice (gia' aperta) con
+ // config.tree_threads thread; restituisce 0 o -1 con errno
+ int run_tree_op(TreeOp *op, TreeNode *root) {
+     pthread_t threads[MAX_TREE_THREADS];
+     TreeWorker workers[MAX_TREE_THREADS];
+     int i, started = 0;
+     
+     // Un calcolo delle dimensioni non si ferma per una directory illeggibile
+     op->keep_going = config.keep_going || op->type == TREE_SIZE;
+     op->preserve_owner = geteuid() == 0;
+     op->num_workers = config.tree_threads;
+     atomic_init(&op->stop, 0);
+     atomic_init(&op->pending, 0);
+     atomic_init(&op->bytes, 0);
+     atomic_init(&op->files, 0);
+     pthread_mutex_init(&op->idle_lock, NULL);
+     pthread_cond_init(&op->idle_cond, NULL);
+     pthread_mutex_init(&op->links_lock, NULL);
+     pthread_mutex_init(&op->errors_lock, NULL);
+     for (i = 0; i < op->num_workers; i++)
+         pthread_mutex_init(&op->deques[i].lock, NULL);
+     atomic_init(&op->group_next, 0);
+     
+     // In un'operazione di gruppo la radice non si scandisce: i thread ne
+     // prendono le entry da op->group
+     if (op->group)
+         op->group_root = root;
+     else
+         tree_push(op, 0, root);
+     
+     // Il thread chiamante e' il lavoratore 0
+     for (i = 1; i < op->num_workers; i++) {
+         workers[i].op = op;
+         workers[i].index = i;
+         if (pthread_create(&threads[i], NULL, tree_worker, &workers[i]) != 0)
+             break;
+         started++;
+     }
+     workers[0].op = op;
+     workers[0].index = 0;
+     tree_worker(&workers[0]);
+     for (i = 1; i <= started; i++)
+         pthread_join(threads[i], NULL);
+     if (op->group)
+         tree_release(op, root);
+     
+     for (i = 0; i < op->num_workers; i++) {
+         free(op->deques[i].items);
+         pthread_mutex_destroy(&op->deques[i].lock);
+     }
+     for (i = 0; i < LINK_BUCKETS; i++) {
+         while (op->links[i]) {
+             LinkEntry *next = op->links[i]->next;
+             free(op->links[i]);
+             op->links[i] = next;
+         }
+     }
+     pthread_mutex_destroy(&op->idle_lock);
+     pthread_cond_destroy(&op->idle_cond);
+     pthread_mutex_destroy(&op->links_lock);
+     pthread_mutex_destroy(&op->errors_lock);
+     
+     op->stats->bytes += atomic_load(&op->bytes);
+     op->stats->files += atomic_load(&op->files);
+     
+     if (op->first_errno) {
+         static char summary[64];
+         // Con piu' errori il riepilogo rimanda all'elenco completo
+         if (op->stats->num_errors > 1) {
+             snprintf(summary, sizeof(summary), "%d errori", op->stats->num_errors);
+             op->stats->failed_step = summary;
+         } else {
+             op->stats->failed_step = op->first_step;
+         }
+         errno = op->first_errno;
+         return -1;
+     }
+     if (op->control && atomic_load(&op->control->cancel)) {
+         op->stats->failed_step = "Operazione annullata";
+         errno = ECANCELED;
+         return -1;
+     }
+     return 0;
+ }
+ 
+ // Copia ricorsivamente una directory (che puo' gia' esistere: il contenuto
+ // viene unito). Link simbolici, link fisici, file speciali, permessi e date
+ // vengono riprodotti; il proprietario solo se si e' root
+ int copy_tree(const char *src, const char *dst, CopyStats *stats, CopyControl *control) {
+     TreeOp op;
+     TreeNode *root;
+     struct stat st;
+     char *src_real, *dst_parent_real;
+     char dst_parent[MAX_PATH_LEN];
+     const char *slash = strrchr(dst, '/');
+     int inside;
+     
+     // Una directory non si puo' copiare su se stessa ne' al proprio interno
+     snprintf(dst_parent, sizeof(dst_parent), "%.*s", slash && slash != dst ? (int)(slash - dst) : 1,
+              slash ? dst : ".");
+     src_real = realpath(src, NULL);
+     dst_parent_real = realpath(dst_parent, NULL);
+     inside = 0;
+     if (src_real && dst_parent_real) {
+         char dst_real[MAX_PATH_LEN];
+         size_t len = strlen(src_real);
+         
+         snprintf(dst_real, sizeof(dst_real), "%s/%s", strcmp(dst_parent_real, "/") ? dst_parent_real : "",
+                  slash ? slash + 1 : dst);
+         inside = strncmp(dst_real, src_real, len) == 0 && (dst_real[len] == '\0' || dst_real[len] == '/');
+     }
+     free(src_real);
+     free(dst_parent_real);
+     if (inside) {
+         stats->failed_step = "Impossibile copiare una directory dentro se stessa";
+         errno = EINVAL;
+         return -1;
+     }
+     
+     memset(&op, 0, sizeof(op));
+     op.type = TREE_COPY;
+     op.src_root = src;
+     op.stats = stats;
+     op.control = control;
+     
+     root = tree_node_new(NULL, "", 0);
+     if (!root) {
+         stats->failed_step = "Memoria insufficiente";
+         errno = ENOMEM;
+         return -1;
+     }
+     stats->failed_step = "Impossibile aprire la directory sorgente";
+     root->src_fd = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+     if (root->src_fd < 0 || fstat(root->src_fd, &st) != 0)
+         goto fail;
+     root->mode = st.st_mode;
+     root->uid = st.st_uid;
+     root->gid = st.st_gid;
+     set_times_from_stat(root->times, &st);
+     
+     stats->failed_step = "Impossibile creare la directory destinazione";
+     if (mkdir(dst, 0700) != 0 && errno != EEXIST)
+         goto fail;
+     root->dst_fd = open(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+     if (root->dst_fd < 0)
+         goto fail;
+     op.dst_root_fd = root->dst_fd;
+     stats->failed_step = NULL;
+     
+     return run_tree_op(&op, root);
+     
+ fail:
+     {
+         int saved_errno = errno;
+         if (root->src_fd >= 0) close(root->src_fd);
+         if (root->dst_fd >= 0) close(root->dst_fd);
+         free(root);
+         errno = saved_errno;
+     }
+     return -1;
+ }
+ 
+ // Elimina ricorsivamente una directory senza seguire i link simbolici
+ int delete_tree(const char *path, CopyStats *stats, CopyControl *control) {
+     TreeOp op;
+     TreeNode *root;
+     char parent[MAX_PATH_LEN];
+     const char *slash = strrchr(path, '/');
+     const char *name = slash ? slash + 1 : path;
+     int result;
+     
+     memset(&op, 0, sizeof(op));
+     op.type = TREE_DELETE;
+     op.src_root = path;
+     op.stats = stats;
+     op.control = control;
+     
+     snprintf(parent, sizeof(parent), "%.*s", slash && slash != path ? (int)(slash - path) : 1,
+              slash ? path : ".");
+     stats->failed_step = "Impossibile aprire la directory";
+     op.root_parent_fd = open(parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+     if (op.root_parent_fd < 0)
+         return -1;
+     
+     root = tree_node_new(NULL, name, strlen(name));
+     if (!root) {
+         close(op.root_parent_fd);
+         errno = ENOMEM;
+         return -1;
+     }
+     root->src_fd = openat(op.root_parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+     if (root->src_fd < 0) {
+         int saved_errno = errno;
+         close(op.root_parent_fd);
+         free(root);
+         errno = saved_errno;
+         return -1;
+     }
+     stats->failed_step = NULL;
+     
+     result = run_tree_op(&op, root);
+     int saved_errno = errno;
+     close(op.root_parent_fd);
+     errno = saved_errno;
+     return result;
+ }
+ 
+ // Copia o sposta nella directory dst_dir, oppure elimina, le entry names
+ // della directory src_dir come un'unica operazione. Le entry si elaborano
+ // in ordine di inode, che nei filesystem comuni segue la posizione dei
+ // metadati sul disco, da piu' thread insieme; il contenuto delle directory
+ // prosegue come nelle operazioni ricorsive. Lo spostamento rinomina dove
+ // puo' e copia le altre entry, eliminandole solo se copiate senza errori
+ int group_operation(int type, const char *src_dir, const char *dst_dir, char **names, int count,
+                     CopyStats *stats, CopyControl *control) {
+     TreeOp op;
+     TreeNode *root;
+     GroupEntry *entries, **order;
+     struct stat src_st, dst_st, st;
+     struct timespec start;
+     char *src_real = NULL, *dst_real = NULL;
+     long long total = 0;
+     int src_fd = -1, dst_fd = -1, has_dirs = 0, result = -1, saved_errno, i;
+     
+     memset(stats, 0, sizeof(CopyStats));
+     perf_start(&start);
+     entries = calloc(count, sizeof(GroupEntry));
+     order = malloc(count * sizeof(GroupEntry *));
+     stats->failed_step = "Memoria insufficiente";
+     errno = ENOMEM;
+     if (!entries || !order)
+         goto done;
+     
+     stats->failed_step = "Impossibile aprire la directory sorgente";
+     src_fd = open(src_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+     if (src_fd < 0 || fstat(src_fd, &src_st) != 0)
+         goto done;
+     if (dst_dir) {
+         stats->failed_step = "Impossibile aprire la directory destinazione";
+         dst_fd = open(dst_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+         if (dst_fd < 0 || fstat(dst_fd, &dst_st) != 0)
+             goto done;
+         // Copiare un file su se stesso lo troncherebbe
+         if (dst_st.st_dev == src_st.st_dev && dst_st.st_ino == src_st.st_ino) {
+             stats->failed_step = "Sorgente e destinazione coincidono";
+             errno = EINVAL;
+             goto done;
+         }
+         src_real = realpath(src_dir, NULL);
+         dst_real = realpath(dst_dir, NULL);
+     }
+     
+     // Inode per l'ordine di elaborazione; per la copia le directory che
+     // contengono la destinazione, che non si possono copiare
+     for (i = 0; i < count; i++) {
+         entries[i].name = names[i];
+         perf_count(PERF_SYS_STAT);
+         if (fstatat(src_fd, names[i], &st, AT_SYMLINK_NOFOLLOW) != 0)
+             continue; // L'errore si registra quando si elabora l'entry
+         entries[i].ino = st.st_ino;
+         if (S_ISDIR(st.st_mode)) {
+             has_dirs = 1;
+             if (type == JOB_COPY && src_real && dst_real) {
+                 char path[MAX_PATH_LEN];
+                 size_t len = snprintf(path, sizeof(path), "%s/%s", strcmp(src_real, "/") ? src_real : "", names[i]);
+                 entries[i].inside = strncmp(dst_real, path, len) == 0 && (dst_real[len] == '\0' || dst_real[len] == '/');
+             }
+         } else if (S_ISREG(st.st_mode)) {
+             total += st.st_size;
+         }
+     }
+     qsort(entries, count, sizeof(GroupEntry), compare_group_names);
+     for (i = 0; i < count; i++) {
+         atomic_init(&entries[i].state, GROUP_QUEUED);
+         order[i] = &entries[i];
+     }
+     qsort(order, count, sizeof(GroupEntry *), compare_group_inodes);
+     // Senza directory il totale e' noto: avanzamento e tempo stimato come per un file
+     if (control && type == JOB_COPY && !has_dirs)
+         atomic_store(&control->bytes_total, total);
+     
+     memset(&op, 0, sizeof(op));
+     op.type = type == JOB_DELETE ? TREE_DELETE : TREE_COPY;
+     op.src_root = src_dir;
+     op.dst_root_fd = dst_fd;
+     op.stats = stats;
+     op.control = control;
+     op.group = entries;
+     op.group_order = order;
+     op.group_count = count;
+     op.group_state = GROUP_QUEUED;
+     op.rename_first = type == JOB_MOVE;
+     if ((root = tree_node_new(NULL, "", 0)) == NULL)
+         goto done;
+     root->src_fd = src_fd;
+     root->dst_fd = dst_fd;
+     stats->failed_step = NULL;
+     result = run_tree_op(&op, root);
+     
+     // Spostamento tra filesystem: si eliminano le entry copiate senza errori,
+     // e solo se la copia non e' stata interrotta
+     if (type == JOB_MOVE && !atomic_load(&op.stop)) {
+         const char *copy_step = stats->failed_step;
+         int copy_errno = errno;
+         
+         memset(&op, 0, sizeof(op));
+         op.type = TREE_DELETE;
+         op.src_root = src_dir;
+         op.stats = stats;
+         op.control = control;
+         op.group = entries;
+         op.group_order = order;
+         op.group_count = count;
+         op.group_state = GROUP_DONE;
+         if ((root = tree_node_new(NULL, "", 0)) != NULL) {
+             root->src_fd = src_fd;
+             if (run_tree_op(&op, root) != 0 && result == 0)
+                 result = -1;
+             else if (result != 0) {
+                 stats->failed_step = copy_step;
+                 errno = copy_errno;
+             }
+         }
+     }
+     
+ done:
+     saved_errno = errno;
+     if (src_fd >= 0) close(src_fd);
+     if (dst_fd >= 0) close(dst_fd);
+     free(src_real);
+     free(dst_real);
+     free(entries);
+     free(order);
+     perf_end(type == JOB_DELETE ? PERF_DELETE : PERF_COPY, &start, stats->files, stats->bytes, src_dir);
+     errno = saved_errno;
+     return result;
+ }
+ 
+ // Calcola ricorsivamente le dimensioni di una directory (apparente e
+ // occupata su disco) senza seguire i link simbolici ne' uscire dal suo
+ // filesystem. I file con piu' link fisici si contano una volta; i totali di
+ // ogni sottodirectory finiscono nella cache delle dimensioni. L'albero si
+ // rilegge sempre tutto: la data di modifica di una directory non cambia se
+ // crescono i suoi file o se cambia qualcosa piu' in basso, quindi un totale
+ // in cache puo' solo essere mostrato, non sommato a un calcolo nuovo
+ int size_tree(const char *path, CopyStats *stats, CopyControl *control) {
+     TreeOp op;
+     TreeNode *root;
+     struct stat st;
+     
+     memset(&op, 0, sizeof(op));
+     op.type = TREE_SIZE;
+     op.src_root = path;
+     op.stats = stats;
+     op.control = control;
+     
+     root = tree_node_new(NULL, "", 0);
+     if (!root) {
+         stats->failed_step = "Memoria insufficiente";
+         errno = ENOMEM;
+         return -1;
+     }
+     root->src_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+     if (root->src_fd < 0 || fstat(root->src_fd, &st) != 0) {
+         int saved_errno = errno;
+         stats->failed_step = "Impossibile aprire la directory";
+         if (root->src_fd >= 0) close(root->src_fd);
+         free(root);
+         errno = saved_errno;
+         return -1;
+     }
+     op.root_dev = root->dev = st.st_dev;
+     root->ino = st.st_ino;
+     set_times_from_stat(root->times, &st);
+     atomic_store(&root->apparent, st.st_size);
+     atomic_store(&root->allocated, (long long)st.st_blocks * 512);
+     
+     return run_tree_op(&op, root);
+ }
+ 
+ // Vero se il file (con piu' link fisici) e' gia' stato contato; altrimenti
+ // lo registra
+ int tree_link_seen(TreeOp *op, const struct stat *st) {
+     unsigned bucket = (unsigned)((st->st_ino ^ st->st_dev) % LINK_BUCKETS);
+     LinkEntry *link;
+     
+     pthread_mutex_lock(&op->links_lock);
+     for (link = op->links[bucket]; link; link = link->next) {
+         if (link->ino == st->st_ino && link->dev == st->st_dev) break;
+     }
+     if (!link && (link = malloc(sizeof(LinkEntry) + 1)) != NULL) {
+         link->dev = st->st_dev;
+         link->ino = st->st_ino;
+         link->path[0] = '\0';
+         link->next = op->links[bucket];
+         op->links[bucket] = link;
+         link = NULL;
+     }
+     pthread_mutex_unlock(&op->links_lock);
+     return link != NULL;
+ }
+ 
+ // Bucket della cache delle dimensioni per una directory
+ static inline unsigned size_cache_bucket(dev_t dev, ino_t ino) {
+     uint64_t key = ((uint64_t)ino ^ ((uint64_t)dev << 32)) * 0x9e3779b97f4a7c15ULL;
+     return (unsigned)(key >> 48) % SIZE_CACHE_BUCKETS;
+ }
+ 
+ // Registra (o aggiorna) in cache i totali di una directory appena conclusa.
+ // Oltre SIZE_CACHE_MAX directory si aggiornano solo quelle gia' presenti
+ void size_cache_store(TreeNode *node, int partial) {
+     unsigned bucket = size_cache_bucket(node->dev, node->ino);
+     SizeEntry *entry;
+     
+     pthread_mutex_lock(&size_cache_lock);
+     if (!size_cache)
+         size_cache = calloc(SIZE_CACHE_BUCKETS, sizeof(SizeEntry *));
+     if (!size_cache) {
+         pthread_mutex_unlock(&size_cache_lock);
+         return;
+     }
+     for (entry = size_cache[bucket]; entry; entry = entry->next) {
+         if (entry->ino == node->ino && entry->dev == node->dev) break;
+     }
+     if (!entry && size_cache_count < SIZE_CACHE_MAX && (entry = malloc(sizeof(SizeEntry))) != NULL) {
+         entry->dev = node->dev;
+         entry->ino = node->ino;
+         entry->next = size_cache[bucket];
+         size_cache[bucket] = entry;
+         size_cache_count++;
+     }
+     if (entry) {
+         entry->mtime = node->times[1];
+         entry->apparent = atomic_load(&node->apparent);
+         entry->allocated = atomic_load(&node->allocated);
+         entry->files = atomic_load(&node->files);
+         entry->partial = partial;
+         atomic_fetch_add(&size_cache_version, 1);
+     }
+     pthread_mutex_unlock(&size_cache_lock);
+ }
+ 
+ // Cerca i totali della directory st; vale solo se la directory non e' stata
+ // modificata dopo il calcolo. Restituisce 1 se trovati
+ int size_cache_lookup(const struct stat *st, SizeEntry *out) {
+     SizeEntry *entry = NULL;
+     struct timespec mtime = stat_mtime(st);
+     
+     pthread_mutex_lock(&size_cache_lock);
+     if (size_cache) {
+         for (entry = size_cache[size_cache_bucket(st->st_dev, st->st_ino)]; entry; entry = entry->next) {
+             if (entry->ino == st->st_ino && entry->dev == st->st_dev) break;
+         }
+     }
+     if (entry && entry->mtime.tv_sec == mtime.tv_sec && entry->mtime.tv_nsec == mtime.tv_nsec)
+         *out = *entry;
+     else
+         entry = NULL;
+     pthread_mutex_unlock(&size_cache_lock);
+     return entry != NULL;
+ }
+ 
+ // Libera la cache delle dimensioni
+ void size_cache_free() {
+     int i;
+     
+     if (!size_cache) return;
+     for (i = 0; i < SIZE_CACHE_BUCKETS; i++) {
+         while (size_cache[i]) {
+             SizeEntry *next = size_cache[i]->next;
+             free(size_cache[i]);
+             size_cache[i] = next;
+         }
+     }
+     free(size_cache);
+     size_cache = NULL;
+     size_cache_count = 0;
+ }
+ 
+ // Riporta sulle directory del pannello i totali presenti in cache (tutti
+ // ricontrollati con force, dopo un cambio fra dimensione apparente e
+ // occupata). Restituisce 1 se qualche dimensione e' cambiata
+ int apply_dir_sizes(Panel *panel, int force) {
+     int i, changed = 0;
+     
+     if (atomic_load(&size_cache_version) == 0 || panel->dir_fd < 0)
+         return 0;
+     for (i = 1; i < panel->num_files; i++) {
+         FileEntry *file = &panel->files[i];
+         struct stat st;
+         SizeEntry cached;
+         off_t size;
+         
+         if (!file->is_dir || (file->has_dir_size == 1 && !force))
+             continue;
+         if (fstatat(panel->dir_fd, file->name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISDIR(st.st_mode) ||
+             !size_cache_lookup(&st, &cached))
+             continue;
+         size = config.allocated_size ? cached.allocated : cached.apparent;
+         if (file->has_dir_size == 1 + cached.partial && file->dir_size == size)
+             continue;
+         file->has_dir_size = 1 + cached.partial;
+         file->dir_size = size;
+         file->row = NULL;
+         changed = 1;
+     }
+     if (changed) {
+         panel->list_version++;
+         panel->changed = 1;
+     }
+     return changed;
+ }
+ 
+ // Aggiorna le dimensioni delle directory nei pannelli, riordinando quelli
+ // ordinati per dimensione. Durante un calcolo al piu' ogni SIZE_REFRESH_MS
+ void update_dir_sizes(int force) {
+     Panel *panels[2] = { &left_panel, &right_panel };
+     unsigned long version = atomic_load(&size_cache_version);
+     struct timespec now;
+     int i;
+     
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     if (!force && (version == size_applied_version ||
+                    elapsed_seconds(&size_applied_time, &now) * 1000 < SIZE_REFRESH_MS))
+         return;
+     size_applied_version = version;
+     size_applied_time = now;
+     for (i = 0; i < 2; i++) {
+         if (panels[i]->loader) continue; // Se ne occupa finish_listing
+         if (apply_dir_sizes(panels[i], force) && panels[i]->sort_by == SORT_SIZE)
+             resort_panel(panels[i]);
+     }
+ }
+ 
+ // Mostra nella riga di stato i totali calcolati per una directory
+ void show_dir_size(const char *path) {
+     const char *name = strrchr(path, '/');
+     char apparent[16], allocated[16];
+     struct stat st;
+     SizeEntry cached;
+     
+     if (stat(path, &st) != 0 || !size_cache_lookup(&st, &cached))
+         return;
+     format_size(cached.apparent, apparent);
+     format_size(cached.allocated, allocated);
+     show_message("%s: %s (su disco %s), %lld file", name && name[1] ? name + 1 : path,
+                  apparent + strspn(apparent, " "), allocated + strspn(allocated, " "), cached.files);
+ }
+ 
+ // Carica libzstd, se installata: senza la libreria gli archivi .tar.zst
+ // non si possono aprire ma tyc funziona comunque
+ void zstd_load() {
+     static const char *libraries[] = { "libzstd.so.1", "libzstd.so", "libzstd.1.dylib", "libzstd.dylib" };
+     static const char *symbols[] = { "ZSTD_createDCtx", "ZSTD_freeDCtx", "ZSTD_decompressStream", "ZSTD_isError" };
+     void *lib = NULL, *found[4];
+     size_t i;
+     
+     for (i = 0; i < sizeof(libraries) / sizeof(libraries[0]) && !lib; i++)
+         lib = dlopen(libraries[i], RTLD_NOW | RTLD_LOCAL);
+     if (!lib) return;
+     for (i = 0; i < 4; i++) {
+         if ((found[i] = dlsym(lib, symbols[i])) == NULL) {
+             dlclose(lib);
+             return;
+         }
+     }
+     // ISO C non ammette la conversione diretta da void * a puntatore a funzione
+     memcpy(&zstd_api.create, &found[0], sizeof(void *));
+     memcpy(&zstd_api.release, &found[1], sizeof(void *));
+     memcpy(&zstd_api.decompress, &found[2], sizeof(void *));
+     memcpy(&zstd_api.is_error, &found[3], sizeof(void *));
+     zstd_api.loaded = 1;
+ }
+ 
+ int zstd_available() {
+     pthread_once(&zstd_once, zstd_load);
+     return zstd_api.loaded;
+ }
+ 
+ // Riconosce la compressione dai primi byte; il resto si tratta come tar
+ int archive_format(int fd) {
+     unsigned char magic[4];
+     ssize_t n = pread_full(fd, (char *)magic, sizeof(magic), 0);
+     
+     if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+         return ARCHIVE_GZIP;
+     if (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+         return ARCHIVE_ZSTD;
+     return ARCHIVE_TAR;
+ }
+ 
+ // Operazione fallita da mostrare per un errore di lettura dell'archivio
+ const char *archive_error_step(int err) {
+     return err == EBADMSG ? "Archivio danneggiato o formato non riconosciuto" : "Lettura dell'archivio non riuscita";
+ }
+ 
+ // Prepara la lettura del flusso tar dall'inizio
+ int archive_stream_init(ArchiveStream *s, Archive *archive, int fd) {
+     memset(s, 0, sizeof(ArchiveStream));
+     s->archive = archive;
+     s->fd = fd;
+     s->out_buf = malloc(ARCHIVE_BUFFER);
+     s->in_buf = malloc(ARCHIVE_BUFFER);
+     if (!s->out_buf || !s->in_buf) {
+         archive_stream_close(s);
+         errno = ENOMEM;
+         return -1;
+     }
+     return archive_stream_open(s, NULL);
+ }
+ 
+ // Riparte dall'inizio o da un punto di ripresa. Per gzip, come in zran.c di
+ // zlib: inflate senza intestazione, i bit residui del byte precedente e gli
+ // ultimi 32 KB decompressi come dizionario. Per zstd il punto e' l'inizio di un frame
+ int archive_stream_open(ArchiveStream *s, const ArchiveCheckpoint *cp) {
+     s->in = cp ? cp->in : 0;
+     s->in_len = s->in_pos = 0;
+     s->base = cp ? cp->out : 0;
+     s->out_len = s->out_off = 0;
+     s->finished = 0;
+     s->raw = 0;
+     s->frame_done = 1;
+     
+     if (s->archive->format == ARCHIVE_GZIP) {
+         if (s->zs_init) inflateEnd(&s->zs);
+         memset(&s->zs, 0, sizeof(z_stream));
+         s->zs_init = inflateInit2(&s->zs, cp ? -15 : 31) == Z_OK;
+         if (!s->zs_init) {
+             errno = ENOMEM;
+             return -1;
+         }
+         if (cp) {
+             s->raw = 1;
+             if (cp->bits) {
+                 unsigned char byte;
+                 if (pread_full(s->fd, (char *)&byte, 1, cp->in - 1) != 1) {
+                     errno = EBADMSG;
+                     return -1;
+                 }
+                 inflatePrime(&s->zs, cp->bits, byte >> (8 - cp->bits));
+             }
+             inflateSetDictionary(&s->zs, cp->window, cp->window_len);
+         }
+     } else if (s->archive->format == ARCHIVE_ZSTD) {
+         if (s->zstd) zstd_api.release(s->zstd);
+         s->zstd = zstd_api.create();
+         if (!s->zstd) {
+             errno = ENOMEM;
+             return -1;
+         }
+     }
+     return 0;
+ }
+ 
+ void archive_stream_close(ArchiveStream *s) {
+     if (s->zs_init) inflateEnd(&s->zs);
+     if (s->zstd) zstd_api.release(s->zstd);
+     free(s->out_buf);
+     free(s->in_buf);
+     s->zs_init = 0;
+     s->zstd = NULL;
+     s->out_buf = NULL;
+     s->in_buf = NULL;
+ }
+ 
+ // Byte del file gia' elaborati, per l'avanzamento
+ off_t archive_stream_progress(ArchiveStream *s) {
+     if (s->archive->format == ARCHIVE_TAR)
+         return s->base;
+     return s->in - (off_t)(s->in_len - s->in_pos);
+ }
+ 
+ // Aggiunge dati compressi in coda a quelli non ancora consumati.
+ // Restituisce i byte letti, 0 alla fine del file
+ ssize_t archive_input(ArchiveStream *s) {
+     ssize_t n;
+     
+     if (s->in_pos > 0) {
+         memmove(s->in_buf, s->in_buf + s->in_pos, s->in_len - s->in_pos);
+         s->in_len -= s->in_pos;
+         s->in_pos = 0;
+     }
+     perf_count(PERF_SYS_READ);
+     do {
+         n = pread(s->fd, s->in_buf + s->in_len, ARCHIVE_BUFFER - s->in_len, s->in);
+     } while (n < 0 && errno == EINTR);
+     if (n > 0) {
+         s->in_len += n;
+         s->in += n;
+     }
+     return n;
+ }
+ 
+ // Garantisce almeno len byte compressi disponibili; ne restituisce meno alla fine del file
+ ssize_t archive_ensure_input(ArchiveStream *s, size_t len) {
+     while (s->in_len - s->in_pos < len) {
+         ssize_t n = archive_input(s);
+         if (n < 0) return -1;
+         if (n == 0) break;
+     }
+     return s->in_len - s->in_pos;
+ }
+ 
+ // Registra un punto di ripresa alla posizione corrente della decompressione
+ int archive_add_checkpoint(ArchiveStream *s, int bits) {
+     Archive *archive = s->archive;
+     ArchiveCheckpoint *cp;
+     
+     if (archive->num_checkpoints == archive->checkpoints_cap) {
+         int cap = archive->checkpoints_cap ? archive->checkpoints_cap * 2 : 16;
+         ArchiveCheckpoint *checkpoints = realloc(archive->checkpoints, cap * sizeof(ArchiveCheckpoint));
+         if (!checkpoints) {
+             errno = ENOMEM;
+             return -1;
+         }
+         archive->checkpoints = checkpoints;
+         archive->checkpoints_cap = cap;
+     }
+     cp = &archive->checkpoints[archive->num_checkpoints];
+     memset(cp, 0, sizeof(ArchiveCheckpoint));
+     cp->in = archive_stream_progress(s);
+     cp->out = s->base + s->out_len;
+     cp->bits = bits;
+     if (archive->format == ARCHIVE_GZIP) {
+         uInt len = ARCHIVE_WINDOW;
+     
+         cp->window = malloc(ARCHIVE_WINDOW);
+         if (!cp->window) {
+             errno = ENOMEM;
+             return -1;
+         }
+         if (inflateGetDictionary(&s->zs, cp->window, &len) != Z_OK) {
+             free(cp->window);
+             errno = EBADMSG;
+             return -1;
+         }
+         cp->window_len = len;
+     }
+     archive->num_checkpoints++;
+     s->last_checkpoint = cp->out;
+     return 0;
+ }
+ 
+ // Fine di un membro gzip: ne puo' seguire un altro (file concatenati, pigz)
+ int archive_next_gzip_member(ArchiveStream *s) {
+     ssize_t n;
+     
+     // Ripartendo senza intestazione il trailer (CRC e lunghezza) resta da saltare
+     if (s->raw) {
+         n = archive_ensure_input(s, 8);
+         if (n < 0) return -1;
+         if (n < 8) {
+             errno = EBADMSG;
+             return -1;
+         }
+         s->in_pos += 8;
+         s->raw = 0;
+     }
+     n = archive_ensure_input(s, 2);
+     if (n < 0) return -1;
+     if (n < 2 || s->in_buf[s->in_pos] != 0x1f || s->in_buf[s->in_pos + 1] != 0x8b) {
+         s->finished = 1;
+         return 0;
+     }
+     inflateReset2(&s->zs, 31);
+     return 0;
+ }
+ 
+ // Decomprime il blocco successivo di un archivio gzip. Con Z_BLOCK inflate
+ // si ferma alla fine di ogni blocco deflate, dove si puo' riprendere
+ int archive_fill_gzip(ArchiveStream *s) {
+     z_stream *zs = &s->zs;
+     
+     while (s->out_len == 0 && !s->finished) {
+         int ret;
+     
+         if (s->in_pos == s->in_len) {
+             ssize_t n = archive_input(s);
+             if (n < 0) return -1;
+             if (n == 0) {
+                 errno = EBADMSG; // Archivio troncato
+                 return -1;
+             }
+         }
+         zs->next_in = s->in_buf + s->in_pos;
+         zs->avail_in = s->in_len - s->in_pos;
+         zs->next_out = (Bytef *)s->out_buf;
+         zs->avail_out = ARCHIVE_BUFFER;
+         ret = inflate(zs, Z_BLOCK);
+         s->in_pos = s->in_len - zs->avail_in;
+         s->out_len = ARCHIVE_BUFFER - zs->avail_out;
+         if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+             errno = ret == Z_MEM_ERROR ? ENOMEM : EBADMSG;
+             return -1;
+         }
+         if (ret == Z_STREAM_END) {
+             if (archive_next_gzip_member(s) < 0) return -1;
+         } else if (s->indexing && (zs->data_type & 128) && !(zs->data_type & 64) &&
+                    s->base + (off_t)s->out_len - s->last_checkpoint >= ARCHIVE_SPAN) {
+             if (archive_add_checkpoint(s, zs->data_type & 7) < 0) return -1;
+         }
+     }
+     return s->out_len;
+ }
+ 
+ // Decomprime il blocco successivo di un archivio zstd. Si riprende solo
+ // all'inizio di un frame: zstd comprime di norma tutto in un solo frame
+ int archive_fill_zstd(ArchiveStream *s) {
+     while (s->out_len == 0 && !s->finished) {
+         ZstdInBuffer in;
+         ZstdOutBuffer out;
+         size_t ret;
+     
+         if (s->in_pos == s->in_len) {
+             ssize_t n = archive_input(s);
+             if (n < 0) return -1;
+             if (n == 0) {
+                 if (!s->frame_done) {
+                     errno = EBADMSG;
+                     return -1;
+                 }
+                 s->finished = 1;
+                 break;
+             }
+         }
+         in.src = s->in_buf;
+         in.size = s->in_len;
+         in.pos = s->in_pos;
+         out.dst = s->out_buf;
+         out.size = ARCHIVE_BUFFER;
+         out.pos = 0;
+         ret = zstd_api.decompress(s->zstd, &out, &in);
+         if (zstd_api.is_error(ret)) {
+             errno = EBADMSG;
+             return -1;
+         }
+         s->in_pos = in.pos;
+         s->out_len = out.pos;
+         s->frame_done = ret == 0;
+         if (ret == 0 && s->indexing && s->base + (off_t)s->out_len - s->last_checkpoint >= ARCHIVE_SPAN &&
+             archive_add_checkpoint(s, 0) < 0)
+             return -1;
+     }
+     return s->out_len;
+ }
+ 
+ // Passa al blocco decompresso successivo, dopo aver consumato il corrente.
+ // Restituisce i byte disponibili, 0 alla fine del flusso
+ int archive_fill(ArchiveStream *s) {
+     s->base += s->out_len;
+     s->out_len = s->out_off = 0;
+     if (s->finished) return 0;
+     return s->archive->format == ARCHIVE_GZIP ? archive_fill_gzip(s) : archive_fill_zstd(s);
+ }
+ 
+ // Legge len byte del flusso tar (buf NULL: li salta). Restituisce meno di
+ // len solo alla fine del flusso
+ ssize_t archive_read(ArchiveStream *s, char *buf, size_t len) {
+     size_t done = 0;
+     
+     if (s->archive->format == ARCHIVE_TAR) {
+         ssize_t n = buf ? pread_full(s->fd, buf, len, s->base) : (ssize_t)len;
+         if (n > 0) s->base += n;
+         return n;
+     }
+     while (done < len) {
+         size_t n;
+     
+         if (s->out_off == s->out_len) {
+             int got = archive_fill(s);
+             if (got < 0) return -1;
+             if (got == 0) break;
+         }
+         n = s->out_len - s->out_off;
+         if (n > len - done) n = len - done;
+         if (buf) memcpy(buf + done, s->out_buf + s->out_off, n);
+         s->out_off += n;
+         done += n;
+     }
+     return done;
+ }
+ 
+ int archive_skip(ArchiveStream *s, off_t len) {
+     while (len > 0) {
+         size_t chunk = len > (off_t)ARCHIVE_BUFFER ? ARCHIVE_BUFFER : (size_t)len;
+         ssize_t n = archive_read(s, NULL, chunk);
+     
+         if (n < 0) return -1;
+         if ((size_t)n < chunk) {
+             errno = EBADMSG;
+             return -1;
+         }
+         len -= n;
+     }
+     return 0;
+ }
+ 
+ // Porta la lettura a offset nel flusso tar. Senza compressione basta
+ // spostarsi; altrimenti si riparte dall'ultimo punto di ripresa che lo
+ // precede, a meno che la posizione corrente non sia gia' piu' vicina
+ int archive_seek(ArchiveStream *s, off_t offset) {
+     Archive *archive = s->archive;
+     off_t pos = s->base + s->out_off;
+     int low = 0, high = archive->num_checkpoints - 1, found = -1;
+     
+     if (archive->format == ARCHIVE_TAR) {
+         s->base = offset;
+         return 0;
+     }
+     if (offset >= s->base && offset <= s->base + (off_t)s->out_len) {
+         s->out_off = offset - s->base;
+         return 0;
+     }
+     while (low <= high) {
+         int mid = (low + high) / 2;
+         if (archive->checkpoints[mid].out <= offset) {
+             found = mid;
+             low = mid + 1;
+         } else {
+             high = mid - 1;
+         }
+     }
+     if (offset < pos || (found >= 0 && archive->checkpoints[found].out > pos)) {
+         if (archive_stream_open(s, found >= 0 ? &archive->checkpoints[found] : NULL) < 0)
+             return -1;
+         pos = s->base;
+     }
+     return archive_skip(s, offset - pos);
+ }
+ 
+ // Scrive in fd fino a len byte del flusso, dalla posizione corrente. Dai tar
+ // non compressi copia nel kernel con copy_file_range. Restituisce i byte
+ // scritti, 0 se il flusso e' finito
+ ssize_t archive_copy_chunk(ArchiveStream *s, int fd, size_t len) {
+     ssize_t n;
+     
+     if (s->archive->format != ARCHIVE_TAR) {
+         if (s->out_off == s->out_len && (n = archive_fill(s)) <= 0)
+             return n;
+         n = s->out_len - s->out_off;
+         if ((size_t)n > len) n = len;
+         perf_count(PERF_SYS_WRITE);
+         if (write_all(fd, s->out_buf + s->out_off, n) != 0) return -1;
+         s->out_off += n;
+         return n;
+     }
+ #if defined(__linux__) && defined(SYS_copy_file_range)
+     if (!s->no_copy_range) {
+         loff_t in = s->base;
+     
+         perf_count(PERF_SYS_COPY);
+         n = syscall(SYS_copy_file_range, s->fd, &in, fd, NULL, len, 0);
+         if (n >= 0) {
+             s->base += n;
+             return n;
+         }
+         if (!copy_method_unsupported(errno)) return -1;
+         s->no_copy_range = 1;
+     }
+ #endif
+     if (len > ARCHIVE_BUFFER) len = ARCHIVE_BUFFER;
+     perf_count(PERF_SYS_READ);
+     n = pread_full(s->fd, (char *)s->in_buf, len, s->base);
+     if (n <= 0) return n;
+     perf_count(PERF_SYS_WRITE);
+     if (write_all(fd, (char *)s->in_buf, n) != 0) return -1;
+     s->base += n;
+     return n;
+ }
+ 
+ // Valore numerico di un campo dell'intestazione tar: ottale, o base 256
+ // (estensione GNU) se il primo byte ha il bit alto
+ long long tar_number(const char *field, size_t len) {
+     const unsigned char *p = (const unsigned char *)field;
+     long long value = 0;
+     size_t i = 0;
+     
+     if (p[0] & 0x80) {
+         value = p[0] & 0x3f;
+         for (i = 1; i < len; i++)
+             value = (value << 8) | p[i];
+         return value;
+     }
+     while (i < len && (p[i] == ' ' || p[i] == '\0'))
+         i++;
+     for (; i < len && p[i] >= '0' && p[i] <= '7'; i++)
+         value = value * 8 + (p[i] - '0');
+     return value;
+ }
+ 
+ // Verifica la somma di controllo di un'intestazione (il campo stesso vale
+ // otto spazi); alcuni programmi la calcolano con i byte con segno
+ int tar_checksum_ok(const char *header) {
+     long long expected = tar_number(header + 148, 8);
+     long unsigned_sum = 0, signed_sum = 0;
+     int i;
+     
+     for (i = 0; i < 512; i++) {
+         int in_field = i >= 148 && i < 156;
+         unsigned_sum += in_field ? ' ' : (unsigned char)header[i];
+         signed_sum += in_field ? ' ' : (signed char)header[i];
+     }
+     return expected == unsigned_sum || expected == signed_sum;
+ }
+ 
+ // Normalizza in dst (lungo almeno quanto src) il percorso di un membro:
+ // toglie "/" iniziali, componenti vuoti e ".". Restituisce la lunghezza,
+ // 0 per la radice stessa, -1 se il percorso risale con ".."
+ long normalize_member_path(const char *src, char *dst) {
+     long len = 0;
+     
+     while (*src) {
+         size_t n = strcspn(src, "/");
+     
+         if (n == 2 && src[0] == '.' && src[1] == '.')
+             return -1;
+         if (n > 0 && !(n == 1 && src[0] == '.')) {
+             if (len > 0) dst[len++] = '/';
+             memcpy(dst + len, src, n);
+             len += n;
+         }
+         src += n;
+         if (*src) src++;
+     }
+     dst[len] = '\0';
+     return len;
+ }
+ 
+ // Applica i record di un'intestazione estesa pax ("lunghezza chiave=valore\n")
+ void archive_parse_pax(ArchiveExtra *extra, char *data, size_t size) {
+     char *p = data, *end = data + size;
+     
+     while (p < end) {
+         char *key, *eq;
+         long len = strtol(p, &key, 10);
+     
+         if (len <= 0 || len > end - p || *key != ' ' || p[len - 1] != '\n')
+             break;
+         key++;
+         eq = memchr(key, '=', p + len - key);
+         if (!eq) break;
+         *eq = '\0';
+         p[len - 1] = '\0';
+         if (strcmp(key, "path") == 0) {
+             free(extra->path);
+             extra->path = strdup(eq + 1);
+         } else if (strcmp(key, "linkpath") == 0) {
+             free(extra->link);
+             extra->link = strdup(eq + 1);
+         } else if (strcmp(key, "size") == 0) {
+             extra->size = strtoll(eq + 1, NULL, 10);
+         } else if (strcmp(key, "mtime") == 0) {
+             extra->mtime = strtoll(eq + 1, NULL, 10);
+             extra->has_mtime = 1;
+         }
+         p += len;
+     }
+ }
+ 
+ // Nuovo membro azzerato in fondo all'indice, NULL se la memoria e' esaurita
+ ArchiveMember *archive_new_member(Archive *archive) {
+     ArchiveMember *member;
+     
+     if (archive->num_members % 1024 == 0) {
+         ArchiveMember *members = realloc(archive->members, (archive->num_members + 1024) * sizeof(ArchiveMember));
+         if (!members) {
+             errno = ENOMEM;
+             return NULL;
+         }
+         archive->members = members;
+     }
+     member = &archive->members[archive->num_members++];
+     memset(member, 0, sizeof(ArchiveMember));
+     return member;
+ }
+ 
+ // Aggiunge un membro all'indice (non ancora ordinato). I percorsi che
+ // escono dall'archivio con ".." vengono ignorati
+ int archive_add_member(Archive *archive, const char *path, const char *link, char type,
+                        off_t offset, off_t size, time_t mtime, mode_t mode) {
+     ArchiveMember *member;
+     char *normal = malloc(strlen(path) + 1);
+     long len;
+     
+     if (!normal) {
+         errno = ENOMEM;
+         return -1;
+     }
+     len = normalize_member_path(path, normal);
+     if (len <= 0) {
+         free(normal);
+         return 0;
+     }
+     if ((member = archive_new_member(archive)) == NULL) {
+         free(normal);
+         return -1;
+     }
+     member->path = arena_strdup(&archive->names, normal, len);
+     free(normal);
+     member->offset = offset;
+     member->mtime = mtime;
+     member->mode = mode & 07777;
+     // Nei tar piu' vecchi le directory sono file con il nome che finisce con "/"
+     if (type == '5' || ((type == '0' || type == '\0') && path[strlen(path) - 1] == '/')) {
+         member->mode |= S_IFDIR;
+     } else if (type == '2') {
+         member->mode |= S_IFLNK;
+         member->link = arena_strdup(&archive->names, link, strlen(link));
+     } else if (type == '1') {
+         char *target = malloc(strlen(link) + 1);
+         // Link fisico: i dati sono quelli del membro indicato, risolto a fine lettura
+         if (!target) {
+             errno = ENOMEM;
+             return -1;
+         }
+         len = normalize_member_path(link, target);
+         member->mode |= S_IFREG;
+         member->link = len > 0 ? arena_strdup(&archive->names, target, len) : "";
+         free(target);
+     } else {
+         member->mode |= S_IFREG;
+         member->size = size;
+     }
+     if (!member->path || (member->link == NULL && (type == '1' || type == '2'))) {
+         errno = ENOMEM;
+         return -1;
+     }
+     return 0;
+ }
+ 
+ // Legge in sequenza le intestazioni di 512 byte e ne registra la posizione,
+ // saltando i dati dei membri. Riconosce ustar, i nomi lunghi GNU e pax
+ int archive_parse(ArchiveStream *s, CopyControl *control, const char **failed_step) {
+     Archive *archive = s->archive;
+     ArchiveExtra extra = { NULL, NULL, -1, 0, 0 }, global = { NULL, NULL, -1, 0, 0 };
+     char header[512], name[256 + 1 + 100 + 1], link[101];
+     int result = -1;
+     
+     for (;;) {
+         off_t size, padded;
+         char type;
+         ssize_t n;
+         int i;
+     
+         if (copy_check_control(control) != 0) {
+             *failed_step = "Operazione annullata";
+             goto done;
+         }
+         if (control)
+             atomic_store(&control->bytes_done, archive_stream_progress(s));
+         n = archive_read(s, header, sizeof(header));
+         if (n < 0) break;
+         // Due blocchi a zero chiudono l'archivio; alcuni programmi li omettono
+         for (i = 0; i < n && header[i] == '\0'; i++)
+             ;
+         if (i == n) {
+             result = 0;
+             goto done;
+         }
+         if (n < (ssize_t)sizeof(header) || !tar_checksum_ok(header)) {
+             errno = EBADMSG;
+             break;
+         }
+         size = tar_number(header + 124, 12);
+         type = header[156];
+     
+         if (type == 'L' || type == 'K' || type == 'x' || type == 'g') {
+             char *data;
+     
+             if (size > ARCHIVE_META_MAX) {
+                 errno = EBADMSG;
+                 break;
+             }
+             if ((data = malloc(size + 1)) == NULL) {
+                 errno = ENOMEM;
+                 *failed_step = "Memoria insufficiente";
+                 goto done;
+             }
+             n = archive_read(s, data, size);
+             if (n != size) {
+                 free(data);
+                 if (n >= 0) errno = EBADMSG;
+                 break;
+             }
+             data[size] = '\0';
+             if (type == 'g') {
+                 // Intestazione pax globale: vale per tutti i membri successivi. Se ne
+                 // usa solo la data; i record in sospeso erano per questa intestazione
+                 archive_parse_pax(&global, data, size);
+                 free(data);
+                 free(extra.path);
+                 free(extra.link);
+                 memset(&extra, 0, sizeof(extra));
+                 extra.size = -1;
+             } else if (type == 'x') {
+                 archive_parse_pax(&extra, data, size);
+                 free(data);
+             } else if (type == 'L') {
+                 free(extra.path);
+                 extra.path = data;
+             } else {
+                 free(extra.link);
+                 extra.link = data;
+             }
+             if (archive_skip(s, ((size + 511) & ~(off_t)511) - size) != 0)
+                 break;
+             continue;
+         }
+     
+         if (type == '0' || type == '\0' || type == '7' || type == '1' || type == '2' || type == '5') {
+             const char *path = extra.path, *target = extra.link;
+     
+             if (extra.size >= 0) size = extra.size;
+             if (!path) {
+                 // Il prefisso ustar vale solo con il magic POSIX ("ustar\0")
+                 if (memcmp(header + 257, "ustar", 6) == 0 && header[345])
+                     snprintf(name, sizeof(name), "%.155s/%.100s", header + 345, header);
+                 else
+                     snprintf(name, sizeof(name), "%.100s", header);
+                 path = name;
+             }
+             if (!target) {
+                 snprintf(link, sizeof(link), "%.100s", header + 157);
+                 target = link;
+             }
+             if (!extra.has_mtime && global.has_mtime) {
+                 extra.mtime = global.mtime;
+                 extra.has_mtime = 1;
+             }
+             if (archive_add_member(archive, path, target, type, s->base + (off_t)s->out_off, size,
+                                    extra.has_mtime ? extra.mtime : (time_t)tar_number(header + 136, 12),
+                                    tar_number(header + 100, 8)) != 0) {
+                 *failed_step = "Memoria insufficiente";
+                 goto done;
+             }
+         }
+         // Nomi lunghi e intestazioni pax valgono solo per il membro che segue
+         free(extra.path);
+         free(extra.link);
+         memset(&extra, 0, sizeof(extra));
+         extra.size = -1;
+         padded = (size + 511) & ~(off_t)511;
+         if (archive_skip(s, padded) != 0)
+             break;
+     }
+     *failed_step = archive_error_step(errno);
+     
+ done:
+     free(extra.path);
+     free(extra.link);
+     free(global.path);
+     free(global.link);
+     return result;
+ }
+ 
+ // Ordine dell'indice: per percorso, e a parita' nell'ordine dell'archivio
+ int member_compare(const void *a, const void *b) {
+     const ArchiveMember *ma = a, *mb = b;
+     int cmp = strcmp(ma->path, mb->path);
+     
+     if (cmp) return cmp;
+     return (ma->offset > mb->offset) - (ma->offset < mb->offset);
+ }
+ 
+ // Ordine dei dati nell'archivio (ExtractItem), per estrarre senza tornare indietro
+ int member_offset_compare(const void *a, const void *b) {
+     const ArchiveMember *ma = ((const ExtractItem *)a)->member, *mb = ((const ExtractItem *)b)->member;
+     
+     return (ma->offset > mb->offset) - (ma->offset < mb->offset);
+ }
+ 
+ // Cerca nell'indice il membro con i primi len caratteri di path, -1 se assente
+ int archive_find(Archive *archive, const char *path, size_t len) {
+     int low = 0, high = archive->num_members - 1;
+     
+     while (low <= high) {
+         int mid = (low + high) / 2;
+         const char *name = archive->members[mid].path;
+         int cmp = strncmp(name, path, len);
+     
+         if (cmp == 0 && name[len]) cmp = 1;
+         if (cmp == 0) return mid;
+         if (cmp < 0) low = mid + 1;
+         else high = mid - 1;
+     }
+     return -1;
+ }
+ 
+ // Membro name nella directory dir (-1 = radice dell'archivio)
+ int archive_child(Archive *archive, int dir, const char *name) {
+     char path[MAX_PATH_LEN];
+     int len = dir < 0 ? snprintf(path, sizeof(path), "%s", name)
+                       : snprintf(path, sizeof(path), "%s/%s", archive->members[dir].path, name);
+     
+     if (len < 0 || len >= (int)sizeof(path)) return -1;
+     return archive_find(archive, path, len);
+ }
+ 
+ // Intervallo [from, to) dei membri contenuti nella directory index, a
+ // qualsiasi profondita': nell'ordine per percorso sono consecutivi
+ void archive_subtree(Archive *archive, int index, int *from, int *to) {
+     const char *prefix;
+     size_t len;
+     int bound;
+     
+     *from = 0;
+     *to = archive->num_members;
+     if (index < 0) return;
+     prefix = archive->members[index].path;
+     len = strlen(prefix);
+     // Primo membro che inizia con "prefix/" (bound 0), poi il primo che lo supera (bound 1)
+     for (bound = 0; bound < 2; bound++) {
+         int low = index + 1, high = archive->num_members;
+     
+         while (low < high) {
+             int mid = (low + high) / 2;
+             const char *path = archive->members[mid].path;
+             int cmp = strncmp(path, prefix, len);
+     
+             if (cmp == 0) cmp = (unsigned char)path[len] - '/';
+             if (cmp < bound) low = mid + 1;
+             else high = mid;
+         }
+         if (bound == 0) *from = low;
+         else *to = low;
+     }
+ }
+ 
+ // Aggiunge le directory che compaiono solo nei percorsi dei membri. I membri
+ // con lo stesso prefisso sono consecutivi: se il precedente ha gia' il
+ // prefisso, la directory e' gia' stata considerata
+ int archive_add_parents(Archive *archive) {
+     const char **dirs = NULL;
+     int num_dirs = 0, cap = 0, i;
+     
+     for (i = 0; i < archive->num_members; i++) {
+         const char *path = archive->members[i].path, *slash;
+     
+         for (slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/')) {
+             size_t len = slash - path;
+     
+             if ((i > 0 && strncmp(archive->members[i - 1].path, path, len + 1) == 0) ||
+                 archive_find(archive, path, len) >= 0)
+                 continue;
+             if (num_dirs == cap) {
+                 const char **grown = realloc(dirs, (cap = cap ? cap * 2 : 64) * sizeof(char *));
+                 if (!grown) goto fail;
+                 dirs = grown;
+             }
+             if ((dirs[num_dirs++] = arena_strdup(&archive->names, path, len)) == NULL)
+                 goto fail;
+         }
+     }
+     for (i = 0; i < num_dirs; i++) {
+         ArchiveMember *member = archive_new_member(archive);
+     
+         if (!member) goto fail;
+         member->path = dirs[i];
+         member->offset = -1;
+         member->mtime = archive->mtime;
+         member->mode = S_IFDIR | 0755;
+     }
+     free(dirs);
+     if (num_dirs > 0)
+         qsort(archive->members, archive->num_members, sizeof(ArchiveMember), member_compare);
+     return 0;
+     
+ fail:
+     free(dirs);
+     errno = ENOMEM;
+     return -1;
+ }
+ 
+ // Completa l'indice: ordina per percorso (un membro ripetuto vale
+ // nell'ultima versione, come per tar), risolve i link fisici, aggiunge le
+ // directory implicite e collega ogni membro alla sua directory
+ int archive_finish_index(Archive *archive) {
+     ArchiveMember *members = archive->members;
+     int count = 0, i;
+     
+     qsort(members, archive->num_members, sizeof(ArchiveMember), member_compare);
+     for (i = 0; i < archive->num_members; i++) {
+         if (i + 1 < archive->num_members && strcmp(members[i].path, members[i + 1].path) == 0)
+             continue;
+         members[count++] = members[i];
+     }
+     archive->num_members = count;
+     
+     for (i = 0; i < archive->num_members; i++) {
+         ArchiveMember *member = &members[i];
+         int target;
+     
+         if (!S_ISREG(member->mode) || !member->link)
+             continue;
+         target = archive_find(archive, member->link, strlen(member->link));
+         if (target >= 0 && S_ISREG(members[target].mode) && !members[target].link) {
+             member->offset = members[target].offset;
+             member->size = members[target].size;
+             member->link = NULL;
+         } else {
+             member->mode = 0; // Link a un membro assente
+         }
+     }
+     for (i = count = 0; i < archive->num_members; i++) {
+         if (members[i].mode != 0)
+             members[count++] = members[i];
+     }
+     archive->num_members = count;
+     
+     if (archive_add_parents(archive) != 0)
+         return -1;
+     members = archive->members;
+     for (i = 0; i < archive->num_members; i++) {
+         const char *slash = strrchr(members[i].path, '/');
+     
+         members[i].name = slash ? slash + 1 : members[i].path;
+         members[i].parent = slash ? archive_find(archive, members[i].path, slash - members[i].path) : -1;
+     }
+     return 0;
+ }
+ 
+ // Costruisce l'indice di un archivio con una sola lettura sequenziale,
+ // senza estrarre nulla. L'indice restituito ha un riferimento per il chiamante
+ Archive *archive_build(const char *path, CopyControl *control, const char **failed_step) {
+     ArchiveStream stream;
+     Archive *archive;
+     struct stat st;
+     int fd, saved_errno;
+     
+     *failed_step = "Impossibile aprire l'archivio";
+     perf_count(PERF_SYS_OPEN);
+     fd = open(path, O_RDONLY | O_CLOEXEC);
+     if (fd < 0)
+         return NULL;
+     if (fstat(fd, &st) != 0 || (archive = calloc(1, sizeof(Archive))) == NULL) {
+         saved_errno = errno;
+         close(fd);
+         errno = saved_errno;
+         return NULL;
+     }
+     archive->refs = 1;
+     snprintf(archive->path, sizeof(archive->path), "%s", path);
+     archive->dev = st.st_dev;
+     archive->ino = st.st_ino;
+     archive->file_size = st.st_size;
+     archive->mtime = st.st_mtime;
+     archive->format = archive_format(fd);
+     if (archive->format == ARCHIVE_ZSTD && !zstd_available()) {
+         *failed_step = "Libreria zstd non disponibile";
+         errno = ENOTSUP;
+         goto fail;
+     }
+     if (control)
+         atomic_store(&control->bytes_total, st.st_size);
+     
+     if (archive_stream_init(&stream, archive, fd) != 0) {
+         *failed_step = "Memoria insufficiente";
+         goto fail;
+     }
+     stream.indexing = 1;
+     if (archive_parse(&stream, control, failed_step) != 0) {
+         saved_errno = errno;
+         archive_stream_close(&stream);
+         errno = saved_errno;
+         goto fail;
+     }
+     if (control)
+         atomic_store(&control->bytes_done, st.st_size);
+     archive_stream_close(&stream);
+     if (archive_finish_index(archive) != 0) {
+         *failed_step = "Memoria insufficiente";
+         goto fail;
+     }
+     close(fd);
+     *failed_step = NULL;
+     return archive;
+     
+ fail:
+     saved_errno = errno;
+     close(fd);
+     archive_free(archive);
+     errno = saved_errno;
+     return NULL;
+ }
+ 
+ void archive_free(Archive *archive) {
+     int i;
+     
+     for (i = 0; i < archive->num_checkpoints; i++)
+         free(archive->checkpoints[i].window);
+     free(archive->checkpoints);
+     free(archive->members);
+     arena_free(&archive->names);
+     free(archive);
+ }
+ 
+ // Rilascia un riferimento all'indice, liberandolo con l'ultimo
+ void archive_release(Archive *archive) {
+     int refs;
+     
+     if (!archive) return;
+     pthread_mutex_lock(&archive_lock);
+     refs = --archive->refs;
+     pthread_mutex_unlock(&archive_lock);
+     if (refs == 0)
+         archive_free(archive);
+ }
+ 
+ // Cerca in cache l'indice di un archivio, valido se il file non e' cambiato.
+ // Restituisce un riferimento da rilasciare con archive_release, o NULL
+ Archive *archive_lookup(const char *path) {
+     Archive **link, *archive, *stale = NULL;
+     struct stat st;
+     
+     if (stat(path, &st) != 0)
+         return NULL;
+     pthread_mutex_lock(&archive_lock);
+     for (link = &archive_cache; (archive = *link) != NULL; link = &archive->next) {
+         if (strcmp(archive->path, path) != 0)
+             continue;
+         *link = archive->next;
+         if (archive->dev == st.st_dev && archive->ino == st.st_ino &&
+             archive->file_size == st.st_size && archive->mtime == st.st_mtime) {
+             // In testa: e' il piu' recente
+             archive->next = archive_cache;
+             archive_cache = archive;
+             archive->refs++;
+         } else {
+             stale = archive;
+             archive = NULL;
+         }
+         break;
+     }
+     pthread_mutex_unlock(&archive_lock);
+     archive_release(stale);
+     return archive;
+ }
+ 
+ // Aggiunge un indice alla cache, che ne tiene un riferimento. Oltre
+ // ARCHIVE_CACHE_MAX si scartano i meno recenti non in uso
+ void archive_insert(Archive *archive) {
+     Archive **link, *entry, *dropped = NULL;
+     int count = 0;
+     
+     pthread_mutex_lock(&archive_lock);
+     archive->refs++;
+     for (link = &archive_cache; (entry = *link) != NULL; ) {
+         // Un indice dello stesso archivio costruito nel frattempo viene sostituito
+         if (strcmp(entry->path, archive->path) == 0 ||
+             (++count >= ARCHIVE_CACHE_MAX && entry->refs == 1)) {
+             *link = entry->next;
+             entry->next = dropped;
+             dropped = entry;
+             continue;
+         }
+         link = &entry->next;
+     }
+     archive->next = archive_cache;
+     archive_cache = archive;
+     pthread_mutex_unlock(&archive_lock);
+     while (dropped) {
+         entry = dropped->next;
+         archive_release(dropped);
+         dropped = entry;
+     }
+ }
+ 
+ void free_archive_cache() {
+     Archive *archive;
+     
+     pthread_mutex_lock(&archive_lock);
+     archive = archive_cache;
+     archive_cache = NULL;
+     pthread_mutex_unlock(&archive_lock);
+     while (archive) {
+         Archive *next = archive->next;
+         archive_release(archive);
+         archive = next;
+     }
+ }
+ 
+ // Indice dell'archivio che contiene un percorso virtuale (il primo prefisso
+ // che e' un file regolare), costruito se non e' in cache. inner punta al
+ // percorso del membro dentro l'archivio
+ Archive *archive_for_path(const char *path, const char **inner, CopyControl *control, const char **failed_step) {
+     char prefix[MAX_PATH_LEN];
+     const char *slash = path;
+     struct stat st;
+     
+     while ((slash = strchr(slash + 1, '/')) != NULL && (size_t)(slash - path) < sizeof(prefix)) {
+         memcpy(prefix, path, slash - path);
+         prefix[slash - path] = '\0';
+         if (stat(prefix, &st) != 0)
+             break;
+         if (S_ISREG(st.st_mode)) {
+             Archive *archive = archive_lookup(prefix);
+     
+             *inner = slash + 1;
+             if (!archive && (archive = archive_build(prefix, control, failed_step)) != NULL)
+                 archive_insert(archive);
+             return archive;
+         }
+     }
+     *failed_step = "Impossibile aprire l'archivio";
+     errno = ENOENT;
+     return NULL;
+ }
+ 
+ // Estrae un file regolare dalla posizione dei suoi dati nell'archivio
+ int archive_extract_file(ArchiveStream *s, ArchiveMember *member, const char *path,
+                          CopyStats *stats, CopyControl *control) {
+     struct timespec times[2];
+     off_t done = 0;
+     int fd, saved_errno;
+     
+     stats->failed_step = "Impossibile creare il file destinazione";
+     perf_count(PERF_SYS_OPEN);
+     fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+     if (fd < 0)
+         return -1;
+     if (archive_seek(s, member->offset) != 0) {
+         stats->failed_step = archive_error_step(errno);
+         goto fail;
+     }
+     stats->failed_step = "Errore durante l'estrazione";
+     while (done < member->size) {
+         off_t left = member->size - done;
+         ssize_t n;
+     
+         if (copy_check_control(control) != 0)
+             goto fail;
+         n = archive_copy_chunk(s, fd, left > COPY_CHUNK_SIZE ? COPY_CHUNK_SIZE : (size_t)left);
+         if (n <= 0) {
+             if (n == 0) errno = EBADMSG;
+             if (errno == EBADMSG) stats->failed_step = archive_error_step(errno);
+             goto fail;
+         }
+         done += n;
+         stats->bytes += n;
+         if (control)
+             atomic_fetch_add(&control->bytes_done, n);
+     }
+     
+     stats->failed_step = "Impossibile impostare permessi e date";
+     times[0].tv_sec = times[1].tv_sec = member->mtime;
+     times[0].tv_nsec = times[1].tv_nsec = 0;
+     if (fchmod(fd, member->mode & 07777) != 0 || futimens(fd, times) != 0)
+         goto fail;
+     stats->failed_step = "Errore durante la scrittura";
+     if (close(fd) != 0) {
+         saved_errno = errno;
+         unlink(path);
+         errno = saved_errno;
+         return -1;
+     }
+     return 0;
+     
+ fail:
+     saved_errno = errno;
+     close(fd);
+     unlink(path);
+     errno = saved_errno;
+     return -1;
+ }
+ 
+ // Estrae i membri roots (con il contenuto, se sono directory) leggendo
+ // l'archivio una sola volta: un solo membro in dst, oppure con keep_names
+ // ognuno con il suo nome nella directory dst. I file si estraggono
+ // nell'ordine dei dati, i link simbolici per ultimi (nessun file viene
+ // scritto attraverso un link dell'archivio) e permessi e date delle
+ // directory si applicano quando il loro contenuto e' completo
+ int archive_extract(Archive *archive, const int *roots, int num_roots, const char *dst, int keep_names,
+                     CopyStats *stats, CopyControl *control) {
+     ArchiveStream stream;
+     ExtractItem *list, *files;
+     char prefix[MAX_PATH_LEN], out[MAX_PATH_LEN];
+     int count = 0, num_files = 0, fd, i, r, result = -1, saved_errno;
+     off_t total = 0;
+     
+     if (snprintf(prefix, sizeof(prefix), keep_names ? "%s/" : "%s", dst) >= (int)sizeof(prefix)) {
+         stats->failed_step = "Percorso troppo lungo";
+         errno = ENAMETOOLONG;
+         return -1;
+     }
+     for (r = 0; r < num_roots; r++) {
+         int from = 0, to = 0;
+     
+         if (S_ISDIR(archive->members[roots[r]].mode))
+             archive_subtree(archive, roots[r], &from, &to);
+         count += 1 + to - from;
+     }
+     list = malloc(count * sizeof(ExtractItem));
+     files = malloc(count * sizeof(ExtractItem));
+     if (!list || !files) {
+         free(list);
+         free(files);
+         stats->failed_step = "Memoria insufficiente";
+         errno = ENOMEM;
+         return -1;
+     }
+     for (r = count = 0; r < num_roots; r++) {
+         ArchiveMember *root = &archive->members[roots[r]];
+         size_t skip = strlen(root->path) - (keep_names ? strlen(root->name) : 0);
+         int from = 0, to = 0;
+     
+         if (S_ISDIR(root->mode))
+             archive_subtree(archive, roots[r], &from, &to);
+         list[count].member = root;
+         list[count++].skip = skip;
+         for (i = from; i < to; i++) {
+             list[count].member = &archive->members[i];
+             list[count++].skip = skip;
+         }
+     }
+     
+     stats->failed_step = "Impossibile aprire l'archivio";
+     perf_count(PERF_SYS_OPEN);
+     fd = open(archive->path, O_RDONLY | O_CLOEXEC);
+     if (fd < 0) {
+         saved_errno = errno;
+         free(list);
+         free(files);
+         errno = saved_errno;
+         return -1;
+     }
+     
+     // Directory nell'ordine dei percorsi: ognuna dopo quella che la contiene
+     for (i = 0; i < count; i++) {
+         ArchiveMember *member = list[i].member;
+         struct stat st;
+     
+         if (snprintf(out, sizeof(out), "%s%s", prefix, member->path + list[i].skip) >= (int)sizeof(out)) {
+             stats->failed_step = "Percorso troppo lungo";
+             errno = ENAMETOOLONG;
+             goto done;
+         }
+         if (S_ISREG(member->mode)) {
+             files[num_files++] = list[i];
+             total += member->size;
+         } else if (S_ISDIR(member->mode) && mkdir(out, 0700) != 0 &&
+                    (errno != EEXIST || lstat(out, &st) != 0 || !S_ISDIR(st.st_mode))) {
+             stats->failed_step = "Impossibile creare la directory";
+             if (errno == 0) errno = EEXIST;
+             goto done;
+         }
+     }
+     if (control)
+         atomic_store(&control->bytes_total, total);
+     
+     if (archive_stream_init(&stream, archive, fd) != 0) {
+         stats->failed_step = "Memoria insufficiente";
+         goto done;
+     }
+     qsort(files, num_files, sizeof(ExtractItem), member_offset_compare);
+     for (i = 0; i < num_files; i++) {
+         snprintf(out, sizeof(out), "%s%s", prefix, files[i].member->path + files[i].skip);
+         if (archive_extract_file(&stream, files[i].member, out, stats, control) != 0)
+             break;
+         stats->files++;
+         if (control)
+             atomic_fetch_add(&control->files_done, 1);
+     }
+     saved_errno = errno;
+     archive_stream_close(&stream);
+     errno = saved_errno;
+     if (i < num_files)
+         goto done;
+     
+     for (i = 0; i < count; i++) {
+         ArchiveMember *member = list[i].member;
+         struct timespec times[2];
+     
+         if (!S_ISLNK(member->mode))
+             continue;
+         snprintf(out, sizeof(out), "%s%s", prefix, member->path + list[i].skip);
+         stats->failed_step = "Impossibile creare il link";
+         if ((unlink(out) != 0 && errno != ENOENT) || symlink(member->link, out) != 0)
+             goto done;
+         times[0].tv_sec = times[1].tv_sec = member->mtime;
+         times[0].tv_nsec = times[1].tv_nsec = 0;
+         utimensat(AT_FDCWD, out, times, AT_SYMLINK_NOFOLLOW);
+         stats->files++;
+     }
+     for (i = count - 1; i >= 0; i--) {
+         ArchiveMember *member = list[i].member;
+         struct timespec times[2];
+     
+         if (!S_ISDIR(member->mode))
+             continue;
+         snprintf(out, sizeof(out), "%s%s", prefix, member->path + list[i].skip);
+         times[0].tv_sec = times[1].tv_sec = member->mtime;
+         times[0].tv_nsec = times[1].tv_nsec = 0;
+         stats->failed_step = "Impossibile impostare permessi e date";
+         if (chmod(out, member->mode & 07777) != 0 || utimensat(AT_FDCWD, out, times, 0) != 0)
+             goto done;
+         stats->files++;
+     }
+     stats->failed_step = NULL;
+     result = 0;
+     
+ done:
+     saved_errno = errno;
+     close(fd);
+     free(list);
+     free(files);
+     errno = saved_errno;
+     return result;
+ }
+ 
+ // Estrae in dst il membro indicato dal percorso virtuale src
+ // (percorso dell'archivio seguito da quello del membro)
+ int extract_path(const char *src, const char *dst, CopyStats *stats, CopyControl *control) {
+     const char *inner = NULL;
+     Archive *archive;
+     int index, result;
+     
+     memset(stats, 0, sizeof(CopyStats));
+     archive = archive_for_path(src, &inner, control, &stats->failed_step);
+     if (!archive)
+         return -1;
+     index = archive_find(archive, inner, strlen(inner));
+     if (index < 0) {
+         archive_release(archive);
+         stats->failed_step = "Membro non trovato nell'archivio";
+         errno = ENOENT;
+         return -1;
+     }
+     if (control) {
+         atomic_store(&control->bytes_done, 0);
+         atomic_store(&control->files_done, 0);
+     }
+     result = archive_extract(archive, &index, 1, dst, 0, stats, control);
+     archive_release(archive);
+     return result;
+ }
+ 
+ // Estrae nella directory dst_dir le entry names della directory virtuale
+ // src_dir come un'unica operazione: l'archivio si legge una volta sola,
+ // nell'ordine dei dati di tutte le entry insieme
+ int extract_group(const char *src_dir, const char *dst_dir, char **names, int count,
+                   CopyStats *stats, CopyControl *control) {
+     char path[MAX_PATH_LEN];
+     const char *inner = NULL;
+     Archive *archive;
+     int *roots, dir, i, result;
+     
+     memset(stats, 0, sizeof(CopyStats));
+     // La directory dell'archivio si ricava dalla prima entry: src_dir puo'
+     // essere l'archivio stesso, che archive_for_path non riconosce
+     if (snprintf(path, sizeof(path), "%s/%s", src_dir, names[0]) >= (int)sizeof(path)) {
+         stats->failed_step = "Percorso troppo lungo";
+         errno = ENAMETOOLONG;
+         return -1;
+     }
+     archive = archive_for_path(path, &inner, control, &stats->failed_step);
+     if (!archive)
+         return -1;
+     roots = malloc(count * sizeof(int));
+     if (!roots) {
+         archive_release(archive);
+         stats->failed_step = "Memoria insufficiente";
+         errno = ENOMEM;
+         return -1;
+     }
+     i = 0;
+     if ((roots[0] = archive_find(archive, inner, strlen(inner))) >= 0) {
+         dir = archive->members[roots[0]].parent;
+         for (i = 1; i < count && (roots[i] = archive_child(archive, dir, names[i])) >= 0; i++)
+             ;
+     }
+     if (i < count) {
+         free(roots);
+         archive_release(archive);
+         stats->failed_step = "Membro non trovato nell'archivio";
+         errno = ENOENT;
+         return -1;
+     }
+     if (control) {
+         atomic_store(&control->bytes_done, 0);
+         atomic_store(&control->files_done, 0);
+     }
+     result = archive_extract(archive, roots, count, dst_dir, 1, stats, control);
+     free(roots);
+     archive_release(archive);
+     return result;
+ }
+ 
+ // Operazione in background: costruisce l'indice di un archivio e lo mette in cache
+ int index_archive(const char *path, CopyStats *stats, CopyControl *control) {
+     Archive *archive = archive_lookup(path);
+     
+     if (!archive) {
+         archive = archive_build(path, control, &stats->failed_step);
+         if (!archive)
+             return -1;
+         archive_insert(archive);
+     }
+     stats->files = archive->num_members;
+     atomic_store(&control->files_done, archive->num_members);
+     archive_release(archive);
+     return 0;
+ }
+ 
+ // Vero per i nomi degli archivi che si aprono come directory
+ int is_archive_name(const char *name) {
+     static const char *suffixes[] = { ".tar", ".tar.gz", ".tgz", ".tar.zst", ".tzst" };
+     size_t len = strlen(name), i;
+     
+     for (i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+         size_t n = strlen(suffixes[i]);
+         if (len > n && strcasecmp(name + len - n, suffixes[i]) == 0)
+             return 1;
+     }
+     return 0;
+ }
+ 
+ // Apre un archivio della directory del pannello: subito se l'indice e' in
+ // cache, altrimenti quando l'operazione che lo costruisce e' conclusa
+ void open_archive(Panel *panel, const char *name) {
+     char path[MAX_PATH_LEN];
+     Archive *archive;
+     Job *job;
+     
+     // Un percorso troncato indicherebbe un altro file
+     if (snprintf(path, sizeof(path), "%s/%s", panel->current_path, name) >= (int)sizeof(path)) {
+         display_error("Percorso troppo lungo");
+         return;
+     }
+     if ((archive = archive_lookup(path)) != NULL) {
+         enter_archive(panel, archive);
+         return;
+     }
+     snprintf(panel->archive_wait, sizeof(panel->archive_wait), "%s", path);
+     // Se l'indice e' gia' in preparazione (anche per l'altro pannello) basta attenderlo
+     pthread_mutex_lock(&jobs_lock);
+     for (job = jobs; job; job = job->next) {
+         if (job->type == JOB_INDEX && job->state < JOB_DONE && strcmp(job->src, path) == 0)
+             break;
+     }
+     pthread_mutex_unlock(&jobs_lock);
+     if (!job)
+         enqueue_job(JOB_INDEX, path, NULL);
+ }
+ 
+ // Mostra nel pannello la radice di un archivio (di cui riceve il riferimento)
+ void enter_archive(Panel *panel, Archive *archive) {
+     cache_listing(panel);
+     cancel_directory_load(panel);
+     unwatch_directory(panel);
+     close_archive(panel);
+     close_found(panel);
+     panel->archive = archive;
+     panel->archive_dir = -1;
+     snprintf(panel->current_path, sizeof(panel->current_path), "%s", archive->path);
+     reset_panel_view(panel);
+     load_directory(panel);
+ }
+ 
+ void close_archive(Panel *panel) {
+     archive_release(panel->archive);
+     panel->archive = NULL;
+     panel->archive_dir = -1;
+ }
+ 
+ // Conclusione della costruzione di un indice: l'archivio si apre nei
+ // pannelli che lo attendono, se mostrano ancora la directory che lo contiene
+ void archive_indexed(const char *path, int ok) {
+     Panel *panels[2] = { &left_panel, &right_panel };
+     int i;
+     
+     for (i = 0; i < 2; i++) {
+         Archive *archive;
+     
+         if (strcmp(panels[i]->archive_wait, path) != 0)
+             continue;
+         panels[i]->archive_wait[0] = '\0';
+         if (!ok || panels[i]->archive || !path_in_directory(path, panels[i]->current_path))
+             continue;
+         if ((archive = archive_lookup(path)) != NULL)
+             enter_archive(panels[i], archive);
+     }
+ }
+ 
+ // Elenca dall'indice i membri della directory dell'archivio mostrata
+ void list_archive_directory(Panel *panel) {
+     Archive *archive = panel->archive;
+     int from, to, i;
+     
+     archive_subtree(archive, panel->archive_dir, &from, &to);
+     for (i = from; i < to; i++) {
+         ArchiveMember *member = &archive->members[i];
+         FileEntry *file;
+     
+         if (member->parent != panel->archive_dir)
+             continue;
+         file = panel_new_entry(panel, member->name, strlen(member->name));
+         if (!file) {
+             display_error("Memoria insufficiente: elenco incompleto");
+             break;
+         }
+         file->is_dir = S_ISDIR(member->mode);
+         file->size = member->size;
+         file->mode = member->mode;
+         file->mtime = member->mtime;
+         file->has_meta = 1;
+         file->d_type = S_ISDIR(member->mode) ? DT_DIR : S_ISLNK(member->mode) ? DT_LNK : DT_REG;
+         file->id = panel->next_id++;
+     }
+     finish_listing(panel);
+ }
+ 
+ // Cambia directory dentro l'archivio; ".." dalla radice torna alla
+ // directory che contiene l'archivio
+ void archive_change_directory(Panel *panel, const char *name) {
+     Archive *archive = panel->archive;
+     const char *reselect = NULL;
+     char path[MAX_PATH_LEN];
+     int index;
+     
+     if (strcmp(name, "..") == 0) {
+         if (panel->archive_dir < 0) {
+             char parent[MAX_PATH_LEN], name[MAX_FILENAME_LEN];
+             char *slash;
+     
+             snprintf(parent, sizeof(parent), "%s", archive->path);
+             slash = strrchr(parent, '/');
+             snprintf(name, sizeof(name), "%s", slash + 1);
+             if (slash == parent) slash[1] = '\0';
+             else *slash = '\0';
+             // L'elenco in cache ha gia' l'archivio selezionato; se la directory
+             // va riletta lo si riseleziona alla fine della lettura
+             change_directory(panel, parent);
+             if (panel->loader && !panel->archive) {
+                 free(panel->reselect_name);
+                 panel->reselect_name = strdup(name);
+                 panel->reselect_index = panel->selected;
+             }
+             return;
+         }
+         reselect = archive->members[panel->archive_dir].name;
+         index = archive->members[panel->archive_dir].parent;
+     } else {
+         index = archive_child(archive, panel->archive_dir, name);
+         if (index < 0 || !S_ISDIR(archive->members[index].mode))
+             return;
+     }
+     
+     // Il percorso si compone prima di cambiare stato: troncato non
+     // corrisponderebbe piu' alla directory dell'archivio
+     if (index < 0)
+         snprintf(path, sizeof(path), "%s", archive->path);
+     else if (snprintf(path, sizeof(path), "%s/%s", archive->path,
+                       archive->members[index].path) >= (int)sizeof(path)) {
+         display_error("Percorso troppo lungo");
+         return;
+     }
+     panel->archive_dir = index;
+     memcpy(panel->current_path, path, sizeof(path));
+     reset_panel_view(panel);
+     free(panel->reselect_name);
+     panel->reselect_name = reselect ? strdup(reselect) : NULL;
+     panel->reselect_index = panel->selected;
+     load_directory(panel);
+ }
+ 
+ // Dimensioni delle directory dell'archivio mostrate nel pannello (con
+ // only_selected solo quella selezionata), sommate dall'indice senza leggere nulla
+ void archive_dir_sizes(Panel *panel, int only_selected) {
+     Archive *archive = panel->archive;
+     int i;
+     
+     for (i = 1; i < panel->num_files; i++) {
+         FileEntry *file = &panel->files[i];
+         long long files = 0;
+         off_t total = 0;
+         int index, from, to, j;
+     
+         if (!file->is_dir || (only_selected && i != panel->selected))
+             continue;
+         if ((index = archive_child(archive, panel->archive_dir, file->name)) < 0)
+             continue;
+         archive_subtree(archive, index, &from, &to);
+         for (j = from; j < to; j++) {
+             if (S_ISREG(archive->members[j].mode)) {
+                 total += archive->members[j].size;
+                 files++;
+             }
+         }
+         file->has_dir_size = 1;
+         file->dir_size = total;
+         file->row = NULL;
+         if (only_selected) {
+             char size[16];
+             format_size(total, size);
+             show_message("%s: %s, %lld file", file->name, size + strspn(size, " "), files);
+         }
+     }
+     panel->list_version++;
+     panel->changed = 1;
+ }
+ 
+ // F3 su un membro dell'archivio: lo estrae con il suo nome in una directory
+ // temporanea con un'operazione in background (un membro grande o uno zstd a
+ // frame singolo puo' richiedere molto), che si puo' seguire e annullare.
+ // Il visualizzatore si apre quando l'estrazione e' conclusa
+ void view_archive_member(Panel *panel, FileEntry *file) {
+     const char *tmpdir = getenv("TMPDIR");
+     char src[MAX_PATH_LEN], dir[MAX_PATH_LEN], dst[MAX_PATH_LEN];
+     Job *job;
+     int index;
+     
+     if (S_ISLNK(file->mode)) {
+         index = archive_child(panel->archive, panel->archive_dir, file->name);
+         if (index >= 0)
+             show_message("%s -> %s", file->name, panel->archive->members[index].link);
+         return;
+     }
+     if (archive_view_job || archive_view_ready) {
+         show_message("Attendere l'estrazione del file da visualizzare");
+         return;
+     }
+     if (snprintf(src, sizeof(src), "%s/%s", panel->current_path, file->name) >= (int)sizeof(src) ||
+         snprintf(dir, sizeof(dir), "%s/tyc-XXXXXX", tmpdir && *tmpdir ? tmpdir : "/tmp") >= (int)sizeof(dir)) {
+         display_error("Percorso troppo lungo");
+         return;
+     }
+     if (!mkdtemp(dir)) {
+         display_error("Impossibile creare la directory temporanea");
+         return;
+     }
+     if (snprintf(dst, sizeof(dst), "%s/%s", dir, file->name) >= (int)sizeof(dst)) {
+         rmdir(dir);
+         display_error("Percorso troppo lungo");
+         return;
+     }
+     memcpy(archive_view_path, dst, sizeof(dst));
+     job = enqueue_job(JOB_EXTRACT, src, archive_view_path);
+     if (!job) {
+         remove_archive_view();
+         display_error("Memoria insufficiente");
+         return;
+     }
+     archive_view_job = job->id;
+ }
+ 
+ // Apre il visualizzatore sul membro estratto da view_archive_member, poi
+ // elimina la copia temporanea
+ void show_archive_view() {
+     archive_view_ready = 0;
+     view_file(archive_view_path);
+     remove_archive_view();
+ }
+ 
+ // Elimina il membro estratto per la visualizzazione e la sua directory
+ void remove_archive_view() {
+     char *slash = strrchr(archive_view_path, '/');
+     
+     archive_view_job = 0;
+     archive_view_ready = 0;
+     if (!slash) return;
+     unlink(archive_view_path);
+     *slash = '\0';
+     rmdir(archive_view_path);
+     archive_view_path[0] = '\0';
+ }
+ 
+ // Vero (con un messaggio) se il pannello mostra un archivio, che non si puo' modificare
+ int archive_readonly(Panel *panel) {
+     if (!panel->archive) return 0;
+     show_message("L'archivio e' in sola lettura");
+     return 1;
+ }
+ 
+ // Copiare da un archivio significa estrarre
+ int copy_job_type(Panel *panel) {
+     return panel->archive ? JOB_EXTRACT : JOB_COPY;
+ }
+ 
+ // File dell'indice dei nomi di root: in TYC_INDEX_DIR, con un nome ricavato
+ // dal percorso (FNV-1a a 64 bit). Una collisione si riconosce dalla radice
+ // registrata nell'intestazione
+ void name_index_file(const char *root, char *buf, size_t size) {
+     uint64_t hash = 14695981039346656037ULL;
+     const unsigned char *c;
+     
+     for (c = (const unsigned char *)root; *c; c++)
+         hash = (hash ^ *c) * 1099511628211ULL;
+     snprintf(buf, size, "%s/names-%016llx.idx", config.index_dir, (unsigned long long)hash);
+ }
+ 
+ // Cerca l'indice dei nomi che copre path: quello di path stesso o della
+ // directory piu' vicina che lo contiene. Restituisce 1 e la radice in root
+ int name_index_root(const char *path, char *root, size_t size) {
+     char file[MAX_PATH_LEN * 2];
+     char *slash;
+     
+     snprintf(root, size, "%s", path);
+     while (1) {
+         name_index_file(root, file, sizeof(file));
+         if (access(file, R_OK) == 0)
+             return 1;
+         if (strcmp(root, "/") == 0 || (slash = strrchr(root, '/')) == NULL)
+             return 0;
+         if (slash == root) slash[1] = '\0';
+         else *slash = '\0';
+     }
+ }
+ 
+ // Mappa in memoria l'indice dei nomi di root e ne controlla posizioni e
+ // lunghezze una volta sola, cosi' le ricerche possono fidarsi del contenuto.
+ // Restituisce NULL se manca, e' danneggiato o appartiene a un'altra radice
+ NameIndex *name_index_open(const char *root) {
+     char file[MAX_PATH_LEN * 2];
+     const NameIndexHeader *header;
+     NameIndex *index;
+     struct stat st;
+     uint64_t expected;
+     uint32_t i;
+     int fd;
+     
+     name_index_file(root, file, sizeof(file));
+     fd = open(file, O_RDONLY | O_CLOEXEC);
+     if (fd < 0) return NULL;
+     index = calloc(1, sizeof(NameIndex));
+     if (!index || fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(NameIndexHeader))
+         goto invalid;
+     index->size = st.st_size;
+     index->map = mmap(NULL, index->size, PROT_READ, MAP_SHARED, fd, 0);
+     if (index->map == MAP_FAILED) {
+         index->map = NULL;
+         goto invalid;
+     }
+     close(fd);
+     fd = -1;
+     
+     header = index->header = index->map;
+     expected = sizeof(NameIndexHeader) + (uint64_t)header->num_dirs * sizeof(NameIndexDir) +
+                (uint64_t)header->num_entries * sizeof(NameIndexEntry) + header->names_size;
+     if (memcmp(header->magic, NAME_INDEX_MAGIC, sizeof(header->magic)) != 0 || expected != index->size ||
+         header->num_dirs == 0 || header->num_entries > INT_MAX || header->names_size == 0 ||
+         strncmp(header->root, root, sizeof(header->root)) != 0)
+         goto invalid;
+     index->dirs = (const NameIndexDir *)(header + 1);
+     index->entries = (const NameIndexEntry *)(index->dirs + header->num_dirs);
+     index->names = (const char *)(index->entries + header->num_entries);
+     if (index->names[header->names_size - 1] != '\0')
+         goto invalid;
+     for (i = 0; i < header->num_dirs; i++) {
+         const NameIndexDir *dir = &index->dirs[i];
+         if (dir->path >= header->names_size || dir->first > header->num_entries ||
+             dir->count > header->num_entries - dir->first)
+             goto invalid;
+     }
+     for (i = 0; i < header->num_entries; i++) {
+         const NameIndexEntry *entry = &index->entries[i];
+         if (entry->dir >= header->num_dirs || entry->name >= header->names_size ||
+             (entry->subdir != NAME_INDEX_NONE && entry->subdir >= header->num_dirs))
+             goto invalid;
+     }
+     // La prima directory e' la radice
+     if (index->names[index->dirs[0].path] != '\0')
+         goto invalid;
+     snprintf(index->root, sizeof(index->root), "%s", root);
+     return index;
+     
+ invalid:
+     if (fd >= 0) close(fd);
+     name_index_close(index);
+     errno = EINVAL;
+     return NULL;
+ }
+ 
+ void name_index_close(NameIndex *index) {
+     if (!index) return;
+     if (index->map) munmap(index->map, index->size);
+     free(index);
+ }
+ 
+ // Posizione dell'entry name nella directory dir dell'indice (le entry di una
+ // directory sono ordinate per nome), o NAME_INDEX_NONE
+ uint32_t name_index_child(const NameIndex *index, uint32_t dir, const char *name) {
+     uint32_t low = index->dirs[dir].first, high = low + index->dirs[dir].count;
+     
+     while (low < high) {
+         uint32_t mid = low + (high - low) / 2;
+         int cmp = strcmp(index->names + index->entries[mid].name, name);
+     
+         if (cmp == 0) return mid;
+         if (cmp < 0) low = mid + 1;
+         else high = mid;
+     }
+     return NAME_INDEX_NONE;
+ }
+ 
+ int compare_index_names(const void *a, const void *b) {
+     return strcmp(((const IndexName *)a)->name, ((const IndexName *)b)->name);
+ }
+ 
+ int compare_index_records(const void *a, const void *b) {
+     return strcmp((*(IndexRecord *const *)a)->path, (*(IndexRecord *const *)b)->path);
+ }
+ 
+ // Nuova directory da leggere: path/name, relativa alla radice
+ IndexItem *index_item_new(IndexItem *next, const char *path, const char *name, uint32_t old) {
+     size_t path_len = strlen(path), name_len = strlen(name);
+     IndexItem *item = malloc(sizeof(IndexItem) + path_len + name_len + 2);
+     
+     if (!item) return NULL;
+     item->next = next;
+     item->old = old;
+     if (path_len > 0) {
+         memcpy(item->path, path, path_len);
+         item->path[path_len++] = '/';
+     }
+     memcpy(item->path + path_len, name, name_len + 1);
+     return item;
+ }
+ 
+ // Registra un errore che rende l'indice inutilizzabile e sveglia i thread
+ // in attesa, che smettono di prendere directory
+ void index_fail(IndexBuild *build, int err) {
+     pthread_mutex_lock(&build->lock);
+     if (!build->error) build->error = err;
+     pthread_cond_broadcast(&build->cond);
+     pthread_mutex_unlock(&build->lock);
+ }
+ 
+ // Porta lo spazio per le entry di una directory ad almeno count elementi
+ int index_reserve(IndexName **scratch, int *cap, int count) {
+     IndexName *grown;
+     int new_cap;
+     
+     if (count <= *cap) return 0;
+     for (new_cap = *cap ? *cap : 256; new_cap < count; new_cap *= 2)
+         ;
+     grown = realloc(*scratch, new_cap * sizeof(IndexName));
+     if (!grown) return -1;
+     *scratch = grown;
+     *cap = new_cap;
+     return 0;
+ }
+ 
+ // Legge una directory per l'indice dei nomi e accoda le sottodirectory. Se
+ // la data di modifica e' quella registrata nell'indice precedente, i nomi
+ // non sono cambiati: le entry si riprendono dall'indice senza leggerla
+ void index_directory(IndexBuild *build, IndexItem *item, NameArena *arena, IndexName **scratch, int *scratch_cap) {
+     const NameIndex *old = build->old;
+     const NameIndexDir *old_dir = item->old != NAME_INDEX_NONE ? &old->dirs[item->old] : NULL;
+     IndexItem *items = NULL, *last = NULL;
+     IndexRecord *record;
+     size_t path_len = strlen(item->path), names_size = 0;
+     struct stat st;
+     struct timespec mtime;
+     int fd, count = 0, partial = 0, reused = 0, i;
+     char *dst;
+     
+     fd = openat(build->root_fd, path_len > 0 ? item->path : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+     if (fd < 0) return;
+     // I filesystem montati sotto la radice restano fuori, come con du -x
+     if (fstat(fd, &st) != 0 || st.st_dev != build->dev) {
+         close(fd);
+         return;
+     }
+     mtime = stat_mtime(&st);
+     
+     if (old_dir && !old_dir->partial && old_dir->mtime_sec == mtime.tv_sec && old_dir->mtime_nsec == mtime.tv_nsec) {
+         if (index_reserve(scratch, scratch_cap, old_dir->count) != 0) {
+             close(fd);
+             index_fail(build, ENOMEM);
+             return;
+         }
+         for (i = 0; i < (int)old_dir->count; i++) {
+             const NameIndexEntry *entry = &old->entries[old_dir->first + i];
+             IndexName *name = &(*scratch)[count++];
+     
+             name->name = old->names + entry->name;
+             name->mode = entry->mode;
+             name->size = entry->size;
+             name->mtime = entry->mtime;
+             name->old = entry->subdir;
+         }
+         reused = 1;
+         atomic_fetch_add(&build->reused, 1);
+     } else {
+         const char *name;
+         size_t len;
+         unsigned char type;
+         DirScan scan;
+         int result = -1;
+     
+         arena_reset(arena);
+         if (dirscan_init(&scan, fd) == 0) {
+             while ((result = dirscan_next(&scan, &name, &len, &type)) > 0) {
+                 IndexName *entry;
+                 struct stat entry_st;
+                 const char *copy;
+     
+                 if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+                 // Servono dimensione e data anche delle entry che d_type classifica
+                 perf_count(PERF_SYS_STAT);
+                 if (fstatat(fd, name, &entry_st, AT_SYMLINK_NOFOLLOW) != 0)
+                     continue; // Rimossa nel frattempo
+                 if (index_reserve(scratch, scratch_cap, count + 1) != 0 ||
+                     (copy = arena_strdup(arena, name, len)) == NULL) {
+                     result = -1;
+                     break;
+                 }
+                 entry = &(*scratch)[count++];
+                 entry->name = copy;
+                 entry->mode = entry_st.st_mode;
+                 entry->size = entry_st.st_size;
+                 entry->mtime = entry_st.st_mtime;
+                 entry->old = NAME_INDEX_NONE;
+             }
+             dirscan_detach(&scan);
+         }
+         partial = result != 0;
+         qsort(*scratch, count, sizeof(IndexName), compare_index_names);
+         // Le sottodirectory ritrovano la loro posizione nell'indice precedente
+         for (i = 0; old_dir && i < count; i++) {
+             IndexName *entry = &(*scratch)[i];
+             uint32_t pos;
+     
+             if (S_ISDIR(entry->mode) && (pos = name_index_child(old, item->old, entry->name)) != NAME_INDEX_NONE)
+                 entry->old = old->entries[pos].subdir;
+         }
+         atomic_fetch_add(&build->reread, 1);
+     }
+     close(fd);
+     
+     for (i = 0; i < count; i++) {
+         IndexName *entry = &(*scratch)[i];
+     
+         names_size += strlen(entry->name) + 1;
+         if (!S_ISDIR(entry->mode)) continue;
+         if ((items = index_item_new(items, item->path, entry->name, entry->old)) == NULL)
+             break;
+         if (!last) last = items;
+     }
+     // Le entry riprese restano nell'indice precedente, mappato fino alla scrittura
+     record = i == count ? malloc(sizeof(IndexRecord) + count * sizeof(IndexName) + path_len + 1 +
+                                  (reused ? 0 : names_size)) : NULL;
+     if (!record) {
+         while (items) {
+             IndexItem *next = items->next;
+             free(items);
+             items = next;
+         }
+         index_fail(build, ENOMEM);
+         return;
+     }
+     dst = (char *)(record->entries + count);
+     record->path = memcpy(dst, item->path, path_len + 1);
+     dst += path_len + 1;
+     record->mtime = mtime;
+     record->partial = partial;
+     record->count = count;
+     for (i = 0; i < count; i++) {
+         record->entries[i] = (*scratch)[i];
+         if (!reused) {
+             size_t len = strlen((*scratch)[i].name) + 1;
+             record->entries[i].name = memcpy(dst, (*scratch)[i].name, len);
+             dst += len;
+         }
+     }
+     
+     pthread_mutex_lock(&build->lock);
+     record->next = build->records;
+     build->records = record;
+     build->num_records++;
+     build->num_entries += count;
+     build->names_size += path_len + 1 + names_size;
+     if (items) {
+         last->next = build->items;
+         build->items = items;
+         pthread_cond_broadcast(&build->cond);
+     }
+     pthread_mutex_unlock(&build->lock);
+     if (build->control)
+         atomic_fetch_add(&build->control->files_done, count);
+ }
+ 
+ // Thread della costruzione dell'indice: prende le directory dalla lista
+ // comune finche' e' vuota e nessun altro thread puo' aggiungerne
+ void *index_worker(void *data) {
+     IndexBuild *build = data;
+     NameArena arena = { NULL, NULL };
+     IndexName *scratch = NULL;
+     int scratch_cap = 0;
+     
+     while (1) {
+         IndexItem *item;
+     
+         pthread_mutex_lock(&build->lock);
+         while (!build->items && build->busy > 0 && !build->error)
+             pthread_cond_wait(&build->cond, &build->lock);
+         if (!build->items || build->error) {
+             pthread_cond_broadcast(&build->cond);
+             pthread_mutex_unlock(&build->lock);
+             break;
          }
-     }
+         item = build->items;
+         build->items = item->next;
+         build->busy++;
+         pthread_mutex_unlock(&build->lock);
      
-     // Riempi il resto del pannello con spazi vuoti
-     attron(COLOR_PAIR(1));
-     for (; i < max_display; i++) {
-         mvhline(y + i + 1, x, ' ', width);
+         // Pausa e annullamento dell'operazione
+         if (copy_check_control(build->control) != 0)
+             index_fail(build, ECANCELED);
+         else
+             index_directory(build, item, &arena, &scratch, &scratch_cap);
+         free(item);
+     
+         pthread_mutex_lock(&build->lock);
+         build->busy--;
+         if (build->busy == 0 && !build->items)
+             pthread_cond_broadcast(&build->cond);
+         pthread_mutex_unlock(&build->lock);
      }
-     attroff(COLOR_PAIR(1));
+     free(scratch);
+     arena_free(&arena);
+     return NULL;
+ }
+ 
+ // Crea la directory degli indici dei nomi e quelle che la contengono
+ int make_index_dir() {
+     char path[MAX_PATH_LEN];
+     char *slash = path;
      
-     if (panel == active_panel) {
-         attroff(A_BOLD);
+     snprintf(path, sizeof(path), "%s", config.index_dir);
+     while (1) {
+         slash = strchr(slash + 1, '/');
+         if (slash) *slash = '\0';
+         if (path[0] && mkdir(path, 0700) != 0 && errno != EEXIST)
+             return -1;
+         if (!slash) return 0;
+         *slash = '/';
      }
  }
  
- // Ottieni stringa di permessi in formato Unix
- char *get_file_permissions(mode_t mode) {
-     char *perms = malloc(11);
-     if (!perms) return NULL;
+ // Scrive l'indice costruito in un file temporaneo che poi sostituisce il
+ // precedente: chi ha mappato la versione vecchia continua a vederla intera.
+ // Le directory si ordinano per percorso, cosi' le sottodirectory si
+ // ritrovano con una ricerca binaria
+ int name_index_write(IndexBuild *build, const char *root) {
+     char file[MAX_PATH_LEN * 2], tmp[MAX_PATH_LEN * 2 + 8], path[MAX_PATH_LEN * 2];
+     long num_dirs = build->num_records, i;
+     IndexRecord **records = NULL, key, *key_ptr = &key, **found;
+     NameIndexDir *dirs = NULL;
+     NameIndexEntry *entries = NULL;
+     NameIndexHeader header;
+     uint32_t names = 0, entry = 0;
+     FILE *out = NULL;
+     int fd, j, saved_errno;
      
-     perms[0] = (S_ISDIR(mode)) ? 'd' : '-';
-     perms[1] = (mode & S_IRUSR) ? 'r' : '-';
-     perms[2] = (mode & S_IWUSR) ? 'w' : '-';
-     perms[3] = (mode & S_IXUSR) ? 'x' : '-';
-     perms[4] = (mode & S_IRGRP) ? 'r' : '-';
-     perms[5] = (mode & S_IWGRP) ? 'w' : '-';
-     perms[6] = (mode & S_IXGRP) ? 'x' : '-';
-     perms[7] = (mode & S_IROTH) ? 'r' : '-';
-     perms[8] = (mode & S_IWOTH) ? 'w' : '-';
-     perms[9] = (mode & S_IXOTH) ? 'x' : '-';
-     perms[10] = '\0';
+     if (num_dirs >= NAME_INDEX_NONE || build->num_entries >= INT_MAX || build->names_size >= UINT32_MAX) {
+         errno = EFBIG;
+         return -1;
+     }
+     records = malloc(num_dirs * sizeof(IndexRecord *));
+     dirs = malloc(num_dirs * sizeof(NameIndexDir));
+     entries = malloc((build->num_entries + 1) * sizeof(NameIndexEntry));
+     if (!records || !dirs || !entries) {
+         errno = ENOMEM;
+         goto fail;
+     }
+     for (i = 0, key.next = build->records; key.next; key.next = key.next->next)
+         records[i++] = key.next;
+     qsort(records, num_dirs, sizeof(IndexRecord *), compare_index_records);
+     
+     // Nei nomi: per ogni directory il percorso, poi i nomi delle sue entry
+     for (i = 0; i < num_dirs; i++) {
+         IndexRecord *record = records[i];
+     
+         dirs[i].path = names;
+         names += strlen(record->path) + 1;
+         dirs[i].first = entry;
+         dirs[i].count = record->count;
+         dirs[i].partial = record->partial;
+         dirs[i].mtime_sec = record->mtime.tv_sec;
+         dirs[i].mtime_nsec = record->mtime.tv_nsec;
+         for (j = 0; j < record->count; j++, entry++) {
+             IndexName *name = &record->entries[j];
+             NameIndexEntry *out_entry = &entries[entry];
+     
+             out_entry->dir = i;
+             out_entry->name = names;
+             names += strlen(name->name) + 1;
+             out_entry->mode = name->mode;
+             out_entry->size = name->size;
+             out_entry->mtime = name->mtime;
+             out_entry->subdir = NAME_INDEX_NONE;
+             if (!S_ISDIR(name->mode))
+                 continue;
+             snprintf(path, sizeof(path), "%s%s%s", record->path, record->path[0] ? "/" : "", name->name);
+             key.path = path;
+             found = bsearch(&key_ptr, records, num_dirs, sizeof(IndexRecord *), compare_index_records);
+             if (found)
+                 out_entry->subdir = found - records;
+         }
+     }
+     
+     memset(&header, 0, sizeof(header));
+     memcpy(header.magic, NAME_INDEX_MAGIC, sizeof(header.magic));
+     header.num_dirs = num_dirs;
+     header.num_entries = entry;
+     header.names_size = names;
+     header.built = time(NULL);
+     snprintf(header.root, sizeof(header.root), "%s", root);
+     
+     name_index_file(root, file, sizeof(file));
+     snprintf(tmp, sizeof(tmp), "%s.XXXXXX", file);
+     if (make_index_dir() != 0 || (fd = mkstemp(tmp)) < 0)
+         goto fail;
+     if ((out = fdopen(fd, "w")) == NULL) {
+         saved_errno = errno;
+         close(fd);
+         unlink(tmp);
+         errno = saved_errno;
+         goto fail;
+     }
+     fwrite(&header, sizeof(header), 1, out);
+     fwrite(dirs, sizeof(NameIndexDir), num_dirs, out);
+     fwrite(entries, sizeof(NameIndexEntry), entry, out);
+     for (i = 0; i < num_dirs; i++) {
+         fwrite(records[i]->path, 1, strlen(records[i]->path) + 1, out);
+         for (j = 0; j < records[i]->count; j++)
+             fwrite(records[i]->entries[j].name, 1, strlen(records[i]->entries[j].name) + 1, out);
+     }
+     if (ferror(out) | (fclose(out) != 0) || rename(tmp, file) != 0) {
+         saved_errno = errno;
+         unlink(tmp);
+         errno = saved_errno;
+         goto fail;
+     }
+     free(records);
+     free(dirs);
+     free(entries);
+     return 0;
      
-     return perms;
+ fail:
+     saved_errno = errno;
+     free(records);
+     free(dirs);
+     free(entries);
+     errno = saved_errno;
+     return -1;
  }
  
- // Cambia directory
- void change_directory(Panel *panel, const char *path) {
-     char new_path[MAX_PATH_LEN];
+ // Costruisce l'indice dei nomi di root con una visita parallela dell'albero
+ // (TYC_TREE_THREADS thread), o lo aggiorna: le directory con la stessa data
+ // di modifica si riprendono dall'indice precedente invece di rileggerle
+ int build_name_index(const char *root, CopyStats *stats, CopyControl *control) {
+     IndexBuild build;
+     struct stat st;
+     int i, result = -1, saved_errno;
      
-     // Gestione percorsi relativi e assoluti
-     if (path[0] == '/') {
-         strncpy(new_path, path, MAX_PATH_LEN - 1);
-     } else {
-         snprintf(new_path, MAX_PATH_LEN, "%s/%s", panel->current_path, path);
+     memset(&build, 0, sizeof(build));
+     build.control = control;
+     stats->failed_step = "Directory non accessibile";
+     build.root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+     if (build.root_fd < 0)
+         return -1;
+     if (fstat(build.root_fd, &st) != 0) {
+         saved_errno = errno;
+         close(build.root_fd);
+         errno = saved_errno;
+         return -1;
      }
+     build.dev = st.st_dev;
+     build.old = name_index_open(root);
+     atomic_init(&build.reread, 0);
+     atomic_init(&build.reused, 0);
+     pthread_mutex_init(&build.lock, NULL);
+     pthread_cond_init(&build.cond, NULL);
+     build.items = index_item_new(NULL, "", "", build.old ? 0 : NAME_INDEX_NONE);
+     if (!build.items)
+         build.error = ENOMEM;
      
-     // Normalizza il percorso
-     char *real_path = realpath(new_path, NULL);
-     if (real_path) {
-         strcpy(panel->current_path, real_path);
-         free(real_path);
-         panel->selected = 0;
-         panel->scroll_pos = 0;
-         read_directory(panel);
+     for (i = 0; i < config.tree_threads && !build.error; i++) {
+         if (pthread_create(&build.threads[build.num_threads], NULL, index_worker, &build) != 0)
+             break;
+         build.num_threads++;
+     }
+     if (build.num_threads == 0)
+         index_worker(&build);
+     for (i = 0; i < build.num_threads; i++)
+         pthread_join(build.threads[i], NULL);
+     
+     if (build.error) {
+         errno = build.error;
+         stats->failed_step = build.error == ECANCELED ? "Operazione annullata" : "Memoria insufficiente";
+     } else if (build.num_records == 0) {
+         errno = EACCES;
      } else {
-         display_error("Directory non accessibile");
+         stats->failed_step = "Impossibile scrivere l'indice";
+         result = name_index_write(&build, root);
+     }
+     saved_errno = errno;
+     stats->files = build.num_entries;
+     
+     while (build.items) {
+         IndexItem *next = build.items->next;
+         free(build.items);
+         build.items = next;
+     }
+     while (build.records) {
+         IndexRecord *next = build.records->next;
+         free(build.records);
+         build.records = next;
      }
+     name_index_close(build.old);
+     close(build.root_fd);
+     pthread_mutex_destroy(&build.lock);
+     pthread_cond_destroy(&build.cond);
+     errno = saved_errno;
+     return result;
  }
  
- // Gestisce l'input utente
- void handle_input() {
-     int ch = getch();
-     FileEntry *selected_file;
-     Panel *inactive_panel;
-     char full_path[MAX_PATH_LEN];
-     char target_path[MAX_PATH_LEN];
+ // Interpreta una ricerca nell'indice dei nomi. Le parole formano il nome
+ // cercato (glob se contiene * ? [, altrimenti sottostringa); ">100k" e "<2g"
+ // limitano la dimensione dei file, "-7d" e "+2h" chiedono le entry modificate
+ // negli ultimi (o da piu' di) N minuti (m), ore (h), giorni (d) o settimane (w).
+ // Restituisce -1 se un filtro non e' valido o se la ricerca e' vuota
+ int parse_name_query(const char *text, NameQuery *query) {
+     char copy[MAX_FILTER_LEN + 1], *word, *save;
+     time_t now = time(NULL);
+     size_t i;
      
-     switch(ch) {
-         case KEY_UP:
-             if (active_panel->selected > 0) {
-                 active_panel->selected--;
+     memset(query, 0, sizeof(*query));
+     query->min_size = query->max_size = -1;
+     snprintf(copy, sizeof(copy), "%s", text);
+     for (word = strtok_r(copy, " ", &save); word; word = strtok_r(NULL, " ", &save)) {
+         char *end;
+     
+         if ((word[0] == '>' || word[0] == '<') && isdigit((unsigned char)word[1])) {
+             static const char units[] = "kmgt";
+             long long value = strtoll(word + 1, &end, 10);
+             const char *unit = *end ? strchr(units, tolower((unsigned char)*end)) : NULL;
+     
+             if (unit) {
+                 value <<= 10 * (unit - units + 1);
+                 end++;
              }
-             break;
-             
-         case KEY_DOWN:
-             if (active_panel->selected < active_panel->num_files - 1) {
-                 active_panel->selected++;
+             if (*end == 'b' || *end == 'B') end++;
+             if (*end) return -1;
+             if (word[0] == '>') query->min_size = value;
+             else query->max_size = value;
+         } else if ((word[0] == '-' || word[0] == '+') && isdigit((unsigned char)word[1])) {
+             long long value = strtoll(word + 1, &end, 10);
+             long seconds;
+     
+             switch (tolower((unsigned char)*end)) {
+                 case 'm': seconds = 60; break;
+                 case 'h': seconds = 3600; break;
+                 case 'd': case '\0': seconds = 86400; break;
+                 case 'w': seconds = 7 * 86400; break;
+                 default: return -1;
              }
+             if (*end && end[1]) return -1;
+             if (word[0] == '-') query->newer = now - value * seconds;
+             else query->older = now - value * seconds;
+         } else {
+             size_t len = strlen(word);
+     
+             if (query->len > 0) query->pattern[query->len++] = ' ';
+             memcpy(query->pattern + query->len, word, len + 1);
+             query->len += len;
+         }
+     }
+     if (query->len == 0 && query->min_size < 0 && query->max_size < 0 && !query->newer && !query->older)
+         return -1;
+     for (i = 0; i < query->len; i++)
+         query->folded[i] = fold_char(query->pattern[i]);
+     query->folded[query->len] = '\0';
+     query->glob = strpbrk(query->pattern, "*?[") != NULL;
+     if (query->glob)
+         query->literal_len = glob_literal(query->folded, query->len, query->literal);
+     return 0;
+ }
+ 
+ // Vero se l'entry dell'indice soddisfa la ricerca. I filtri sulla dimensione
+ // valgono solo per i file regolari, e si controllano prima del nome
+ int name_query_match(const NameQuery *query, const char *name, const NameIndexEntry *entry) {
+     if (query->min_size >= 0 || query->max_size >= 0) {
+         if (!S_ISREG(entry->mode)) return 0;
+         if (query->min_size >= 0 && entry->size <= query->min_size) return 0;
+         if (query->max_size >= 0 && entry->size >= query->max_size) return 0;
+     }
+     if (query->newer && entry->mtime < query->newer) return 0;
+     if (query->older && entry->mtime >= query->older) return 0;
+     if (query->len == 0) return 1;
+     if (!query->glob) return contains_folded(name, query->folded, query->len);
+     if (query->literal_len > 0 && !contains_folded(name, query->literal, query->literal_len))
+         return 0;
+     return fnmatch(query->pattern, name, FNM_CASEFOLD) == 0;
+ }
+ 
+ // Applica la ricerca alle entry [from, to) dell'indice di un FindJob
+ void find_task(void *arg, int from, int to) {
+     FindJob *job = arg;
+     int i;
+     
+     for (i = from; i < to; i++) {
+         const NameIndexEntry *entry = &job->index->entries[i];
+         job->hits[i] = job->in_scope[entry->dir] && name_query_match(job->query, job->index->names + entry->name, entry);
+     }
+ }
+ 
+ // Elenca nel pannello le entry dell'indice sotto la sua directory che
+ // soddisfano la ricerca, con il percorso relativo come nome. L'indice e'
+ // mappato in memoria: la ricerca scorre entry e nomi senza leggere il disco,
+ // divisa tra i thread del pool come il filtro
+ void list_found(Panel *panel) {
+     NameIndex *index = panel->found;
+     uint32_t num_dirs = index->header->num_dirs, num_entries = index->header->num_entries, i;
+     const char *scope = panel->current_path + strlen(index->root);
+     char path[MAX_PATH_LEN * 2];
+     struct timespec start;
+     NameQuery query;
+     size_t scope_len;
+     unsigned char *in_scope = NULL;
+     WorkerPool *pool;
+     FindJob job;
+     
+     perf_start(&start);
+     panel->found_truncated = 0;
+     if (*scope == '/') scope++;
+     scope_len = strlen(scope);
+     job.index = index;
+     job.query = &query;
+     job.hits = malloc(num_entries + 1);
+     if (parse_name_query(panel->found_query, &query) != 0 || !job.hits || !(in_scope = malloc(num_dirs))) {
+         free(job.hits);
+         finish_listing(panel);
+         return;
+     }
+     // Solo le directory sotto quella del pannello
+     for (i = 0; i < num_dirs; i++) {
+         const char *dir = index->names + index->dirs[i].path;
+         in_scope[i] = scope_len == 0 ||
+             (strncmp(dir, scope, scope_len) == 0 && (dir[scope_len] == '\0' || dir[scope_len] == '/'));
+     }
+     job.in_scope = in_scope;
+     
+     if (num_entries >= PARALLEL_FILTER_MIN && config.stat_threads > 1 && (pool = get_stat_pool()))
+         pool_run(pool, find_task, &job, num_entries, PARALLEL_FILTER_BATCH);
+     else
+         find_task(&job, 0, num_entries);
+     
+     for (i = 0; i < num_entries; i++) {
+         const NameIndexEntry *entry = &index->entries[i];
+         const char *dir;
+         FileEntry *file;
+         int len;
+     
+         if (!job.hits[i]) continue;
+         if (panel->num_files > FIND_MAX_RESULTS) {
+             panel->found_truncated = 1;
              break;
-             
-         case KEY_LEFT:
-         case '\t':
-             // Cambia pannello attivo
-             active_panel = (active_panel == &left_panel) ? &right_panel : &left_panel;
+         }
+         dir = index->names + index->dirs[entry->dir].path + scope_len;
+         if (*dir == '/') dir++;
+         len = snprintf(path, sizeof(path), "%s%s%s", dir, *dir ? "/" : "", index->names + entry->name);
+         if (len >= (int)sizeof(path)) continue;
+         file = panel_new_entry(panel, path, len);
+         if (!file) {
+             display_error("Memoria insufficiente: elenco incompleto");
              break;
-             
-         case '\n': // Enter
-             selected_file = &active_panel->files[active_panel->selected];
-             if (selected_file->is_dir) {
-                 change_directory(active_panel, selected_file->name);
-             }
+         }
+         file->is_dir = S_ISDIR(entry->mode);
+         file->size = entry->size;
+         file->mode = entry->mode;
+         file->mtime = entry->mtime;
+         file->has_meta = 1;
+         file->d_type = S_ISDIR(entry->mode) ? DT_DIR : S_ISLNK(entry->mode) ? DT_LNK : DT_REG;
+         file->id = panel->next_id++;
+     }
+     free(in_scope);
+     free(job.hits);
+     perf_end(PERF_FIND, &start, panel->num_files - 1, 0, panel->found_query);
+     finish_listing(panel);
+ }
+ 
+ // Accoda la costruzione (o l'aggiornamento) dell'indice dei nomi di root,
+ // se non e' gia' in coda
+ void start_name_index(const char *root) {
+     Job *job;
+     
+     pthread_mutex_lock(&jobs_lock);
+     for (job = jobs; job; job = job->next) {
+         if (job->type == JOB_NAMES && job->state < JOB_DONE && strcmp(job->src, root) == 0)
              break;
-             
-         case KEY_F(3): // View
-             selected_file = &active_panel->files[active_panel->selected];
-             if (!selected_file->is_dir) {
-                 snprintf(full_path, MAX_PATH_LEN, "%s/%s", 
-                          active_panel->current_path, selected_file->name);
-                 view_file(full_path);
-             }
+     }
+     pthread_mutex_unlock(&jobs_lock);
+     if (!job)
+         enqueue_job(JOB_NAMES, root, NULL);
+ }
+ 
+ // Cerca i file nell'indice dei nomi che copre la directory del pannello.
+ // Se l'indice c'e' i risultati si mostrano subito e l'indice si aggiorna in
+ // background; altrimenti si costruisce e i risultati arrivano al termine
+ void find_files(Panel *panel, const char *text) {
+     char root[MAX_PATH_LEN];
+     NameQuery query;
+     NameIndex *index;
+     
+     if (parse_name_query(text, &query) != 0) {
+         show_message("Ricerca non valida: nome, >100k, <2g, -7d (ultimi 7 giorni), +2h (da piu' di 2 ore)");
+         return;
+     }
+     snprintf(panel->found_query, sizeof(panel->found_query), "%s", text);
+     if (!name_index_root(panel->current_path, root, sizeof(root)))
+         snprintf(root, sizeof(root), "%s", panel->current_path);
+     if ((index = name_index_open(root)) == NULL) {
+         snprintf(panel->found_wait, sizeof(panel->found_wait), "%s", root);
+         start_name_index(root);
+         return;
+     }
+     show_found(panel, index);
+     start_name_index(root);
+ }
+ 
+ // Mostra nel pannello, al posto dell'elenco della directory, i risultati
+ // della ricerca found_query nell'indice (di cui riceve la proprieta')
+ void show_found(Panel *panel, NameIndex *index) {
+     cache_listing(panel);
+     cancel_directory_load(panel);
+     unwatch_directory(panel);
+     close_found(panel);
+     panel->found = index;
+     reset_panel_view(panel);
+     load_directory(panel);
+ }
+ 
+ void close_found(Panel *panel) {
+     name_index_close(panel->found);
+     panel->found = NULL;
+ }
+ 
+ // Vero se path e' dir o si trova sotto dir
+ int path_within(const char *path, const char *dir) {
+     size_t len = strlen(dir);
+     
+     if (strcmp(dir, "/") == 0) return 1;
+     return strncmp(path, dir, len) == 0 && (path[len] == '\0' || path[len] == '/');
+ }
+ 
+ // Conclusione della costruzione di un indice dei nomi: i pannelli che lo
+ // attendevano mostrano i risultati della ricerca, quelli che ne mostravano
+ // gia' i risultati li ricalcolano sull'indice aggiornato
+ void names_indexed(const char *root, int ok) {
+     Panel *panels[2] = { &left_panel, &right_panel };
+     int i;
+     
+     for (i = 0; i < 2; i++) {
+         Panel *panel = panels[i];
+         int waiting = strcmp(panel->found_wait, root) == 0;
+         NameIndex *index;
+     
+         if (waiting) panel->found_wait[0] = '\0';
+         if (!ok || panel->archive)
+             continue;
+         if (panel->found ? strcmp(panel->found->root, root) != 0
+                          : !waiting || !path_within(panel->current_path, root))
+             continue;
+         if ((index = name_index_open(root)) == NULL)
+             continue;
+         if (panel->found) {
+             // La selezione resta sulla stessa entry, se c'e' ancora
+             name_index_close(panel->found);
+             panel->found = index;
+             refresh_directory(panel);
+         } else {
+             show_found(panel, index);
+         }
+     }
+ }
+ 
+ // Enter sui risultati: ".." torna all'elenco della directory, una directory
+ // si apre, per un file il pannello passa alla sua directory e lo seleziona
+ void open_found_entry(Panel *panel, FileEntry *file) {
+     char path[MAX_PATH_LEN * 2], name[MAX_FILENAME_LEN];
+     char *slash;
+     
+     if (strcmp(file->name, "..") == 0) {
+         snprintf(path, sizeof(path), "%s", panel->current_path);
+         change_directory(panel, path);
+         return;
+     }
+     snprintf(path, sizeof(path), "%s/%s", panel->current_path, file->name);
+     if (file->is_dir) {
+         change_directory(panel, path);
+         return;
+     }
+     slash = strrchr(path, '/');
+     snprintf(name, sizeof(name), "%s", slash + 1);
+     *slash = '\0';
+     change_directory(panel, path);
+     if (panel->found)
+         return; // Directory non accessibile
+     select_loaded_entry(panel, name);
+ }
+ 
+ // Seleziona l'entry name dopo change_directory: un elenco dalla cache e'
+ // gia' completo (la rilettura in background mantiene la selezione per
+ // nome), altrimenti l'entry si seleziona al termine della lettura
+ void select_loaded_entry(Panel *panel, const char *name) {
+     int i;
+     
+     if (panel->loader && !panel->loader->shadow) {
+         free(panel->reselect_name);
+         panel->reselect_name = strdup(name);
+         panel->reselect_index = panel->selected;
+         return;
+     }
+     for (i = 1; i < panel->num_files; i++) {
+         if (strcmp(panel->files[i].name, name) == 0) {
+             panel->selected = i;
              break;
+         }
+     }
+ }
+ 
+ // Vero (con un messaggio) se il pannello mostra i risultati di una ricerca,
+ // che contengono entry di directory diverse
+ int found_readonly(Panel *panel) {
+     if (!panel->found) return 0;
+     show_message("Risultati della ricerca: Enter porta al file, Esc torna alla directory");
+     return 1;
+ }
+ 
+ // Secondi trascorsi tra due istanti
+ double elapsed_seconds(const struct timespec *from, const struct timespec *to) {
+     return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+ }
+ 
+ // Attiva la strumentazione se richiesta: TYC_PERF=1 raccoglie le statistiche
+ // dall'avvio, TYC_TRACE=file scrive anche la traccia degli eventi
+ void perf_init() {
+     const char *value = getenv("TYC_PERF");
+     
+     clock_gettime(CLOCK_MONOTONIC, &perf.origin);
+     if (value && *value && strcmp(value, "0") != 0)
+         atomic_store(&perf.enabled, 1);
+     
+     value = getenv("TYC_TRACE");
+     if (!value || !*value) return;
+     perf.trace = fopen(value, "w");
+     if (!perf.trace) {
+         fprintf(stderr, "Impossibile creare la traccia %s: %s\n", value, strerror(errno));
+         return;
+     }
+     perf.trace_path = value;
+     fprintf(perf.trace, "[\n");
+     atomic_store(&perf.enabled, 1);
+ }
+ 
+ // Chiude l'array JSON della traccia
+ void perf_close() {
+     pthread_mutex_lock(&perf.trace_lock);
+     if (perf.trace) {
+         fprintf(perf.trace, "\n]\n");
+         fclose(perf.trace);
+         perf.trace = NULL;
+     }
+     pthread_mutex_unlock(&perf.trace_lock);
+ }
+ 
+ // Registra la durata di un'operazione iniziata in start: istogramma,
+ // contatori e, se attiva, un evento completo ("ph":"X") nella traccia
+ void perf_record(int op, const struct timespec *start, long entries, long long bytes, const char *detail) {
+     static const char *op_names[] = { "read_directory", "sort_files", "draw_interface", "copy_file", "delete_file",
+                                       "find_files" };
+     PerfCounter *counter = &perf.ops[op];
+     struct timespec end;
+     unsigned long us, max;
+     int bucket = 0;
+     
+     clock_gettime(CLOCK_MONOTONIC, &end);
+     us = (unsigned long)(elapsed_seconds(start, &end) * 1e6);
+     while (bucket < PERF_BUCKETS - 1 && (1UL << bucket) <= us)
+         bucket++;
+     
+     atomic_fetch_add_explicit(&counter->count, 1, memory_order_relaxed);
+     atomic_fetch_add_explicit(&counter->total_us, us, memory_order_relaxed);
+     atomic_fetch_add_explicit(&counter->buckets[bucket], 1, memory_order_relaxed);
+     if (entries > 0) atomic_fetch_add_explicit(&counter->entries, entries, memory_order_relaxed);
+     if (bytes > 0) atomic_fetch_add_explicit(&counter->bytes, bytes, memory_order_relaxed);
+     max = atomic_load_explicit(&counter->max_us, memory_order_relaxed);
+     while (us > max && !atomic_compare_exchange_weak(&counter->max_us, &max, us))
+         ;
+     
+     if (!perf.trace) return;
+     pthread_mutex_lock(&perf.trace_lock);
+     if (perf.trace) {
+         long tid;
+ #ifdef __linux__
+         tid = syscall(SYS_gettid);
+ #else
+         tid = (long)(uintptr_t)pthread_self();
+ #endif
+         fprintf(perf.trace, "%s{\"name\":\"%s\",\"cat\":\"tyc\",\"ph\":\"X\",\"ts\":%.0f,\"dur\":%lu,"
+                             "\"pid\":%d,\"tid\":%ld,\"args\":{\"entries\":%ld,\"bytes\":%lld",
+                 perf.trace_events++ ? ",\n" : "", op_names[op], elapsed_seconds(&perf.origin, start) * 1e6, us,
+                 (int)getpid(), tid, entries, bytes);
+         if (detail) {
+             const unsigned char *c;
              
-         case KEY_F(4): // Edit
-             selected_file = &active_panel->files[active_panel->selected];
-             if (!selected_file->is_dir) {
-                 snprintf(full_path, MAX_PATH_LEN, "%s/%s", 
-                          active_panel->current_path, selected_file->name);
-                 edit_file(full_path);
+             // Come json_string, ma sul file della traccia
+             fprintf(perf.trace, ",\"path\":\"");
+             for (c = (const unsigned char *)detail; *c; c++) {
+                 if (*c == '"' || *c == '\\')
+                     fprintf(perf.trace, "\\%c", *c);
+                 else if (*c < 0x20)
+                     fprintf(perf.trace, "\\u%04x", *c);
+                 else
+                     fputc(*c, perf.trace);
              }
-             break;
-             
-         case KEY_F(5): // Copy
-             selected_file = &active_panel->files[active_panel->selected];
-             inactive_panel = (active_panel == &left_panel) ? &right_panel : &left_panel;
-             
-             snprintf(full_path, MAX_PATH_LEN, "%s/%s", 
-                      active_panel->current_path, selected_file->name);
-             snprintf(target_path, MAX_PATH_LEN, "%s/%s", 
-                      inactive_panel->current_path, selected_file->name);
-             
-             copy_file(full_path, target_path);
-             read_directory(inactive_panel);
-             break;
-             
-         case KEY_F(6): // Move
-             selected_file = &active_panel->files[active_panel->selected];
-             inactive_panel = (active_panel == &left_panel) ? &right_panel : &left_panel;
-             
-             snprintf(full_path, MAX_PATH_LEN, "%s/%s", 
-                      active_panel->current_path, selected_file->name);
-             snprintf(target_path, MAX_PATH_LEN, "%s/%s", 
-                      inactive_panel->current_path, selected_file->name);
-             
-             move_file(full_path, target_path);
-             read_directory(active_panel);
-             read_directory(inactive_panel);
-             break;
-             
-         case KEY_F(8): // Delete
-             selected_file = &active_panel->files[active_panel->selected];
-             
-             // Non eliminiamo ".."
-             if (strcmp(selected_file->name, "..") == 0)
-                 break;
-                 
-             snprintf(full_path, MAX_PATH_LEN, "%s/%s", 
-                      active_panel->current_path, selected_file->name);
-             
-             delete_file(full_path);
-             read_directory(active_panel);
-             break;
-             
-         case KEY_F(9): // Shell
-             open_shell();
-             break;
-             
-         case KEY_F(7): // Mkdir
-             // TODO: implementare creazione directory
-             break;
-             
-         case KEY_F(1): // Help
-             // TODO: mostra aiuto
-             break;
-             
-         case KEY_F(2): // Menu
-             // TODO: mostra menu
-             break;
-             
-         case 's': // Cambia ordinamento (nome, dimensione, data)
-             active_panel->sort_by = (active_panel->sort_by + 1) % 3;
-             sort_files(active_panel);
-             break;
-             
-         case 'r': // Inverte ordine
-             active_panel->sort_order = !active_panel->sort_order;
-             sort_files(active_panel);
-             break;
-         
-         case 'q':
-         case 'Q':  
-         case KEY_F(10):  // F10
-             cleanup();
-             exit(0);
-             break;
+             fputc('"', perf.trace);
+         }
+         fprintf(perf.trace, "}}");
      }
+     pthread_mutex_unlock(&perf.trace_lock);
  }
  
- // Visualizza un file usando il visualizzatore configurato
- void view_file(const char *path) {
-     char command[MAX_COMMAND_LEN];
-     
-     // Ottieni il visualizzatore dalla variabile d'ambiente o usa 'less' di default
-     char *viewer = getenv("PAGER");
-     if (!viewer) viewer = "less";
+ // Durata in forma breve: microsecondi, millisecondi o secondi
+ void perf_format_us(unsigned long us, char *buf, size_t size) {
+     if (us < 1000)
+         snprintf(buf, size, "%luus", us);
+     else if (us < 1000000)
+         snprintf(buf, size, "%.1fms", us / 1000.0);
+     else
+         snprintf(buf, size, "%.2fs", us / 1e6);
+ }
+ 
+ // Percentile stimato dall'istogramma: limite superiore del bucket che lo contiene
+ unsigned long perf_percentile(PerfCounter *counter, int percent) {
+     unsigned long count = atomic_load(&counter->count), seen = 0;
+     int i;
      
-     // Costruisci il comando
-     snprintf(command, MAX_COMMAND_LEN, "%s \"%s\"", viewer, path);
+     for (i = 0; i < PERF_BUCKETS; i++) {
+         seen += atomic_load(&counter->buckets[i]);
+         if (seen * 100 >= count * percent)
+             return 1UL << i;
+     }
+     return 1UL << (PERF_BUCKETS - 1);
+ }
+ 
+ // Riquadro delle statistiche ('P'): per ogni operazione numero, media,
+ // percentili, massimo, entry, byte e istogramma delle durate (una colonna per
+ // potenza di 2 da 1 us), poi le chiamate di sistema contate
+ void draw_perf_overlay(int y, int rows) {
+     static const char *labels[] = { "lettura dir", "ordinamento", "disegno", "copia", "eliminazione", "ricerca nomi" };
+     static const char *call_names[] = { "getdents", "stat", "open", "read", "write", "copy", "unlink", "uring" };
+     static const char shades[] = " .:-=+*#%@";
+     int width = term_cols - 4 < 110 ? term_cols - 4 : 110;
+     int height = PERF_OPS + 5, i, j;
+     char text[32];
      
-     // Salva lo stato del terminale e ripristina modalità canonica
-     def_prog_mode();
-     endwin();
+     if (rows < height || width < 60) return;
+     if (!perf.win || getmaxx(perf.win) != width || getbegy(perf.win) != y + rows - height ||
+         getbegx(perf.win) != term_cols - width - 2) {
+         if (perf.win) delwin(perf.win);
+         perf.win = newwin(height, width, y + rows - height, term_cols - width - 2);
+         if (!perf.win) return;
+     }
      
-     // Esegui il comando
-     system(command);
+     werase(perf.win);
+     wattron(perf.win, COLOR_PAIR(2));
+     box(perf.win, 0, 0);
+     mvwprintw(perf.win, 0, 2, " Prestazioni (P chiude) ");
+     mvwprintw(perf.win, 1, 1, "%-12s %7s %8s %8s %8s %8s %9s %8s  1us%*s32s", "operazione", "n", "media", "p50", "p99",
+               "max", "entry", "byte", PERF_BUCKETS - 6, "");
+     for (i = 0; i < PERF_OPS; i++) {
+         PerfCounter *counter = &perf.ops[i];
+         unsigned long count = atomic_load(&counter->count), peak = 0;
+         char avg[16], p50[16], p99[16], max[16], bytes[16];
+         
+         mvwprintw(perf.win, 2 + i, 1, "%-12s %7lu", labels[i], count);
+         if (count == 0) continue;
+         perf_format_us(atomic_load(&counter->total_us) / count, avg, sizeof(avg));
+         perf_format_us(perf_percentile(counter, 50), p50, sizeof(p50));
+         perf_format_us(perf_percentile(counter, 99), p99, sizeof(p99));
+         perf_format_us(atomic_load(&counter->max_us), max, sizeof(max));
+         format_size(atomic_load(&counter->bytes), bytes);
+         wprintw(perf.win, " %8s %8s %8s %8s %9lu %8s  ", avg, p50, p99, max, atomic_load(&counter->entries), bytes);
+         for (j = 0; j < PERF_BUCKETS; j++) {
+             unsigned long n = atomic_load(&counter->buckets[j]);
+             if (n > peak) peak = n;
+         }
+         for (j = 0; j < PERF_BUCKETS; j++) {
+             unsigned long n = atomic_load(&counter->buckets[j]);
+             // Anche un solo evento resta visibile
+             waddch(perf.win, shades[n == 0 ? 0 : 1 + n * (sizeof(shades) - 3) / peak]);
+         }
+     }
+     wmove(perf.win, 2 + PERF_OPS, 1);
+     wprintw(perf.win, "syscall:");
+     for (i = 0; i < PERF_SYSCALLS; i++)
+         wprintw(perf.win, " %s %lu", call_names[i], atomic_load(&perf.syscalls[i]));
+     if (perf.trace) {
+         snprintf(text, sizeof(text), "%ld", perf.trace_events);
+         mvwprintw(perf.win, 3 + PERF_OPS, 1, "traccia: %.*s (%s eventi)", width - 30, perf.trace_path, text);
+     }
+     wattroff(perf.win, COLOR_PAIR(2));
+     // Sopra le finestre dei pannelli, che nel frattempo possono essere cambiate
+     touchwin(perf.win);
+     wnoutrefresh(perf.win);
+ }
+ 
+ // Accoda un'operazione; i thread delle operazioni vengono avviati al primo uso
+ Job *enqueue_job(int type, const char *src, const char *dst) {
+     Job *job = new_job(type, src, dst);
      
-     // Ripristina lo stato del terminale
-     reset_prog_mode();
-     refresh();
+     return job ? submit_job(job) : NULL;
  }
  
- // Modifica un file usando l'editor configurato
- void edit_file(const char *path) {
-     char command[MAX_COMMAND_LEN];
+ // Accoda un'operazione sulle entry names (un solo blocco, che passa
+ // all'operazione) della directory src_dir, verso la directory dst_dir
+ Job *enqueue_group(int type, const char *src_dir, const char *dst_dir, char **names, int count) {
+     Job *job = new_job(type, src_dir, dst_dir);
      
-     // Ottieni l'editor dalla variabile d'ambiente o usa 'vi' di default
-     char *editor = getenv("EDITOR");
-     if (!editor) editor = "vi";
+     if (!job) {
+         free(names);
+         return NULL;
+     }
+     job->names = names;
+     job->num_names = count;
+     return submit_job(job);
+ }
+ 
+ // Prepara un'operazione ancora da accodare
+ Job *new_job(int type, const char *src, const char *dst) {
+     Job *job = calloc(1, sizeof(Job));
      
-     // Costruisci il comando
-     snprintf(command, MAX_COMMAND_LEN, "%s \"%s\"", editor, path);
+     if (!job) {
+         display_error("Memoria insufficiente");
+         return NULL;
+     }
+     job->type = type;
+     job->state = JOB_QUEUED;
+     snprintf(job->src, MAX_PATH_LEN, "%s", src);
+     if (dst) snprintf(job->dst, MAX_PATH_LEN, "%s", dst);
+     atomic_init(&job->control.bytes_done, 0);
+     atomic_init(&job->control.bytes_total, 0);
+     atomic_init(&job->control.paused, 0);
+     atomic_init(&job->control.cancel, 0);
+     return job;
+ }
+ 
+ // Mette in coda un'operazione preparata con new_job
+ Job *submit_job(Job *job) {
+     Job **tail;
      
-     // Salva lo stato del terminale e ripristina modalità canonica
-     def_prog_mode();
-     endwin();
+     pthread_mutex_lock(&jobs_lock);
+     job->id = next_job_id++;
+     for (tail = &jobs; *tail; tail = &(*tail)->next)
+         ;
+     *tail = job;
      
-     // Esegui il comando
-     system(command);
+     while (num_job_threads < config.job_threads &&
+            pthread_create(&job_threads[num_job_threads], NULL, job_worker, NULL) == 0)
+         num_job_threads++;
+     pthread_cond_signal(&jobs_cond);
+     pthread_mutex_unlock(&jobs_lock);
      
-     // Ripristina lo stato del terminale
-     reset_prog_mode();
-     refresh();
+     if (num_job_threads == 0) {
+         // Senza thread l'operazione viene eseguita subito
+         run_job(job);
+     }
+     return job;
  }
  
- // Copia un file
- void copy_file(const char *src, const char *dst) {
-     FILE *src_file, *dst_file;
-     char buffer[4096];
-     size_t bytes_read;
+ // Esegue un'operazione e ne registra il risultato
+ void run_job(Job *job) {
+     CopyStats stats;
+     const char *failed_step = NULL;
+     int result;
      
-     // Non copiare ".."
-     if (strcmp(src, "..") == 0)
-         return;
+     pthread_mutex_lock(&jobs_lock);
+     job->state = JOB_RUNNING;
+     pthread_mutex_unlock(&jobs_lock);
+     clock_gettime(CLOCK_MONOTONIC, &job->started);
      
-     src_file = fopen(src, "rb");
-     if (!src_file) {
-         display_error("Impossibile aprire il file sorgente");
-         return;
+     memset(&stats, 0, sizeof(stats));
+     if (job->names) {
+         // Operazione di gruppo sulle entry marcate
+         if (job->type == JOB_EXTRACT)
+             result = extract_group(job->src, job->dst, job->names, job->num_names, &stats, &job->control);
+         else
+             result = group_operation(job->type, job->src, job->type == JOB_DELETE ? NULL : job->dst,
+                                      job->names, job->num_names, &stats, &job->control);
+         failed_step = stats.failed_step;
+     } else {
+         switch (job->type) {
+             case JOB_COPY:
+                 result = copy_file(job->src, job->dst, &stats, &job->control);
+                 failed_step = stats.failed_step;
+                 break;
+             case JOB_MOVE:
+                 result = move_file(job->src, job->dst, &stats, &job->control);
+                 failed_step = stats.failed_step;
+                 break;
+             case JOB_EXTRACT:
+                 result = extract_path(job->src, job->dst, &stats, &job->control);
+                 failed_step = stats.failed_step;
+                 break;
+             case JOB_INDEX:
+                 result = index_archive(job->src, &stats, &job->control);
+                 failed_step = stats.failed_step;
+                 break;
+             case JOB_NAMES:
+                 result = build_name_index(job->src, &stats, &job->control);
+                 failed_step = stats.failed_step;
+                 break;
+             case JOB_SIZE:
+             case JOB_SIZE_ALL:
+                 result = size_tree(job->src, &stats, &job->control);
+                 failed_step = stats.failed_step;
+                 break;
+             default:
+                 result = delete_file(job->src, &stats, &job->control);
+                 failed_step = stats.failed_step;
+                 break;
+         }
      }
      
-     dst_file = fopen(dst, "wb");
-     if (!dst_file) {
-         fclose(src_file);
-         display_error("Impossibile creare il file destinazione");
-         return;
+     pthread_mutex_lock(&jobs_lock);
+     clock_gettime(CLOCK_MONOTONIC, &job->finished);
+     job->method = stats.method;
+     job->errors = stats.errors;
+     job->num_errors = stats.num_errors;
+     if (result == 0) {
+         job->state = JOB_DONE;
+     } else {
+         job->error = errno;
+         job->failed_step = failed_step;
+         job->state = errno == ECANCELED ? JOB_CANCELLED : JOB_FAILED;
      }
+     pthread_mutex_unlock(&jobs_lock);
+     ui_wake();
+ }
+ 
+ // Thread delle operazioni: esegue in ordine le operazioni in coda
+ void *job_worker(void *data) {
+     (void)data;
      
-     while ((bytes_read = fread(buffer, 1, sizeof(buffer), src_file)) > 0) {
-         fwrite(buffer, 1, bytes_read, dst_file);
+     pthread_mutex_lock(&jobs_lock);
+     while (!jobs_shutdown) {
+         Job *job;
+         
+         for (job = jobs; job && job->state != JOB_QUEUED; job = job->next)
+             ;
+         if (!job) {
+             pthread_cond_wait(&jobs_cond, &jobs_lock);
+             continue;
+         }
+         
+         job->state = JOB_RUNNING;
+         pthread_mutex_unlock(&jobs_lock);
+         if (atomic_load(&job->control.cancel)) {
+             pthread_mutex_lock(&jobs_lock);
+             job->state = JOB_CANCELLED;
+             job->reaped = 0;
+             clock_gettime(CLOCK_MONOTONIC, &job->finished);
+             continue;
+         }
+         run_job(job);
+         pthread_mutex_lock(&jobs_lock);
      }
+     pthread_mutex_unlock(&jobs_lock);
+     return NULL;
+ }
+ 
+ // Vero se la directory dir contiene direttamente path
+ int path_in_directory(const char *path, const char *dir) {
+     const char *slash = strrchr(path, '/');
+     size_t len;
      
-     fclose(src_file);
-     fclose(dst_file);
+     if (!slash) return 0;
+     len = slash == path ? 1 : (size_t)(slash - path);
+     return strlen(dir) == len && strncmp(path, dir, len) == 0;
+ }
+ 
+ // Vero se l'operazione ha modificato il contenuto della directory dir: quella
+ // che contiene sorgente o destinazione, o per un gruppo le due directory
+ int job_touches(Job *job, const char *dir) {
+     if (job->names)
+         return strcmp(job->src, dir) == 0 || (job->dst[0] && strcmp(job->dst, dir) == 0);
+     return path_in_directory(job->src, dir) || (job->dst[0] && path_in_directory(job->dst, dir));
+ }
+ 
+ // Gestisce le operazioni concluse: aggiorna i pannelli interessati, segnala
+ // gli errori e rimuove dalla coda quelle terminate da qualche secondo.
+ // Restituisce 1 se l'area delle operazioni e' cambiata
+ int poll_jobs() {
+     struct timespec now;
+     Job **link, *job;
+     int changed = 0, sizes_running = 0, sizes_done = 0;
      
-     // Copia anche i permessi
-     struct stat st;
-     if (stat(src, &st) == 0) {
-         chmod(dst, st.st_mode);
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     pthread_mutex_lock(&jobs_lock);
+     link = &jobs;
+     while ((job = *link) != NULL) {
+         int finished = job->state >= JOB_DONE;
+         int is_size = job->type == JOB_SIZE || job->type == JOB_SIZE_ALL;
+         
+         if (is_size && job->state == JOB_RUNNING)
+             sizes_running = 1;
+         if (finished && !job->reaped) {
+             job->reaped = 1;
+             changed = 1;
+             
+             // Aggiorna i pannelli che mostrano la sorgente o la destinazione
+             Panel *panels[2] = { &left_panel, &right_panel };
+             int i;
+             // Il calcolo delle dimensioni non modifica le directory: cambiano solo i totali
+             if (is_size)
+                 sizes_done = 1;
+             // L'indice di un archivio non modifica nulla: si apre nei pannelli che lo attendono
+             if (job->type == JOB_INDEX)
+                 archive_indexed(job->src, job->state == JOB_DONE);
+             // Il membro estratto per F3 si visualizza fuori da jobs_lock e da eventuali
+             // finestre modali; se l'estrazione non e' riuscita si elimina subito
+             if (job->id == archive_view_job) {
+                 archive_view_job = 0;
+                 if (job->state == JOB_DONE) archive_view_ready = 1;
+                 else remove_archive_view();
+             }
+             // Lo stesso per l'indice dei nomi e le ricerche che lo attendono
+             if (job->type == JOB_NAMES)
+                 names_indexed(job->src, job->state == JOB_DONE);
+             for (i = 0; i < 2 && !is_size && job->type != JOB_INDEX && job->type != JOB_NAMES; i++) {
+                 // Con inotify le modifiche arrivano gia' come eventi
+                 if (panels[i]->watch_wd >= 0 && !panels[i]->watch_poll)
+                     continue;
+                 if (job_touches(job, panels[i]->current_path))
+                     refresh_directory(panels[i]);
+             }
+             
+             if (job->num_errors > 0) {
+                 // Gli errori dell'operazione diventano l'elenco consultabile con 'e'
+                 int i;
+                 for (i = 0; i < error_report_count; i++)
+                     free(error_report[i]);
+                 free(error_report);
+                 error_report = job->errors;
+                 error_report_count = job->num_errors;
+                 job->errors = NULL;
+                 job->num_errors = 0;
+                 snprintf(error_report_title, sizeof(error_report_title), "Errori dell'operazione #%d", job->id);
+                 show_message("Errore: %s: %s ('e' per l'elenco)",
+                              job->failed_step ? job->failed_step : "operazione fallita", strerror(job->error));
+             } else if (job->state == JOB_FAILED) {
+                 show_message("Errore: %s: %s", job->failed_step ? job->failed_step : "operazione fallita",
+                              strerror(job->error));
+             }
+             if (job->type == JOB_SIZE && job->state == JOB_DONE)
+                 show_dir_size(job->src);
+         }
+         
+         if (finished && elapsed_seconds(&job->finished, &now) >= JOB_LINGER_SEC) {
+             *link = job->next;
+             free(job->errors);
+             free(job->names);
+             free(job);
+             changed = 1;
+             continue;
+         }
+         link = &job->next;
      }
+     pthread_mutex_unlock(&jobs_lock);
+     
+     if (sizes_done || sizes_running)
+         update_dir_sizes(sizes_done);
+     return changed;
  }
  
- // Sposta un file
- void move_file(const char *src, const char *dst) {
-     // Prova a rinominare (funziona solo se src e dst sono sullo stesso filesystem)
-     if (rename(src, dst) == 0) {
-         return;
-     }
+ // Numero di operazioni nella coda (in corso, in attesa o terminate da poco)
+ int count_jobs() {
+     Job *job;
+     int count = 0;
      
-     // Se rename fallisce, copia e poi elimina
-     copy_file(src, dst);
-     delete_file(src);
+     pthread_mutex_lock(&jobs_lock);
+     for (job = jobs; job; job = job->next)
+         count++;
+     pthread_mutex_unlock(&jobs_lock);
+     return count;
  }
  
- // Elimina un file o directory
- void delete_file(const char *path) {
-     struct stat st;
+ // Vero se c'e' lavoro in background che richiede di aggiornare la vista
+ int background_busy() {
+     return left_panel.loader || right_panel.loader || compare_check || count_jobs() > 0;
+ }
+ 
+ // Restituisce l'operazione selezionata, o la prima non ancora terminata.
+ // Va chiamata con jobs_lock acquisito
+ Job *find_selected_job() {
+     Job *job;
      
-     if (stat(path, &st) != 0) {
-         display_error("File non trovato");
-         return;
+     for (job = jobs; job; job = job->next) {
+         if (job->id == selected_job) return job;
+     }
+     for (job = jobs; job; job = job->next) {
+         if (job->state < JOB_DONE) return job;
      }
+     return NULL;
+ }
+ 
+ // Disegna l'area delle operazioni: avanzamento, velocita' e tempo stimato
+ void draw_jobs(int y, int rows) {
+     static const char *type_names[] = { "Copia", "Sposta", "Elimina", "Estrai", "Indice", "Nomi", "Calcola", "Calcola" };
+     struct timespec now;
+     Job *job, *selected;
+     int row = 0;
      
-     if (S_ISDIR(st.st_mode)) {
-         // È una directory, elimina ricorsivamente
-         // Nota: per semplicità, questa implementazione non è ricorsiva
-         // Usa rmdir solo per directory vuote
-         if (rmdir(path) != 0) {
-             display_error("Impossibile eliminare la directory (potrebbe non essere vuota)");
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     pthread_mutex_lock(&jobs_lock);
+     selected = find_selected_job();
+     
+     for (job = jobs; job && row < rows; job = job->next, row++) {
+         long long done = atomic_load(&job->control.bytes_done);
+         long long total = atomic_load(&job->control.bytes_total);
+         const char *name = strrchr(job->src, '/');
+         char info[128], label[64];
+         
+         name = name ? name + 1 : job->src;
+         if (job->names) {
+             snprintf(label, sizeof(label), "%d elementi", job->num_names);
+             name = label;
          }
-     } else {
-         // È un file normale
-         if (unlink(path) != 0) {
-             display_error("Impossibile eliminare il file");
+         
+         if (job->state == JOB_QUEUED) {
+             snprintf(info, sizeof(info), "in coda");
+         } else if (job->state == JOB_RUNNING) {
+             double elapsed = elapsed_seconds(&job->started, &now);
+             double rate = elapsed > 0 ? done / elapsed : 0;
+             int percent = total > 0 ? (int)(done * 100 / total) : 0;
+             
+             if (atomic_load(&job->control.paused)) {
+                 snprintf(info, sizeof(info), "%3d%%  in pausa", percent);
+             } else if (total == 0) {
+                 // Operazione ricorsiva: il totale non e' noto in anticipo
+                 long long files = atomic_load(&job->control.files_done);
+                 if (job->type == JOB_DELETE)
+                     snprintf(info, sizeof(info), "%lld file", files);
+                 else if (job->type == JOB_NAMES)
+                     snprintf(info, sizeof(info), "%lld voci", files);
+                 else if (job->type >= JOB_SIZE)
+                     snprintf(info, sizeof(info), "%lld file  %.1f MB", files, done / (1024.0 * 1024));
+                 else
+                     snprintf(info, sizeof(info), "%lld file  %.1f MB  %7.1f MB/s",
+                              files, done / (1024.0 * 1024), rate / (1024 * 1024));
+             } else {
+                 long eta = rate > 0 ? (long)((total - done) / rate) : 0;
+                 snprintf(info, sizeof(info), "%3d%%  %7.1f MB/s  ETA %ld:%02ld",
+                          percent, rate / (1024 * 1024), eta / 60, eta % 60);
+             }
+         } else if (job->state == JOB_DONE) {
+             double elapsed = elapsed_seconds(&job->started, &job->finished);
+             long long files = atomic_load(&job->control.files_done);
+             if (job->type == JOB_DELETE && files > 1)
+                 snprintf(info, sizeof(info), "completato  %lld file", files);
+             else if (job->type == JOB_DELETE)
+                 snprintf(info, sizeof(info), "completato");
+             else if (job->type >= JOB_SIZE)
+                 snprintf(info, sizeof(info), "completato  %lld file  %.1f MB", files, done / (1024.0 * 1024));
+             else if (job->type == JOB_INDEX || job->type == JOB_NAMES)
+                 snprintf(info, sizeof(info), "completato  %lld voci", files);
+             else if (job->type == JOB_EXTRACT)
+                 snprintf(info, sizeof(info), "completato  %lld file  %.1f MB/s",
+                          files, elapsed > 0 ? done / elapsed / (1024 * 1024) : 0.0);
+             else if ((total == 0 || job->names) && files > 0)
+                 snprintf(info, sizeof(info), "completato  %lld file  %.1f MB/s",
+                          files, elapsed > 0 ? done / elapsed / (1024 * 1024) : 0.0);
+             else if (total == 0)
+                 snprintf(info, sizeof(info), "completato");
+             else
+                 snprintf(info, sizeof(info), "completato  %.1f MB/s (%s)",
+                          elapsed > 0 ? done / elapsed / (1024 * 1024) : 0.0,
+                          copy_method_names[job->method]);
+         } else if (job->state == JOB_CANCELLED) {
+             snprintf(info, sizeof(info), "annullato");
+         } else {
+             snprintf(info, sizeof(info), "errore: %s", strerror(job->error));
          }
+         
+         attron(COLOR_PAIR(job == selected ? 6 : 2));
+         mvhline(y + row, 0, ' ', term_cols);
+         mvprintw(y + row, 1, "%c#%d %-7s %.40s", job == selected ? '>' : ' ',
+                  job->id, type_names[job->type], name);
+         mvprintw(y + row, term_cols / 2, "%s", info);
+         attroff(COLOR_PAIR(job == selected ? 6 : 2));
      }
+     pthread_mutex_unlock(&jobs_lock);
+ }
+ 
+ // Annulla tutte le operazioni e termina i thread
+ void stop_jobs() {
+     Job *job;
+     int i;
+     
+     pthread_mutex_lock(&jobs_lock);
+     jobs_shutdown = 1;
+     for (job = jobs; job; job = job->next)
+         atomic_store(&job->control.cancel, 1);
+     pthread_cond_broadcast(&jobs_cond);
+     pthread_mutex_unlock(&jobs_lock);
+     
+     for (i = 0; i < num_job_threads; i++)
+         pthread_join(job_threads[i], NULL);
+     num_job_threads = 0;
+     // Copia temporanea di un membro d'archivio non ancora visualizzato
+     if (archive_view_job || archive_view_ready)
+         remove_archive_view();
+     
+     while (jobs) {
+         int i;
+         job = jobs->next;
+         for (i = 0; i < jobs->num_errors; i++)
+             free(jobs->errors[i]);
+         free(jobs->errors);
+         free(jobs->names);
+         free(jobs);
+         jobs = job;
+     }
+     
+     while (error_report_count > 0)
+         free(error_report[--error_report_count]);
+     free(error_report);
+     error_report = NULL;
  }
  
  // Apre una shell
@@ -656,21 +11427,736 @@
      
      // Ripristina lo stato del terminale
      reset_prog_mode();
-     refresh();
+     invalidate_screen();
+ }
+ 
+ // Mostra un messaggio nella linea di comando fino al prossimo tasto
+ void show_message(const char *format, ...) {
+     va_list args;
+     
+     va_start(args, format);
+     vsnprintf(status_message, sizeof(status_message), format, args);
+     va_end(args);
+     status_error = 0;
+ }
+ 
+ // Chiede conferma nella linea di comando; vero se l'utente risponde 's'
+ int confirm(const char *format, ...) {
+     char question[MAX_COMMAND_LEN];
+     va_list args;
+     int ch;
+     
+     va_start(args, format);
+     vsnprintf(question, sizeof(question), format, args);
+     va_end(args);
+     
+     // Le operazioni e le letture in corso proseguono durante la domanda
+     do {
+         attron(COLOR_PAIR(5));
+         mvhline(term_rows - 1, 0, ' ', term_cols);
+         mvprintw(term_rows - 1, 0, "%s (s/n)", question);
+         attroff(COLOR_PAIR(5));
+         refresh();
+     } while ((ch = modal_getch(1, -1)) == ERR);
+     return ch == 's' || ch == 'S' || ch == 'y' || ch == 'Y';
+ }
+ 
+ // Mostra a tutto schermo l'elenco degli errori dell'ultima operazione
+ // ricorsiva, scorrevole con le frecce. Le operazioni in corso proseguono e
+ // una che termina con errori sostituisce l'elenco, che si rilegge ad ogni giro
+ void show_error_list() {
+     int top = 0;
+     
+     while (1) {
+         int rows = term_rows - 2, count = error_report_count;
+         int i, ch;
+         
+         if (top >= count) top = count > 0 ? count - 1 : 0;
+         erase();
+         attron(COLOR_PAIR(1) | A_BOLD);
+         mvhline(0, 0, ' ', term_cols);
+         mvprintw(0, 1, "%s (%d)", error_report_title, count);
+         attroff(COLOR_PAIR(1) | A_BOLD);
+         for (i = 0; i < rows && top + i < count; i++)
+             mvprintw(i + 1, 1, "%.*s", term_cols - 2, error_report[top + i]);
+         attron(COLOR_PAIR(2));
+         mvhline(term_rows - 1, 0, ' ', term_cols);
+         mvprintw(term_rows - 1, 1, "Frecce: scorri  q/Esc: chiudi");
+         attroff(COLOR_PAIR(2));
+         refresh();
+         
+         ch = modal_getch(0, -1);
+         if (ch == KEY_UP && top > 0) top--;
+         else if (ch == KEY_DOWN && top + rows < count) top++;
+         else if (ch == KEY_PPAGE) top = top > rows ? top - rows : 0;
+         else if (ch == KEY_NPAGE && top + rows < count) top += rows;
+         else if (ch == 'q' || ch == 27 || ch == '\n' || ch == KEY_F(10)) break;
+     }
+     clear();
+     invalidate_screen();
  }
  
- // Mostra un messaggio di errore
+ // Mostra un messaggio di errore fino al prossimo tasto, senza fermare il
+ // ciclo degli eventi
  void display_error(const char *message) {
-     attron(COLOR_PAIR(5));
-     mvhline(term_rows - 1, 0, ' ', term_cols);
-     mvprintw(term_rows - 1, 0, "Errore: %s", message);
-     attroff(COLOR_PAIR(5));
-     refresh();
-     getch(); // Aspetta che l'utente prema un tasto
+     if (batch_mode) {
+         fprintf(stderr, "tyc: %s\n", message);
+         return;
+     }
+     show_message("Errore: %s", message);
+     status_error = 1;
  }
  
  // Pulisce e chiude ncurses
  void cleanup() {
      endwin();
      printf("Grazie per aver usato Tiny Commander!\n");
- }
\ No newline at end of file
+ }
+ // Scrive su stdout una stringa JSON, con i caratteri speciali protetti
+ void json_string(const char *value) {
+     const unsigned char *c;
+     
+     putchar('"');
+     for (c = (const unsigned char *)value; *c; c++) {
+         if (*c == '"' || *c == '\\')
+             printf("\\%c", *c);
+         else if (*c < 0x20)
+             printf("\\u%04x", *c);
+         else
+             putchar(*c);
+     }
+     putchar('"');
+ }
+ 
+ // Scrive la riga JSON di un'entry elencata
+ void batch_entry(const FileEntry *file) {
+     const char *type = file->d_type == DT_LNK ? "link" : file->is_dir ? "dir"
+                      : S_ISREG(file->mode) ? "file" : "other";
+     
+     printf("{\"op\":\"entry\",\"name\":");
+     json_string(file->name);
+     printf(",\"type\":\"%s\",\"size\":%lld,\"mtime\":%lld,\"mode\":\"%04o\"}\n",
+            type, (long long)file->size, (long long)file->mtime, (unsigned)(file->mode & 07777));
+ }
+ 
+ // Cerca per nome nell'indice che copre path, costruendolo se manca: una
+ // riga per risultato e una di riepilogo, con il tempo della sola ricerca
+ int batch_find(const char *path, const char *text) {
+     char root[MAX_PATH_LEN];
+     struct timespec start, end;
+     char *real_path = realpath(path, NULL);
+     NameIndex *index = NULL;
+     NameQuery query;
+     int i, built = 0;
+     
+     if (parse_name_query(text, &query) != 0) {
+         free(real_path);
+         fprintf(stderr, "tyc: ricerca non valida: %s\n", text);
+         return -1;
+     }
+     if (real_path) {
+         if (!name_index_root(real_path, root, sizeof(root)))
+             snprintf(root, sizeof(root), "%s", real_path);
+         if ((index = name_index_open(root)) == NULL) {
+             CopyStats stats;
+     
+             memset(&stats, 0, sizeof(stats));
+             built = 1;
+             if (build_name_index(root, &stats, NULL) == 0)
+                 index = name_index_open(root);
+             free_copy_stats(&stats);
+         }
+     }
+     
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     if (index) {
+         snprintf(left_panel.current_path, MAX_PATH_LEN, "%s", real_path);
+         snprintf(left_panel.found_query, sizeof(left_panel.found_query), "%s", text);
+         left_panel.found = index;
+         read_directory(&left_panel);
+     }
+     clock_gettime(CLOCK_MONOTONIC, &end);
+     
+     for (i = 1; index && i < left_panel.num_files; i++)
+         batch_entry(&left_panel.files[i]);
+     printf("{\"op\":\"find\",\"path\":");
+     json_string(path);
+     printf(",\"query\":");
+     json_string(text);
+     printf(",\"ok\":%s,\"entries\":%d,\"truncated\":%s,\"built\":%s,\"ms\":%.3f", index ? "true" : "false",
+            index ? left_panel.num_files - 1 : 0, index && left_panel.found_truncated ? "true" : "false",
+            built ? "true" : "false", elapsed_seconds(&start, &end) * 1000);
+     if (!index) {
+         printf(",\"error\":");
+         json_string(strerror(errno));
+     }
+     printf("}\n");
+     free(real_path);
+     return index ? 0 : -1;
+ }
+ 
+ // Elenca una directory con la lettura dell'interfaccia: una riga per entry
+ // e una riga di riepilogo. Restituisce 0 se la directory e' stata letta
+ int batch_list(const char *path) {
+     struct timespec start, end;
+     char *real_path = realpath(path, NULL);
+     int i, ok;
+     
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     if (real_path) {
+         snprintf(left_panel.current_path, MAX_PATH_LEN, "%s", real_path);
+         free(real_path);
+         read_directory(&left_panel);
+     }
+     clock_gettime(CLOCK_MONOTONIC, &end);
+     ok = real_path && left_panel.dir_fd >= 0;
+     
+     for (i = 1; ok && i < left_panel.num_files; i++)
+         batch_entry(&left_panel.files[i]);
+     printf("{\"op\":\"list\",\"path\":");
+     json_string(path);
+     printf(",\"ok\":%s,\"entries\":%d,\"ms\":%.3f", ok ? "true" : "false",
+            ok ? left_panel.num_files - 1 : 0, elapsed_seconds(&start, &end) * 1000);
+     if (!ok) {
+         printf(",\"error\":");
+         json_string(strerror(errno));
+     }
+     printf("}\n");
+     return ok ? 0 : -1;
+ }
+ 
+ // Esegue copia, spostamento, eliminazione o calcolo delle dimensioni con le
+ // stesse funzioni delle operazioni in background e ne scrive l'esito
+ int batch_operation(const char *op, const char *src, const char *dst) {
+     struct timespec start, end;
+     CopyStats stats;
+     CopyControl control;
+     int result, saved_errno, i;
+     
+     memset(&stats, 0, sizeof(stats));
+     memset(&control, 0, sizeof(control));
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     if (strcmp(op, "copy") == 0)
+         result = copy_file(src, dst, &stats, &control);
+     else if (strcmp(op, "move") == 0)
+         result = move_file(src, dst, &stats, &control);
+     else if (strcmp(op, "rm") == 0)
+         result = delete_file(src, &stats, &control);
+     else if (strcmp(op, "index") == 0)
+         result = build_name_index(src, &stats, &control);
+     else
+         result = size_tree(src, &stats, &control);
+     saved_errno = errno;
+     clock_gettime(CLOCK_MONOTONIC, &end);
+     
+     printf("{\"op\":\"%s\",\"src\":", op);
+     json_string(src);
+     if (dst) {
+         printf(",\"dst\":");
+         json_string(dst);
+     }
+     printf(",\"ok\":%s,\"ms\":%.3f", result == 0 ? "true" : "false", elapsed_seconds(&start, &end) * 1000);
+     if (strcmp(op, "du") == 0) {
+         struct stat st;
+         SizeEntry cached;
+         
+         if (stat(src, &st) == 0 && size_cache_lookup(&st, &cached))
+             printf(",\"bytes\":%lld,\"allocated\":%lld,\"files\":%lld,\"partial\":%s",
+                    cached.apparent, cached.allocated, cached.files, cached.partial ? "true" : "false");
+     } else {
+         printf(",\"bytes\":%lld,\"files\":%lld", (long long)atomic_load(&control.bytes_done),
+                (long long)atomic_load(&control.files_done));
+         // Metodo di copia dei dati, per un singolo file
+         if (strcmp(op, "rm") != 0 && result == 0 && stats.files == 0 && atomic_load(&control.bytes_done) > 0)
+             printf(",\"method\":\"%s\"", copy_method_names[stats.method]);
+     }
+     if (result != 0) {
+         char error[MAX_COMMAND_LEN];
+         snprintf(error, sizeof(error), "%s: %s", stats.failed_step ? stats.failed_step : "operazione fallita",
+                  strerror(saved_errno));
+         printf(",\"error\":");
+         json_string(error);
+     }
+     if (stats.num_errors > 0) {
+         printf(",\"errors\":[");
+         for (i = 0; i < stats.num_errors; i++) {
+             if (i) putchar(',');
+             json_string(stats.errors[i]);
+         }
+         printf("]");
+     }
+     printf("}\n");
+     fflush(stdout);
+     free_copy_stats(&stats);
+     return result;
+ }
+ 
+ // Modalita' non interattiva: tyc --batch list|copy|move|rm|du|index|find ... Una riga
+ // JSON per ogni risultato su stdout; esce con 1 se qualcosa e' fallito
+ int run_batch(int argc, char **argv) {
+     const char *op = argc > 0 ? argv[0] : "";
+     int i, failed = 0;
+     
+     batch_mode = 1;
+     config.watch = 0;
+     config.lazy_stat = 0;
+     init_panels();
+     
+     if (strcmp(op, "list") == 0 && argc >= 1) {
+         if (argc == 1) failed |= batch_list(".") != 0;
+         for (i = 1; i < argc; i++)
+             failed |= batch_list(argv[i]) != 0;
+     } else if ((strcmp(op, "copy") == 0 || strcmp(op, "move") == 0) && argc >= 3) {
+         // Come cp e mv: con piu' sorgenti, o una directory come destinazione,
+         // le entry finiscono dentro la destinazione
+         const char *dst = argv[argc - 1];
+         struct stat st;
+         int into = argc > 3 || (stat(dst, &st) == 0 && S_ISDIR(st.st_mode));
+         
+         for (i = 1; i < argc - 1; i++) {
+             char target[MAX_PATH_LEN];
+             const char *name = strrchr(argv[i], '/');
+             
+             name = name && name[1] ? name + 1 : argv[i];
+             snprintf(target, sizeof(target), "%s/%s", dst, name);
+             failed |= batch_operation(op, argv[i], into ? target : dst) != 0;
+         }
+     } else if ((strcmp(op, "rm") == 0 || strcmp(op, "du") == 0) && argc >= 2) {
+         for (i = 1; i < argc; i++)
+             failed |= batch_operation(op, argv[i], NULL) != 0;
+     } else if (strcmp(op, "index") == 0 && argc >= 2) {
+         // L'indice si registra con il percorso assoluto, come lo cerca l'interfaccia
+         for (i = 1; i < argc; i++) {
+             char *real_path = realpath(argv[i], NULL);
+             failed |= batch_operation(op, real_path ? real_path : argv[i], NULL) != 0;
+             free(real_path);
+         }
+     } else if (strcmp(op, "find") == 0 && argc == 3) {
+         failed = batch_find(argv[1], argv[2]) != 0;
+     } else if (strcmp(op, "bench") == 0 && argc >= 2) {
+         failed = run_bench(argv[1], argc - 2, argv + 2) != 0;
+     } else {
+         fprintf(stderr, "Uso: tyc --batch list [DIR...]\n"
+                         "       tyc --batch copy|move SORGENTE... DESTINAZIONE\n"
+                         "       tyc --batch rm|du PERCORSO...\n"
+                         "       tyc --batch index DIR...\n"
+                         "       tyc --batch find DIR RICERCA\n"
+                         "       tyc --batch bench DIR [ENTRY...]\n");
+         perf_close();
+         return 2;
+     }
+     free_panels();
+     perf_close();
+     return failed ? 1 : 0;
+ }
+
+ // Confronto per qsort dei tempi misurati
+ int compare_doubles(const void *a, const void *b) {
+     double da = *(const double *)a, db = *(const double *)b;
+     return (da > db) - (da < db);
+ }
+ 
+ // Scrive una riga di risultato del benchmark: tempi in millisecondi con
+ // minimo, mediana, percentili e massimo (rango piu' vicino), e il throughput
+ // se la misura ha spostato dei dati
+ void bench_report(const char *test, const char *tree, long entries, double *samples, int count, long long bytes) {
+     static const int percentiles[] = { 50, 90, 99 };
+     int i;
+     
+     if (count < 1) return;
+     qsort(samples, count, sizeof(double), compare_doubles);
+     printf("{\"op\":\"bench\",\"test\":\"%s\",\"tree\":\"%s\",\"entries\":%ld,\"samples\":%d,\"min_ms\":%.3f",
+            test, tree, entries, count, samples[0]);
+     for (i = 0; i < (int)(sizeof(percentiles) / sizeof(percentiles[0])); i++) {
+         int rank = (percentiles[i] * count + 99) / 100;
+         printf(",\"p%d_ms\":%.3f", percentiles[i], samples[rank > 0 ? rank - 1 : 0]);
+     }
+     printf(",\"max_ms\":%.3f", samples[count - 1]);
+     if (bytes > 0)
+         printf(",\"bytes\":%lld,\"mb_s\":%.1f", bytes, bytes / 1048576.0 / (samples[(count + 1) / 2 - 1] / 1000));
+     printf("}\n");
+     fflush(stdout);
+ }
+ 
+ // Elimina i resti di una misura precedente, se ci sono
+ void bench_remove(const char *path) {
+     CopyStats stats;
+     
+     if (delete_file(path, &stats, NULL) != 0 && errno != ENOENT)
+         fprintf(stderr, "Impossibile eliminare %s: %s\n", path, strerror(errno));
+     free_copy_stats(&stats);
+ }
+ 
+ // Crea root/name con il numero di entry richiesto: piatto (una directory con
+ // un centesimo di sottodirectory) o profondo (albero con 16 file per directory
+ // e 4 sottodirectory ciascuna). Nomi, dimensioni e date variano per rendere
+ // significativi tutti gli ordinamenti; le dimensioni sono sparse tranne, con
+ // data, un file su otto da 4 KB. Un albero gia' completo (marcato da
+ // root/name.done) viene riutilizzato
+ int bench_make_tree(const char *root, const char *name, long entries, int deep, int data) {
+     static const char *extensions[] = { ".c", ".h", ".txt", ".tar.gz", ".jpg", "", ".log" };
+     char path[MAX_PATH_LEN], marker[MAX_PATH_LEN], block[4096];
+     long num_dirs = deep ? entries / 17 + 1 : entries / 100;
+     time_t now = time(NULL);
+     char **dirs;
+     long i;
+     int fd, failed = 0;
+     
+     if (snprintf(path, sizeof(path), "%s/%s", root, name) >= (int)sizeof(path) ||
+         snprintf(marker, sizeof(marker), "%s.done", path) >= (int)sizeof(marker)) {
+         fprintf(stderr, "Percorso troppo lungo: %s/%s\n", root, name);
+         return -1;
+     }
+     if (access(marker, F_OK) == 0) return 0;
+     
+     fprintf(stderr, "Creazione di %s...\n", path);
+     bench_remove(path);
+     dirs = calloc(num_dirs + 1, sizeof(char *));
+     if (!dirs || mkdir(path, 0755) != 0) {
+         free(dirs);
+         return -1;
+     }
+     memset(block, 'x', sizeof(block));
+     
+     // Nell'albero profondo la directory i sta dentro la (i - 1) / 4
+     for (i = 0; i < num_dirs && !failed; i++) {
+         char dir[MAX_PATH_LEN];
+         int len;
+         
+         if (deep && i > 0)
+             len = snprintf(dir, sizeof(dir), "%s/d%ld", dirs[(i - 1) / 4], i);
+         else
+             len = snprintf(dir, sizeof(dir), "%s/%s%ld", path, deep ? "d" : "dir", i);
+         if (len >= (int)sizeof(dir)) {
+             errno = ENAMETOOLONG;
+             failed = 1;
+             break;
+         }
+         dirs[i] = strdup(dir);
+         failed = !dirs[i] || mkdir(dir, 0755) != 0;
+     }
+     
+     // Le directory fanno parte del conteggio delle entry
+     for (i = 0; i < entries - num_dirs && !failed; i++) {
+         uint32_t hash = (uint32_t)i * 2654435761u;
+         struct timespec times[2];
+         char file[MAX_PATH_LEN];
+         
+         if (snprintf(file, sizeof(file), "%s/f%08x_%ld%s", deep ? dirs[i % num_dirs] : path,
+                      (unsigned)hash, i, extensions[hash % 7]) >= (int)sizeof(file)) {
+             errno = ENAMETOOLONG;
+             failed = 1;
+             break;
+         }
+         fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+         if (fd < 0) {
+             failed = 1;
+             break;
+         }
+         if (data && i % 8 == 0)
+             failed = write_all(fd, block, sizeof(block)) != 0;
+         else
+             failed = ftruncate(fd, hash % (1024 * 1024)) != 0;
+         times[0].tv_sec = times[1].tv_sec = now - hash % 10000000;
+         times[0].tv_nsec = times[1].tv_nsec = 0;
+         futimens(fd, times);
+         close(fd);
+     }
+     
+     for (i = 0; i < num_dirs; i++)
+         free(dirs[i]);
+     free(dirs);
+     if (!failed) {
+         fd = open(marker, O_WRONLY | O_CREAT, 0644);
+         failed = fd < 0;
+         if (fd >= 0) close(fd);
+     }
+     if (failed) fprintf(stderr, "Impossibile creare %s: %s\n", path, strerror(errno));
+     return failed ? -1 : 0;
+ }
+ 
+ // Crea i file per le misure di copia: molti file piccoli, pochi file grandi
+ // e un file sparso
+ int bench_make_files(const char *root) {
+     char path[MAX_PATH_LEN];
+     char *block;
+     off_t offset;
+     int i, fd, failed = 0;
+     
+     snprintf(path, sizeof(path), "%s/files.done", root);
+     if (access(path, F_OK) == 0) return 0;
+     fprintf(stderr, "Creazione dei file in %s...\n", root);
+     
+     block = malloc(COPY_BUFFER_SIZE);
+     if (!block) return -1;
+     for (i = 0; i < COPY_BUFFER_SIZE; i++)
+         block[i] = (char)(i * 31 + (i >> 12));
+     
+     snprintf(path, sizeof(path), "%s/small", root);
+     bench_remove(path);
+     failed = mkdir(path, 0755) != 0;
+     for (i = 0; i < BENCH_SMALL_FILES && !failed; i++) {
+         snprintf(path, sizeof(path), "%s/small/file%d", root, i);
+         fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+         failed = fd < 0 || write_all(fd, block + i % 4096, BENCH_SMALL_SIZE) != 0;
+         if (fd >= 0) close(fd);
+     }
+     
+     snprintf(path, sizeof(path), "%s/large", root);
+     bench_remove(path);
+     failed |= mkdir(path, 0755) != 0;
+     for (i = 0; i < BENCH_LARGE_FILES && !failed; i++) {
+         snprintf(path, sizeof(path), "%s/large/file%d", root, i);
+         fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+         failed = fd < 0;
+         for (offset = 0; offset < BENCH_LARGE_SIZE && !failed; offset += COPY_BUFFER_SIZE)
+             failed = write_all(fd, block, COPY_BUFFER_SIZE) != 0;
+         if (fd >= 0) close(fd);
+     }
+     
+     // Un blocco da 1 MB ogni 64 MB
+     snprintf(path, sizeof(path), "%s/sparse", root);
+     fd = failed ? -1 : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+     failed |= fd < 0;
+     for (offset = 0; offset < BENCH_SPARSE_SIZE && !failed; offset += 64 * 1024 * 1024)
+         failed = pwrite_all(fd, block, COPY_BUFFER_SIZE, offset) != 0;
+     if (!failed) failed = ftruncate(fd, BENCH_SPARSE_SIZE) != 0;
+     if (fd >= 0) close(fd);
+     free(block);
+     
+     if (!failed) {
+         snprintf(path, sizeof(path), "%s/files.done", root);
+         fd = open(path, O_WRONLY | O_CREAT, 0644);
+         failed = fd < 0;
+         if (fd >= 0) close(fd);
+     }
+     if (failed) fprintf(stderr, "Impossibile creare i file in %s: %s\n", root, strerror(errno));
+     return failed ? -1 : 0;
+ }
+ 
+ // Lettura della directory e ordinamento per ogni criterio. L'ordinamento
+ // riparte ogni volta dall'ordine di lettura, con la cache invalidata
+ void bench_listing(const char *root, const char *tree, int runs) {
+     double *samples = malloc(runs * sizeof(double));
+     FileEntry *scan_order;
+     struct timespec start, end;
+     int i, sort_by;
+     
+     if (!samples) return;
+     snprintf(left_panel.current_path, MAX_PATH_LEN, "%s/%s", root, tree);
+     for (i = 0; i < runs; i++) {
+         clock_gettime(CLOCK_MONOTONIC, &start);
+         read_directory(&left_panel);
+         clock_gettime(CLOCK_MONOTONIC, &end);
+         samples[i] = elapsed_seconds(&start, &end) * 1000;
+     }
+     bench_report("scan", tree, left_panel.num_files - 1, samples, runs, 0);
+     
+     scan_order = malloc(left_panel.num_files * sizeof(FileEntry));
+     if (!scan_order) {
+         free(samples);
+         return;
+     }
+     memcpy(scan_order, left_panel.files, left_panel.num_files * sizeof(FileEntry));
+     for (sort_by = 0; sort_by < SORT_MODES; sort_by++) {
+         static const char *sort_tests[] = { "sort_name", "sort_size", "sort_mtime", "sort_natural", "sort_extension" };
+         
+         left_panel.sort_by = sort_by;
+         for (i = 0; i < runs; i++) {
+             memcpy(left_panel.files, scan_order, left_panel.num_files * sizeof(FileEntry));
+             left_panel.list_version++;
+             clock_gettime(CLOCK_MONOTONIC, &start);
+             sort_files(&left_panel);
+             clock_gettime(CLOCK_MONOTONIC, &end);
+             samples[i] = elapsed_seconds(&start, &end) * 1000;
+         }
+         bench_report(sort_tests[sort_by], tree, left_panel.num_files - 1, samples, runs, 0);
+     }
+     left_panel.sort_by = SORT_NAME;
+     free(scan_order);
+     free(samples);
+ }
+ 
+ // Disegno della lista ordinata nel pannello sinistro su un terminale virtuale
+ // (uscita su /dev/null): schermate complete e scorrimento di una riga
+ void bench_render(const char *tree, int runs) {
+     const char *term = getenv("TERM");
+     FILE *out = fopen("/dev/null", "w"), *in = fopen("/dev/null", "r");
+     int count = runs * BENCH_FRAMES;
+     double *full = malloc(count * sizeof(double)), *scroll = malloc(count * sizeof(double));
+     struct timespec start, end;
+     SCREEN *screen = NULL;
+     int i;
+     
+     if (out && in && full && scroll)
+         screen = newterm(term && *term && strcmp(term, "dumb") != 0 ? term : "xterm", out, in);
+     if (!screen) {
+         fprintf(stderr, "Terminale virtuale non disponibile: disegno non misurato\n");
+     } else {
+         start_color();
+         init_pair(1, COLOR_WHITE, COLOR_BLUE);
+         init_pair(2, COLOR_BLACK, COLOR_CYAN);
+         init_pair(3, COLOR_YELLOW, COLOR_BLUE);
+         init_pair(4, COLOR_GREEN, COLOR_BLUE);
+         init_pair(6, COLOR_BLACK, COLOR_WHITE);
+         init_pair(7, COLOR_CYAN, COLOR_BLUE);
+         resize_term(50, 160);
+         getmaxyx(stdscr, term_rows, term_cols);
+         left_panel.selected = left_panel.scroll_pos = 0;
+         
+         for (i = 0; i < count; i++) {
+             invalidate_screen();
+             left_panel.changed = right_panel.changed = 1;
+             clock_gettime(CLOCK_MONOTONIC, &start);
+             draw_interface();
+             clock_gettime(CLOCK_MONOTONIC, &end);
+             full[i] = elapsed_seconds(&start, &end) * 1000;
+         }
+         // Oltre la prima pagina la selezione trascina la lista
+         for (i = 0; i < count; i++) {
+             move_selection(&left_panel, term_rows);
+             draw_interface();
+             move_selection(&left_panel, 1);
+             clock_gettime(CLOCK_MONOTONIC, &start);
+             draw_interface();
+             clock_gettime(CLOCK_MONOTONIC, &end);
+             scroll[i] = elapsed_seconds(&start, &end) * 1000;
+         }
+         bench_report("render_full", tree, left_panel.num_files - 1, full, count, 0);
+         bench_report("render_scroll", tree, left_panel.num_files - 1, scroll, count, 0);
+         
+         delwin(left_panel.view.win);
+         delwin(right_panel.view.win);
+         left_panel.view.win = right_panel.view.win = NULL;
+         endwin();
+         delscreen(screen);
+     }
+     if (out) fclose(out);
+     if (in) fclose(in);
+     free(full);
+     free(scroll);
+ }
+ 
+ // Copia ricorsiva di root/tree in root/tree.copy ed eliminazione della copia
+ void bench_copy(const char *root, const char *tree, int runs) {
+     double *copy = malloc(runs * sizeof(double)), *del = malloc(runs * sizeof(double));
+     char src[MAX_PATH_LEN], dst[MAX_PATH_LEN];
+     struct timespec start, end;
+     long long bytes = 0, files = 0;
+     int i;
+     
+     snprintf(src, sizeof(src), "%s/%s", root, tree);
+     snprintf(dst, sizeof(dst), "%s/%s.copy", root, tree);
+     bench_remove(dst);
+     for (i = 0; copy && del && i < runs; i++) {
+         CopyStats stats;
+         CopyControl control;
+         int result;
+         
+         memset(&stats, 0, sizeof(stats));
+         memset(&control, 0, sizeof(control));
+         clock_gettime(CLOCK_MONOTONIC, &start);
+         result = copy_file(src, dst, &stats, &control);
+         clock_gettime(CLOCK_MONOTONIC, &end);
+         copy[i] = elapsed_seconds(&start, &end) * 1000;
+         bytes = atomic_load(&control.bytes_done);
+         free_copy_stats(&stats);
+         
+         memset(&stats, 0, sizeof(stats));
+         memset(&control, 0, sizeof(control));
+         clock_gettime(CLOCK_MONOTONIC, &start);
+         result |= delete_file(dst, &stats, &control);
+         clock_gettime(CLOCK_MONOTONIC, &end);
+         del[i] = elapsed_seconds(&start, &end) * 1000;
+         files = atomic_load(&control.files_done);
+         free_copy_stats(&stats);
+         if (result != 0) {
+             fprintf(stderr, "Copia di %s non riuscita: %s\n", src, strerror(errno));
+             bench_remove(dst);
+             break;
+         }
+     }
+     if (i == runs) {
+         bench_report("copy", tree, files, copy, runs, bytes);
+         bench_report("delete", tree, files, del, runs, 0);
+     }
+     free(copy);
+     free(del);
+ }
+ 
+ // tyc --batch bench DIR [ENTRY...]: crea in DIR gli alberi sintetici (se non
+ // ci sono gia') e misura lettura, ordinamento, disegno, visita ricorsiva,
+ // copia ed eliminazione. Una riga JSON per misura, in ordine fisso, per
+ // confrontare versioni diverse
+ int run_bench(const char *root, int argc, char **argv) {
+     static char *default_sizes[] = { "1000", "100000", "1000000" };
+     const char *value = getenv("TYC_BENCH_RUNS");
+     int runs = value ? atoi(value) : BENCH_RUNS;
+     struct timespec start, end;
+     char tree[64], path[MAX_PATH_LEN];
+     double *samples;
+     int i, j, failed = 0;
+     
+     if (runs < 1) runs = 1;
+     if (argc == 0) {
+         argc = sizeof(default_sizes) / sizeof(default_sizes[0]);
+         argv = default_sizes;
+     }
+     if (mkdir(root, 0755) != 0 && errno != EEXIST) {
+         fprintf(stderr, "Impossibile creare %s: %s\n", root, strerror(errno));
+         return -1;
+     }
+     samples = malloc(runs * sizeof(double));
+     if (!samples) return -1;
+     
+     printf("{\"op\":\"bench_info\",\"version\":\"%s\",\"runs\":%d,\"cpus\":%ld,\"tree_threads\":%d,\"dir\":",
+            GIT_VERSION, runs, sysconf(_SC_NPROCESSORS_ONLN), config.tree_threads);
+     json_string(root);
+     printf("}\n");
+     
+     for (i = 0; i < argc; i++) {
+         long entries = atol(argv[i]);
+         
+         if (entries < 1) continue;
+         snprintf(tree, sizeof(tree), "flat-%ld", entries);
+         if (bench_make_tree(root, tree, entries, 0, 0) != 0) {
+             failed = 1;
+             continue;
+         }
+         bench_listing(root, tree, runs);
+         bench_render(tree, runs);
+         
+         // Visita ricorsiva come il calcolo delle dimensioni, senza cache
+         snprintf(tree, sizeof(tree), "deep-%ld", entries);
+         if (bench_make_tree(root, tree, entries, 1, entries <= BENCH_COPY_MAX) != 0) {
+             failed = 1;
+             continue;
+         }
+         snprintf(path, sizeof(path), "%s/%s", root, tree);
+         for (j = 0; j < runs; j++) {
+             CopyStats stats;
+             CopyControl control;
+             
+             memset(&stats, 0, sizeof(stats));
+             memset(&control, 0, sizeof(control));
+             clock_gettime(CLOCK_MONOTONIC, &start);
+             failed |= size_tree(path, &stats, &control) != 0;
+             clock_gettime(CLOCK_MONOTONIC, &end);
+             samples[j] = elapsed_seconds(&start, &end) * 1000;
+             free_copy_stats(&stats);
+         }
+         bench_report("walk", tree, entries, samples, runs, 0);
+         if (entries <= BENCH_COPY_MAX)
+             bench_copy(root, tree, runs);
+     }
+     
+     if (bench_make_files(root) == 0) {
+         bench_copy(root, "small", runs);
+         bench_copy(root, "large", runs);
+         bench_copy(root, "sparse", runs);
+     } else {
+         failed = 1;
+     }
+     free(samples);
+     return failed ? -1 : 0;
+ }